@@ -0,0 +1,168 @@
+// Copyright 2020 Sebastian Hoof & Lennert J. Thormaehlen
+// See the LICENSE file for the license conditions and a disclaimer
+
+#ifndef __benchmarks_hpp__
+#define __benchmarks_hpp__
+
+#include <iostream>
+#include <vector>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+#include <numeric>
+#include <sstream>
+#include <iomanip>
+#include <fstream>
+
+#include "utils.hpp"
+#include "solar_model.hpp"
+#include "spectral_flux.hpp"
+#include "experimental_flux.hpp"
+
+// Repeatable benchmarks for the different layers of the library (SolarModel setup, single rates, opacity and auxiliary functions, drivers).
+// Each benchmark runs a fixed workload several times; the results are CSV lines (see benchmark_csv_header) s.t. they can be tracked over time.
+// N.B. The checksum (result of the last repetition) guards against eliminated work and changes in the numerical results.
+struct benchmark_result { std::string name; int repetitions; long calls; double t_min; double t_median; double t_mean; double checksum; };
+const std::string benchmark_csv_header = "benchmark,repetitions,calls,min_s,median_s,mean_s,ns_per_call,checksum";
+
+benchmark_result run_benchmark(std::string name, int repetitions, long calls, std::function<double()> workload) {
+  std::vector<double> times;
+  double checksum = 0;
+  for (int k = 0; k < repetitions; k++) {
+    auto t_start = std::chrono::steady_clock::now();
+    checksum = workload();
+    auto t_end = std::chrono::steady_clock::now();
+    times.push_back(std::chrono::duration<double>(t_end - t_start).count());
+  }
+  std::vector<double> sorted = times;
+  std::sort(sorted.begin(), sorted.end());
+  double mean = 0;
+  for (auto t = times.begin(); t != times.end(); ++t) { mean += *t/double(repetitions); }
+  double median = (repetitions % 2 == 1) ? sorted[repetitions/2] : 0.5*(sorted[repetitions/2-1] + sorted[repetitions/2]);
+  return { name, repetitions, calls, sorted.front(), median, mean, checksum };
+}
+
+std::string benchmark_csv_line(const benchmark_result &res) {
+  std::ostringstream line;
+  line << std::setprecision(6) << res.name << "," << res.repetitions << "," << res.calls << "," << res.t_min << "," << res.t_median << "," << res.t_mean << ","
+       << 1.0e9*res.t_min/double(std::max(res.calls, 1L)) << "," << std::setprecision(10) << res.checksum;
+  return line.str();
+}
+
+// Deterministic (omega, r) samples for the single-rate benchmarks; energies are log-spaced in [erg_lo, erg_hi] keV.
+void benchmark_samples(const SolarModel &s, int n, double erg_lo, double erg_hi, std::vector<double> &ergs, std::vector<double> &radii) {
+  const double r_lo = s.get_r_lo(), r_hi = std::min(s.get_r_hi(), 0.95);
+  ergs.resize(n);
+  radii.resize(n);
+  for (int i = 0; i < n; ++i) {
+    // N.B. Van der Corput-like sequence in r to avoid correlations between energy and radius
+    double x = fmod(0.6180339887*(i+1), 1.0);
+    ergs[i] = erg_lo*pow(erg_hi/erg_lo, (i+0.5)/double(n));
+    radii[i] = r_lo + x*(r_hi - r_lo);
+  }
+}
+
+// Runs all benchmarks whose name contains filter (all of them if filter is empty); the repetitions of the micro benchmarks can be rescaled.
+std::vector<benchmark_result> run_benchmarks(std::string filter = "", int repetitions = 5, std::ostream &out = std::cout) {
+  std::vector<benchmark_result> results;
+  auto selected = [&filter](std::string name) { return (filter == "") || (name.find(filter) != std::string::npos); };
+  auto record = [&results, &out](benchmark_result res) { out << benchmark_csv_line(res) << std::endl; results.push_back(res); };
+  const int reps_macro = std::max(1, std::min(repetitions, 3));
+
+  const std::string solar_model_file = SOLAXFLUX_DIR "/data/solar_models/SolarModel_B16-AGSS09.dat";
+  const std::string solar_model_file_agss09 = SOLAXFLUX_DIR "/data/solar_models/SolarModel_AGSS09.dat";
+  const std::string output_path = SOLAXFLUX_DIR "/results/";
+
+  out << benchmark_csv_header << std::endl;
+
+  // SolarModel construction for each opacity code (N.B. the non-OP codes require the AGSS09 model); the automatic cache of the derived
+  // radial profiles is disabled s.t. all repetitions perform the full construction
+  const TableLoading no_profile_cache (false, true, 1.0, false);
+  for (auto it = opacitycode_name.begin(); it != opacitycode_name.end(); ++it) {
+    std::string name = "SolarModel_construction_"+it->second;
+    if (not(selected(name))) { continue; }
+    opacitycode opcode = it->first;
+    std::string file = (opcode == OP) ? solar_model_file : solar_model_file_agss09;
+    record(run_benchmark(name, reps_macro, 1, [&]() { SolarModel sm (file, opcode, false, "", no_profile_cache); return sm.temperature_in_keV(0.1); }));
+  }
+
+  std::cerr << "INFO. Setting up the solar model for the remaining benchmarks..." << std::endl;
+  SolarModel s (solar_model_file, OP);
+  const int n_calls = 100000;
+  std::vector<double> ergs, radii, ergs_lp, radii_lp;
+  benchmark_samples(s, n_calls, 0.1, 12.0, ergs, radii);
+  benchmark_samples(s, n_calls, 0.001, 1.0, ergs_lp, radii_lp);
+
+  // Single evaluations of the production rates and opacities
+  const std::vector<std::pair<std::string,SolarModelMemberFn> > rates = { {"Gamma_Primakoff", &SolarModel::Gamma_Primakoff},
+    {"Gamma_all_electron", &SolarModel::Gamma_all_electron}, {"Gamma_LP", &SolarModel::Gamma_LP} };
+  for (auto it = rates.begin(); it != rates.end(); ++it) {
+    if (not(selected(it->first))) { continue; }
+    SolarModelMemberFn rate = it->second;
+    const std::vector<double> &x = (it->first == "Gamma_LP") ? ergs_lp : ergs;
+    const std::vector<double> &r = (it->first == "Gamma_LP") ? radii_lp : radii;
+    record(run_benchmark(it->first, repetitions, n_calls, [&]() { double sum = 0; for (int i = 0; i < n_calls; ++i) { sum += (s.*rate)(x[i], r[i]); } return sum; }));
+  }
+  if (selected("opacity_table_interpolator_op")) {
+    record(run_benchmark("opacity_table_interpolator_op", repetitions, n_calls, [&]() {
+      double sum = 0;
+      for (int i = 0; i < n_calls; ++i) { sum += s.opacity_table_interpolator_op(ergs[i], radii[i], OP_Fe); }
+      return sum;
+    }));
+  }
+  if (selected("aux_function")) {
+    const int n_aux = 1000;
+    record(run_benchmark("aux_function", repetitions, n_calls, [&]() {
+      double sum = 0;
+      for (int i = 0; i < n_calls; ++i) { sum += aux_function(ergs[i], ergs_lp[i]); }
+      return sum;
+    }));
+    record(run_benchmark("aux_function_exact", repetitions, n_aux, [&]() {
+      double sum = 0;
+      for (int i = 0; i < n_aux; ++i) { sum += aux_function_exact(ergs[100*i], ergs_lp[100*i]); }
+      return sum;
+    }));
+  }
+
+  // Spectral flux drivers (1D: full solar volume; 2D: solar disc up to different radii)
+  std::vector<double> driver_ergs, driver_rads = { 0.2, 0.5, 1.0 };
+  for (int k = 0; k < 50; k++) { driver_ergs.push_back(0.1 + k*11.9/50.0); }
+  if (selected("spectral_flux_1d")) {
+    record(run_benchmark("spectral_flux_1d_Primakoff", reps_macro, driver_ergs.size(), [&]() {
+      std::vector<std::vector<double> > res = fully_integrate_d2Phi_a_domega_drho_in_rho_Primakoff(driver_ergs, s);
+      return std::accumulate(res[1].begin(), res[1].end(), 0.0);
+    }));
+    record(run_benchmark("spectral_flux_1d_axionelectron", reps_macro, driver_ergs.size(), [&]() {
+      std::vector<std::vector<double> > res = fully_integrate_d2Phi_a_domega_drho_in_rho_axionelectron(driver_ergs, s);
+      return std::accumulate(res[1].begin(), res[1].end(), 0.0);
+    }));
+  }
+  if (selected("spectral_flux_2d")) {
+    std::vector<double> ergs_2d (driver_ergs.begin(), driver_ergs.begin()+10);
+    record(run_benchmark("spectral_flux_2d_Primakoff", reps_macro, ergs_2d.size()*driver_rads.size(), [&]() {
+      std::vector<std::vector<double> > res = integrate_d2Phi_a_domega_drho_up_to_rho_Primakoff(ergs_2d, driver_rads, s);
+      return std::accumulate(res.back().begin(), res.back().end(), 0.0);
+    }));
+  }
+
+  // Reference counts for CAST 2007 (from a Primakoff spectrum that is computed first; not part of the timing)
+  if (selected("axion_reference_counts_from_file")) {
+    std::vector<double> spectrum_ergs, masses;
+    for (int k = 0; k < 200; k++) { spectrum_ergs.push_back(0.5 + k*(7.5 - 0.5)/199.0); }
+    for (int k = 0; k < 50; k++) { masses.push_back(pow(10, -3.0 + 3.0*k/49.0)); }
+    std::string spectrum_file = output_path + "benchmark_primakoff.dat";
+    fully_integrate_d2Phi_a_domega_drho_in_rho_Primakoff(spectrum_ergs, s, spectrum_file);
+    const bool engines [2] = { true, false };
+    for (int e = 0; e < 2; e++) {
+      std::string name = engines[e] ? "axion_reference_counts_from_file_mass_scan" : "axion_reference_counts_from_file_adaptive";
+      record(run_benchmark(name, reps_macro, masses.size(), [&]() {
+        std::vector<std::vector<double> > res = axion_reference_counts_from_file(&cast_2007_setup, masses, spectrum_file, "", "", false, engines[e]);
+        return std::accumulate(res[2].begin(), res[2].end(), 0.0);
+      }));
+    }
+  }
+
+  return results;
+}
+
+#endif // defined __benchmarks_hpp__
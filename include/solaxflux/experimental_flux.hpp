@@ -59,19 +59,69 @@ double conversion_prob_correction(double mass, double erg, double length);
 double eff_exposure(double erg, std::string dataset);
 double eff_exposure(double erg, experiment dataset);
 
+// ExposureTable class: Effective exposure of one experiment, resolved once (e.g. when the counts for a setup are prepared), s.t. evaluating it
+// in the integrands requires neither string handling nor map lookups. Data from the exposure files is interpolated linearly (O(1) on uniform grids).
+// N.B. Evaluation is const and thread-safe; outside of the range of the exposure file, the effective exposure is zero.
+class ExposureTable {
+  public:
+    ExposureTable();
+    ExposureTable(experiment dataset);
+    ExposureTable(std::string dataset);
+    experiment get_experiment() const { return dataset; }
+    double operator()(double erg) const;
+  private:
+    experiment dataset = CAST2007;
+    double constant_exposure = 0;
+    bool uniform_grid = false;
+    double erg_lo = 0, erg_hi = 0, inv_delta = 0;
+    std::vector<double> ergs, exposures;
+};
+
+inline double ExposureTable::operator()(double erg) const {
+  if (ergs.empty()) { return constant_exposure; }
+  if ((erg < erg_lo) || (erg > erg_hi)) { return 0; }
+  const size_t last = ergs.size() - 2;
+  size_t i;
+  if (uniform_grid) {
+    i = std::min(static_cast<size_t>((erg - erg_lo)*inv_delta), last);
+  } else {
+    i = std::upper_bound(ergs.begin(), ergs.end(), erg) - ergs.begin();
+    i = (i > 0) ? std::min(i-1, last) : 0;
+  }
+  const double t = (erg - ergs[i])/(ergs[i+1] - ergs[i]);
+  return exposures[i] + t*(exposures[i+1] - exposures[i]);
+}
+
+// Pre-built exposure table of each experiment (constructed once on first use)
+const ExposureTable& exposure_table(experiment dataset);
+const ExposureTable& exposure_table(std::string dataset);
+
 
 //////////////////////////////////////////////////////////////////////////////////////
 //  Modified and extended integration routines (possibly include energy dispersion) //
 //////////////////////////////////////////////////////////////////////////////////////
 
-struct exp_flux_from_file_integration_parameters { double mass; double length; std::string dataset; OneDInterpolator* spectral_flux; double support [2]; double sigma; };
+struct exp_flux_from_file_integration_parameters { double mass; double length; const ExposureTable* exposure; const SpectrumInterpolator* spectral_flux; double support [2]; double sigma; };
+
 
+// Gaussian convolution of the values f sampled on the uniform grid x_i = x_lo + i*delta, evaluated at x_out (trapezoidal rule).
+// N.B. The kernel is truncated at gaussian_convolution_n_sigma standard deviations, s.t. each output value only requires a band of grid points.
+const double gaussian_convolution_n_sigma = 8.0;
+const int gaussian_convolution_pts_per_sigma = 20, gaussian_convolution_max_pts = 100000;
+std::vector<double> gaussian_convolution(const std::vector<double> &f, double x_lo, double delta, double sigma, const std::vector<double> &x_out);
+// Uniform grid spacing for the convolution on the support, resolving sigma and a given feature scale (number of grid points is capped at gaussian_convolution_max_pts)
+double gaussian_convolution_grid_spacing(double support[2], double sigma, double feature_scale = 0);
 
-// Functions to calculate the spectrum with finite energy resolution convolution kernel.
-std::vector<double> convolved_spectrum_from_file(std::vector<double> ergs, double support[2], double resolution, std::string filename);
+// Line sources (see nuclear_line in spectral_flux.hpp): Gaussian line profile, including the energy resolution (added in quadrature to the Doppler width), at
+// the energies ergs. Add this to the (convolved) continuum spectrum.
+std::vector<double> nuclear_line_spectrum(std::vector<double> ergs, const nuclear_line &line, double resolution = 0);
+
+// Functions to calculate the spectrum with finite energy resolution convolution kernel; an optional line source is added with nuclear_line_spectrum.
+std::vector<double> convolved_spectrum_from_file(std::vector<double> ergs, double support[2], double resolution, std::string filename, const nuclear_line* line = NULL);
 
 // Functions to calculate the counts in all bins of a helioscope experiment, given an experimental configuration.
-std::vector<double> axion_photon_counts_from_file(double mass, double gagg, exp_setup *setup, std::string spectral_flux_file);
+// N.B. The counts from an optional line source (for the given line flux) scale with (gagg/10^-10 GeV^-1)^2 and include the energy resolution of the setup.
+std::vector<double> axion_photon_counts_from_file(double mass, double gagg, exp_setup *setup, std::string spectral_flux_file, const nuclear_line* line = NULL);
 std::vector<double> axion_photon_counts_full(double mass, double gagg, exp_setup *setup, SolarModel *s);
 std::vector<double> axion_electron_counts(double mass, double gaee, double gagg, exp_setup *setup, std::string spectral_flux_file);
 std::vector<double> axion_electron_counts_full(double mass, double gaee, double gagg, exp_setup *setup, SolarModel *s);
@@ -79,21 +129,72 @@ std::vector<double> axion_electron_counts_full(double mass, double gaee, double
 const double ref_erg_value = 2.0, ref_r_value = 0.05;
 
 // Data structs to pass variables to functions and integrators.
-//struct erg_integration_params { double mass; double length; double r_max; std::string dataset; SolarModel* s; double (SolarModel::*integrand)(double, double); gsl_integration_workspace* w1; gsl_integration_workspace* w2; };
-struct erg_integration_params { double mass; double length; double r_max; std::string dataset; SolarModel* s; double (SolarModel::*integrand)(double, double); gsl_integration_cquad_workspace* w1; gsl_integration_workspace* w2; };
-struct simple_convolution_params { double sigma; double erg0; OneDInterpolator* spectral_flux; };
+//struct erg_integration_params { double mass; double length; double r_max; const ExposureTable* exposure; SolarModel* s; double (SolarModel::*integrand)(double, double) const; gsl_integration_workspace* w1; gsl_integration_workspace* w2; };
+struct erg_integration_params { double mass; double length; double r_max; const ExposureTable* exposure; SolarModel* s; double (SolarModel::*integrand)(double, double) const; gsl_integration_cquad_workspace* w1; gsl_integration_workspace* w2; };
+struct simple_convolution_params { double sigma; double erg0; const SpectrumInterpolator* spectral_flux; };
 struct convolution_params { double erg0; exp_flux_from_file_integration_parameters* p; };
+struct binned_exp_flux_params { double bin [2]; exp_flux_from_file_integration_parameters* p; };
 
 // Wrapper functions for integrating the axion spectra.
 double exp_flux_integrand_from_file(double erg, void * params);
+// Exposure x flux x (Gaussian response of the bin [bin[0], bin[1]]) for finite energy resolution; the integral over the support yields the convolved counts in the bin
+double binned_exp_flux_integrand_from_file(double erg, void * params);
 double erg_integrand(double erg, void * params);
 
 //////////////////////////////////////////////////////////////////////////////
 //  Routines to compute 'reference count files' for the various experiments //
 //////////////////////////////////////////////////////////////////////////////
 
+// Mass-scan engine: only the conversion probability correction depends on the mass. The mass-independent part (exposure x flux, times the response of
+// each bin for finite energy resolution) is tabulated once on a uniform grid in u = 1/erg, where sinc^2 becomes (1 - cos(kappa u))/(2 a^2 m^4 u^2).
+// The integrals for all masses then use a piecewise-linear Filon rule (trapezoidal rule if the phase is small) and are parallelised over the masses.
+const int mass_scan_intervals_per_bin = 500;
+struct mass_scan_segment { double u_lo; double delta_u; int n_intervals; std::vector<int> bins; std::vector<std::vector<double>> h; };
+std::vector<mass_scan_segment> mass_scan_segments(exp_setup *setup, const SpectrumInterpolator &spectral_flux, int intervals_per_bin = mass_scan_intervals_per_bin);
+// Integrals for all masses and bins (at position i*n_bins+bin) from the tabulated segments
+std::vector<double> mass_scan_integrals(const std::vector<mass_scan_segment> &segments, int n_bins, const std::vector<double> &masses, double length);
+
+// Counts from a line source in all bins for g_agamma = 10^-10 1/GeV and g_eff = 1 (i.e. scale with (g_agamma/10^-10 GeV^-1)^2 g_eff^2); the fraction
+// of the line in each bin follows from the Gaussian line profile, s.t. no integration over energies is required.
+std::vector<double> nuclear_line_counts(double mass, exp_setup *setup, const nuclear_line &line);
+// N.B. With a line source, the line counts (see nuclear_line_counts) are saved as the last column; the axion-electron column is then always included (zero without a file).
 std::vector<std::vector<double>> axion_reference_counts_from_file(exp_setup *setup, std::vector<double> masses, std::string spectral_flux_file_gagg,
-                                                                  std::string spectral_flux_file_gaee = "", std::string saveas = "", bool save_convolved_spectra=false);
+                                                                  std::string spectral_flux_file_gaee = "", std::string saveas = "", bool save_convolved_spectra=false, bool use_mass_scan_engine=true,
+                                                                  const nuclear_line* line = NULL);
+std::vector<std::vector<double>> axion_reference_counts_nuclear_line(exp_setup *setup, std::vector<double> masses, const nuclear_line &line, std::string saveas = "");
+// N.B. Convenience function; keeps the last file in memory but is not thread-safe. Use the CountsPredictor class below for repeated evaluations.
 std::vector<double> counts_prediciton_from_file(double mass, double gagg, std::string reference_counts_file, double gaee = 0);
 
+// CountsPredictor class: Loads a reference counts file (see axion_reference_counts_from_file) once and predicts the counts in all bins for given
+// values of the axion mass (in eV), gagg (in GeV^-1) and gaee; linear interpolation in log10(mass). All evaluation routines are const and thread-safe.
+// Line counts, scaled by g_eff^2, are taken from the file (if present) or from an optional line source in the given setup (exact in the mass).
+class CountsPredictor {
+  public:
+    CountsPredictor();
+    CountsPredictor(std::string reference_counts_file, const nuclear_line* line = NULL, exp_setup *setup = NULL);
+    int get_n_bins() const;
+    std::vector<double> get_bin_centres() const;
+    std::vector<double> get_masses() const;
+    bool includes_axion_electron() const;
+    bool includes_line() const;
+    // Counts in all bins for one parameter point, written to out[0], ..., out[n_bins-1]
+    void predict(double mass, double gagg, double gaee, double geff, double* out) const;
+    void predict(double mass, double gagg, double gaee, double* out) const { predict(mass, gagg, gaee, 0, out); }
+    std::vector<double> predict(double mass, double gagg, double gaee = 0, double geff = 0) const;
+    // Counts for n parameter points, written to out[i*n_bins + bin]; gaees = NULL (geffs = NULL) is equivalent to gaee = 0 (geff = 0)
+    void predict(const double* ms, const double* gaggs, const double* gaees, size_t n, double* out, const double* geffs = NULL) const;
+  private:
+    int n_bins = 0, n_masses = 0;
+    bool has_gaee = false, has_line = false;
+    // Line source: counts in each bin for massless axions, the line energy, and the length of the magnet
+    bool has_line_source = false;
+    double line_energy = 0, line_length = 0;
+    std::vector<double> line_source_counts;
+    double min_m = 1.0e-4;
+    double lgm0 = -4.0; // Axions with m = 10^-4 eV are effectivly massless
+    std::vector<double> masses, log_masses, bin_centres;
+    // Reference counts for mass k and bin j at position k*n_bins+j
+    std::vector<double> ref_counts_gagg, ref_counts_gaee, ref_counts_line;
+};
+
 #endif // defined __experimental_flux_hpp__
@@ -5,6 +5,8 @@
 #define __python_wrapper_hpp__
 
 #include <algorithm>
+#include <memory>
+#include <mutex>
 
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
@@ -17,6 +19,16 @@
 #include "experimental_flux.hpp"
 #include "tests.hpp"
 
+// NumPy arrays of doubles; inputs with other dtypes or memory layouts are converted once (contiguous float64 arrays are used as they are)
+typedef pybind11::array_t<double, pybind11::array::c_style | pybind11::array::forcecast> py11_array;
+// Conversion between NumPy arrays and std::vector; the returned arrays take ownership of the (moved) vectors, i.e. no data is copied
+std::vector<double> py11_to_vector(const py11_array &arr);
+py11_array py11_to_array(std::vector<double> &&vec);
+pybind11::list py11_to_arrays(std::vector<std::vector<double> > &&table);
+// Production rate for a given process name: 'ABC' (as in the other Python functions; equivalent to 'all_electron') or any name in
+// map_interaction_name_to_function, i.e. the names used by the C++ drivers (throws XUnsupportedOption for unknown processes)
+SolarModelMemberFn py11_rate_function(std::string process);
+
 // The name of the module and other info
 void module_info();
 // A simple unit test for the Python wrapper
@@ -27,6 +39,8 @@ void py11_save_spectral_flux_for_different_radii(std::vector<double> ergs, std::
 // Calculate the integrated flux up to given radii
 std::vector<std::vector<double> > py11_calc_integrated_flux_up_to_different_radii(std::vector<double> radii, SolarModel *s, std::string output_file_root = "", std::vector<double> erg_limits = {1.0, 20.0}, std::string process = "Primakoff");
 // Calculate the spectral flux for different energies (radius = 1) with corrected opacities and magnetic fields
+// N.B. The Solar model (with opacity code OP) is only loaded if the file differs from the previous call; the spectra are computed via VariedSpectralFlux, which is
+//      kept for the same energies, s.t. only the channels affected by the changed parameters are re-computed
 void py11_save_varied_spectral_flux(std::vector<double> ergs, std::string solar_model_file, std::string output_file_root, double a = 0.0, double b = 0.0, std::vector<double> c = {0.0, 0.0, 0.0});
 // Calculate reference counts for a named helioscope experiment/dataset
 std::vector<std::vector<double> > py11_calculate_reference_counts(std::vector<double> masses, std::string dataset, std::string ref_spectrum_file_gagg, std::string ref_spectrum_file_gaee, std::string output_file_name);
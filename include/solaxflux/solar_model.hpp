@@ -4,6 +4,7 @@
 #ifndef __solar_model_hpp__
 #define __solar_model_hpp__
 
+#include <cmath>
 #include <iostream>
 #include <iomanip>
 #include <fstream>
@@ -12,6 +13,8 @@
 #include <map>
 #include <set>
 #include <algorithm>
+#include <memory>
+#include <atomic>
 
 #include <gsl/gsl_math.h>
 #include <gsl/gsl_sf.h>
@@ -23,13 +26,62 @@
 #include "constants.hpp"
 #include "utils.hpp"
 
+// Auxiliary function for the ff and ee rates [Eq. (2.17) in arXiv:1310.0823]; aux_function uses a pre-computed table where possible, aux_function_exact the numerical integral
+double aux_function(double u, double y);
+double aux_function_exact(double u, double y);
+
+// PlasmaState: Snapshot of the radius-dependent quantities needed for the production rates at radius r (see SolarModel::plasma_state)
+struct PlasmaState {
+  double r;
+  double temperature; // in keV
+  double density; // in g cm^-3
+  double n_e; // in cm^-3
+  double z2_n; // in cm^-3
+  double z2_n_ff; // z2_n of the isotopes used in the ff contribution (H1, He3, He4)
+  double kappa_squared; // in keV^2
+  double omega_pl_squared; // in keV^2
+  double degeneracy_factor;
+  double bfield; // in keV^2
+  double opacity_correction;
+  // Element number densities (in cm^-3) and the surrounding (ite, jne) grid points and weights for the OP opacities and ionisation tables
+  double n_op_element [num_op_elements];
+  int ite1, ite2, jne1, jne2;
+  double t1, t2;
+  // Temperatures (in keV) of the grid points ite1 and ite2
+  double kT_ite1, kT_ite2;
+};
+
+// TabulatedOpacity: Opacities (without the opacity correction factor) on a uniform grid in r and log10(omega), see SolarModel::set_tabulated_opacity
+// N.B. Values are stored as log(opacity) at position i*n_ergs+j for the i-th radius and j-th energy; "metals" only contains the elements with Z > 2 (only for OP).
+struct TabulatedOpacity {
+  int n_radii = 0, n_ergs = 0;
+  double r_lo, r_delta, log10_erg_lo, log10_erg_delta;
+  std::vector<double> log_total;
+  std::vector<double> log_metals;
+};
+
+// TableLoading: Options for reading the opacity and ionisation tables in the SolarModel constructor (default: all tables are read at once).
+// In lazy mode, each cell of the tables (the ionisation table or the opacity table(s) at one grid point) is only read when it is first needed (thread-safe).
+// The hints state whether the opacities will be used (e.g. not for Primakoff-only runs) and the radial range r <= r_max, s.t. the cells needed
+// for these are read directly in the constructor. N.B. Lazy mode is not used together with a cache file.
+// If cache_profiles is true, the derived radial profiles are cached automatically in user_cache_directory() (see utils.hpp) and reused by later constructions.
+struct TableLoading {
+  TableLoading(bool lazy = false, bool uses_opacities = true, double r_max = 1.0, bool cache_profiles = true) : lazy(lazy), uses_opacities(uses_opacities), r_max(r_max), cache_profiles(cache_profiles) {}
+  bool lazy;
+  bool uses_opacities;
+  double r_max;
+  bool cache_profiles;
+};
+
 // SolarModel class: Provides a container to store a (tabulated) Solar model and functions to return its properties.
 class SolarModel {
   public:
     // Constructors, destructors, operators...
     SolarModel();
-    SolarModel(std::string path_to_model_file, opacitycode opcode_tag = OP, const bool set_raffelt_approx = false);
-    SolarModel(std::string path_to_model_file, std::string opcode_name, const bool set_raffelt_approx = false);
+    // N.B. If cache_file is not empty, the tabulated data and derived radial profiles are loaded from this binary file if it is compatible
+    // with the model file, opacity code, and library version (otherwise they are computed and the cache file is created).
+    SolarModel(std::string path_to_model_file, opacitycode opcode_tag = OP, const bool set_raffelt_approx = false, std::string cache_file = "", TableLoading loading = TableLoading());
+    SolarModel(std::string path_to_model_file, std::string opcode_name, const bool set_raffelt_approx = false, std::string cache_file = "", TableLoading loading = TableLoading());
     ~SolarModel();
     SolarModel& operator=(SolarModel&&);
     // Delete copy constructor and assignment operator to avoid shallow copies
@@ -38,105 +90,163 @@ class SolarModel {
 
     // Solar properties
     // Interpolate numerated data
-    double interp_index(int i, double r);
+    double interp_index(int i, double r) const;
     // Fast lookup function for the standard isotope index
-    int lookup_isotope_index(Isotope isotope);
+    int lookup_isotope_index(Isotope isotope) const;
     // Solar plasma temperature in keV
-    double temperature_in_keV(double r);
+    double temperature_in_keV(double r) const;
     // Solar plasma density in g cm^-3
-    double density(double r);
+    double density(double r) const;
     // Routines to return ion number density (in cm^-3) times (normalised) charge^2
-    double z2_n_iz(double r, int isotope_index);
-    double z2_n_iz(double r, Isotope isotope);
-    double z2_n(double r); // sum over all isotopes
+    double z2_n_iz(double r, int isotope_index) const;
+    double z2_n_iz(double r, Isotope isotope) const;
+    double z2_n(double r) const; // sum over all isotopes
     // Routine to return ion density (in cm^-3) for each isotope
-    double n_iz(double r, int isotope_index);
-    double n_iz(double r, Isotope isotope);
-    double n_element(double r, std::string el_name);
-    double mass_fraction(double r, std::string element);
+    double n_iz(double r, int isotope_index) const;
+    double n_iz(double r, Isotope isotope) const;
+    double n_element(double r, std::string el_name) const;
+    double n_element(double r, op_element element) const;
+    double mass_fraction(double r, std::string element) const;
+    double mass_fraction(double r, op_element element) const;
     // Metallicity Z
-    double metallicity(double r);
+    double metallicity(double r) const;
     // alpha is the expected contribution of all metals to z2_n per nucleon density: z2_n = (X + Y + alpha*Z)*density / m_u
-    double alpha(double r);
+    double alpha(double r) const;
     // The electron density of the plasma (in cm^-3)
-    double n_electron(double r);
+    double n_electron(double r) const;
     // Screening parameter kappa^2 (in keV^2; kappa^-1 = Debye-Hueckel radius)
-    double kappa_squared(double r);
+    double kappa_squared(double r) const;
     // Plasma frequency squared (in keV^2)
-    double omega_pl_squared(double r);
-    double r_from_omega_pl(double omega_pl);
+    double omega_pl_squared(double r) const;
+    // Inverse of the plasma frequency profile (from a table built at initialisation); optionally returns the derivative dr/d(omega_pl^2) (in keV^-2)
+    double r_from_omega_pl(double omega_pl) const;
+    double r_from_omega_pl_squared(double omega_pl_sq, double* dr_domega_pl_sq = NULL) const;
 
     // Solar B-field
-    double bfield(double r);
+    double bfield(double r) const;
 
     // Production rates for the various axion production channels
-    double Gamma_ff(double omega, double r, int isotope_index);
-    double Gamma_ff(double omega, double r, std::vector<int> isotope_indices);
-    double Gamma_ff(double omega, double r, Isotope isotope);
-    double Gamma_ff(double omega, double r); // sum over all isotopes
-    double Gamma_ee(double omega, double r);
-    double Gamma_Compton(double omega, double r);
-    double Gamma_opacity(double omega, double r, std::string element);
-    double Gamma_opacity(double omega, double r, Isotope isotope); // overloaded for convenience; opacity only depends on chemical element, not on isotope
-    double Gamma_opacity(double omega, double r); // sum over all elements
-    double Gamma_all_electron(double omega, double r); // sum over all axion-electron interactions
-    double Gamma_Primakoff(double omega, double r); // The usual Primakoff rate, but incl. corrections for lower energies < 1 keV
-    double Gamma_LP(double omega, double r);
-    double Gamma_LP_Rosseland(double omega, double r); // using Rosseland opacities
-    double Gamma_TP(double omega, double r); // only non-resonant part (m_a = 0)
-    double Gamma_TP_Rosseland(double omega, double r); // using Rosseland opacities; only non-resonant part (m_a = 0)
-    double Gamma_plasmon(double omega, double r); // all plasmon interactions
-    double Gamma_all_photon(double omega, double r); // sum over all axion-photon interactions
+    double Gamma_ff(double omega, double r, int isotope_index) const;
+    double Gamma_ff(double omega, double r, std::vector<int> isotope_indices) const;
+    double Gamma_ff(double omega, double r, Isotope isotope) const;
+    double Gamma_ff(double omega, double r) const; // sum over all isotopes
+    double Gamma_ee(double omega, double r) const;
+    double Gamma_Compton(double omega, double r) const;
+    double Gamma_opacity(double omega, double r, std::string element) const;
+    double Gamma_opacity(double omega, double r, op_element element) const;
+    double Gamma_opacity(double omega, double r, Isotope isotope) const; // overloaded for convenience; opacity only depends on chemical element, not on isotope
+    double Gamma_opacity(double omega, double r) const; // sum over all elements
+    double Gamma_all_electron(double omega, double r) const; // sum over all axion-electron interactions
+    double Gamma_Primakoff(double omega, double r) const; // The usual Primakoff rate, but incl. corrections for lower energies < 1 keV
+    double Gamma_LP(double omega, double r) const;
+    double Gamma_LP_Rosseland(double omega, double r) const; // using Rosseland opacities
+    // Damping xi^2 = gamma_L*omega (in keV^2) of the LP resonance, i.e. Gamma_LP is a Lorentzian in omega_pl^2 with half width xi^2 around omega^2
+    double LP_resonance_width_squared(double omega, double r, bool use_rosseland_opacity = false) const;
+    double Gamma_TP(double omega, double r) const; // only non-resonant part (m_a = 0)
+    double Gamma_TP_Rosseland(double omega, double r) const; // using Rosseland opacities; only non-resonant part (m_a = 0)
+    double Gamma_plasmon(double omega, double r) const; // all plasmon interactions
+    double Gamma_all_photon(double omega, double r) const; // sum over all axion-photon interactions
     // General nuclear transition and most improtant iron 57 
-    double Gamma_nuclear(double omega, double r, Nucleartransition trans);
-    double Gamma_Fe57(double omega, double r);
+    double Gamma_nuclear(double omega, double r, Nucleartransition trans) const;
+    double Gamma_Fe57(double omega, double r) const;
+    // Energy-integrated line emission, int domega omega^2 Gamma_nuclear(omega, r)/(2 pi^2), and Doppler width (in keV) of the Gaussian line profile
+    double nuclear_line_emissivity(double r, Nucleartransition trans) const;
+    double nuclear_line_doppler_width(double r, Nucleartransition trans) const;
+    // Radius-dependent quantities at radius r, and the production rates and opacities for a given plasma state
+    // N.B. Use these if several rates, energies, or elements are needed at the same radius.
+    PlasmaState plasma_state(double r) const;
+    double Gamma_ff(double omega, const PlasmaState &ps) const;
+    double Gamma_ee(double omega, const PlasmaState &ps) const;
+    double Gamma_Compton(double omega, const PlasmaState &ps) const;
+    double Gamma_opacity(double omega, const PlasmaState &ps, op_element element) const;
+    double Gamma_opacity(double omega, const PlasmaState &ps) const;
+    double Gamma_all_electron(double omega, const PlasmaState &ps) const;
+    double Gamma_Primakoff(double omega, const PlasmaState &ps) const;
+    double Gamma_LP(double omega, const PlasmaState &ps) const;
+    double Gamma_TP(double omega, const PlasmaState &ps) const;
+    double Gamma_plasmon(double omega, const PlasmaState &ps) const;
+    double Gamma_all_photon(double omega, const PlasmaState &ps) const;
+    double opacity_table_interpolator_op(double omega, const PlasmaState &ps, op_element element) const;
+    double opacity_element(double omega, const PlasmaState &ps, op_element element) const;
+    double opacity(double omega, const PlasmaState &ps) const;
+    double ionisationsqr_element(const PlasmaState &ps, op_element element) const;
+    // Batched evaluation of the rates above: out[i] = Gamma(omegas[i], r) for one radius or out[i] = Gamma(omega, radii[i]) for one energy.
+    // N.B. For the standard photon and electron channels, the radius-dependent quantities are only computed once per radius.
+    void rates(double (SolarModel::*rate)(double, double) const, const double* omegas, size_t n, double r, double* out) const;
+    void rates(double (SolarModel::*rate)(double, double) const, double omega, const double* radii, size_t n, double* out) const;
+    std::vector<double> rates(double (SolarModel::*rate)(double, double) const, const std::vector<double> &omegas, double r) const;
+    // Several channels at once: out[c*n+i] = Gamma_c(omegas[i], r); the radius-dependent quantities are shared by all channels.
+    void rates(const std::vector<double (SolarModel::*)(double, double) const> &channels, const double* omegas, size_t n, double r, double* out) const;
     // Interpolation routines for the opacity data
-    double op_grid_interp_erg(double u, int ite, int jne, std::string element);
-    double tops_grid_interp_erg(double erg, float t, float rho);
-    double opas_grid_interp_erg(double erg, double r);
-    double opacity_table_interpolator_op(double omega, double r, std::string element);
-    double opacity_table_interpolator_tops(double omega, double r);
-    double opacity_table_interpolator_opas(double omega, double r);
-    double opacity_element(double omega, double r, std::string element);
+    double op_grid_interp_erg(double u, int ite, int jne, std::string element) const;
+    double op_grid_interp_erg(double u, int ite, int jne, op_element element) const;
+    double tops_grid_interp_erg(double erg, float t, float rho) const;
+    double opas_grid_interp_erg(double erg, double r) const;
+    double opacity_table_interpolator_op(double omega, double r, std::string element) const;
+    double opacity_table_interpolator_op(double omega, double r, op_element element) const;
+    double opacity_table_interpolator_tops(double omega, double r) const;
+    double opacity_table_interpolator_opas(double omega, double r) const;
+    double opacity_element(double omega, double r, std::string element) const;
+    double opacity_element(double omega, double r, op_element element) const;
 
     // Interpolation routines for the ionisation tables from the Opacity Project
-    double ionisationsqr_grid(int ite, int jne, std::string element);
-    double ionisationsqr_element(double r, std::string element);
+    double ionisationsqr_grid(int ite, int jne, std::string element) const;
+    double ionisationsqr_grid(int ite, int jne, op_element element) const;
+    double ionisationsqr_element(double r, std::string element) const;
+    double ionisationsqr_element(double r, op_element element) const;
 
     // N.B. Opacity only depends on chemical properties; below just overloaded for convenience;
-    double opacity_element(double omega, double r, Isotope isotope);
-    double opacity(double omega, double r);
-    std::vector<double> log10_rosseland_opacity(std::vector<double> radii);
-    double interpolate_rosseland_opacity(double r);
+    double opacity_element(double omega, double r, Isotope isotope) const;
+    double opacity(double omega, double r) const;
+    // N.B. Parallelised over the radii if get_num_threads() > 1 (same for calc_averaged_electron_degeneracy_factor)
+    std::vector<double> log10_rosseland_opacity(std::vector<double> radii) const;
+    double interpolate_rosseland_opacity(double r) const;
 
     // Electron degeneracy-related functions
-    double calc_electron_chemical_potential(double r);
-    double electron_chemical_potential(double r);
-    std::vector<std::vector<double> > calc_electron_degeneracy_factor(std::vector<double> ergs, std::vector<double> all_radii);
-    std::vector<double> calc_averaged_electron_degeneracy_factor(std::vector<double> radii);
-    double avg_degeneracy_factor(double r);
+    double calc_electron_chemical_potential(double r) const;
+    double electron_chemical_potential(double r) const;
+    std::vector<std::vector<double> > calc_electron_degeneracy_factor(std::vector<double> ergs, std::vector<double> all_radii) const;
+    std::vector<double> calc_averaged_electron_degeneracy_factor(std::vector<double> radii) const;
+    double avg_degeneracy_factor(double r) const;
 
     // B-field correction
     void set_bfields(double b_rad, double b_tach, double b_outer); // Set B-fields in tesla
-    std::vector<double> get_bfields();
+    std::vector<double> get_bfields() const;
     // Set the opacity correction of the Opacity Project values according to opacity*(1 + delta), with
     // delta = a + b * log10(T(0)/T(r)) / log10(T(0)/T(r_CZ)), where r_CZ = location of convective zone
     void set_opacity_correction(double a, double b);
-    std::vector<double> get_opacity_correction();
-    double apply_opacity_correction_factor(double r);
+    std::vector<double> get_opacity_correction() const;
+    double apply_opacity_correction_factor(double r) const;
+
+    // Tabulated opacities: tabulate the opacity of the full mixture (and of the metals for OP) on a grid in (r, log10(omega)) for erg_lo <= omega <= erg_hi (in keV).
+    // The grid is refined until the rms relative interpolation error at the midpoints between grid points is below rel_tolerance (or the maximum size is reached).
+    // N.B. Used by opacity, Gamma_opacity, Gamma_all_electron, Gamma_TP, Gamma_LP; lookups outside of the grid use the standard routines.
+    // The table does not depend on the opacity correction or B-fields, which can be changed afterwards.
+    void set_tabulated_opacity(bool use_table = true, double rel_tolerance = 1.0e-2, double erg_lo = 0.1, double erg_hi = 20.0);
+    bool uses_tabulated_opacity() const;
+    // Arguments { rel_tolerance, erg_lo, erg_hi } of the tabulated opacities (empty if not used)
+    std::vector<double> get_tabulated_opacity_settings() const;
+
+    // Thread safety: by default, the interpolators use (shared) GSL accelerators to speed up serial lookups.
+    // Lookups from inside an OpenMP parallel region (e.g. the parallel drivers) never use the accelerators.
+    // In thread-safe mode, every lookup performs its own binary search s.t. one SolarModel can also be shared by several (non-OpenMP) threads, e.g. from Python.
+    void set_thread_safe_evaluation(bool thread_safe = true);
+    bool is_thread_safe() const;
 
     // Metadata and information from the Solar model
     void save_solar_model_data(std::string output_file_root, std::vector<double> ergs, int n_radii=1000);
-    double get_r_lo();
-    double get_r_hi();
-    std::vector<double> get_supported_radii(std::vector<double> radii);
+    double get_r_lo() const;
+    double get_r_hi() const;
+    std::vector<double> get_supported_radii(std::vector<double> radii) const;
     std::vector<double> get_all_radii();
-    double get_gagg_ref_value_in_inverse_GeV();
-    double get_gaee_ref_value();
-    std::string get_solaxlib_name_and_version();
-    std::string get_solar_model_name();
-    std::string get_opacitycode_name();
-    bool is_initialised();
+    double get_gagg_ref_value_in_inverse_GeV() const;
+    double get_gaee_ref_value() const;
+    std::string get_solaxlib_name_and_version() const;
+    std::string get_solar_model_name() const;
+    std::string get_opacitycode_name() const;
+    bool is_initialised() const;
+    bool uses_lazy_table_loading() const;
+    bool uses_raffelt_approx() const;
 
   private:
     // INFO
@@ -144,6 +254,8 @@ class SolarModel {
     bool initialisation_status = false;
     // Use the approximation by Raffelt, PRD 33 (1986) 4, Eq. (16a); default is false
     bool raffelt_approx;
+    // Do not use the GSL accelerators for lookups; default is false
+    std::atomic<bool> thread_safe_evaluation { false };
     // Solar model file name (derived from path)
     std::string solar_model_name;
     // PROPERTIES
@@ -156,6 +268,11 @@ class SolarModel {
     double bfield_rad_T = 3.0e3;
     double bfield_tach_T = 50.0;
     double bfield_outer_T = 4.0;
+    // Reference values, computed once at initialisation: temperatures at the centre and at r_CZ, min./max. plasma frequency squared
+    double temperature_centre, temperature_cz;
+    double omega_pl_squared_min, omega_pl_squared_max;
+    // Inverse plasma frequency profile: radii for increasing omega_pl^2 (the monotone envelope of the profile, from r_hi inwards)
+    std::vector<double> inverse_omega_pl_squared, inverse_omega_pl_radius;
     // DATA AND INTERPOLATION
     ASCIItableReader data;
     ASCIItableReader data_rosseland_opacity;
@@ -163,16 +280,26 @@ class SolarModel {
     int num_tracked_isotopes;
     int num_interp_pts;
     std::vector<Isotope> tracked_isotopes;
+    // Indices of the isotopes {H1, He3, He4} used in the (fully ionised) ff contribution
+    std::vector<int> ff_isotope_indices;
     std::vector<gsl_interp_accel*> accel;
     std::vector<gsl_spline*> linear_interp;
     std::vector<gsl_interp_accel*> n_isotope_acc;
     std::vector<gsl_spline*> n_isotope_lin_interp;
     std::vector<gsl_interp_accel*> z2_n_isotope_acc;
     std::vector<gsl_spline*> z2_n_isotope_lin_interp;
-    std::map<std::string, gsl_interp_accel*> n_element_acc;
-    std::map<std::string, gsl_spline*> n_element_lin_interp;
-    std::map< std::string, std::map<std::pair<int,int>, gsl_interp_accel*> > opacity_acc_op;
-    std::map< std::string, std::map<std::pair<int,int>, gsl_spline*> > opacity_lin_interp_op;
+    // Ion density for each element (indexed by op_element)
+    std::vector<gsl_interp_accel*> n_element_acc;
+    std::vector<gsl_spline*> n_element_lin_interp;
+    // OP opacity tables for all elements and grid points, stored contiguously: the log(u) and opacity values for element k and
+    // grid point j (position in op_grid) are stored in [op_offsets[k*op_grid_size+j], op_offsets[k*op_grid_size+j+1]) of op_log_u/op_opacity.
+    std::vector<double> op_log_u;
+    std::vector<double> op_opacity;
+    std::vector<size_t> op_offsets;
+    // Pointers to the OP data, which are either stored in op_log_u/op_opacity or in the memory-mapped cache file
+    const double* op_log_u_ptr = nullptr;
+    const double* op_opacity_ptr = nullptr;
+    MemoryMappedFile cache_mapping;
     std::map<std::pair<float,float>, gsl_interp_accel*> opacity_acc_tops;
     std::map<std::pair<float,float>, gsl_spline*> opacity_lin_interp_tops;
     std::map<double, gsl_interp_accel*> opacity_acc_opas;
@@ -180,19 +307,49 @@ class SolarModel {
     std::vector<std::vector<float>> tops_grid;
     std::vector<float> tops_temperatures;
     std::vector<float> tops_densities;
-    std::map< std::pair<int,int>,  std::map<std::string, double> > element_ionisationsqr;
+    // Squared ionisation for element k and grid point j at position k*op_grid_size+j
+    std::vector<double> op_ionisationsqr;
+    // Tables that are read on first access in lazy mode (see TableLoading); the data above are not used in this case
+    struct LazyTables;
+    std::unique_ptr<LazyTables> lazy_tables;
+    void load_lazy_cells(int table, const std::vector<int> &cells) const;
+    void require_lazy_cell(int table, int cell) const;
+    void preload_lazy_cells(double r_max, bool uses_opacities) const;
+    // Tabulated opacities (if use_opacity_table == true)
+    bool use_opacity_table = false;
+    TabulatedOpacity opacity_table;
+    std::vector<double> opacity_table_settings;
+    // private routines to compute the opacities without the correction factor (directly or from the table; the latter returns false if the table cannot be used)
+    double uncorrected_opacity(double omega, const PlasmaState &ps, bool metals_only) const;
+    void calc_uncorrected_opacities(const std::vector<double> &radii, const std::vector<double> &ergs, std::vector<double> &total, std::vector<double> &metals) const;
+    bool lookup_uncorrected_opacity(double omega, double r, const std::vector<double> &log_values, double &result) const;
+    // private routine to compute the part of the plasma state needed for the opacities (r, temperature, density, n_e, opacity correction, OP grid)
+    void init_opacity_plasma_state(double r, PlasmaState &ps) const;
     // private routines to initialise internal interpolators.
     void init_interp(gsl_interp_accel*& acc, gsl_spline*& interp, const double* x, const double* y);
     void init_numbered_interp(const int index, const double* x, const double* y);
+    // private routine to select the accelerator for a lookup (NULL in thread-safe mode or inside a parallel region)
+    gsl_interp_accel* lookup_accel(gsl_interp_accel* acc) const;
+    // private routine to evaluate internal interpolators (returns GSL status code; no GSL error handler is called)
+    int eval_interp(const gsl_spline* interp, gsl_interp_accel* acc, double x, double* result) const;
+    double eval_interp(const gsl_spline* interp, gsl_interp_accel* acc, double x) const;
 };
 
 // Typedef of SolarModel member function as 'SolarModelMemberFn'
-typedef double (SolarModel::*SolarModelMemberFn)(double,double);
+typedef double (SolarModel::*SolarModelMemberFn)(double,double) const;
 const std::map<std::string, SolarModelMemberFn> map_interaction_name_to_function {
   {"Primakoff", &SolarModel::Gamma_Primakoff}, {"Compton", &SolarModel::Gamma_Compton}, {"ee", &SolarModel::Gamma_ee},
-  {"ff", &SolarModel::Gamma_ff}, {"opacity", &SolarModel::Gamma_opacity}, {"all_electron", &SolarModel::Gamma_all_electron}
+  {"ff", &SolarModel::Gamma_ff}, {"opacity", &SolarModel::Gamma_opacity}, {"all_electron", &SolarModel::Gamma_all_electron},
+  {"TP", &SolarModel::Gamma_TP}, {"LP", &SolarModel::Gamma_LP}, {"plasmon", &SolarModel::Gamma_plasmon}, {"all_photon", &SolarModel::Gamma_all_photon}
 };
 SolarModelMemberFn get_SolarModel_function_pointer(std::string interaction_name);
+// Inverse of the above (e.g. for log messages); returns 'Fe57' for Gamma_Fe57 and 'other' for functions not in the map
+std::string get_SolarModel_function_name(SolarModelMemberFn integrand);
+// Names of several functions, separated by '+'
+std::string get_SolarModel_function_names(const std::vector<SolarModelMemberFn> &integrands);
+
+// Table loading options for the given channels (opacities are only read when needed) in lazy mode
+TableLoading lazy_table_loading(std::vector<SolarModelMemberFn> channels, double r_max = 1.0);
 
 std::string standard_header(SolarModel *s);
 
@@ -10,6 +10,7 @@
 #include <random>
 #include <algorithm>
 #include <chrono>
+#include <functional>
 
 #include <gsl/gsl_integration.h>
 #include <gsl/gsl_cdf.h>
@@ -24,33 +25,133 @@ const double distance_factor = pow(radius_sol/(1.0e-2*keV2cm),3) / ( pow(1.0e2*d
 /////////////////////////////////////////////////////
 
 // Variables that define the behaviour of the GSL integrators and wrapper functions for solar model integration routines
+// N.B. The int_space_size_* values are the initial numbers of subintervals of the QAG workspaces, which are enlarged if needed (see integrate_qag in utils.hpp).
+//      The CQUAD workspaces have a fixed size, which is much larger than the number of intervals needed by the (smooth) integrands on the solar disc.
 // 1D-Integration for files
-const int int_method_file = 5, int_space_size_file = 1e6;
+const int int_method_file = 5, int_space_size_file = 1000;
 const double int_abs_prec_file = 0.0, int_rel_prec_file = 1.0e-4;
 struct solar_model_integration_params_custom { double erg; SolarModel* sol; Isotope isotope; };
 
 // Integration over the full Sun (1D), see Eq. (2.42) in [arXiv:2101.08789]
-const int int_method_1d = 5, int_space_size_1d = 1e6;
+const int int_method_1d = 5, int_space_size_1d = 1000;
 const double int_abs_prec_1d = 0.0, int_rel_prec_1d = 1.0e-3;
-struct solar_model_integration_parameters_1d { double erg; SolarModel* s; double (SolarModel::*integrand)(double, double); gsl_function* f; gsl_integration_workspace* w; };
+struct solar_model_integration_parameters_1d { double erg; SolarModel* s; double (SolarModel::*integrand)(double, double) const; gsl_function* f; gsl_integration_workspace* w; };
 double r_integrand_1d(double r, void * params);
 double erg_integrand_1d(double erg, void * params);
 
+// Treatment of the LP resonance (Gamma_LP and Gamma_LP_Rosseland) in the 1D integrals: the resonance radius is used as a breakpoint of the adaptive
+// integration over r (default), or the integral is performed in theta = atan((omega^2 - omega_pl^2(r))/xi^2), which removes the Lorentzian peak analytically
+// (see SolarModel::LP_resonance_width_squared), s.t. the remaining integrand is smooth. The theta interval covers lp_resonance_window half widths.
+enum lp_resonance_integration { LP_RESONANCE_BREAKPOINT, LP_RESONANCE_SUBSTITUTION };
+void set_lp_resonance_integration(lp_resonance_integration mode);
+lp_resonance_integration get_lp_resonance_integration();
+const double lp_resonance_window = 100.0;
+struct lp_resonance_integration_params { solar_model_integration_parameters_1d* p; double erg2; double xi2; };
+double lp_resonance_theta_integrand(double theta, void * params);
+
 // Integration over the central Solar disc (2D), see (2.45) in [arXiv:2101.08789]
-const int int_method_2d = 5, int_space_size_2d = 1e6, int_space_size_2d_cquad = 1e6;
+const int int_method_2d = 5, int_space_size_2d = 1000, int_space_size_2d_cquad = 1000;
 const double int_abs_prec_2d = 0.0, int_rel_prec_2d = 1.0e-3;
-struct solar_model_integration_parameters_2d { double erg; double rho; double rho_0; double rho_1; SolarModel* s; double (SolarModel::*integrand)(double, double);
+struct solar_model_integration_parameters_2d { double erg; double rho; double rho_0; double rho_1; SolarModel* s; double (SolarModel::*integrand)(double, double) const;
   gsl_function* f1; gsl_integration_cquad_workspace* w1; gsl_function* f2; gsl_integration_cquad_workspace* w2; };
 double r_integrand_2d(double r, void * params);
 double rho_integrand_2d(double rho, void * params);
 double erg_integrand_2d(double erg, void * params);
 
+// Each thread of the parallelised integration routines owns a full set of parameters and GSL workspaces
+struct integration_worker_1d {
+  integration_worker_1d(SolarModel* s, double (SolarModel::*integrand)(double, double) const);
+  ~integration_worker_1d();
+  integration_worker_1d(const integration_worker_1d&) = delete;
+  integration_worker_1d& operator=(const integration_worker_1d&) = delete;
+  gsl_function f;
+  gsl_integration_workspace* w;
+  solar_model_integration_parameters_1d p;
+};
+struct integration_worker_2d {
+  integration_worker_2d(SolarModel* s, double (SolarModel::*integrand)(double, double) const);
+  ~integration_worker_2d();
+  integration_worker_2d(const integration_worker_2d&) = delete;
+  integration_worker_2d& operator=(const integration_worker_2d&) = delete;
+  gsl_function f1, f2;
+  gsl_integration_cquad_workspace *w1, *w2;
+  solar_model_integration_parameters_2d p;
+};
+
+// Integration engines for the 2D integrals over the solar disc: nested adaptive GSL routines (default) or fixed-order quadrature.
+// The fixed-order engine uses 15-point Gauss-Kronrod rules on panels in r (with breakpoints at all ring boundaries and n_panels uniform ones), and the
+// rho integral is performed analytically. All rings and energies share the same radial nodes s.t. each radius requires only one call of SolarModel::rates.
+// N.B. Rates with narrow resonances in r or omega (LP, plasmon, all_photon, nuclear lines) always use the adaptive routines.
+enum integration_engine { ADAPTIVE_INTEGRATION, FIXED_ORDER_INTEGRATION };
+void set_integration_engine(integration_engine engine, int n_panels = 50);
+integration_engine get_integration_engine();
+int get_fixed_order_panels();
+bool supports_fixed_order_integration(double (SolarModel::*integrand)(double, double) const);
+
+// Nodes and weights of composite 15-point Gauss-Kronrod rules between the breakpoints; w_gauss are the weights of the embedded 7-point Gauss rule (0 for the other nodes).
+// If sqrt_substitution is true, x = a + (b-a) t^2 s.t. square-root singularities at the lower end of each panel [a, b] are removed.
+struct fixed_order_rule { std::vector<double> x, w_kronrod, w_gauss; std::vector<int> panel; int n_panels; };
+fixed_order_rule gauss_kronrod_rule(std::vector<double> breakpoints, bool sqrt_substitution = false);
+// Fixed-order disc integrals for all combinations of rings [rhos_0[i], rhos_1[i]] and energies ergs[j] (at position i*ergs.size()+j); returns { fluxes, error estimates }
+// N.B. Fluxes without the distance_factor, i.e. the same normalisation as erg_integrand_2d.
+std::vector<std::vector<double> > fixed_order_disc_integrals(std::vector<double> ergs, std::vector<double> rhos_0, std::vector<double> rhos_1, SolarModel &s, double (SolarModel::*integrand)(double, double) const);
+// Same for several channels, which share the radial nodes and the radius-dependent quantities; returns { fluxes, error estimates } for each channel
+std::vector<std::vector<std::vector<double> > > fixed_order_disc_integrals(std::vector<double> ergs, std::vector<double> rhos_0, std::vector<double> rhos_1, SolarModel &s, std::vector<SolarModelMemberFn> integrands);
+
+// Vector-valued adaptive integration of the n components of f(x, out) over [breakpoints.front(), breakpoints.back()], s.t. all components share the nodes of the
+// 15-point Gauss-Kronrod rules. The interval with the largest error relative to the target precision max(abs_prec, rel_prec*|integral|) of each component (max-norm over
+// all components that have not converged) is bisected, until all components converge or max_intervals is reached; returns { integrals, error estimates }.
+// If sqrt_substitution is true, x = a + (b-a) t^2 on each panel [a, b] (see gauss_kronrod_rule); converged (if given) is set to false if the target precision is not reached.
+std::vector<std::vector<double> > integrate_vector_adaptive(std::function<void(double, double*)> f, int n, std::vector<double> breakpoints, double abs_prec, double rel_prec, int max_intervals,
+                                                           bool sqrt_substitution = false, bool* converged = NULL);
+// Disc integrals over the ring [rho_0, rho_1] at energy erg for several channels with the adaptive routine above (same normalisation as fixed_order_disc_integrals);
+// the rates of all channels are evaluated at the same radii, and the LP resonance radius (if relevant) is a breakpoint. Returns { fluxes, error estimates } over the channels.
+std::vector<std::vector<double> > adaptive_disc_integrals(double erg, double rho_0, double rho_1, SolarModel &s, const std::vector<SolarModelMemberFn> &integrands, double rel_prec, bool* converged = NULL);
+
 // General functions for various integration routines; see Eq. (2.42) and (2.45) in [arXiv:2101.08789]
-std::vector<std::vector<double> > calculate_d2Phi_a_domega_drho(std::vector<double> ergs, std::vector<double> rhos, SolarModel &s, double (SolarModel::*integrand)(double, double), std::string saveas = "");
-std::vector<std::vector<double> > integrate_d2Phi_a_domega_drho_up_to_rho(std::vector<double> ergs, double rho_max, SolarModel &s, double (SolarModel::*integrand)(double, double), std::string saveas = "", Isotope isotope = {});
-std::vector<std::vector<double> > integrate_d2Phi_a_domega_drho_between_rhos(std::vector<double> ergs, std::vector<double> rhos, SolarModel &s, double (SolarModel::*integrand)(double, double), std::string saveas = "", bool use_ring_geometry=false, Isotope isotope = {});
-std::vector<std::vector<double> > fully_integrate_d2Phi_a_domega_drho_in_rho(std::vector<double> ergs, SolarModel &s, double (SolarModel::*integrand)(double, double), std::string saveas = "", Isotope isotope = {});
-std::vector<std::vector<double> > integrate_d2Phi_a_domega_drho_up_to_rho_and_for_omega_interval(double erg_lo, double erg_hi, std::vector<double> rhos, SolarModel &s, double (SolarModel::*integrand)(double, double), std::string saveas = "");
+std::vector<std::vector<double> > calculate_d2Phi_a_domega_drho(std::vector<double> ergs, std::vector<double> rhos, SolarModel &s, double (SolarModel::*integrand)(double, double) const, std::string saveas = "");
+std::vector<std::vector<double> > integrate_d2Phi_a_domega_drho_up_to_rho(std::vector<double> ergs, double rho_max, SolarModel &s, double (SolarModel::*integrand)(double, double) const, std::string saveas = "", Isotope isotope = {});
+std::vector<std::vector<double> > integrate_d2Phi_a_domega_drho_between_rhos(std::vector<double> ergs, std::vector<double> rhos, SolarModel &s, double (SolarModel::*integrand)(double, double) const, std::string saveas = "", bool use_ring_geometry=false, Isotope isotope = {});
+std::vector<std::vector<double> > fully_integrate_d2Phi_a_domega_drho_in_rho(std::vector<double> ergs, SolarModel &s, double (SolarModel::*integrand)(double, double) const, std::string saveas = "", Isotope isotope = {});
+std::vector<std::vector<double> > integrate_d2Phi_a_domega_drho_up_to_rho_and_for_omega_interval(double erg_lo, double erg_hi, std::vector<double> rhos, SolarModel &s, double (SolarModel::*integrand)(double, double) const, std::string saveas = "");
+
+// Multi-channel versions of the routines above: return the same table for each channel (and save it to saveas[c] if output files are given).
+// With the fixed-order engine, all supported channels are integrated in a single pass that shares the nodes and radius-dependent quantities. The other channels
+// (all channels for the default adaptive engine, incl. plasmon with the LP resonance as a breakpoint) share the nodes of integrate_vector_adaptive, s.t. each
+// radius only requires one plasma state for all channels. N.B. A single adaptive channel and, in the 1D integral, Gamma_LP and Gamma_LP_Rosseland use the
+// single-channel routines.
+std::vector<std::vector<std::vector<double> > > fully_integrate_d2Phi_a_domega_drho_in_rho(std::vector<double> ergs, SolarModel &s, std::vector<SolarModelMemberFn> integrands, std::vector<std::string> saveas = {});
+std::vector<std::vector<std::vector<double> > > integrate_d2Phi_a_domega_drho_between_rhos(std::vector<double> ergs, std::vector<double> rhos, SolarModel &s, std::vector<SolarModelMemberFn> integrands,
+                                                                                           std::vector<std::string> saveas = {}, bool use_ring_geometry=false);
+std::vector<std::vector<std::vector<double> > > integrate_d2Phi_a_domega_drho_up_to_rho_and_for_omega_interval(double erg_lo, double erg_hi, std::vector<double> rhos, SolarModel &s, std::vector<SolarModelMemberFn> integrands,
+                                                                                                              std::vector<std::string> saveas = {});
+
+// Adaptive energy grids: starting from n_initial uniformly spaced energies in [erg_lo, erg_hi] (and both sides of the absorption edges, see get_relevant_peaks), the
+// midpoint of each interval is computed and compared to the linear interpolation of the interval. Intervals where the difference exceeds
+// max(rel_tolerance*|flux|, abs_tolerance) are split, until all intervals pass or max_points energies are computed. All computed energies are reused and
+// returned as a non-uniform grid { energies, fluxes }, s.t. linear interpolation (e.g. SpectrumInterpolator or OneDInterpolator) has the requested accuracy.
+// N.B. The energies of each refinement step are computed in one batch (i.e. in parallel); features narrower than the initial spacing may be missed.
+const int adaptive_erg_grid_n_initial = 33, adaptive_erg_grid_max_points = 10000;
+const double adaptive_erg_grid_min_width = 1.0e-6; // Minimum width of the intervals relative to erg_hi - erg_lo
+std::vector<std::vector<double> > adaptive_erg_grid(double erg_lo, double erg_hi, std::function<std::vector<double>(const std::vector<double>&)> fluxes, double rel_tolerance, double abs_tolerance = 0,
+                                                    int n_initial = adaptive_erg_grid_n_initial, int max_points = adaptive_erg_grid_max_points);
+// Versions of fully_integrate_d2Phi_a_domega_drho_in_rho and integrate_d2Phi_a_domega_drho_up_to_rho on adaptive energy grids; return { energies, fluxes }
+std::vector<std::vector<double> > adaptively_integrate_d2Phi_a_domega_drho_in_rho(double erg_lo, double erg_hi, SolarModel &s, double (SolarModel::*integrand)(double, double) const,
+                                                                                  double rel_tolerance = 1.0e-3, std::string saveas = "", double abs_tolerance = 0);
+std::vector<std::vector<double> > adaptively_integrate_d2Phi_a_domega_drho_up_to_rho(double erg_lo, double erg_hi, double rho_max, SolarModel &s, double (SolarModel::*integrand)(double, double) const,
+                                                                                     double rel_tolerance = 1.0e-3, std::string saveas = "", double abs_tolerance = 0);
+
+// Distributed versions of the 2D routines for large (omega, rho) maps: all processes that run the same computation with the same work_dir (e.g. the ranks of
+// an MPI job or batch jobs on several nodes, with a shared file system) process chunks of chunk_size tasks each, which are saved in work_dir (see TaskCheckpoints).
+// When all chunks are done, the results are merged, saved to saveas, and returned; otherwise an empty table is returned. Running again resumes an interrupted computation.
+// Claims of chunks that were not refreshed for claim_timeout seconds (e.g. of a killed job) are taken over. The claims are refreshed after every task, s.t. the timeout
+// only needs to exceed the duration of a single task; use claim_timeout = 0 to take over all unfinished chunks if no other process is running.
+const double distributed_claim_timeout = 600.0;
+std::vector<std::vector<double> > calculate_d2Phi_a_domega_drho_distributed(std::vector<double> ergs, std::vector<double> rhos, SolarModel &s, double (SolarModel::*integrand)(double, double) const,
+                                                                            std::string work_dir, std::string saveas = "", int chunk_size = 64, double claim_timeout = distributed_claim_timeout);
+std::vector<std::vector<double> > integrate_d2Phi_a_domega_drho_between_rhos_distributed(std::vector<double> ergs, std::vector<double> rhos, SolarModel &s, double (SolarModel::*integrand)(double, double) const,
+                                                                                         std::string work_dir, std::string saveas = "", bool use_ring_geometry=false, int chunk_size = 64,
+                                                                                         double claim_timeout = distributed_claim_timeout);
 
 // Convenience functions for integrating specific processes
 std::vector<std::vector<double> > fully_integrate_d2Phi_a_domega_drho_in_rho_Primakoff(std::vector<double> ergs, SolarModel &s, std::string saveas = "");
@@ -66,6 +167,32 @@ std::vector<std::vector<double> > fully_integrate_d2Phi_a_domega_drho_in_rho_axi
 std::vector<std::vector<double> > integrate_d2Phi_a_domega_drho_up_to_rho_axionelectron(std::vector<double> ergs, std::vector<double> rhos, SolarModel &s, std::string saveas = "");
 std::vector<std::vector<double> > integrate_d2Phi_a_domega_drho_up_to_rho_axionelectron(std::vector<double> ergs, double rho_max, SolarModel &s, std::string saveas= "");
 
+// VariedSpectralFlux class: Spectral fluxes over the full solar volume for variations of the opacity correction and B-fields (see SolarModel::set_opacity_correction
+// and SolarModel::set_bfields) of one loaded SolarModel, s.t. the Solar model and its tables are only loaded once. Each channel is only re-computed if one of the
+// parameters it depends on has changed: "Primakoff" (none), "ABC" (opacity correction), and "plasmon" (opacity correction and B-fields).
+// N.B. The SolarModel needs to outlive this object. Its parameters are compared at every call, i.e. they can also be changed directly via the SolarModel.
+class VariedSpectralFlux {
+  public:
+    VariedSpectralFlux(SolarModel &s, std::vector<double> ergs);
+    // Set the opacity correction (a, b) and B-fields c (in tesla) of the SolarModel
+    void set_parameters(double a, double b, std::vector<double> c);
+    // Spectral flux { energies, fluxes } of one channel for the current parameters (optionally saved to a file)
+    std::vector<std::vector<double> > spectral_flux(std::string channel, std::string saveas = "");
+    // Save the spectra to output_file_root + "_Primakoff.dat", "_ABC.dat", and "_plasmon.dat" (the latter only if the B-fields are not zero); the outdated
+    // channels are computed in one multi-channel pass
+    void save_spectral_fluxes(std::string output_file_root);
+    // Number of spectra computed so far (i.e. not taken from the cache)
+    int get_n_computations() const;
+  private:
+    struct channel_cache { std::vector<double> parameters; std::vector<std::vector<double> > result; };
+    SolarModel* s;
+    std::vector<double> ergs;
+    std::map<std::string,channel_cache> cache;
+    int n_computations = 0;
+    std::vector<double> channel_parameters(std::string channel) const;
+    void update_cache(std::vector<std::string> channels);
+};
+
 // General functions to allow for custom integration routines of non-SolarModel-type functions
 std::vector<double> calculate_spectral_flux_custom(std::vector<double> ergs, SolarModel &s, double (*integrand)(double, void*), std::string saveas = "", Isotope isotope = {});
 
@@ -74,6 +201,46 @@ std::vector<double> calculate_spectral_flux_weightedCompton(std::vector<double>
 std::vector<double> calculate_spectral_flux_all_ff(std::vector<double> ergs, SolarModel &s, std::string saveas = "");
 std::vector<double> calculate_spectral_flux_opacity_element(std::vector<double> ergs, SolarModel &s, std::string element, std::string saveas = "");
 
+// Line sources: the lines from nuclear transitions (e.g. Gamma_Fe57) are far narrower than any detector bin and are therefore treated analytically. The line
+// flux (in g_eff^2 cm^-2 s^-1, from the disc with rho < rho_max) follows from the energy-integrated emission, s.t. no energies need to be sampled within the line.
+// N.B. The line profile is Gaussian with the flux-weighted rms Doppler width; the continuum spectra (and files) do not include the line.
+struct nuclear_line { double energy; double flux; double width; };
+struct nuclear_line_integration_params { SolarModel* s; Nucleartransition trans; double rho_max; bool doppler_moment; };
+double nuclear_line_r_integrand(double r, void * params);
+nuclear_line nuclear_line_source(SolarModel &s, Nucleartransition trans = fe57trans, double rho_max = 1.0);
+// Line flux from the disc with rho < rhos[i]; returns { rhos, line fluxes }
+std::vector<std::vector<double> > nuclear_line_flux_up_to_rho(std::vector<double> rhos, SolarModel &s, Nucleartransition trans = fe57trans, std::string saveas = "");
+
+// FluxSampler class: Draws axions (energy omega, radius on the solar disc rho, polar angle phi) from the differential flux d^2Phi/(domega drho) on a grid in
+// (rho, omega), e.g. from calculate_d2Phi_a_domega_drho or straight from a SolarModel and a list of channels (whose fluxes are added). The distribution is the
+// bilinear interpolation of the grid: each event picks a grid cell from an alias table and is then drawn exactly from the bilinear density in the cell.
+// N.B. The random numbers of event k are a function of (seed, k) only; the events are therefore reproducible and independent of the number of threads and
+//      of how the events are split into batches (e.g. events [0, n) and [n, 2n) from two calls with first_event = 0 and n). Sampling is const and thread-safe.
+class FluxSampler {
+  public:
+    FluxSampler();
+    // Table with columns { rho [R_sol], omega [keV], d^2Phi/(domega drho) [cm^-2 s^-1 keV^-1] }, where omega runs fastest (as calculate_d2Phi_a_domega_drho)
+    FluxSampler(const std::vector<std::vector<double> > &d2Phi_table);
+    FluxSampler(std::string d2Phi_file);
+    FluxSampler(SolarModel &s, std::vector<SolarModelMemberFn> integrands, std::vector<double> ergs, std::vector<double> rhos);
+    // Integral of the (interpolated) flux over the grid [cm^-2 s^-1]
+    double get_total_flux() const { return total_flux; }
+    std::vector<double> get_ergs() const { return ergs; }
+    std::vector<double> get_rhos() const { return rhos; }
+    // Events first_event, ..., first_event+n-1 written to ergs_out, rhos_out, and phis_out (ignored if NULL)
+    void sample(size_t n, double* ergs_out, double* rhos_out, double* phis_out, uint64_t seed, uint64_t first_event = 0) const;
+    // Same, returns { energies, radii, angles }
+    std::vector<std::vector<double> > sample(size_t n, uint64_t seed, uint64_t first_event = 0) const;
+  private:
+    void init(const std::vector<std::vector<double> > &d2Phi_table);
+    std::vector<double> ergs, rhos;
+    double total_flux = 0;
+    // For each cell (rho_i, omega_j): alias table entries and cumulative probabilities of the corners (rho_i, omega_j), (rho_i+1, omega_j), (rho_i, omega_j+1)
+    // of the bilinear density
+    struct cell { double alias_prob; uint32_t alias; uint32_t i, j; double corner_cdf [3]; };
+    std::vector<cell> cells;
+};
+
 // Function to perform simple integrations from a text file
 double integrated_flux_from_file(double erg_min, double erg_max, std::string spectral_flux_file, bool includes_electron_interactions = true);
 
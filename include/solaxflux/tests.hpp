@@ -17,6 +17,15 @@ using namespace std::chrono;
 
 high_resolution_clock::time_point time_now() { return high_resolution_clock::now(); };
 
+// Maximum relative deviation of the values from the reference values (reference values that are zero are skipped)
+double max_rel_deviation(const std::vector<double> &values, const std::vector<double> &reference) {
+  double result = 0;
+  for (size_t i = 0; i < std::min(values.size(), reference.size()); i++) {
+    if (reference[i] != 0) { result = std::max(result, std::abs(values[i]/reference[i] - 1.0)); }
+  }
+  return result;
+}
+
 // A simple selection of unit tests for the library.
 void run_unit_test() {
   auto t_start = time_now();
@@ -39,15 +48,10 @@ void run_unit_test() {
   std::cout << "\n# Setting up the Solar model '" << solar_model_name << "' took " << duration_cast<seconds>(t1e-t1s).count() << " seconds." << std::endl;
   const int n_erg_values = 500;
   const int n_erg_values_LP = 1000;
-  const int n_erg_values_Fe57 = 1000;
   std:: vector<double> test_ergs;
   for (int k=0; k<n_erg_values; k++) { test_ergs.push_back(0.1+k*11.9/n_erg_values); }
   std:: vector<double> test_ergs_LP;
   for (int k=0; k<n_erg_values_LP; k++) { test_ergs_LP.push_back((0.001*gsl_pow_int(1.006,k))); }
-  std::vector<double> test_ergs_Fe;
-  double width = 0.1;
-  double step = width / n_erg_values_Fe57;
-  for (int k=0; k<n_erg_values_Fe57; k++) { test_ergs_Fe.push_back(14.4 + (k - n_erg_values_Fe57/2) * step); }
   const int n_rad_values = 6;
   std:: vector<double> test_rads;
   for (int k=0; k<n_rad_values; k++) { test_rads.push_back(k*1.0/(n_rad_values-1)); }
@@ -126,14 +130,207 @@ void run_unit_test() {
   std::cout << "# Calculating the full axion-electron spectrum (" << n_erg_values << " energy values) took " << duration_cast<seconds>(t12e-t12s).count() << " seconds." << std::endl;
    
   auto t13s = time_now();
-  std::cout << "\n# Computing spectrum from Fe57 nuclear transition" << std::endl;
-  std::vector<std::vector<double> > specFeFlux = fully_integrate_d2Phi_a_domega_drho_in_rho(test_ergs_Fe, s, &SolarModel::Gamma_Fe57, output_path + "Fe57.dat");
+  std::cout << "\n# Computing the line flux from Fe57 nuclear transition" << std::endl;
+  nuclear_line fe57_line = nuclear_line_source(s, fe57trans);
   auto t13e = time_now();
-  std::cout << "# Calculating the spectrum from Fe57 nuclear transition for (" << n_erg_values_Fe57 << " energy values) took " << duration_cast<seconds>(t13e-t13s).count() << " seconds." << std::endl;
-  double integratedflux = 0.0;
-  for (std::vector<double>::iterator it=specFeFlux[1].begin() ; it != specFeFlux[1].end(); ++it) { integratedflux += *it; }
-  integratedflux *= step;
-  std::cout << "The integrated Fe57 flux: " << integratedflux << " g_eff^2 cm^-2 s^-1 (should be 5.0565e+23 g_eff^2 cm^-2 s^-1)." << std::endl;
+  std::cout << "# Calculating the line flux from Fe57 nuclear transition took " << duration_cast<seconds>(t13e-t13s).count() << " seconds." << std::endl;
+  std::cout << "The integrated Fe57 flux: " << fe57_line.flux << " g_eff^2 cm^-2 s^-1 (should be 5.0565e+23 g_eff^2 cm^-2 s^-1)." << std::endl;
+  std::cout << "Doppler width of the Fe57 line: " << fe57_line.width << " keV." << std::endl;
+
+  auto t14s = time_now();
+  std::cout << "\n# Comparing the fixed-order and adaptive integration engines for the Primakoff flux..." << std::endl;
+  std::vector<double> engine_ergs;
+  for (int k=0; k<20; k++) { engine_ergs.push_back(0.5+k*0.5); }
+  set_integration_engine(ADAPTIVE_INTEGRATION);
+  std::vector<std::vector<double> > adaptive_spectrum = fully_integrate_d2Phi_a_domega_drho_in_rho(engine_ergs, s, &SolarModel::Gamma_Primakoff);
+  std::vector<std::vector<double> > adaptive_rings = integrate_d2Phi_a_domega_drho_between_rhos(engine_ergs, test_rads, s, &SolarModel::Gamma_Primakoff, "", true);
+  std::vector<std::vector<double> > adaptive_interval = integrate_d2Phi_a_domega_drho_up_to_rho_and_for_omega_interval(0.5, 10.0, test_rads, s, &SolarModel::Gamma_Primakoff);
+  set_integration_engine(FIXED_ORDER_INTEGRATION);
+  std::vector<std::vector<double> > fixed_order_spectrum = fully_integrate_d2Phi_a_domega_drho_in_rho(engine_ergs, s, &SolarModel::Gamma_Primakoff);
+  std::vector<std::vector<double> > fixed_order_rings = integrate_d2Phi_a_domega_drho_between_rhos(engine_ergs, test_rads, s, &SolarModel::Gamma_Primakoff, "", true);
+  std::vector<std::vector<double> > fixed_order_interval = integrate_d2Phi_a_domega_drho_up_to_rho_and_for_omega_interval(0.5, 10.0, test_rads, s, &SolarModel::Gamma_Primakoff);
+  set_integration_engine(ADAPTIVE_INTEGRATION);
+  auto t14e = time_now();
+  std::cout << "Max. relative deviation of the fixed-order spectrum: " << max_rel_deviation(fixed_order_spectrum.back(), adaptive_spectrum.back()) << " (should be below 0.001)." << std::endl;
+  std::cout << "Max. relative deviation of the fixed-order ring spectra: " << max_rel_deviation(fixed_order_rings.back(), adaptive_rings.back()) << " (should be below 0.001)." << std::endl;
+  std::cout << "Max. relative deviation of the fixed-order fluxes in [0.5, 10] keV: " << max_rel_deviation(fixed_order_interval[1], adaptive_interval[1]) << " (should be below 0.001)." << std::endl;
+  std::cout << "# Comparing the integration engines took " << duration_cast<seconds>(t14e-t14s).count() << " seconds." << std::endl;
+
+  auto t15s = time_now();
+  std::cout << "\n# Comparing the mass-scan and adaptive engines for the CAST 2007 reference counts..." << std::endl;
+  std::vector<double> test_masses = { 1.0e-3, 0.01, 0.05, 0.1, 0.5 };
+  std::vector<std::vector<double> > counts_adaptive = axion_reference_counts_from_file(&cast_2007_setup, test_masses, output_path + "primakoff.dat", output_path + "all_gaee.dat", output_path + "counts_adaptive.dat", false, false);
+  std::vector<std::vector<double> > counts_mass_scan = axion_reference_counts_from_file(&cast_2007_setup, test_masses, output_path + "primakoff.dat", output_path + "all_gaee.dat", output_path + "counts_mass_scan.dat", false, true);
+  auto t15e = time_now();
+  std::cout << "Max. relative deviation of the Primakoff counts: " << max_rel_deviation(counts_mass_scan[2], counts_adaptive[2]) << " (should be below 0.001)." << std::endl;
+  std::cout << "Max. relative deviation of the axion-electron counts: " << max_rel_deviation(counts_mass_scan[3], counts_adaptive[3]) << " (should be below 0.01)." << std::endl;
+  std::cout << "# Comparing the engines for " << test_masses.size() << " masses took " << duration_cast<milliseconds>(t15e-t15s).count()/1000.0 << " seconds." << std::endl;
+
+  std::cout << "\n# Comparing the CountsPredictor with the reference counts..." << std::endl;
+  CountsPredictor predictor (output_path + "counts_mass_scan.dat");
+  const int n_bins = predictor.get_n_bins();
+  std::vector<double> predicted_counts, predicted_counts_gagg, reference_counts, reference_counts_gagg;
+  for (size_t k = 0; k < test_masses.size(); k++) {
+    std::vector<double> counts = predictor.predict(test_masses[k], 1.0e-10, 1.0e-13);
+    std::vector<double> counts_gagg = predictor.predict(test_masses[k], 2.0e-10);
+    predicted_counts.insert(predicted_counts.end(), counts.begin(), counts.end());
+    predicted_counts_gagg.insert(predicted_counts_gagg.end(), counts_gagg.begin(), counts_gagg.end());
+    for (int j = 0; j < n_bins; j++) {
+      reference_counts.push_back(counts_mass_scan[2][k*n_bins+j] + counts_mass_scan[3][k*n_bins+j]);
+      reference_counts_gagg.push_back(16.0*counts_mass_scan[2][k*n_bins+j]);
+    }
+  }
+  std::cout << "Max. relative deviation of the predicted counts for the reference couplings: " << max_rel_deviation(predicted_counts, reference_counts) << " (should be below 1e-6)." << std::endl;
+  std::cout << "Max. relative deviation of the predicted counts for g_agamma = 2 x 10^-10 1/GeV: " << max_rel_deviation(predicted_counts_gagg, reference_counts_gagg) << " (should be below 1e-6)." << std::endl;
+
+  std::cout << "\n# Writing and reading tables in the .npy format..." << std::endl;
+  std::vector<double> test_values;
+  for (auto erg = test_ergs.begin(); erg != test_ergs.end(); erg++) { test_values.push_back(exp(-(*erg))/(*erg)); }
+  save_to_file(output_path + "npy_test.npy", { test_ergs, test_values }, "Test table\nColumns: Energy [keV] | exp(-E)/E");
+  TableWriter npy_writer (output_path + "npy_test_rows.npy", 2, "Test table (written row by row)");
+  for (size_t i = 0; i < test_ergs.size(); i++) { npy_writer.write_row({ test_ergs[i], test_values[i] }); }
+  npy_writer.close();
+  ASCIItableReader npy_columns (output_path + "npy_test.npy");
+  ASCIItableReader npy_rows (output_path + "npy_test_rows.npy");
+  double npy_deviation = 0;
+  for (size_t i = 0; i < test_ergs.size(); i++) {
+    npy_deviation = std::max(npy_deviation, std::abs(npy_columns[0][i] - test_ergs[i]) + std::abs(npy_columns[1][i] - test_values[i]));
+    npy_deviation = std::max(npy_deviation, std::abs(npy_rows[0][i] - test_ergs[i]) + std::abs(npy_rows[1][i] - test_values[i]));
+  }
+  std::cout << "Rows read from the .npy files: " << npy_columns.getnrow() << " and " << npy_rows.getnrow() << " (should be " << test_ergs.size() << ")." << std::endl;
+  std::cout << "Max. deviation of the values read from the .npy files: " << npy_deviation << " (should be 0)." << std::endl;
+
+  std::cout << "\n# Resuming a partial computation with TaskCheckpoints..." << std::endl;
+  const std::string checkpoints_dir = output_path + "checkpoints_test";
+  const int n_checkpoint_tasks = 10, checkpoint_chunk_size = 3;
+  // Remove the files of previous runs of the test (4 chunks)
+  for (int i = 0; i < 4; i++) {
+    std::remove((checkpoints_dir + "/chunk_" + std::to_string(i) + ".npy").c_str());
+    std::remove((checkpoints_dir + "/chunk_" + std::to_string(i) + ".claim").c_str());
+  }
+  std::remove((checkpoints_dir + "/manifest.txt").c_str());
+  int chunk, first_task, last_task;
+  {
+    // First run: one chunk is saved, the next one is claimed but the run is "interrupted" before it is saved
+    TaskCheckpoints first_run (checkpoints_dir, "unit test", n_checkpoint_tasks, checkpoint_chunk_size);
+    first_run.claim_chunk(chunk, first_task, last_task);
+    std::vector<double> results;
+    for (int t = first_task; t < last_task; t++) { results.push_back(t*t); }
+    first_run.save_chunk(chunk, results);
+    first_run.claim_chunk(chunk, first_task, last_task);
+  }
+  // Second run: takes over the stale claim (claim_timeout = 0) and computes the remaining chunks
+  TaskCheckpoints second_run (checkpoints_dir, "unit test", n_checkpoint_tasks, checkpoint_chunk_size, 0.0);
+  std::cout << "Chunks done before resuming: " << second_run.get_n_chunks_done() << " of " << second_run.get_n_chunks() << " (should be 1 of 4)." << std::endl;
+  int n_chunks_resumed = 0;
+  while (second_run.claim_chunk(chunk, first_task, last_task)) {
+    std::vector<double> results;
+    for (int t = first_task; t < last_task; t++) { results.push_back(t*t); }
+    second_run.save_chunk(chunk, results);
+    n_chunks_resumed++;
+  }
+  std::vector<double> merged_results = second_run.merge_results();
+  double checkpoints_deviation = 0;
+  for (int t = 0; t < n_checkpoint_tasks; t++) { checkpoints_deviation = std::max(checkpoints_deviation, std::abs(merged_results[t] - t*t)); }
+  std::cout << "Chunks computed after resuming: " << n_chunks_resumed << " (should be 3); max. deviation of the merged results: " << checkpoints_deviation << " (should be 0)." << std::endl;
+
+  std::cout << "\n# Resuming a distributed computation with different outer radii..." << std::endl;
+  const std::string distributed_dir = output_path + "distributed_test";
+  std::remove((distributed_dir + "/chunk_0.npy").c_str());
+  std::remove((distributed_dir + "/chunk_0.claim").c_str());
+  std::remove((distributed_dir + "/manifest.txt").c_str());
+  std::vector<double> distributed_ergs = { 1.0, 2.0 };
+  std::vector<std::vector<double> > distributed_fluxes = integrate_d2Phi_a_domega_drho_between_rhos_distributed(distributed_ergs, { 0.1, 0.5, 1.0 }, s, &SolarModel::Gamma_Primakoff, distributed_dir);
+  std::cout << "Rows computed for the first radii: " << distributed_fluxes[0].size() << "." << std::endl;
+  try {
+    integrate_d2Phi_a_domega_drho_between_rhos_distributed(distributed_ergs, { 0.1, 0.4, 0.9 }, s, &SolarModel::Gamma_Primakoff, distributed_dir);
+    std::cout << "The computation with different outer radii was resumed from the same work directory (should be rejected)." << std::endl;
+  } catch(XSanityCheck& err) {
+    std::cout << "The computation with different outer radii was rejected (should be rejected):" << std::endl;
+    std::cout << err.what() << std::endl;
+  }
+
+  std::cout << "\n# Comparing the SpectrumInterpolator with the GSL-based OneDInterpolator..." << std::endl;
+  for (std::string spectrum_file : { "primakoff.dat", "all_gaee.dat" }) {
+    SpectrumInterpolator spectrum (output_path + spectrum_file);
+    OneDInterpolator spectrum_gsl (output_path + spectrum_file);
+    std::vector<double> interp_ergs, interp_values, interp_values_gsl;
+    for (int k = 0; k <= 10000; k++) { interp_ergs.push_back(spectrum.lower() + k*(spectrum.upper() - spectrum.lower())/10000.0); }
+    interp_values = spectrum.interpolate(interp_ergs);
+    for (auto erg = interp_ergs.begin(); erg != interp_ergs.end(); erg++) { interp_values_gsl.push_back(spectrum_gsl.interpolate(*erg)); }
+    std::cout << "Max. relative deviation of the interpolated values from " << spectrum_file << ": " << max_rel_deviation(interp_values, interp_values_gsl) << " (should be below 1e-12)." << std::endl;
+  }
+
+  auto t16s = time_now();
+  std::cout << "\n# Sampling axions from the Primakoff flux on the solar disc..." << std::endl;
+  std::vector<double> sampler_ergs, sampler_rhos;
+  for (int k=0; k<39; k++) { sampler_ergs.push_back(0.5+k*0.25); }
+  for (int k=0; k<21; k++) { sampler_rhos.push_back(k*0.05); }
+  std::vector<std::vector<double> > d2Phi = calculate_d2Phi_a_domega_drho(sampler_ergs, sampler_rhos, s, &SolarModel::Gamma_Primakoff);
+  FluxSampler sampler (d2Phi);
+  // Exact moments of the bilinear interpolation of the grid (omega runs fastest in the table)
+  const int n_sampler_ergs = sampler_ergs.size();
+  double grid_flux = 0, grid_mean_erg = 0, grid_mean_rho = 0;
+  for (size_t i = 0; i+1 < sampler_rhos.size(); i++) {
+    for (int j = 0; j+1 < n_sampler_ergs; j++) {
+      double r0 = sampler_rhos[i], dr = sampler_rhos[i+1] - r0, e0 = sampler_ergs[j], de = sampler_ergs[j+1] - e0;
+      double f00 = d2Phi[2][i*n_sampler_ergs+j], f01 = d2Phi[2][i*n_sampler_ergs+j+1], f10 = d2Phi[2][(i+1)*n_sampler_ergs+j], f11 = d2Phi[2][(i+1)*n_sampler_ergs+j+1];
+      // Averages over rho at both energies (and over omega at both radii) are linear in the other variable
+      double fe0 = 0.5*(f00 + f10), fe1 = 0.5*(f01 + f11), fr0 = 0.5*(f00 + f01), fr1 = 0.5*(f10 + f11);
+      grid_flux += 0.25*dr*de*(f00 + f01 + f10 + f11);
+      grid_mean_erg += dr*de*(0.5*e0*(fe0 + fe1) + de*(fe0/6.0 + fe1/3.0));
+      grid_mean_rho += dr*de*(0.5*r0*(fr0 + fr1) + dr*(fr0/6.0 + fr1/3.0));
+    }
+  }
+  grid_mean_erg /= grid_flux;
+  grid_mean_rho /= grid_flux;
+  const size_t n_events = 1000000;
+  std::vector<std::vector<double> > events = sampler.sample(n_events, 42);
+  double sample_mean_erg = 0, sample_mean_rho = 0;
+  for (size_t k = 0; k < n_events; k++) { sample_mean_erg += events[0][k]/n_events; sample_mean_rho += events[1][k]/n_events; }
+  auto t16e = time_now();
+  std::cout << "Total flux of the sampler: " << sampler.get_total_flux() << " cm^-2 s^-1 (should be approx. " << grid_flux << " cm^-2 s^-1)." << std::endl;
+  std::cout << "Mean energy of " << n_events << " events: " << sample_mean_erg << " keV (should be approx. " << grid_mean_erg << " keV)." << std::endl;
+  std::cout << "Mean radius of " << n_events << " events: " << sample_mean_rho << " R_sol (should be approx. " << grid_mean_rho << " R_sol)." << std::endl;
+  std::cout << "# Tabulating the flux and sampling the events took " << duration_cast<seconds>(t16e-t16s).count() << " seconds." << std::endl;
+
+  auto t17s = time_now();
+  std::cout << "\n# Comparing the substitution and breakpoint treatments of the LP resonance..." << std::endl;
+  std::vector<double> resonance_ergs;
+  for (int k=0; k<900; k+=25) { resonance_ergs.push_back(test_ergs_LP[k]); }
+  const lp_resonance_integration lp_mode = get_lp_resonance_integration();
+  set_lp_resonance_integration(LP_RESONANCE_BREAKPOINT);
+  std::vector<std::vector<double> > lp_breakpoint = fully_integrate_d2Phi_a_domega_drho_in_rho(resonance_ergs, s, &SolarModel::Gamma_LP);
+  set_lp_resonance_integration(LP_RESONANCE_SUBSTITUTION);
+  std::vector<std::vector<double> > lp_substitution = fully_integrate_d2Phi_a_domega_drho_in_rho(resonance_ergs, s, &SolarModel::Gamma_LP);
+  set_lp_resonance_integration(lp_mode);
+  auto t17e = time_now();
+  std::cout << "Max. relative deviation of the LP spectrum with the substitution: " << max_rel_deviation(lp_substitution[1], lp_breakpoint[1]) << " (should be below 0.01)." << std::endl;
+  std::cout << "# Calculating the LP spectra (" << resonance_ergs.size() << " energy values) took " << duration_cast<milliseconds>(t17e-t17s).count()/1000.0 << " seconds." << std::endl;
+
+  auto t18s = time_now();
+  std::cout << "\n# Calculating the Primakoff spectrum on an adaptive energy grid..." << std::endl;
+  std::vector<std::vector<double> > adaptive_grid_spectrum = adaptively_integrate_d2Phi_a_domega_drho_in_rho(test_ergs.front(), test_ergs.back(), s, &SolarModel::Gamma_Primakoff, 1.0e-3, output_path + "primakoff_adaptive_grid.dat");
+  auto t18e = time_now();
+  ASCIItableReader dense_grid_spectrum (output_path + "primakoff.dat");
+  SpectrumInterpolator adaptive_grid_interpolator (adaptive_grid_spectrum[0], adaptive_grid_spectrum[1]);
+  std::cout << "Max. relative deviation from the spectrum on the dense grid: " << max_rel_deviation(adaptive_grid_interpolator.interpolate(dense_grid_spectrum[0]), dense_grid_spectrum[1]) << " (should be below 0.002)." << std::endl;
+  std::cout << "# Calculating the spectrum on the adaptive grid (" << adaptive_grid_spectrum[0].size() << " instead of " << n_erg_values << " energy values) took "
+            << duration_cast<milliseconds>(t18e-t18s).count()/1000.0 << " seconds." << std::endl;
+
+  auto t19s = time_now();
+  std::cout << "\n# Comparing the multi-channel and single-channel integration routines..." << std::endl;
+  std::vector<SolarModelMemberFn> test_channels = { &SolarModel::Gamma_Primakoff, &SolarModel::Gamma_all_electron, &SolarModel::Gamma_plasmon };
+  std::vector<std::vector<std::vector<double> > > multi_channel_spectra = fully_integrate_d2Phi_a_domega_drho_in_rho(engine_ergs, s, test_channels);
+  std::vector<std::vector<std::vector<double> > > multi_channel_rings = integrate_d2Phi_a_domega_drho_between_rhos(engine_ergs, test_rads, s, test_channels, {}, true);
+  auto t19e = time_now();
+  for (size_t c = 0; c < test_channels.size(); c++) {
+    std::vector<std::vector<double> > single_channel_spectrum = fully_integrate_d2Phi_a_domega_drho_in_rho(engine_ergs, s, test_channels[c]);
+    std::vector<std::vector<double> > single_channel_rings = integrate_d2Phi_a_domega_drho_between_rhos(engine_ergs, test_rads, s, test_channels[c], "", true);
+    std::cout << "Max. relative deviations for " << get_SolarModel_function_name(test_channels[c]) << ": " << max_rel_deviation(multi_channel_spectra[c][1], single_channel_spectrum[1]) << " (spectrum) and "
+              << max_rel_deviation(multi_channel_rings[c].back(), single_channel_rings.back()) << " (rings), both should be below 0.002." << std::endl;
+  }
+  std::cout << "# Calculating the spectra and ring spectra of all channels in one pass took " << duration_cast<milliseconds>(t19e-t19s).count()/1000.0 << " seconds." << std::endl;
 
   auto t_end = time_now();
   std::cout << "\n# Finished testing! Total runtime: " << duration_cast<minutes>(t_end-t_start).count() << " mins." << std::endl;
@@ -5,6 +5,7 @@
 #define __utils_hpp__
 
 #include <ctime>
+#include <cmath>
 #include <iostream>
 #include <iomanip>
 #include <fstream>
@@ -14,6 +15,10 @@
 #include <set>
 #include <algorithm>
 #include <stdexcept>
+#include <exception>
+#include <cstdint>
+#include <atomic>
+#include <chrono>
 
 #include <sys/stat.h> // Needed to check if file exists before we can expect C++14 std
 
@@ -21,6 +26,7 @@
 #include <gsl/gsl_interp2d.h>
 #include <gsl/gsl_spline2d.h>
 #include <gsl/gsl_errno.h>
+#include <gsl/gsl_integration.h>
 
 #include "constants.hpp"
 
@@ -45,20 +51,99 @@ class XUnsupportedOption : public std::runtime_error::runtime_error {
     XUnsupportedOption(std::string err_msg): std::runtime_error::runtime_error("UnsupportedOption ERROR! "+err_msg) {}
 };
 
+// GSL errors (other than domain errors) thrown by my_gsl_handler; stores the GSL error code
+class XGSLError : public std::runtime_error::runtime_error {
+  public:
+    XGSLError(std::string err_msg, int gsl_errno): std::runtime_error::runtime_error(err_msg), gsl_errno(gsl_errno) {}
+    const int gsl_errno;
+};
+
 void my_global_exception_handler();
 // Globally enforce the custom termination behaviour.
 const auto terminator { std::set_terminate(my_global_exception_handler) };
 void my_gsl_handler(const char * reason, const char * file, int line, int gsl_errno);
+// Globally use the custom GSL error handler s.t. GSL errors can be caught (the default handler aborts the program).
+const auto gsl_handler { gsl_set_error_handler(&my_gsl_handler) };
 
 void terminate_with_error(std::string err_string);
 void terminate_with_error_if(bool condition, std::string err_string);
 bool file_exists(const std::string& filename);
+// Create a directory if it does not exist yet (returns false if this fails)
+bool make_directory(std::string path);
+// Directory for the caches created automatically by the library: $SOLAXFLUX_CACHE_DIR if set, otherwise $XDG_CACHE_HOME/solaxflux or ~/.cache/solaxflux
+// (created if needed). Returns an empty string if the directory cannot be created or if SOLAXFLUX_CACHE_DIR=none (which disables these caches).
+std::string user_cache_directory();
+// 64-bit FNV-1a hash of a block of memory (continuing from a previous hash value) or of the content of a file; used to identify inputs in cache files
+const uint64_t fnv1a_offset_basis = 14695981039346656037ULL;
+uint64_t fnv1a_hash(const void* data, size_t n, uint64_t hash = fnv1a_offset_basis);
+uint64_t file_content_hash(std::string path);
 void locate_data_folder(std::string path_to_model_file, std::string &path_to_data, std::string &model_file_name);
-void save_to_file(std::string path, std::vector<std::vector<double>> buffer, std::string comment = "", bool overwrite = true);
+// Save the columns of a table to a text file or, if the path ends with ".npy", to a binary file in NumPy's .npy format (columnar, i.e. Fortran order).
+// N.B. The comment is stored in the header of .npy files (as lines starting with '#'), which can be read with numpy.load.
+void save_to_file(std::string path, const std::vector<std::vector<double>> &buffer, std::string comment = "", bool overwrite = true);
+bool is_binary_table_file(std::string path);
+// Same as save_to_file, but the data are written to a temporary file first, s.t. other processes never see an incomplete file
+void save_to_file_atomically(std::string path, const std::vector<std::vector<double>> &buffer, std::string comment = "");
+// Identifier of the current process (host name and process ID)
+std::string process_identifier();
+
+// TableWriter class: Buffered writer for tables that are written row by row, e.g. while a computation is still running.
+// Same formats as save_to_file (rows are stored in C order in .npy files, which become valid once the writer is closed).
+class TableWriter {
+  public:
+    TableWriter(std::string path, int n_cols, std::string comment = "", bool overwrite = true);
+    ~TableWriter();
+    // Delete copy constructor and assignment operator since the class owns the file
+    TableWriter(const TableWriter&) = delete;
+    TableWriter& operator=(const TableWriter&) = delete;
+    void write_row(const double* row);
+    void write_row(const std::vector<double> &row);
+    size_t get_n_rows() const { return n_rows; }
+    // Write the remaining data and finalise the file (returns false if anything went wrong).
+    bool close();
+  private:
+    std::string path, comment;
+    int n_cols;
+    bool binary;
+    size_t n_rows = 0;
+    std::vector<char> stream_buffer;
+    std::ofstream out;
+    bool closed = false;
+};
+
+// TaskCheckpoints class: Splits n_tasks independent tasks into chunks, which can be processed by several processes at the same time (e.g. MPI ranks or batch jobs on
+// different nodes) that share the directory work_dir. The processes claim the chunks dynamically via lock files, and the results of each chunk are saved once it is done.
+// An interrupted computation is resumed by running it again; claims of unfinished chunks are taken over if they were not refreshed for claim_timeout seconds (e.g. after a job was killed).
+// N.B. The key identifies the computation: the constructor throws XSanityCheck if work_dir belongs to a different computation.
+class TaskCheckpoints {
+  public:
+    TaskCheckpoints(std::string work_dir, std::string key, int n_tasks, int chunk_size = 64, double claim_timeout = 86400.0);
+    int get_n_tasks() const { return n_tasks; }
+    int get_n_chunks() const { return n_chunks; }
+    int get_n_chunks_done() const;
+    bool is_complete() const { return get_n_chunks_done() == n_chunks; }
+    // Claim a chunk that is neither done nor claimed by another process; the chunk contains the tasks first_task, ..., last_task-1 (returns false if there is none)
+    bool claim_chunk(int &chunk, int &first_task, int &last_task);
+    // Refresh the time stamp of a claimed chunk while it is being processed s.t. it is not taken over (the file is touched at most every claim_timeout/10 seconds)
+    void refresh_claim(int chunk);
+    // Save the results of a claimed chunk
+    void save_chunk(int chunk, const std::vector<double> &results);
+    // Results of all tasks (throws XSanityCheck if the computation is not complete)
+    std::vector<double> merge_results() const;
+  private:
+    std::string work_dir;
+    int n_tasks, chunk_size, n_chunks;
+    double claim_timeout;
+    time_t last_claim_refresh = 0;
+    std::string chunk_file(int chunk) const;
+    std::string claim_file(int chunk) const;
+    bool try_claim(int chunk, bool take_over_stale_claims);
+};
 
 // ASCIItableReader class from GAMBIT (main author: Christoph Weniger)
 class ASCIItableReader {
   public:
+    // N.B. Also reads binary .npy files with one or two dimensions (8-byte floats) as written by save_to_file or TableWriter
     ASCIItableReader(std::string filename) { read(filename); }
     ASCIItableReader() {}
     ~ASCIItableReader() {}
@@ -79,15 +164,89 @@ class ASCIItableReader {
     }
 
     void prepend_data(double datum, int i) { data[i].insert(data[i].begin(), datum); }
-    const std::vector<double> & operator[] (int i) { return data[i]; }
-    const std::vector<double> & operator[] (std::string name) { return data[colnames[name]]; }
-    std::vector<std::vector<double> > get_data() { return data; }
-    int getncol() { return data.size(); }
-    int getnrow() { return data[0].size(); }
+    // Access to the columns and the full table (N.B. no copies are made)
+    const std::vector<double> & operator[] (int i) const { return data[i]; }
+    const std::vector<double> & operator[] (std::string name) const { return data[colnames.at(name)]; }
+    const std::vector<std::vector<double> > & get_data() const { return data; }
+    // Move the table out of the reader (leaves the reader empty)
+    std::vector<std::vector<double> > move_data() { colnames.clear(); return std::move(data); }
+    int getncol() const { return data.size(); }
+    int getnrow() const { return data[0].size(); }
 
   private:
     std::vector<std::vector<double>> data;
     std::map<std::string, int> colnames;
+    // Parse the table from a buffer (text or .npy format; the latter returns false if the format is not supported)
+    void parse(const char* begin, const char* end);
+    bool parse_npy(const char* begin, const char* end);
+};
+
+// Read many files at once (in parallel if compiled with OpenMP; see set_num_threads)
+std::vector<ASCIItableReader> read_ascii_tables(const std::vector<std::string> &filenames);
+
+// Read-only memory map of a file; the mapped pages can be shared between different processes.
+class MemoryMappedFile {
+  public:
+    MemoryMappedFile() {}
+    MemoryMappedFile(std::string filename);
+    MemoryMappedFile(MemoryMappedFile&&);
+    MemoryMappedFile& operator=(MemoryMappedFile&&);
+    ~MemoryMappedFile();
+    // Delete copy constructor and assignment operator to avoid unmapping the file twice
+    MemoryMappedFile(const MemoryMappedFile&) = delete;
+    MemoryMappedFile& operator=(const MemoryMappedFile&) = delete;
+    const char* data() const { return mapped_data; }
+    size_t size() const { return mapped_size; }
+    bool is_open() const { return (mapped_data != nullptr); }
+  private:
+    const char* mapped_data = nullptr;
+    size_t mapped_size = 0;
+};
+
+// Simple, versioned binary format for caching arrays of 8-byte numbers (double or uint64_t), native byte order:
+// header (magic string, format version, endianness check, key string) followed by a sequence of (length, values) blocks.
+// The key identifies the content (e.g. input files and library version); files with a different key are rejected.
+const uint64_t binary_cache_format_version = 1;
+
+class BinaryCacheWriter {
+  public:
+    BinaryCacheWriter(std::string filename, std::string key);
+    ~BinaryCacheWriter();
+    template <typename T>
+    void write(const T* values, size_t n) {
+      static_assert(sizeof(T) == 8, "BinaryCacheWriter only supports 8-byte types.");
+      uint64_t len = n;
+      out.write(reinterpret_cast<const char*>(&len), sizeof(len));
+      if (n > 0) { out.write(reinterpret_cast<const char*>(values), n*sizeof(T)); }
+    }
+    template <typename T>
+    void write(const std::vector<T> &values) { write(values.data(), values.size()); }
+    // Close the file and move it to its final location (returns false if anything went wrong).
+    bool close();
+  private:
+    std::string filename, tmp_filename;
+    std::ofstream out;
+    bool closed = false;
+};
+
+class BinaryCacheReader {
+  public:
+    BinaryCacheReader(const MemoryMappedFile &file, std::string key);
+    bool is_valid() const { return valid; }
+    // Pointer to the next block of n values; N.B. points into the mapped file, i.e. only valid while the file is mapped.
+    template <typename T>
+    const T* next(size_t &n) {
+      static_assert(sizeof(T) == 8, "BinaryCacheReader only supports 8-byte types.");
+      const uint64_t* len = next_block(n);
+      return reinterpret_cast<const T*>(len+1);
+    }
+    template <typename T>
+    std::vector<T> next_vector() { size_t n; const T* values = next<T>(n); return std::vector<T>(values, values+n); }
+  private:
+    const uint64_t* next_block(size_t &n);
+    const MemoryMappedFile &file;
+    size_t pos = 0;
+    bool valid = false;
 };
 
 ///////////////////////////////
@@ -129,6 +288,50 @@ class OneDInterpolator {
     double lo, up;
 };
 
+// SpectrumInterpolator class: Immutable linear interpolation of tabulated spectra (e.g. the spectral flux files). Uniform and log-uniform
+// grids are detected on construction, s.t. the interval follows from the argument without searching (binary search otherwise).
+// N.B. Evaluation is const and thread-safe; outside of [lower(), upper()], the interpolated value is zero.
+class SpectrumInterpolator {
+  public:
+    SpectrumInterpolator();
+    SpectrumInterpolator(std::string file);
+    SpectrumInterpolator(std::vector<std::vector<double> > table);
+    SpectrumInterpolator(const std::vector<double> &x, const std::vector<double> &y);
+    double operator()(double x) const;
+    double interpolate(double x) const { return (*this)(x); }
+    // Interpolated values for n arguments, written to out[0], ..., out[n-1]
+    void interpolate(const double* x, size_t n, double* out) const;
+    std::vector<double> interpolate(const std::vector<double> &x) const;
+    double lower() const { return lo; }
+    double upper() const { return up; }
+    bool is_uniform() const { return grid == uniform; }
+    bool is_log_uniform() const { return grid == log_uniform; }
+    // Prints a single warning if [x_lo, x_hi] extends beyond the table (where the spectrum is treated as zero); returns false in that case.
+    bool check_range(double x_lo, double x_hi, std::string context) const;
+  private:
+    enum grid_type { irregular, uniform, log_uniform };
+    void init();
+    grid_type grid = irregular;
+    double lo = 0, up = 0, offset = 0, inv_delta = 0;
+    std::vector<double> xs, ys;
+};
+
+inline double SpectrumInterpolator::operator()(double x) const {
+  if (xs.empty() || (x < lo) || (x > up)) { return 0; }
+  const size_t last = xs.size() - 2;
+  size_t i;
+  if (grid == irregular) {
+    i = std::upper_bound(xs.begin(), xs.end(), x) - xs.begin();
+    i = (i > 0) ? std::min(i-1, last) : 0;
+  } else {
+    double t = (grid == uniform) ? (x - offset)*inv_delta : (std::log(x) - offset)*inv_delta;
+    i = (t > 0) ? std::min(static_cast<size_t>(t), last) : 0;
+    // N.B. Correct for the rounding of the grid points written to file (at most by one interval, see init())
+    if ((i > 0) && (x < xs[i])) { --i; } else if ((i < last) && (x > xs[i+1])) { ++i; }
+  }
+  return ys[i] + (x - xs[i])*(ys[i+1] - ys[i])/(xs[i+1] - xs[i]);
+}
+
 // TwoDInterpolator class: Provides a general one-dimensional interpolation container based on the gsl library.
 class TwoDInterpolator {
   public:
@@ -218,6 +421,14 @@ const int op_grid [op_grid_size][2] = { {150,54}, {150,56}, {152,54}, {152,56},
 const std::set<std::pair<int,int>> unavailable_OP = { {150,66}, {150,68}, {150,70}, {152,66}, {152,68}, {152,70}, {154,68}, {154,70}, {156,70} };
 const int num_op_elements = 17;
 const std::string op_element_names [num_op_elements] = { "H", "He", "C", "N", "O", "Ne", "Na", "Mg", "Al", "Si", "S", "Ar", "Ca", "Cr", "Mn", "Fe", "Ni" };
+// Elements in the OP tables (same order as op_element_names) and mapping from their names
+enum op_element { OP_H, OP_He, OP_C, OP_N, OP_O, OP_Ne, OP_Na, OP_Mg, OP_Al, OP_Si, OP_S, OP_Ar, OP_Ca, OP_Cr, OP_Mn, OP_Fe, OP_Ni };
+const std::map<std::string,op_element> op_element_tag = { {"H",OP_H}, {"He",OP_He}, {"C",OP_C}, {"N",OP_N}, {"O",OP_O}, {"Ne",OP_Ne}, {"Na",OP_Na}, {"Mg",OP_Mg}, {"Al",OP_Al}, {"Si",OP_Si},
+                                                          {"S",OP_S}, {"Ar",OP_Ar}, {"Ca",OP_Ca}, {"Cr",OP_Cr}, {"Mn",OP_Mn}, {"Fe",OP_Fe}, {"Ni",OP_Ni} };
+op_element lookup_op_element(std::string element);
+// Position of the grid point (ite, jne) in op_grid; returns op_grid_unavailable for points in unavailable_OP and op_grid_missing for all other points
+const int op_grid_unavailable = -1, op_grid_missing = -2;
+int op_grid_index(int ite, int jne);
 const std::vector<std::vector<int>> op_elements = { {0}, {1,2}, {3,4}, {5,6}, {7,8,9}, {10}, {11}, {12}, {13}, {14}, {16}, {18}, {20}, {24}, {25}, {26}, {28} };
 const std::vector<std::vector<float> > ledcop_grid =  { {0.5,10.175}, {0.5,13.684}, {0.5,18.308}, {0.6,10.175}, {0.6,13.684}, {0.6,18.308}, {0.6,24.268}, {0.6,31.802}, {0.6,41.156}, {0.8,13.684}, {0.8,18.308}, {0.8,24.268}, {0.8,31.802},
                                                         {0.8,41.156}, {0.8,52.611}, {0.8,66.544}, {1.0,31.802}, {1.0,41.156}, {1.0,52.611}, {1.0,66.544}, {1.0,83.466}, {1.0,103.442}, {1.0,124.995}, {1.25,52.611}, {1.25,66.544}, {1.25,83.466},
@@ -244,6 +455,119 @@ double safe_log10(double x, double lgx0);
 std::string current_time_string();
 void print_current_time();
 
+// Number of threads used by the parallelised integration routines (only available if compiled with OpenMP)
+// Default is 1 (serial execution); n_threads <= 0 uses the OpenMP default (e.g. set via OMP_NUM_THREADS).
+void set_num_threads(int n_threads);
+int get_num_threads();
+// Whether the calling thread is part of an active OpenMP parallel region (always false without OpenMP)
+bool in_parallel_region();
+
+// Collects the first exception thrown inside a parallel region s.t. it can be rethrown afterwards (exceptions must not leave OpenMP regions).
+class ParallelExceptionHandler {
+  public:
+    ParallelExceptionHandler() {}
+    void capture();
+    bool has_exception() const { return bool(exception); }
+    void rethrow_if_any() const { if (exception) { std::rethrow_exception(exception); } }
+  private:
+    std::exception_ptr exception = nullptr;
+};
+
+// Thread-local pools of GSL integration workspaces: integration routines and integrands that are called many times take their workspaces from the pool of the
+// current thread, which returns the smallest free workspace that supports the requested limit (allocating a new one only if there is none), instead of allocating
+// and freeing workspaces for every call. The pooled workspaces are freed when the thread exits; workspaces larger than max_pooled_workspace_limit are freed immediately.
+// N.B. The workspaces start small (see int_space_size_* in spectral_flux.hpp) and are only enlarged by the integrate_* routines below if an integration needs more subintervals.
+const size_t max_pooled_workspace_limit = 1e4;
+gsl_integration_workspace* acquire_qag_workspace(size_t limit);
+void release_qag_workspace(gsl_integration_workspace* w);
+gsl_integration_cquad_workspace* acquire_cquad_workspace(size_t n);
+void release_cquad_workspace(gsl_integration_cquad_workspace* w);
+
+// Handles that return their pooled workspace when going out of scope; can be passed to the GSL routines directly.
+class QAGWorkspace {
+  public:
+    QAGWorkspace(size_t limit) : w(acquire_qag_workspace(limit)) {}
+    ~QAGWorkspace() { release_qag_workspace(w); }
+    QAGWorkspace(const QAGWorkspace&) = delete;
+    QAGWorkspace& operator=(const QAGWorkspace&) = delete;
+    operator gsl_integration_workspace*() const { return w; }
+    gsl_integration_workspace* operator->() const { return w; }
+  private:
+    gsl_integration_workspace* w;
+};
+
+class CQUADWorkspace {
+  public:
+    CQUADWorkspace(size_t n) : w(acquire_cquad_workspace(n)) {}
+    ~CQUADWorkspace() { release_cquad_workspace(w); }
+    CQUADWorkspace(const CQUADWorkspace&) = delete;
+    CQUADWorkspace& operator=(const CQUADWorkspace&) = delete;
+    operator gsl_integration_cquad_workspace*() const { return w; }
+    gsl_integration_cquad_workspace* operator->() const { return w; }
+  private:
+    gsl_integration_cquad_workspace* w;
+};
+
+// Wrappers of gsl_integration_qag, _qagp, and _qagiu that use all subintervals of the workspace w. If an integration reaches the maximum number of subdivisions,
+// w is enlarged (in place) to 8 times as many subintervals, up to max_workspace_limit, and the integration is repeated.
+const size_t max_workspace_limit = 1e6;
+int integrate_qag(gsl_function* f, double a, double b, double epsabs, double epsrel, int key, gsl_integration_workspace* w, double* result, double* abserr);
+int integrate_qagp(gsl_function* f, double* pts, size_t npts, double epsabs, double epsrel, gsl_integration_workspace* w, double* result, double* abserr);
+int integrate_qagiu(gsl_function* f, double a, double epsabs, double epsrel, gsl_integration_workspace* w, double* result, double* abserr);
+
+// Optional instrumentation (compile with -DSOLAXFLUX_INSTRUMENTATION, e.g. via the CMake option INSTRUMENTATION=ON): per-thread counters for the
+// production rates, opacity lookups and integration routines, and wall-clock timers for the SolarModel constructor phases and the driver routines.
+// N.B. If disabled, the SOLAXFLUX_COUNT/TIMER macros below compile to nothing and snapshots are empty. Combined rates (e.g. Gamma_all_electron)
+//      are counted via their individual contributions; opacity_lookups counts evaluations of the opacity code data (per element for OP).
+enum instrumentation_counter { COUNT_GAMMA_PRIMAKOFF, COUNT_GAMMA_TP, COUNT_GAMMA_LP, COUNT_GAMMA_FF, COUNT_GAMMA_EE, COUNT_GAMMA_COMPTON,
+                               COUNT_GAMMA_OPACITY, COUNT_GAMMA_FE57, COUNT_OPACITY_LOOKUPS, COUNT_OPACITY_TABLE_LOOKUPS, COUNT_QAG_CALLS, COUNT_QAG_INTERVALS,
+                               COUNT_CQUAD_CALLS, COUNT_CQUAD_EVALS, n_instrumentation_counters };
+const std::vector<std::string> instrumentation_counter_names = { "Gamma_Primakoff", "Gamma_TP", "Gamma_LP", "Gamma_ff", "Gamma_ee", "Gamma_Compton",
+                                                                 "Gamma_opacity", "Gamma_Fe57", "opacity_lookups", "opacity_table_lookups", "qag_calls",
+                                                                 "qag_intervals", "cquad_calls", "cquad_evals" };
+
+// Counters summed over all (also finished) threads and accumulated time (in seconds) and number of calls for each timer.
+struct InstrumentationSnapshot { std::map<std::string,uint64_t> counters; std::map<std::string,double> timer_seconds; std::map<std::string,uint64_t> timer_calls; };
+bool instrumentation_enabled();
+InstrumentationSnapshot instrumentation_snapshot();
+// N.B. Resetting while other threads are running may lose some of their counts.
+void reset_instrumentation();
+void print_instrumentation_report();
+
+// Counters of one thread; only the owning thread writes, s.t. relaxed atomic loads and stores suffice (no locks or read-modify-write operations).
+class InstrumentationCounters {
+  public:
+    InstrumentationCounters();
+    ~InstrumentationCounters();
+    void add(instrumentation_counter c, uint64_t n) { counts[c].store(counts[c].load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+    uint64_t get(int c) const { return counts[c].load(std::memory_order_relaxed); }
+    void reset() { for (int c = 0; c < n_instrumentation_counters; c++) { counts[c].store(0, std::memory_order_relaxed); } }
+  private:
+    std::atomic<uint64_t> counts [n_instrumentation_counters];
+};
+
+// Accumulates the time between creation (or the last call to next) and destruction (or the next call to next) under the current name.
+class InstrumentationTimer {
+  public:
+    InstrumentationTimer(std::string name);
+    ~InstrumentationTimer();
+    void next(std::string next_name);
+  private:
+    std::string name;
+    std::chrono::steady_clock::time_point start;
+};
+
+#ifdef SOLAXFLUX_INSTRUMENTATION
+  extern thread_local InstrumentationCounters instrumentation_counters;
+  #define SOLAXFLUX_COUNT(counter, n) instrumentation_counters.add(counter, n)
+  #define SOLAXFLUX_TIMER(timer, name) InstrumentationTimer timer (name)
+  #define SOLAXFLUX_NEXT_PHASE(timer, name) timer.next(name)
+#else
+  #define SOLAXFLUX_COUNT(counter, n) ((void)0)
+  #define SOLAXFLUX_TIMER(timer, name) ((void)0)
+  #define SOLAXFLUX_NEXT_PHASE(timer, name) ((void)0)
+#endif
+
 // Nuclear transition class
 class Nucleartransition {
   public:
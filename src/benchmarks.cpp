@@ -0,0 +1,24 @@
+// Copyright 2020 Sebastian Hoof & Lennert J. Thormaehlen
+// See the LICENSE file for the license conditions and a disclaimer
+
+#include "benchmarks.hpp"
+
+// Usage: benchmark_library [filter] [repetitions] [n_threads] [output_file]
+// N.B. The CSV results are written to stdout (and to output_file if given); all other messages go to stderr.
+int main(int argc, char* argv[]) {
+  std::string filter = (argc > 1) ? argv[1] : "";
+  if (filter == "all") { filter = ""; }
+  int repetitions = (argc > 2) ? std::max(1, atoi(argv[2])) : 5;
+  if (argc > 3) { set_num_threads(atoi(argv[3])); }
+
+  std::cerr << "INFO. Running " LIBRARY_NAME " benchmarks with " << repetitions << " repetitions and " << get_num_threads() << " thread(s)." << std::endl;
+  std::vector<benchmark_result> results = run_benchmarks(filter, repetitions);
+
+  if (argc > 4) {
+    std::ofstream output_file (argv[4]);
+    if (not(output_file.is_open())) { throw XFileNotFound(argv[4]); }
+    output_file << benchmark_csv_header << std::endl;
+    for (auto res = results.begin(); res != results.end(); ++res) { output_file << benchmark_csv_line(*res) << std::endl; }
+  }
+  return 0;
+}
@@ -3,6 +3,8 @@
 
 #include "experimental_flux.hpp"
 
+#include <mutex>
+
 
 ///////////////////////////////////////////////////////
 //  Experimental axion-photon conversion and spectra //
@@ -18,69 +20,40 @@ double conversion_prob_correction(double mass, double erg, double length) {
 }
 
 // Effective exposures (in seconds x cm^2) for various experiments.
-double eff_exposure_cast2007(double erg) {
-  static OneDInterpolator eff_exp (SOLAXFLUX_DIR "/data/exposures/CAST2007_EffectiveExposure.dat");
-  return 24.0*60.0*60.0*eff_exp.interpolate(erg);
-}
-
-double eff_exposure_cast2017_a(double erg) {
-  static OneDInterpolator eff_exp (SOLAXFLUX_DIR "/data/exposures/CAST2017_A_EffectiveExposure.dat");
-  return 24.0*60.0*60.0*eff_exp.interpolate(erg);
-}
-
-double eff_exposure_cast2017_b(double erg) {
-  static OneDInterpolator eff_exp (SOLAXFLUX_DIR "/data/exposures/CAST2017_B_EffectiveExposure.dat");
-  return 24.0*60.0*60.0*eff_exp.interpolate(erg);
-}
-
-double eff_exposure_cast2017_c(double erg) {
-  static OneDInterpolator eff_exp (SOLAXFLUX_DIR "/data/exposures/CAST2017_C_EffectiveExposure.dat");
-  return 24.0*60.0*60.0*eff_exp.interpolate(erg);
-}
-
-double eff_exposure_cast2017_d(double erg) {
-  static OneDInterpolator eff_exp (SOLAXFLUX_DIR "/data/exposures/CAST2017_D_EffectiveExposure.dat");
-  return 24.0*60.0*60.0*eff_exp.interpolate(erg);
-}
-
-double eff_exposure_cast2017_e(double erg) {
-  static OneDInterpolator eff_exp (SOLAXFLUX_DIR "/data/exposures/CAST2017_E_EffectiveExposure.dat");
-  return 24.0*60.0*60.0*eff_exp.interpolate(erg);
-}
-
-double eff_exposure_cast2017_f(double erg) {
-  static OneDInterpolator eff_exp (SOLAXFLUX_DIR "/data/exposures/CAST2017_F_EffectiveExposure.dat");
-  return 24.0*60.0*60.0*eff_exp.interpolate(erg);
-}
-
-double eff_exposure_cast2017_g(double erg) {
-  static OneDInterpolator eff_exp (SOLAXFLUX_DIR "/data/exposures/CAST2017_G_EffectiveExposure.dat");
-  return 24.0*60.0*60.0*eff_exp.interpolate(erg);
-}
-
-double eff_exposure_cast2017_h(double erg) {
-  static OneDInterpolator eff_exp (SOLAXFLUX_DIR "/data/exposures/CAST2017_H_EffectiveExposure.dat");
-  return 24.0*60.0*60.0*eff_exp.interpolate(erg);
-}
-
-double eff_exposure_cast2017_i(double erg) {
-  static OneDInterpolator eff_exp (SOLAXFLUX_DIR "/data/exposures/CAST2017_I_EffectiveExposure.dat");
-  return 24.0*60.0*60.0*eff_exp.interpolate(erg);
-}
-
-double eff_exposure_cast2017_j(double erg) {
-  static OneDInterpolator eff_exp (SOLAXFLUX_DIR "/data/exposures/CAST2017_J_EffectiveExposure.dat");
-  return 24.0*60.0*60.0*eff_exp.interpolate(erg);
-}
-
-double eff_exposure_cast2017_k(double erg) {
-  static OneDInterpolator eff_exp (SOLAXFLUX_DIR "/data/exposures/CAST2017_K_EffectiveExposure.dat");
-  return 24.0*60.0*60.0*eff_exp.interpolate(erg);
-}
-
-double eff_exposure_cast2017_l(double erg) {
-  static OneDInterpolator eff_exp (SOLAXFLUX_DIR "/data/exposures/CAST2017_L_EffectiveExposure.dat");
-  return 24.0*60.0*60.0*eff_exp.interpolate(erg);
+// Exposure files (in days x cm^2) for the CAST data sets; an empty file name denotes a constant exposure.
+std::string eff_exposure_file(experiment dataset) {
+  std::string file = "";
+  switch (dataset) {
+    case(CAST2007):
+      file = "CAST2007"; break;
+    case(CAST2017_A):
+      file = "CAST2017_A"; break;
+    case(CAST2017_B):
+      file = "CAST2017_B"; break;
+    case(CAST2017_C):
+      file = "CAST2017_C"; break;
+    case(CAST2017_D):
+      file = "CAST2017_D"; break;
+    case(CAST2017_E):
+      file = "CAST2017_E"; break;
+    case(CAST2017_F):
+      file = "CAST2017_F"; break;
+    case(CAST2017_G):
+      file = "CAST2017_G"; break;
+    case(CAST2017_H):
+      file = "CAST2017_H"; break;
+    case(CAST2017_I):
+      file = "CAST2017_I"; break;
+    case(CAST2017_J):
+      file = "CAST2017_J"; break;
+    case(CAST2017_K):
+      file = "CAST2017_K"; break;
+    case(CAST2017_L):
+      file = "CAST2017_L"; break;
+    default:
+      return "";
+  }
+  return SOLAXFLUX_DIR "/data/exposures/"+file+"_EffectiveExposure.dat";
 }
 
 // Baseline IAXO exposure from [arXiv:1904.09155]
@@ -110,52 +83,66 @@ double eff_exposure_iaxoplus(double erg) {
   return eff_exp;
 }
 
-double eff_exposure(double erg, std::string dataset) {
-  experiment exp = experiment_name.at(dataset);
-  return eff_exposure(erg, exp);
+ExposureTable::ExposureTable() {}
+
+ExposureTable::ExposureTable(std::string dataset) {
+  auto it = experiment_name.find(dataset);
+  if (it == experiment_name.end()) { throw XUnsupportedOption("Data set '"+dataset+"' not known!"); }
+  *this = ExposureTable(it->second);
 }
 
-double eff_exposure(double erg, experiment dataset) {
-  double res = 0.0;
+ExposureTable::ExposureTable(experiment dataset) : dataset(dataset) {
   switch (dataset) {
-    case(CAST2007):
-      res = eff_exposure_cast2007(erg); break;
-    case(CAST2017_A):
-      res = eff_exposure_cast2017_a(erg); break;
-    case(CAST2017_B):
-      res = eff_exposure_cast2017_b(erg); break;
-    case(CAST2017_C):
-      res = eff_exposure_cast2017_c(erg); break;
-    case(CAST2017_D):
-      res = eff_exposure_cast2017_d(erg); break;
-    case(CAST2017_E):
-      res = eff_exposure_cast2017_e(erg); break;
-    case(CAST2017_F):
-      res = eff_exposure_cast2017_f(erg); break;
-    case(CAST2017_G):
-      res = eff_exposure_cast2017_g(erg); break;
-    case(CAST2017_H):
-      res = eff_exposure_cast2017_h(erg); break;
-    case(CAST2017_I):
-      res = eff_exposure_cast2017_i(erg); break;
-    case(CAST2017_J):
-      res = eff_exposure_cast2017_j(erg); break;
-    case(CAST2017_K):
-      res = eff_exposure_cast2017_k(erg); break;
-    case(CAST2017_L):
-      res = eff_exposure_cast2017_l(erg); break;
     case(IAXO):
-      res = eff_exposure_iaxo(erg); break;
+      constant_exposure = eff_exposure_iaxo(ref_erg_value); return;
     case(BABYIAXO):
-      res = eff_exposure_babyiaxo(erg); break;
+      constant_exposure = eff_exposure_babyiaxo(ref_erg_value); return;
     case(IAXOPLUS):
-      res = eff_exposure_iaxoplus(erg); break;
+      constant_exposure = eff_exposure_iaxoplus(ref_erg_value); return;
     default:
-      terminate_with_error("ERROR! Data set not known!");
+      break;
+  }
+  std::string file = eff_exposure_file(dataset);
+  if (file == "") { throw XUnsupportedOption("Data set not known!"); }
+  if (not(file_exists(file))) { throw XFileNotFound(file); }
+  ASCIItableReader tab (file);
+  ergs = tab[0];
+  exposures = tab[1];
+  const size_t n = ergs.size();
+  if ((n < 2) || (exposures.size() != n)) { throw XSanityCheck("Exposure file '"+file+"' needs to contain at least two energies and exposures."); }
+  for (size_t i = 0; i < n; i++) {
+    if ((i > 0) && (ergs[i] <= ergs[i-1])) { throw XSanityCheck("Energies in exposure file '"+file+"' need to be strictly increasing."); }
+    exposures[i] *= 24.0*60.0*60.0;
   }
-  return res;
+  erg_lo = ergs.front();
+  erg_hi = ergs.back();
+  // N.B. Most exposure files are tabulated on a uniform energy grid; the interval then follows from the energy without searching.
+  const double delta = (erg_hi - erg_lo)/double(n-1);
+  uniform_grid = true;
+  for (size_t i = 1; i < n; i++) { uniform_grid = uniform_grid && (std::abs(ergs[i] - ergs[i-1] - delta) < 1.0e-6*delta); }
+  inv_delta = 1.0/delta;
 }
 
+const ExposureTable& exposure_table(experiment dataset) {
+  // N.B. Each table is built (and its exposure file loaded) exactly once, on first use; std::call_once makes this thread-safe.
+  const int n_experiments = IAXOPLUS + 1;
+  static ExposureTable tables [n_experiments];
+  static std::once_flag flags [n_experiments];
+  if ((dataset < CAST2007) || (dataset > IAXOPLUS)) { throw XUnsupportedOption("Data set not known!"); }
+  std::call_once(flags[dataset], [dataset]() { tables[dataset] = ExposureTable(dataset); });
+  return tables[dataset];
+}
+
+const ExposureTable& exposure_table(std::string dataset) {
+  auto it = experiment_name.find(dataset);
+  if (it == experiment_name.end()) { throw XUnsupportedOption("Data set '"+dataset+"' not known!"); }
+  return exposure_table(it->second);
+}
+
+double eff_exposure(double erg, std::string dataset) { return exposure_table(dataset)(erg); }
+
+double eff_exposure(double erg, experiment dataset) { return exposure_table(dataset)(erg); }
+
 
 //////////////////////////////////////////////////////////////////////////////////////
 //  Modified and extended integration routines (possibly include energy dispersion) //
@@ -168,13 +155,20 @@ double exp_flux_integrand_from_file(double erg, void * params) {
   struct exp_flux_from_file_integration_parameters * p = (struct exp_flux_from_file_integration_parameters *)params;
 
   double sincsq = conversion_prob_correction(p->mass, erg, p->length);
-  double exposure = eff_exposure(erg, p->dataset);
+  double exposure = (*p->exposure)(erg);
   // N.B. Here we assume axion is massless in stellar interior:
   double exp_flux = p->spectral_flux->interpolate(erg);
 
   return exposure*exp_flux*sincsq;
 }
 
+double binned_exp_flux_integrand_from_file(double erg, void * params) {
+  struct binned_exp_flux_params * q = (struct binned_exp_flux_params *)params;
+  double sqrt2_sigma = sqrt(2.0)*q->p->sigma;
+  double response = 0.5*( std::erf((q->bin[1] - erg)/sqrt2_sigma) - std::erf((q->bin[0] - erg)/sqrt2_sigma) );
+  return exp_flux_integrand_from_file(erg, q->p)*response;
+}
+
 double simple_convolution_kernel(double erg, void * params) {
   struct simple_convolution_params * p = (struct simple_convolution_params *)params;
   double two_sigma2 = 2.0*gsl_pow_2(p->sigma);
@@ -184,7 +178,7 @@ double simple_convolution_kernel(double erg, void * params) {
 double convolution_kernel(double erg, void * params) {
   struct convolution_params * p = (struct convolution_params *)params;
   double sincsq = conversion_prob_correction(p->p->mass, erg, p->p->length);
-  double exposure = eff_exposure(erg, p->p->dataset);
+  double exposure = (*p->p->exposure)(erg);
   double exp_flux = p->p->spectral_flux->interpolate(erg);
   double two_sigma2 = 2.0*gsl_pow_2(p->p->sigma);
   return exposure*exp_flux*sincsq * exp(-gsl_pow_2(p->erg0 - erg)/two_sigma2)/sqrt(two_sigma2*pi);
@@ -197,15 +191,13 @@ double convolved_exp_flux_integrand_from_file(double erg, void * params) {
   struct convolution_params q = { erg, p };
   std::vector<double> relevant_peaks = get_relevant_peaks(p->support[0], p->support[1]);
 
-  gsl_integration_workspace * w = gsl_integration_workspace_alloc (int_space_size_file);
+  QAGWorkspace w (int_space_size_file);
 
   gsl_function f;
   f.function = &convolution_kernel;
   f.params = &q;
 
-  gsl_integration_qagp(&f, &relevant_peaks[0], relevant_peaks.size(), int_abs_prec_file, int_rel_prec_file, int_space_size_file, w, &result, &error);
-
-  gsl_integration_workspace_free(w);
+  integrate_qagp(&f, &relevant_peaks[0], relevant_peaks.size(), int_abs_prec_file, int_rel_prec_file, w, &result, &error);
 
   return result;
 }
@@ -214,36 +206,185 @@ double convolved_exp_flux_integrand_from_file(double erg, void * params) {
 //  Routines to compute 'reference count files' for the various experiments //
 //////////////////////////////////////////////////////////////////////////////
 
-// TODO: Here actual integration routines from file
-std::vector<double> convolved_spectrum_from_file(std::vector<double> ergs, double support[2], double resolution, std::string filename) {
-  std::vector<double> result;
-  OneDInterpolator spectrum (filename);
+std::vector<double> gaussian_convolution(const std::vector<double> &f, double x_lo, double delta, double sigma, const std::vector<double> &x_out) {
+  const int n = f.size(), n_out = x_out.size();
+  const double norm = 1.0/(sqrt(2.0*pi)*sigma), half_width = gaussian_convolution_n_sigma*sigma;
+  std::vector<double> result (n_out, 0);
+  #ifdef _OPENMP
+  #pragma omp parallel for schedule(static) num_threads(get_num_threads())
+  #endif
+  for (int j = 0; j < n_out; j++) {
+    int i_lo = std::max(0, int(ceil((x_out[j] - half_width - x_lo)/delta)));
+    int i_hi = std::min(n-1, int(floor((x_out[j] + half_width - x_lo)/delta)));
+    double sum = 0;
+    for (int i = i_lo; i <= i_hi; i++) {
+      double weight = ((i == 0) || (i == n-1)) ? 0.5 : 1.0;
+      sum += weight*f[i]*exp(-0.5*gsl_pow_2((x_out[j] - x_lo - i*delta)/sigma));
+    }
+    result[j] = norm*delta*sum;
+  }
+  return result;
+}
 
-  double flux, flux_error;
-  gsl_integration_workspace * w = gsl_integration_workspace_alloc (int_space_size_file);
+double gaussian_convolution_grid_spacing(double support[2], double sigma, double feature_scale) {
+  double delta = sigma/double(gaussian_convolution_pts_per_sigma);
+  if (feature_scale > 0) { delta = std::min(delta, feature_scale); }
+  double width = support[1] - support[0];
+  int n_pts = std::min(int(ceil(width/delta)) + 1, gaussian_convolution_max_pts);
+  return width/double(std::max(n_pts - 1, 1));
+}
 
-  struct simple_convolution_params p = { resolution, 0, &spectrum };
+std::vector<double> convolved_spectrum_from_file(std::vector<double> ergs, double support[2], double resolution, std::string filename, const nuclear_line* line) {
+  ASCIItableReader data (filename);
+  SpectrumInterpolator spectrum (data[0], data[1]);
+  spectrum.check_range(support[0], support[1], "convolved_spectrum_from_file ("+filename+")");
 
-  gsl_function f;
-  f.function = &simple_convolution_kernel;
-  f.params = &p;
+  // Resolve the Gaussian kernel and the spacing of the spectrum within the support
+  double min_spacing = 0;
+  for (int i = 1; i < data.getnrow(); i++) {
+    double spacing = data[0][i] - data[0][i-1];
+    if ((spacing > 0) && (data[0][i] > support[0]) && (data[0][i-1] < support[1])) { min_spacing = (min_spacing > 0) ? std::min(min_spacing, spacing) : spacing; }
+  }
+  double delta = gaussian_convolution_grid_spacing(support, resolution, min_spacing);
+  int n_pts = int(round((support[1] - support[0])/delta)) + 1;
+  std::vector<double> grid (n_pts);
+  for (int i = 0; i < n_pts; i++) { grid[i] = std::min(support[0] + i*delta, support[1]); }
+  std::vector<double> values = spectrum.interpolate(grid);
+
+  std::vector<double> result = gaussian_convolution(values, support[0], delta, resolution, ergs);
+  if (line != NULL) {
+    std::vector<double> line_values = nuclear_line_spectrum(ergs, *line, resolution);
+    for (size_t i = 0; i < result.size(); i++) { result[i] += line_values[i]; }
+  }
+  return result;
+}
 
-  std::vector<double> relevant_peaks = get_relevant_peaks(support[0], support[1]);
-  for (auto erg0 = ergs.begin(); erg0 != ergs.end(); ++erg0) {
-    p.erg0 = *erg0;
-    std::cout << *erg0 << " " << flux << std::endl;
-    //gsl_integration_qags(&f, support[0], support[1], int_abs_prec, int_rel_prec, int_space_size_file, w, &flux, &flux_error);
-    gsl_integration_qagp(&f, &relevant_peaks[0], relevant_peaks.size(), int_abs_prec_file, int_rel_prec_file, int_space_size_file, w, &flux, &flux_error);
-    //gsl_integration_qag (&f, support[0], support[1], int_abs_prec, int_rel_prec, int_space_size_file, int_method_1, w, &flux, &flux_error);
-    result.push_back(flux);
+std::vector<double> nuclear_line_spectrum(std::vector<double> ergs, const nuclear_line &line, double resolution) {
+  const double sigma = sqrt(gsl_pow_2(line.width) + gsl_pow_2(resolution));
+  std::vector<double> result;
+  for (auto erg = ergs.begin(); erg != ergs.end(); erg++) {
+    double value = 0;
+    if (sigma > 0) { value = line.flux*exp(-0.5*gsl_pow_2((*erg - line.energy)/sigma))/(sqrt(2.0*pi)*sigma); }
+    result.push_back(value);
+  }
+  return result;
+}
+
+// Mass-scan engine; tabulate H(u) = g(1/u)/u^2 with g = exposure x flux (x bin response), s.t. the count integral is int du H(u) sinc^2(a m^2 u).
+std::vector<mass_scan_segment> mass_scan_segments(exp_setup *setup, const SpectrumInterpolator &spectral_flux, int intervals_per_bin) {
+  SOLAXFLUX_TIMER(timer, "mass_scan_segments");
+  std::vector<mass_scan_segment> result;
+  const int n_bins = setup->n_bins;
+  const double bin_lo = setup->bin_lo, bin_delta = setup->bin_delta, bin_hi = bin_lo + bin_delta*double(n_bins);
+  const double sigma = setup->erg_resolution;
+  const ExposureTable &exposure = exposure_table(setup->dataset);
+
+  if (sigma > 0) {
+    // Finite energy resolution: all bins receive contributions from the full support, weighted by the integrated Gaussian kernel over the bin
+    mass_scan_segment seg;
+    seg.n_intervals = n_bins*intervals_per_bin;
+    seg.u_lo = 1.0/bin_hi;
+    seg.delta_u = (1.0/bin_lo - seg.u_lo)/double(seg.n_intervals);
+    seg.h = std::vector<std::vector<double>> (n_bins, std::vector<double> (seg.n_intervals+1));
+    for (int i = 0; i <= seg.n_intervals; i++) {
+      double u = seg.u_lo + i*seg.delta_u;
+      double erg = std::min(std::max(1.0/u, bin_lo), bin_hi);
+      double g = exposure(erg)*spectral_flux.interpolate(erg)/(u*u);
+      for (int bin = 0; bin < n_bins; bin++) {
+        double erg_lo = bin_lo + bin*bin_delta;
+        double response = 0.5*( std::erf((erg_lo + bin_delta - erg)/(sqrt(2.0)*sigma)) - std::erf((erg_lo - erg)/(sqrt(2.0)*sigma)) );
+        seg.h[bin][i] = g*response;
+      }
+    }
+    for (int bin = 0; bin < n_bins; bin++) { seg.bins.push_back(bin); }
+    result.push_back(seg);
+  } else {
+    for (int bin = 0; bin < n_bins; bin++) {
+      double erg_lo = bin_lo + bin*bin_delta;
+      double erg_hi = erg_lo + bin_delta;
+      mass_scan_segment seg;
+      seg.n_intervals = intervals_per_bin;
+      seg.u_lo = 1.0/erg_hi;
+      seg.delta_u = (1.0/erg_lo - seg.u_lo)/double(seg.n_intervals);
+      seg.bins.push_back(bin);
+      seg.h.push_back(std::vector<double> (seg.n_intervals+1));
+      for (int i = 0; i <= seg.n_intervals; i++) {
+        double u = seg.u_lo + i*seg.delta_u;
+        double erg = std::min(std::max(1.0/u, erg_lo), erg_hi);
+        seg.h[0][i] = exposure(erg)*spectral_flux.interpolate(erg)/(u*u);
+      }
+      result.push_back(seg);
+    }
+  }
+
+  return result;
+}
+
+std::vector<double> mass_scan_integrals(const std::vector<mass_scan_segment> &segments, int n_bins, const std::vector<double> &masses, double length) {
+  SOLAXFLUX_TIMER(timer, "mass_scan_integrals");
+  const int n_masses = masses.size();
+  const double a = 0.25*1.0e-3*(length/eVm); // sinc argument = a m^2/erg, see conversion_prob_correction
+  std::vector<double> result (n_masses*n_bins, 0);
+
+  #ifdef _OPENMP
+  #pragma omp parallel for schedule(static) num_threads(get_num_threads())
+  #endif
+  for (int k = 0; k < n_masses; k++) {
+    const double m2 = masses[k] > 0 ? masses[k]*masses[k] : 0;
+    std::vector<double> cos_vals, sin_vals;
+    for (auto seg = segments.begin(); seg != segments.end(); ++seg) {
+      const int n = seg->n_intervals;
+      const double h = seg->delta_u, u_hi = seg->u_lo + n*h;
+      if (a*m2*u_hi < 1.0) {
+        // Small phase: trapezoidal rule with the sinc^2 factor
+        for (size_t b = 0; b < seg->bins.size(); b++) {
+          double sum = 0;
+          for (int i = 0; i <= n; i++) {
+            double x = a*m2*(seg->u_lo + i*h);
+            double sincsq = gsl_pow_2(gsl_sf_sinc(x/pi));
+            sum += ((i == 0) || (i == n) ? 0.5 : 1.0)*seg->h[b][i]*sincsq;
+          }
+          result[k*n_bins+seg->bins[b]] = h*sum;
+        }
+      } else {
+        // Filon rule for G(u) = H(u)/u^2 linear on each interval: int G cos(kappa u) du = [G sin(kappa u)]/kappa + sum_i (G_{i+1}-G_i)(c_{i+1}-c_i)/(h kappa^2)
+        // N.B. The cosines/sines are computed via the angle-addition recursion (re-initialised every 256 steps).
+        const double kappa = 2.0*a*m2;
+        const double cos_step = cos(kappa*h), sin_step = sin(kappa*h);
+        cos_vals.resize(n+1);
+        sin_vals.resize(n+1);
+        for (int i = 0; i <= n; i++) {
+          if (i % 256 == 0) {
+            cos_vals[i] = cos(kappa*(seg->u_lo + i*h));
+            sin_vals[i] = sin(kappa*(seg->u_lo + i*h));
+          } else {
+            cos_vals[i] = cos_vals[i-1]*cos_step - sin_vals[i-1]*sin_step;
+            sin_vals[i] = sin_vals[i-1]*cos_step + cos_vals[i-1]*sin_step;
+          }
+        }
+        for (size_t b = 0; b < seg->bins.size(); b++) {
+          const std::vector<double> &hb = seg->h[b];
+          double g_prev = hb[0]/gsl_pow_2(seg->u_lo), trapz = 0.5*g_prev, filon = 0;
+          for (int i = 1; i <= n; i++) {
+            double u = seg->u_lo + i*h;
+            double g = hb[i]/(u*u);
+            trapz += (i == n ? 0.5 : 1.0)*g;
+            filon += (g - g_prev)*(cos_vals[i] - cos_vals[i-1]);
+            g_prev = g;
+          }
+          double cos_integral = (g_prev*sin_vals[n] - hb[0]/gsl_pow_2(seg->u_lo)*sin_vals[0])/kappa + filon/(h*kappa*kappa);
+          result[k*n_bins+seg->bins[b]] = (h*trapz - cos_integral)/(2.0*a*a*m2*m2);
+        }
+      }
+    }
   }
-  gsl_integration_workspace_free(w);
 
   return result;
 }
 
 // Return relative counts at reference values of the coupling.
-std::vector<std::vector<double>> axion_reference_counts_from_file(exp_setup *setup, std::vector<double> masses, std::string spectral_flux_file_gagg, std::string spectral_flux_file_gaee, std::string saveas, bool save_convolved_spectra) {
+std::vector<std::vector<double>> axion_reference_counts_from_file(exp_setup *setup, std::vector<double> masses, std::string spectral_flux_file_gagg, std::string spectral_flux_file_gaee, std::string saveas, bool save_convolved_spectra, bool use_mass_scan_engine, const nuclear_line* line) {
+  SOLAXFLUX_TIMER(timer, "axion_reference_counts_from_file");
   std::vector<std::vector<double>> result;
 
   int n_bins = setup->n_bins;
@@ -254,20 +395,31 @@ std::vector<std::vector<double>> axion_reference_counts_from_file(exp_setup *set
   double erg_resolution = setup->erg_resolution;
 
   double gagg_result, gagg_error, gaee_result, gaee_error;
-  OneDInterpolator spectral_flux_gagg (spectral_flux_file_gagg);
-  OneDInterpolator spectral_flux_gaee;
-  if (spectral_flux_file_gaee != "") { spectral_flux_gaee = OneDInterpolator(spectral_flux_file_gaee); }
-
-  gsl_integration_workspace * w1 = gsl_integration_workspace_alloc (int_space_size_file);
-  gsl_integration_workspace * w2 = gsl_integration_workspace_alloc (int_space_size_file);
-  exp_flux_from_file_integration_parameters p1 { 0, setup->length, setup->dataset, &spectral_flux_gagg, {bin_lo, bin_hi}, setup->erg_resolution };
-  exp_flux_from_file_integration_parameters p2 { 0, setup->length, setup->dataset, &spectral_flux_gaee, {bin_lo, bin_hi}, setup->erg_resolution };
+  double support [2] = { bin_lo, bin_hi };
+  SpectrumInterpolator spectral_flux_gagg (spectral_flux_file_gagg);
+  SpectrumInterpolator spectral_flux_gaee;
+  spectral_flux_gagg.check_range(bin_lo, bin_hi, "axion_reference_counts_from_file ("+spectral_flux_file_gagg+")");
+  if (spectral_flux_file_gaee != "") {
+    spectral_flux_gaee = SpectrumInterpolator(spectral_flux_file_gaee);
+    spectral_flux_gaee.check_range(bin_lo, bin_hi, "axion_reference_counts_from_file ("+spectral_flux_file_gaee+")");
+  }
+
+  QAGWorkspace w1 (int_space_size_file);
+  QAGWorkspace w2 (int_space_size_file);
+  const ExposureTable* exposure = &exposure_table(setup->dataset);
+  exp_flux_from_file_integration_parameters p1 { 0, setup->length, exposure, &spectral_flux_gagg, {bin_lo, bin_hi}, setup->erg_resolution };
+  exp_flux_from_file_integration_parameters p2 { 0, setup->length, exposure, &spectral_flux_gaee, {bin_lo, bin_hi}, setup->erg_resolution };
+  binned_exp_flux_params q1 { {bin_lo, bin_hi}, &p1 };
+  binned_exp_flux_params q2 { {bin_lo, bin_hi}, &p2 };
   gsl_function f1, f2;
   f1.params = &p1;
   f2.params = &p2;
   if (erg_resolution > 0) {
-    f1.function = &convolved_exp_flux_integrand_from_file;
-    f2.function = &convolved_exp_flux_integrand_from_file;
+    // N.B. The convolution is included via the Gaussian response of each bin, s.t. the counts only require one integral over the support
+    f1.function = &binned_exp_flux_integrand_from_file;
+    f2.function = &binned_exp_flux_integrand_from_file;
+    f1.params = &q1;
+    f2.params = &q2;
   } else {
     f1.function = &exp_flux_integrand_from_file;
     f2.function = &exp_flux_integrand_from_file;
@@ -277,7 +429,11 @@ std::vector<std::vector<double>> axion_reference_counts_from_file(exp_setup *set
   if (spectral_flux_file_gaee != "") {
     for (int bin = 0; bin < n_bins; ++bin) {
       double erg_lo = bin_lo + bin*bin_delta;
-      relevant_peaks.push_back(get_relevant_peaks(erg_lo, erg_lo+bin_delta));
+      if (erg_resolution > 0) {
+        relevant_peaks.push_back(get_relevant_peaks(bin_lo, bin_hi));
+      } else {
+        relevant_peaks.push_back(get_relevant_peaks(erg_lo, erg_lo+bin_delta));
+      }
     }
   }
 
@@ -291,37 +447,78 @@ std::vector<std::vector<double>> axion_reference_counts_from_file(exp_setup *set
     }
   }
 
-  std::vector<double> expanded_masses, bin_centres, results_gagg, results_gaee;
+  std::vector<double> expanded_masses, bin_centres, results_gagg, results_gaee, results_line;
   std::vector<double> convolved_spectra_masses_gagg, convolved_spectra_masses_gaee, convolved_spectra_energies_gagg, convolved_spectra_energies_gaee, convolved_spectra_results_gagg, convolved_spectra_results_gaee;
+  std::vector<double> convolved_spectra_results_line, line_profile;
+  if ((line != NULL) && (erg_resolution > 0) && save_convolved_spectra) { line_profile = nuclear_line_spectrum(gagg_ergs, *line, erg_resolution); }
+  std::vector<double> mass_scan_gagg, mass_scan_gaee;
+  if (use_mass_scan_engine) {
+    mass_scan_gagg = mass_scan_integrals(mass_scan_segments(setup, spectral_flux_gagg), n_bins, masses, setup->length);
+    if (spectral_flux_file_gaee != "") { mass_scan_gaee = mass_scan_integrals(mass_scan_segments(setup, spectral_flux_gaee), n_bins, masses, setup->length); }
+  }
   for (auto mass = masses.begin(); mass != masses.end(); mass++) {
     p1.mass = *mass;
     p2.mass = *mass;
-    if (erg_resolution > 0) {
-      for (auto erg = gagg_ergs.begin(); erg != gagg_ergs.end(); ++erg) {
-        convolved_spectra_masses_gagg.push_back(*mass);
-        convolved_spectra_energies_gagg.push_back(*erg);
-        convolved_spectra_results_gagg.push_back(GSL_FN_EVAL(&f1,*erg));
+    if ((erg_resolution > 0) && save_convolved_spectra) {
+      // Convolve exposure x flux x sinc^2 on a uniform grid that resolves the oscillations of sinc^2 (period in erg ~ pi erg^2/(a m^2))
+      double a = 0.25*1.0e-3*(setup->length/eVm);
+      double osc_scale = (*mass > 0) ? 0.125*pi*bin_lo*bin_lo/(a*(*mass)*(*mass)) : 0;
+      double delta = gaussian_convolution_grid_spacing(support, erg_resolution, osc_scale);
+      int n_pts = int(round((bin_hi - bin_lo)/delta)) + 1;
+      std::vector<double> values_gagg (n_pts), values_gaee;
+      for (int i = 0; i < n_pts; i++) { values_gagg[i] = exp_flux_integrand_from_file(std::min(bin_lo + i*delta, bin_hi), &p1); }
+      std::vector<double> conv_gagg = gaussian_convolution(values_gagg, bin_lo, delta, erg_resolution, gagg_ergs);
+      convolved_spectra_masses_gagg.insert(convolved_spectra_masses_gagg.end(), gagg_ergs.size(), *mass);
+      convolved_spectra_energies_gagg.insert(convolved_spectra_energies_gagg.end(), gagg_ergs.begin(), gagg_ergs.end());
+      convolved_spectra_results_gagg.insert(convolved_spectra_results_gagg.end(), conv_gagg.begin(), conv_gagg.end());
+      if (line != NULL) {
+        // N.B. Exposure and conversion probability are evaluated at the line energy (i.e. constant across the line profile)
+        double line_factor = exposure_table(setup->dataset)(line->energy)*conversion_prob_correction(*mass, line->energy, setup->length);
+        for (auto value = line_profile.begin(); value != line_profile.end(); value++) { convolved_spectra_results_line.push_back(line_factor*(*value)); }
       }
       if (spectral_flux_file_gaee != "") {
-        for (auto erg = gaee_ergs.begin(); erg != gaee_ergs.end(); ++erg) {
-          convolved_spectra_masses_gaee.push_back(*mass);
-          convolved_spectra_energies_gaee.push_back(*erg);
-          convolved_spectra_results_gaee.push_back(GSL_FN_EVAL(&f2,*erg));
-        }
+        values_gaee.resize(n_pts);
+        for (int i = 0; i < n_pts; i++) { values_gaee[i] = exp_flux_integrand_from_file(std::min(bin_lo + i*delta, bin_hi), &p2); }
+        std::vector<double> conv_gaee = gaussian_convolution(values_gaee, bin_lo, delta, erg_resolution, gaee_ergs);
+        convolved_spectra_masses_gaee.insert(convolved_spectra_masses_gaee.end(), gaee_ergs.size(), *mass);
+        convolved_spectra_energies_gaee.insert(convolved_spectra_energies_gaee.end(), gaee_ergs.begin(), gaee_ergs.end());
+        convolved_spectra_results_gaee.insert(convolved_spectra_results_gaee.end(), conv_gaee.begin(), conv_gaee.end());
       }
     }
 
+    if (line != NULL) {
+      std::vector<double> counts = nuclear_line_counts(*mass, setup, *line);
+      results_line.insert(results_line.end(), counts.begin(), counts.end());
+    }
     for (int bin = 0; bin < n_bins; ++bin) {
       expanded_masses.push_back(*mass);
       double erg_lo = bin_lo + bin*bin_delta;
       double erg_hi = erg_lo + bin_delta;
+      q1.bin[0] = erg_lo;
+      q1.bin[1] = erg_hi;
+      q2.bin[0] = erg_lo;
+      q2.bin[1] = erg_hi;
       bin_centres.push_back(0.5*(erg_lo + erg_hi));
-      // TODO: Improve results with QAWO adaptive integration for oscillatory functions?! factor out sin^2()?
-      gsl_integration_qag(&f1, erg_lo, erg_hi, int_abs_prec_file, int_rel_prec_file, int_space_size_file, int_method_file, w1, &gagg_result, &gagg_error);
-      results_gagg.push_back(overall_factor*gagg_result);
-      if (spectral_flux_file_gaee != "") {
-        gsl_integration_qagp(&f2, &relevant_peaks[bin][0], relevant_peaks[bin].size(), 10.0*int_abs_prec_file, 10.0*int_rel_prec_file, int_space_size_file, w2, &gaee_result, &gaee_error);
-        results_gaee.push_back(overall_factor*gaee_result);
+      if (use_mass_scan_engine) {
+        int index = (mass - masses.begin())*n_bins + bin;
+        results_gagg.push_back(overall_factor*mass_scan_gagg[index]);
+        if (spectral_flux_file_gaee != "") { results_gaee.push_back(overall_factor*mass_scan_gaee[index]); }
+      } else {
+        // TODO: Improve results with QAWO adaptive integration for oscillatory functions?! factor out sin^2()?
+        if (erg_resolution > 0) {
+          integrate_qag(&f1, bin_lo, bin_hi, int_abs_prec_file, int_rel_prec_file, int_method_file, w1, &gagg_result, &gagg_error);
+        } else {
+          integrate_qag(&f1, erg_lo, erg_hi, int_abs_prec_file, int_rel_prec_file, int_method_file, w1, &gagg_result, &gagg_error);
+        }
+        SOLAXFLUX_COUNT(COUNT_QAG_CALLS, 1);
+        SOLAXFLUX_COUNT(COUNT_QAG_INTERVALS, w1->size);
+        results_gagg.push_back(overall_factor*gagg_result);
+        if (spectral_flux_file_gaee != "") {
+          integrate_qagp(&f2, &relevant_peaks[bin][0], relevant_peaks[bin].size(), 10.0*int_abs_prec_file, 10.0*int_rel_prec_file, w2, &gaee_result, &gaee_error);
+          SOLAXFLUX_COUNT(COUNT_QAG_CALLS, 1);
+          SOLAXFLUX_COUNT(COUNT_QAG_INTERVALS, w2->size);
+          results_gaee.push_back(overall_factor*gaee_result);
+        }
       }
     }
   }
@@ -330,12 +527,20 @@ std::vector<std::vector<double>> axion_reference_counts_from_file(exp_setup *set
   result.push_back(expanded_masses);
   result.push_back(bin_centres);
   result.push_back(results_gagg);
-  if (spectral_flux_file_gaee != "") { result.push_back(results_gaee); header += " | Counts from axion-electron"; }
+  if (spectral_flux_file_gaee != "") {
+    result.push_back(results_gaee);
+    header += " | Counts from axion-electron";
+  } else if (line != NULL) {
+    result.push_back(std::vector<double> (results_gagg.size(), 0));
+    header += " | Counts from axion-electron (none)";
+  }
+  if (line != NULL) { result.push_back(results_line); header += " | Counts from line at " + std::to_string(line->energy) + " keV (g_eff = 1)"; }
   save_to_file(saveas, result, header);
 
   if ((erg_resolution > 0) && save_convolved_spectra) {
     header = "Reference flux (convolved) for g_agamma = 10^-10 1/GeV\nColumns: Axion mass [eV] | Energy [keV] | Primakoff flux [s^-1 cm^-1 keV^-1]";
     std::vector<std::vector<double>> convolved_spectra_gagg = {convolved_spectra_masses_gagg, convolved_spectra_energies_gagg, convolved_spectra_results_gagg};
+    if (line != NULL) { convolved_spectra_gagg.push_back(convolved_spectra_results_line); header += " | Line flux (g_eff = 1) [s^-1 cm^-1 keV^-1]"; }
     save_to_file(spectral_flux_file_gagg+"_convolved", convolved_spectra_gagg, header);
     if (spectral_flux_file_gaee != "") {
       std::vector<std::vector<double>> convolved_spectra_gaee = {convolved_spectra_masses_gaee, convolved_spectra_energies_gaee, convolved_spectra_results_gaee};
@@ -343,9 +548,44 @@ std::vector<std::vector<double>> axion_reference_counts_from_file(exp_setup *set
     }
   }
 
-  gsl_integration_workspace_free (w1);
-  gsl_integration_workspace_free (w2);
+  return result;
+}
+
 
+// Line sources: exposure x flux x conversion probability at the line energy, times the fraction of the (Gaussian) line in each bin
+std::vector<double> nuclear_line_counts(double mass, exp_setup *setup, const nuclear_line &line) {
+  std::vector<double> result;
+  const int n_bins = setup->n_bins;
+  const double overall_factor = gsl_pow_2((setup->b_field/9.0)*(setup->length/9.26))*conversion_prob_factor;
+  const double sqrt2_sigma = sqrt(2.0)*sqrt(gsl_pow_2(line.width) + gsl_pow_2(setup->erg_resolution));
+  const double line_counts = overall_factor*exposure_table(setup->dataset)(line.energy)*line.flux*conversion_prob_correction(mass, line.energy, setup->length);
+  for (int bin = 0; bin < n_bins; ++bin) {
+    double erg_lo = setup->bin_lo + bin*setup->bin_delta;
+    double erg_hi = erg_lo + setup->bin_delta;
+    double fraction;
+    if (sqrt2_sigma > 0) {
+      fraction = 0.5*( std::erf((erg_hi - line.energy)/sqrt2_sigma) - std::erf((erg_lo - line.energy)/sqrt2_sigma) );
+    } else {
+      fraction = ((erg_lo <= line.energy) && (line.energy < erg_hi)) ? 1.0 : 0.0;
+    }
+    result.push_back(line_counts*fraction);
+  }
+  return result;
+}
+
+std::vector<std::vector<double>> axion_reference_counts_nuclear_line(exp_setup *setup, std::vector<double> masses, const nuclear_line &line, std::string saveas) {
+  std::vector<double> expanded_masses, bin_centres, results;
+  for (auto mass = masses.begin(); mass != masses.end(); mass++) {
+    std::vector<double> counts = nuclear_line_counts(*mass, setup, line);
+    for (int bin = 0; bin < setup->n_bins; ++bin) {
+      expanded_masses.push_back(*mass);
+      bin_centres.push_back(setup->bin_lo + (bin + 0.5)*setup->bin_delta);
+      results.push_back(counts[bin]);
+    }
+  }
+  std::vector<std::vector<double>> result = { expanded_masses, bin_centres, results };
+  std::string header = "Reference counts for g_agamma = 10^-10 1/GeV and g_eff = 1 from the line at " + std::to_string(line.energy) + " keV\nColumns: Axion mass [eV] | Energy bin centre [keV] | Counts from line";
+  save_to_file(saveas, result, header);
   return result;
 }
 
@@ -360,10 +600,10 @@ double erg_integrand(double erg, void * params) {
   SolarModel *s = p3->s;
   double r_min = s->get_r_lo(), r_max = std::min(p3->r_max, s->get_r_hi());
 
-  double norm_factor3 = 0.5*gsl_pow_2(ref_erg_value/pi)*(eff_exposure(ref_erg_value, p3->dataset))*conversion_prob_correction(p3->mass, ref_erg_value, p3->length);
+  double norm_factor3 = 0.5*gsl_pow_2(ref_erg_value/pi)*(*p3->exposure)(ref_erg_value)*conversion_prob_correction(p3->mass, ref_erg_value, p3->length);
 
   double sincsq = conversion_prob_correction(p3->mass, erg, p3->length);
-  double exposure = eff_exposure(erg, p3->dataset);
+  double exposure = (*p3->exposure)(erg);
 
   gsl_function f2;
   f2.function = &rho_integrand_2d;
@@ -372,15 +612,15 @@ double erg_integrand(double erg, void * params) {
   f2.params = &p2;
 
   double spectral_flux, spectral_flux_error;
-  gsl_integration_qag (&f2, r_min, r_max, 0.1*int_abs_prec_file , 0.1*int_rel_prec_file , int_space_size_file, int_method_file, p3->w2, &spectral_flux, &spectral_flux_error);
+  integrate_qag(&f2, r_min, r_max, 0.1*int_abs_prec_file, 0.1*int_rel_prec_file, int_method_file, p3->w2, &spectral_flux, &spectral_flux_error);
 
   return 0.5*gsl_pow_2(erg/pi)*exposure*spectral_flux*sincsq/norm_factor3;
 }
 
 // Functions to calculate the counts in all bins of a helioscope experiment
-std::vector<double> axion_photon_counts_from_file(double mass, double gagg, exp_setup *setup, std::string spectral_flux_file) {
+std::vector<double> axion_photon_counts_from_file(double mass, double gagg, exp_setup *setup, std::string spectral_flux_file, const nuclear_line* line) {
   std::vector<double> result;
-  OneDInterpolator spectral_flux;
+  SpectrumInterpolator spectral_flux;
 
   int n_bins = setup->n_bins;
   double bin_lo = setup->bin_lo;
@@ -394,29 +634,38 @@ std::vector<double> axion_photon_counts_from_file(double mass, double gagg, exp_
     ASCIItableReader temp (spectral_flux_file);
     std::vector<double> ergs = temp[0];
     std::vector<double> flux = convolved_spectrum_from_file(ergs, support, erg_resolution, spectral_flux_file);
-    spectral_flux = OneDInterpolator(ergs, flux);
-    save_to_file(spectral_flux_file+"_convolved", {ergs, flux}, "");
+    spectral_flux = SpectrumInterpolator(ergs, flux);
+    // N.B. The line is not interpolated from the file grid (which need not resolve it) but added to the counts below; it is saved as a separate column
+    if (line != NULL) {
+      save_to_file(spectral_flux_file+"_convolved", {ergs, flux, nuclear_line_spectrum(ergs, *line, erg_resolution)}, "");
+    } else {
+      save_to_file(spectral_flux_file+"_convolved", {ergs, flux}, "");
+    }
   } else {
-    spectral_flux = OneDInterpolator(spectral_flux_file);
+    spectral_flux = SpectrumInterpolator(spectral_flux_file);
+    spectral_flux.check_range(bin_lo, bin_hi, "axion_photon_counts_from_file ("+spectral_flux_file+")");
   }
 
   double gagg_result, gagg_error;
-  gsl_integration_workspace * w = gsl_integration_workspace_alloc (int_space_size_file);
-  exp_flux_from_file_integration_parameters p { mass, setup->length, setup->dataset, &spectral_flux, {support[0], support[1]}, setup->erg_resolution };
+  QAGWorkspace w (int_space_size_file);
+  exp_flux_from_file_integration_parameters p { mass, setup->length, &exposure_table(setup->dataset), &spectral_flux, {support[0], support[1]}, setup->erg_resolution };
   gsl_function f;
   f.function = &exp_flux_integrand_from_file;
   f.params = &p;
 
+  std::vector<double> line_counts;
+  if (line != NULL) { line_counts = nuclear_line_counts(mass, setup, *line); }
+
   double erg_lo, erg_hi = bin_lo;
   for (int bin = 0; bin < n_bins; ++bin) {
     erg_lo = erg_hi;
     erg_hi += bin_delta;
-    gsl_integration_qag(&f, erg_lo, erg_hi, int_abs_prec_file, int_rel_prec_file, int_space_size_file, int_method_file, w, &gagg_result, &gagg_error);
+    integrate_qag(&f, erg_lo, erg_hi, int_abs_prec_file, int_rel_prec_file, int_method_file, w, &gagg_result, &gagg_error);
     double counts = gsl_pow_2(gsl_pow_2(gagg/1.0e-10)*(setup->b_field/9.0)*(setup->length/9.26))*conversion_prob_factor*gagg_result;
+    if (line != NULL) { counts += gsl_pow_2(gagg/1.0e-10)*line_counts[bin]; }
     printf("gagg | % 6.4f [%3.2f, %3.2f] % 4.3e\n", log10(mass), erg_lo, erg_hi, log10(counts));
     result.push_back(counts);
   }
-  gsl_integration_workspace_free (w);
 
   return result;
 }
@@ -434,16 +683,17 @@ std::vector<double> axion_photon_counts_full(double mass, double gagg, exp_setup
   double bin_lo = setup->bin_lo;
   double bin_delta = setup->bin_delta;
   double norm_factor1 = s->Gamma_Primakoff(ref_erg_value, s->get_r_lo());
-  double norm_factor3 = 0.5*gsl_pow_2(ref_erg_value/pi)*eff_exposure(ref_erg_value, setup->dataset)*conversion_prob_correction(mass, ref_erg_value, setup->length);
+  const ExposureTable* exposure = &exposure_table(setup->dataset);
+  double norm_factor3 = 0.5*gsl_pow_2(ref_erg_value/pi)*(*exposure)(ref_erg_value)*conversion_prob_correction(mass, ref_erg_value, setup->length);
 
   //gsl_integration_workspace * w1 = gsl_integration_workspace_alloc (int_space_size_file);
-  gsl_integration_cquad_workspace * w1 = gsl_integration_cquad_workspace_alloc(int_space_size_2d_cquad);
-  gsl_integration_workspace * w2 = gsl_integration_workspace_alloc (int_space_size_file);
-  gsl_integration_workspace * w3 = gsl_integration_workspace_alloc (int_space_size_file);
+  CQUADWorkspace w1 (int_space_size_2d_cquad);
+  QAGWorkspace w2 (int_space_size_file);
+  QAGWorkspace w3 (int_space_size_file);
 
-  double (SolarModel::*integrand)(double, double) = &SolarModel::Gamma_Primakoff;
+  double (SolarModel::*integrand)(double, double) const = &SolarModel::Gamma_Primakoff;
 
-  erg_integration_params p3 = { mass, setup->length, setup->r_max, setup->dataset, s, integrand, w1, w2 };
+  erg_integration_params p3 = { mass, setup->length, setup->r_max, exposure, s, integrand, w1, w2 };
   gsl_function f3;
   f3.function = &erg_integrand;
   f3.params = &p3;
@@ -453,7 +703,7 @@ std::vector<double> axion_photon_counts_full(double mass, double gagg, exp_setup
     double gagg_result, gagg_error;
     erg_lo = erg_hi;
     erg_hi += bin_delta;
-    gsl_integration_qag (&f3, erg_lo, erg_hi, int_abs_prec_file, int_rel_prec_file, int_space_size_file, int_method_file, w3, &gagg_result, &gagg_error);
+    integrate_qag(&f3, erg_lo, erg_hi, int_abs_prec_file, int_rel_prec_file, int_method_file, w3, &gagg_result, &gagg_error);
     double counts = factor*norm_factor1*norm_factor3*gsl_pow_2(gsl_pow_2(gagg/1.0e-10)*(setup->b_field/9.0)*(setup->length/9.26))*gagg_result;
     //std::cout << "integral 3 = " << gagg_result << std::endl;
     printf("gagg | % 6.4f [%3.2f, %3.2f] % 4.3e\n", log10(mass), erg_lo, erg_hi, log10(counts));
@@ -461,25 +711,23 @@ std::vector<double> axion_photon_counts_full(double mass, double gagg, exp_setup
   }
 
   //gsl_integration_workspace_free (w1);
-  gsl_integration_cquad_workspace_free(w1);
-  gsl_integration_workspace_free (w2);
-  gsl_integration_workspace_free (w3);
 
   return result;
 }
 
 std::vector<double> axion_electron_counts(double mass, double gaee, double gagg, exp_setup *setup, std::string spectral_flux_file) {
   std::vector<double> result;
-  static OneDInterpolator spectral_flux (spectral_flux_file);
+  SpectrumInterpolator spectral_flux (spectral_flux_file);
 
   int n_bins = setup->n_bins;
   double bin_lo = setup->bin_lo;
   double bin_delta = setup->bin_delta;
   double bin_hi = bin_lo + bin_delta*double(n_bins);
+  spectral_flux.check_range(bin_lo, bin_hi, "axion_electron_counts ("+spectral_flux_file+")");
 
   double gaee_result, gaee_error;
-  gsl_integration_workspace * w = gsl_integration_workspace_alloc (int_space_size_file);
-  exp_flux_from_file_integration_parameters p { mass, setup->length, setup->dataset, &spectral_flux, setup->erg_resolution };
+  QAGWorkspace w (int_space_size_file);
+  exp_flux_from_file_integration_parameters p { mass, setup->length, &exposure_table(setup->dataset), &spectral_flux, {bin_lo, bin_hi}, setup->erg_resolution };
   gsl_function f;
   f.function = &exp_flux_integrand_from_file;
   f.params = &p;
@@ -491,12 +739,11 @@ std::vector<double> axion_electron_counts(double mass, double gaee, double gagg,
     std::vector<double> relevant_peaks = get_relevant_peaks(erg_lo, erg_hi);
     // TODO: Should set abs prec. threshold to ~ 0.001 counts? Would need correct units for energy integrand.
     //       Massive downside: only valid for given gagg... cannot simply rescale results. Computational cost not worth it?!
-    gsl_integration_qagp(&f, &relevant_peaks[0], relevant_peaks.size(), int_abs_prec_file, int_rel_prec_file, int_space_size_file, w, &gaee_result, &gaee_error);
+    integrate_qagp(&f, &relevant_peaks[0], relevant_peaks.size(), int_abs_prec_file, int_rel_prec_file, w, &gaee_result, &gaee_error);
     double counts = gsl_pow_2((gaee/1.0e-13)*(gagg/1.0e-10)*(setup->b_field/9.0)*(setup->length/9.26))*conversion_prob_factor*gaee_result;
     printf("gaee | % 6.4f [%3.2f, %3.2f] % 4.3e\n", log10(mass), erg_lo, erg_hi, log10(counts));
     result.push_back(counts);
   }
-  gsl_integration_workspace_free (w);
 
   return result;
 }
@@ -512,18 +759,18 @@ std::vector<double> axion_electron_counts_full(double mass, double gaee, double
   int n_bins = setup->n_bins;
   double bin_lo = setup->bin_lo;
   double bin_delta = setup->bin_delta;
-  double bin_hi = bin_lo + bin_delta*double(n_bins);
 
   double norm_factor1 = s->Gamma_all_electron(ref_erg_value, s->get_r_lo());
-  double norm_factor3 = 0.5*gsl_pow_2(ref_erg_value/pi)*eff_exposure(ref_erg_value,setup->dataset)*conversion_prob_correction(mass, ref_erg_value, setup->length);
+  const ExposureTable* exposure = &exposure_table(setup->dataset);
+  double norm_factor3 = 0.5*gsl_pow_2(ref_erg_value/pi)*(*exposure)(ref_erg_value)*conversion_prob_correction(mass, ref_erg_value, setup->length);
 
-  gsl_integration_cquad_workspace * w1 = gsl_integration_cquad_workspace_alloc(int_space_size_2d_cquad);
-  gsl_integration_workspace * w2 = gsl_integration_workspace_alloc (int_space_size_file);
-  gsl_integration_workspace * w3 = gsl_integration_workspace_alloc (int_space_size_file);
+  CQUADWorkspace w1 (int_space_size_2d_cquad);
+  QAGWorkspace w2 (int_space_size_file);
+  QAGWorkspace w3 (int_space_size_file);
 
-  double (SolarModel::*integrand)(double, double) = &SolarModel::Gamma_all_electron;
+  double (SolarModel::*integrand)(double, double) const = &SolarModel::Gamma_all_electron;
 
-  erg_integration_params p3 = { mass, setup->length, setup->r_max, setup->dataset, s, integrand, w1, w2 };
+  erg_integration_params p3 = { mass, setup->length, setup->r_max, exposure, s, integrand, w1, w2 };
   gsl_function f3;
   f3.function = &erg_integrand;
   f3.params = &p3;
@@ -535,108 +782,135 @@ std::vector<double> axion_electron_counts_full(double mass, double gaee, double
     erg_hi += bin_delta;
     std::vector<double> relevant_peaks = get_relevant_peaks(erg_lo, erg_hi);
     //gsl_integration_qag (&f3, erg_lo, erg_hi, int_abs_prec, int_rel_prec, int_space_size_file, gagg_method, w3, &gagg_result, &gagg_error);
-    gsl_integration_qagp(&f3, &relevant_peaks[0], relevant_peaks.size(), int_abs_prec_file, int_rel_prec_file, int_space_size_file, w3, &gaee_result, &gaee_error);
+    integrate_qagp(&f3, &relevant_peaks[0], relevant_peaks.size(), int_abs_prec_file, int_rel_prec_file, w3, &gaee_result, &gaee_error);
     double counts = factor*norm_factor1*norm_factor3*gsl_pow_2((gagg/1.0e-10)*(gaee/1.0e-13)*(setup->b_field/9.0)*(setup->length/9.26))*gaee_result;
     printf("gaee | % 6.4f [%3.2f, %3.2f] % 4.3e\n", log10(mass), erg_lo, erg_hi, log10(counts));
     result.push_back(counts);
   }
 
   //gsl_integration_workspace_free (w1);
-  gsl_integration_cquad_workspace_free(w1);
-  gsl_integration_workspace_free (w2);
-  gsl_integration_workspace_free (w3);
 
   return result;
 }
 
 std::vector<double> counts_prediciton_from_file(double mass, double gagg, std::string reference_counts_file, double gaee) {
-  std::vector<double> result;
-
-  // Only setup the interpolators once while the function is being used...
+  // Only setup the predictor once while the function is being used unless the user decides to change the reference counts file.
   static std::string reference_counts_file_bak = "";
-  static int n_cols;
-  static int n_bins;
-  static int n_masses;
-  static double min_m = 1.0e-4;
-  static double lgm0 = -4.0; // Axions with m = 10^-4 eV are effectivly massless
-  static std::vector<double> log_masses;
-  static std::vector<std::vector<double>> ref_counts_gagg;
-  static std::vector<OneDInterpolator> interp_ref_counts_gagg;
-  static std::vector<std::vector<double>> ref_counts_gaee;
-  static std::vector<OneDInterpolator> interp_ref_counts_gaee;
-
-  // ... unless the user decides to change the reference counts file.
-  bool new_reference_counts_file = (reference_counts_file != reference_counts_file_bak);
-  if (new_reference_counts_file) {
+  static CountsPredictor predictor;
+  if (reference_counts_file != reference_counts_file_bak) {
+    predictor = CountsPredictor(reference_counts_file);
     reference_counts_file_bak = reference_counts_file;
-    ASCIItableReader data (reference_counts_file);
-    n_cols = data.getncol();
-    int n_rows = data.getnrow();
-
-    // Make sure that the table is processed correctly with any formatting
-    // Extract unique mass values from the file
-    std::vector<double> m = data[0];
-    sort(m.begin(), m.end());
-    m.erase(unique(m.begin(), m.end()), m.end());
-    n_masses = m.size();
-    log_masses = std::vector<double> (n_masses);
-    min_m = m[0];
-    if ((min_m > 0) && (min_m < 1.0e-4)) { lgm0 = log10(min_m); }
-    if (n_masses > 1) { if ((min_m = 0) && (m[1] < 1.0e-4)) { lgm0 = log10(m[1]) - 100.0; } }
-    for (int k=0; k<n_masses; ++k) { log_masses[k] = safe_log10(m[k],lgm0); }
-    // Extract unique energy bin values from the file
-    std::vector<double> bins = data[1];
-    sort(bins.begin(), bins.end());
-    bins.erase(unique(bins.begin(), bins.end()), bins.end());
-    n_bins = bins.size();
-
-    // Resize the vectors according to the inputs of the file.
-    interp_ref_counts_gagg = std::vector<OneDInterpolator> (n_bins);
-    ref_counts_gagg.resize(n_bins, std::vector<double> (n_masses));
-    if (n_cols > 3) {
-      interp_ref_counts_gaee = std::vector<OneDInterpolator> (n_bins);
-      ref_counts_gaee.resize(n_bins, std::vector<double> (n_masses));
-    }
+  }
+  return predictor.predict(mass, gagg, gaee);
+}
 
-    // Assign the data from the file to the appropriate places.
-    for (int i=0; i<n_rows; ++i) {
-      auto itj = std::find(bins.begin(), bins.end(), data[1][i]);
-      int j = std::distance(bins.begin(), itj);
-      auto itk = std::find(m.begin(), m.end(), data[0][i]);
-      int k = std::distance(m.begin(), itk);
-      ref_counts_gagg[j][k] = data[2][i];
-      if (n_cols > 3) { ref_counts_gaee[j][k] = data[3][i]; }
-    }
+CountsPredictor::CountsPredictor() {}
+
+CountsPredictor::CountsPredictor(std::string reference_counts_file, const nuclear_line* line, exp_setup *setup) {
+  ASCIItableReader data (reference_counts_file);
+  int n_cols = data.getncol();
+  int n_rows = data.getnrow();
+  has_gaee = (n_cols > 3);
+  has_line = (n_cols > 4);
+
+  // Make sure that the table is processed correctly with any formatting
+  // Extract unique mass values from the file
+  masses = data[0];
+  sort(masses.begin(), masses.end());
+  masses.erase(unique(masses.begin(), masses.end()), masses.end());
+  n_masses = masses.size();
+  if (n_masses == 0) { throw XSanityCheck("The reference counts file "+reference_counts_file+" does not contain any data."); }
+  min_m = masses[0];
+  if ((min_m > 0) && (min_m < 1.0e-4)) { lgm0 = log10(min_m); }
+  if (n_masses > 1) { if ((min_m == 0) && (masses[1] < 1.0e-4)) { lgm0 = log10(masses[1]) - 100.0; } }
+  for (int k=0; k<n_masses; ++k) { log_masses.push_back(safe_log10(masses[k],lgm0)); }
+  // Extract unique energy bin values from the file
+  bin_centres = data[1];
+  sort(bin_centres.begin(), bin_centres.end());
+  bin_centres.erase(unique(bin_centres.begin(), bin_centres.end()), bin_centres.end());
+  n_bins = bin_centres.size();
+
+  // Assign the data from the file to the appropriate places.
+  ref_counts_gagg.resize(n_masses*n_bins);
+  if (has_gaee) { ref_counts_gaee.resize(n_masses*n_bins); }
+  if (has_line) { ref_counts_line.resize(n_masses*n_bins); }
+  for (int i=0; i<n_rows; ++i) {
+    int j = std::distance(bin_centres.begin(), std::lower_bound(bin_centres.begin(), bin_centres.end(), data[1][i]));
+    int k = std::distance(masses.begin(), std::lower_bound(masses.begin(), masses.end(), data[0][i]));
+    ref_counts_gagg[k*n_bins+j] = data[2][i];
+    if (has_gaee) { ref_counts_gaee[k*n_bins+j] = data[3][i]; }
+    if (has_line) { ref_counts_line[k*n_bins+j] = data[4][i]; }
+  }
 
-    if (n_masses > 1) {
-      for (int j=0; j<n_bins; ++j) {
-        interp_ref_counts_gagg[j] = OneDInterpolator(log_masses, ref_counts_gagg[j]);
-        if (n_cols > 3) {
-          OneDInterpolator temp_gaee (log_masses, ref_counts_gaee[j]);
-          interp_ref_counts_gaee[j] = std::move(temp_gaee);
-        }
-      }
-    }
+  if (line != NULL) {
+    if (setup == NULL) { throw XSanityCheck("CountsPredictor needs the experimental setup to include the line source."); }
+    if (has_line) { throw XSanityCheck("The reference counts file "+reference_counts_file+" already contains the counts from a line source."); }
+    if (setup->n_bins != n_bins) { throw XSanityCheck("The number of bins in the setup and the reference counts file "+reference_counts_file+" do not match."); }
+    // N.B. Only the conversion probability at the line energy depends on the mass, s.t. the line counts for massless axions are rescaled in predict()
+    line_source_counts = nuclear_line_counts(0, setup, *line);
+    line_energy = line->energy;
+    line_length = setup->length;
+    has_line_source = true;
   }
+}
+
+int CountsPredictor::get_n_bins() const { return n_bins; }
+
+std::vector<double> CountsPredictor::get_bin_centres() const { return bin_centres; }
+
+std::vector<double> CountsPredictor::get_masses() const { return masses; }
+
+bool CountsPredictor::includes_axion_electron() const { return has_gaee; }
+
+bool CountsPredictor::includes_line() const { return has_line || has_line_source; }
 
-  // Reference values are gagg = 10^-10/GeV and gaee = 10^-13.
+void CountsPredictor::predict(double mass, double gagg, double gaee, double geff, double* out) const {
+  // Reference values are gagg = 10^-10/GeV, gaee = 10^-13, and geff = 1.
   double gagg_rel_sq = gagg*gagg/1.0e-20;
   double gaee_rel_sq = gaee*gaee/1.0e-26;
-  double lgm = safe_log10(mass,lgm0);
+  double geff_sq = geff*geff;
+  // Weights of the two neighbouring mass points k and k+1 (same as linear GSL interpolation in log10(mass))
+  int k = 0;
+  double t = 0;
   if (n_masses > 1) {
-    for (int i = 0; i < n_bins; ++i) {
-      double temp = gagg_rel_sq*interp_ref_counts_gagg[i].interpolate(lgm);
-      if (n_cols > 3) { temp += gaee_rel_sq*interp_ref_counts_gaee[i].interpolate(lgm); }
-      result.push_back(gagg_rel_sq*temp);
-    }
-  } else {
-    terminate_with_error_if(mass != min_m, "ERROR! Your reference counts file is only valid for an axion mass of m = "+std::to_string(min_m)+" eV!");
-    for (int i = 0; i < n_bins; ++i) {
-      double temp = gagg_rel_sq*ref_counts_gagg[i][0];
-      if (n_cols > 3) { temp += gaee_rel_sq*ref_counts_gaee[i][0]; }
-      result.push_back(gagg_rel_sq*temp);
+    double lgm = safe_log10(mass,lgm0);
+    if ((lgm < log_masses.front()) || (lgm > log_masses.back())) {
+      throw XSanityCheck("The axion mass m = "+std::to_string(mass)+" eV is outside of the range of the reference counts file.");
     }
+    k = std::upper_bound(log_masses.begin(), log_masses.end(), lgm) - log_masses.begin() - 1;
+    k = std::min(std::max(k, 0), n_masses-2);
+    t = (lgm - log_masses[k])/(log_masses[k+1] - log_masses[k]);
+  } else if (mass != min_m) {
+    throw XSanityCheck("Your reference counts file is only valid for an axion mass of m = "+std::to_string(min_m)+" eV!");
   }
 
+  const double* gagg_lo = &ref_counts_gagg[k*n_bins];
+  const double* gagg_hi = (n_masses > 1) ? gagg_lo + n_bins : gagg_lo;
+  for (int j = 0; j < n_bins; ++j) { out[j] = gagg_rel_sq*(gagg_lo[j] + t*(gagg_hi[j] - gagg_lo[j])); }
+  if (has_gaee) {
+    const double* gaee_lo = &ref_counts_gaee[k*n_bins];
+    const double* gaee_hi = (n_masses > 1) ? gaee_lo + n_bins : gaee_lo;
+    for (int j = 0; j < n_bins; ++j) { out[j] += gaee_rel_sq*(gaee_lo[j] + t*(gaee_hi[j] - gaee_lo[j])); }
+  }
+  if (has_line) {
+    const double* line_lo = &ref_counts_line[k*n_bins];
+    const double* line_hi = (n_masses > 1) ? line_lo + n_bins : line_lo;
+    for (int j = 0; j < n_bins; ++j) { out[j] += geff_sq*(line_lo[j] + t*(line_hi[j] - line_lo[j])); }
+  }
+  if (has_line_source) {
+    double line_factor = geff_sq*conversion_prob_correction(mass, line_energy, line_length);
+    for (int j = 0; j < n_bins; ++j) { out[j] += line_factor*line_source_counts[j]; }
+  }
+  // N.B. Overall factor gagg^2 from the conversion in the detector
+  for (int j = 0; j < n_bins; ++j) { out[j] *= gagg_rel_sq; }
+}
+
+std::vector<double> CountsPredictor::predict(double mass, double gagg, double gaee, double geff) const {
+  std::vector<double> result (n_bins);
+  if (n_bins > 0) { predict(mass, gagg, gaee, geff, &result[0]); }
   return result;
 }
+
+void CountsPredictor::predict(const double* ms, const double* gaggs, const double* gaees, size_t n, double* out, const double* geffs) const {
+  for (size_t i = 0; i < n; ++i) { predict(ms[i], gaggs[i], (gaees == NULL) ? 0.0 : gaees[i], (geffs == NULL) ? 0.0 : geffs[i], &out[i*n_bins]); }
+}
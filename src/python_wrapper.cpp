@@ -10,27 +10,196 @@ PYBIND11_MODULE(pyaxionflux, m) {
 
   try { pybind11::module_::import("numpy"); } catch (...) { return; }
 
+  // N.B. The long-running routines below release the GIL during the C++ computations, s.t. several (different) SolarModel objects can be used
+  //      from different Python threads at the same time. Share one SolarModel object between threads only after calling set_thread_safe_evaluation().
+  typedef pybind11::call_guard<pybind11::gil_scoped_release> release_gil;
+
   m.def("module_info", &module_info, "Basic information about the library.");
-  m.def("test_module", &test_module, "A few simple unit tests of the library.");
+  m.def("test_module", &test_module, "A few simple unit tests of the library.", release_gil());
+  m.def("set_num_threads", &set_num_threads, "Set the number of threads used by the integration routines (requires OpenMP).", "n_threads"_a);
+  m.def("get_num_threads", &get_num_threads, "Number of threads used by the integration routines.");
+  m.def("instrumentation_enabled", &instrumentation_enabled, "Whether the library was compiled with instrumentation (CMake option INSTRUMENTATION=ON).");
+  m.def("instrumentation_snapshot", []() {
+          InstrumentationSnapshot snapshot = instrumentation_snapshot();
+          pybind11::dict result;
+          result["counters"] = snapshot.counters;
+          result["timer_seconds"] = snapshot.timer_seconds;
+          result["timer_calls"] = snapshot.timer_calls;
+          return result;
+        }, "Counters (summed over all threads) and accumulated timers of the instrumentation.");
+  m.def("reset_instrumentation", &reset_instrumentation, "Reset all instrumentation counters and timers.");
   pybind11::class_<SolarModel>(m, "SolarModel", "A simplified reduced implementation of the C++ SolarModel class in Python.")
-    .def(pybind11::init([](std::string file) { return new SolarModel(file); }), "Class constructor using only the path to the solar model file.", "solar_model_file"_a)
+    .def(pybind11::init([](std::string file) { pybind11::gil_scoped_release release; return new SolarModel(file); }), "Class constructor using only the path to the solar model file.", "solar_model_file"_a)
+    .def(pybind11::init([](std::string file, std::string opcode, std::string cache_file, bool lazy_tables, bool uses_opacities, double r_max, bool cache_profiles) {
+           pybind11::gil_scoped_release release;
+           return new SolarModel(file, opcode, false, cache_file, TableLoading(lazy_tables, uses_opacities, r_max, cache_profiles));
+         }), "Class constructor using the path to the solar model file, opacity code, (optional) binary cache file, (optional) lazy loading of the opacity tables "
+             "with hints about the use of opacities and the radial range, and (optional) automatic caching of the derived radial profiles.",
+             "solar_model_file"_a, "opacity_code"_a, "cache_file"_a="", "lazy_tables"_a=false, "uses_opacities"_a=true, "r_max"_a=1.0, "cache_profiles"_a=true)
+    .def("uses_lazy_table_loading", &SolarModel::uses_lazy_table_loading, "Whether the opacity and ionisation tables are read on first access.")
     .def("temperature", pybind11::vectorize(&SolarModel::temperature_in_keV), "Solar model temperature (in keV)", "radius"_a)
     .def("kappa_squared", pybind11::vectorize(&SolarModel::kappa_squared), "Screening scale squared (in keV^2)", "radius"_a)
     .def("omega_pl_squared", pybind11::vectorize(&SolarModel::omega_pl_squared), "Plasma frequency squared (in keV^2)", "radius"_a)
     .def("n_e", pybind11::vectorize(&SolarModel::n_electron), "Electron density (in keV^3)", "radius"_a)
     .def("z2_n", pybind11::vectorize(&SolarModel::z2_n), "Charge-square-weighted ion density (in keV^3)", "radius"_a)
     .def("degeneracy_factor", pybind11::vectorize(&SolarModel::avg_degeneracy_factor), "Electron degeneracy factor", "radius"_a)
-    .def("primakoff_rate", pybind11::vectorize(&SolarModel::Gamma_Primakoff), "Primakoff production rate", "omega"_a, "radius"_a)
-    .def("abc_rate", pybind11::vectorize(&SolarModel::Gamma_all_electron), "Production rate for ABC processes", "omega"_a, "radius"_a)
-    .def("save_solar_model_data", &SolarModel::save_solar_model_data, "Save all solar model data relevant for axion computations.", "output_file_root"_a, "ergs"_a, "n_radii"_a=1000)
+    .def("primakoff_rate", pybind11::vectorize(static_cast<SolarModelMemberFn>(&SolarModel::Gamma_Primakoff)), "Primakoff production rate", "omega"_a, "radius"_a)
+    .def("abc_rate", pybind11::vectorize(static_cast<SolarModelMemberFn>(&SolarModel::Gamma_all_electron)), "Production rate for ABC processes", "omega"_a, "radius"_a)
+    .def("rates", [](const SolarModel &s, py11_array omegas, double r, std::string process) {
+           SolarModelMemberFn rate = py11_rate_function(process);
+           py11_array result (std::vector<pybind11::ssize_t> (omegas.shape(), omegas.shape()+omegas.ndim()));
+           const double* in = omegas.data();
+           double* out = result.mutable_data();
+           const size_t n = omegas.size();
+           { pybind11::gil_scoped_release release; s.rates(rate, in, n, r, out); }
+           return result;
+         }, "Production rate of a given process for many energies at one radius (batched; no copies of contiguous float64 arrays). Processes: 'ABC' (= 'all_electron') and the interaction names of the C++ library.", "omegas"_a, "radius"_a, "process"_a="Primakoff")
+    .def("radial_rates", [](const SolarModel &s, double omega, py11_array radii, std::string process) {
+           SolarModelMemberFn rate = py11_rate_function(process);
+           py11_array result (std::vector<pybind11::ssize_t> (radii.shape(), radii.shape()+radii.ndim()));
+           const double* in = radii.data();
+           double* out = result.mutable_data();
+           const size_t n = radii.size();
+           { pybind11::gil_scoped_release release; s.rates(rate, omega, in, n, out); }
+           return result;
+         }, "Production rate of a given process for one energy at many radii (batched; no copies of contiguous float64 arrays). Processes as for rates().", "omega"_a, "radii"_a, "process"_a="Primakoff")
+    .def("set_thread_safe_evaluation", &SolarModel::set_thread_safe_evaluation, "Do not use shared GSL accelerators, s.t. the object can be used by several threads at once.", "thread_safe"_a=true)
+    .def("is_thread_safe", &SolarModel::is_thread_safe, "Whether the object can be used by several threads at once.")
+    .def("set_tabulated_opacity", &SolarModel::set_tabulated_opacity, "Tabulate the opacities on a grid in radius and energy to speed up the rates.", "use_table"_a=true, "rel_tolerance"_a=1.0e-2, "erg_lo"_a=0.1, "erg_hi"_a=20.0, release_gil())
+    .def("set_opacity_correction", &SolarModel::set_opacity_correction, "Set the opacity correction opacity*(1 + a + b*log10(T(0)/T(r))/log10(T(0)/T(r_CZ))) for r < r_CZ.", "a"_a, "b"_a)
+    .def("get_opacity_correction", &SolarModel::get_opacity_correction, "Opacity correction parameters (a, b).")
+    .def("set_bfields", &SolarModel::set_bfields, "Set the B-fields (in tesla) in the radiative zone, tachocline, and outer layers.", "b_rad"_a, "b_tach"_a, "b_outer"_a)
+    .def("get_bfields", &SolarModel::get_bfields, "B-fields (in tesla) in the radiative zone, tachocline, and outer layers.")
+    .def("save_solar_model_data", &SolarModel::save_solar_model_data, "Save all solar model data relevant for axion computations.", "output_file_root"_a, "ergs"_a, "n_radii"_a=1000, release_gil())
+  ;
+  pybind11::class_<VariedSpectralFlux>(m, "VariedSpectralFlux", "Spectral fluxes of a loaded SolarModel for different opacity corrections and B-fields; only the affected channels are re-computed.")
+    .def(pybind11::init<SolarModel&, std::vector<double> >(), "Class constructor using the SolarModel object and the energies (in keV).", "solar_model"_a, "ergs"_a, pybind11::keep_alive<1,2>())
+    .def("set_parameters", &VariedSpectralFlux::set_parameters, "Set the opacity correction (a, b) and B-fields c (in tesla) of the SolarModel.", "a"_a=0, "b"_a=0, "c"_a=std::vector<double>{ 3.0e3, 50.0, 4.0 })
+    .def("spectral_flux", [](VariedSpectralFlux &vf, std::string channel, std::string saveas) {
+           std::vector<std::vector<double> > result;
+           { pybind11::gil_scoped_release release; result = vf.spectral_flux(channel, saveas); }
+           return py11_to_arrays(std::move(result));
+         }, "Spectral flux of the 'Primakoff', 'ABC', or 'plasmon' channel for the current parameters.", "channel"_a, "saveas"_a="")
+    .def("save_spectral_fluxes", &VariedSpectralFlux::save_spectral_fluxes, "Save the spectra of all relevant channels for the current parameters.", "output_file_root"_a, release_gil())
+    .def("get_n_computations", &VariedSpectralFlux::get_n_computations, "Number of spectra computed so far (i.e. not taken from the cache).")
+  ;
+  pybind11::class_<CountsPredictor>(m, "CountsPredictor", "Predicted counts in all bins of a helioscope experiment from a reference counts file.")
+    .def(pybind11::init([](std::string file) { pybind11::gil_scoped_release release; return new CountsPredictor(file); }), "Class constructor using the path to the reference counts file.", "reference_counts_file"_a)
+    .def("get_n_bins", &CountsPredictor::get_n_bins, "Number of energy bins.")
+    .def("get_bin_centres", [](const CountsPredictor &cp) { return py11_to_array(cp.get_bin_centres()); }, "Centres of the energy bins (in keV).")
+    .def("get_masses", [](const CountsPredictor &cp) { return py11_to_array(cp.get_masses()); }, "Axion masses (in eV) of the reference counts.")
+    .def("includes_axion_electron", &CountsPredictor::includes_axion_electron, "Whether the file contains axion-electron counts.")
+    .def("includes_line", &CountsPredictor::includes_line, "Whether the file contains counts from a line source.")
+    .def("predict", [](const CountsPredictor &cp, py11_array masses, py11_array gaggs, py11_array gaees, py11_array geffs) {
+           const size_t n = masses.size();
+           if ((gaggs.size() != n) || ((gaees.size() != n) && (gaees.size() != 0)) || ((geffs.size() != n) && (geffs.size() != 0))) {
+             throw XSanityCheck("The arrays 'masses', 'gaggs', 'gaees', and 'geffs' need to have the same size.");
+           }
+           const int n_bins = cp.get_n_bins();
+           py11_array result ({ static_cast<pybind11::ssize_t>(n), static_cast<pybind11::ssize_t>(n_bins) });
+           const double* ms = masses.data();
+           const double* gs = gaggs.data();
+           const double* es = (gaees.size() > 0) ? gaees.data() : NULL;
+           const double* fs = (geffs.size() > 0) ? geffs.data() : NULL;
+           double* out = result.mutable_data();
+           { pybind11::gil_scoped_release release; cp.predict(ms, gs, es, n, out, fs); }
+           return result;
+         }, "Counts in all bins (array of shape [n_points, n_bins]) for a batch of masses (in eV), gagg (in GeV^-1), gaee, and g_eff values.", "masses"_a, "gaggs"_a, "gaees"_a=py11_array(), "geffs"_a=py11_array())
+  ;
+  pybind11::class_<FluxSampler>(m, "FluxSampler", "Monte Carlo sampler of axion energies, radii, and angles on the solar disc from the differential flux.")
+    .def(pybind11::init([](std::string file) { pybind11::gil_scoped_release release; return new FluxSampler(file); }), "Class constructor using a file with the differential flux on a (radius, energy) grid.", "d2Phi_file"_a)
+    .def(pybind11::init([](SolarModel &s, std::vector<std::string> processes, py11_array ergs, py11_array radii) {
+           std::vector<SolarModelMemberFn> integrands;
+           for (auto process = processes.begin(); process != processes.end(); process++) { integrands.push_back(py11_rate_function(*process)); }
+           std::vector<double> ergs_vec = py11_to_vector(ergs), radii_vec = py11_to_vector(radii);
+           pybind11::gil_scoped_release release;
+           return new FluxSampler(s, integrands, ergs_vec, radii_vec);
+         }, "Class constructor computing the differential flux (sum of the processes; names as for SolarModel.rates()) on the grid of energies (in keV) and radii (in R_sol).", "solar_model"_a, "processes"_a, "ergs"_a, "radii"_a)
+    .def("get_total_flux", &FluxSampler::get_total_flux, "Integral of the differential flux over the grid (in cm^-2 s^-1).")
+    .def("sample", [](const FluxSampler &fs, size_t n, uint64_t seed, uint64_t first_event) {
+           py11_array ergs (n), radii (n), angles (n);
+           double* e = ergs.mutable_data();
+           double* r = radii.mutable_data();
+           double* a = angles.mutable_data();
+           { pybind11::gil_scoped_release release; fs.sample(n, e, r, a, seed, first_event); }
+           return pybind11::make_tuple(ergs, radii, angles);
+         }, "Events first_event, ..., first_event+n-1: energies (in keV), radii (in R_sol), and polar angles; reproducible for a given seed.", "n"_a, "seed"_a, "first_event"_a=0)
   ;
-  m.def("calculate_spectra", &py11_calc_spectral_flux_up_to_rmax, "Integrates 'Primakoff' and/or 'ABC' flux from solar model file up to radius rmax.",  "ergs"_a, "rmax"_a, "solar_model"_a, "output_file_root"_a="", "process"_a="Primakoff");
-  m.def("save_spectra", &py11_save_spectral_flux_for_different_radii, "Integrates 'Primakoff' and/or 'ABC' flux from solar model file for different radii and saves the results as a text file.",  "ergs"_a, "radii"_a, "solar_model_file"_a, "output_file_root"_a, "process"_a="Primakoff", "op_code"_a="OP");
+  m.def("calculate_spectra", [](py11_array ergs, double rmax, SolarModel *s, std::string output_file_root, std::string process) {
+          std::vector<double> ergs_vec = py11_to_vector(ergs);
+          std::vector<std::vector<double> > result;
+          { pybind11::gil_scoped_release release; result = py11_calc_spectral_flux_up_to_rmax(ergs_vec, rmax, s, output_file_root, process); }
+          return py11_to_arrays(std::move(result));
+        }, "Integrates 'Primakoff' and/or 'ABC' flux from solar model file up to radius rmax.",  "ergs"_a, "rmax"_a, "solar_model"_a, "output_file_root"_a="", "process"_a="Primakoff");
+  m.def("save_spectra", [](py11_array ergs, py11_array radii, std::string solar_model_file, std::string output_file_root, std::string process, std::string op_code) {
+          std::vector<double> ergs_vec = py11_to_vector(ergs), radii_vec = py11_to_vector(radii);
+          pybind11::gil_scoped_release release;
+          py11_save_spectral_flux_for_different_radii(ergs_vec, radii_vec, solar_model_file, output_file_root, process, op_code);
+        }, "Integrates 'Primakoff' and/or 'ABC' flux from solar model file for different radii and saves the results as a text file.",  "ergs"_a, "radii"_a, "solar_model_file"_a, "output_file_root"_a, "process"_a="Primakoff", "op_code"_a="OP");
   const std::vector<double> v1 = { 1.0, 20.0 };
-  m.def("calculate_fluxes_on_solar_disc", &py11_calc_integrated_flux_up_to_different_radii, "Integrated flux within different radii on the solar disc.", "radii"_a, "s"_a, "output_file_root"_a="", "erg_limits"_a=v1, "process"_a="Primakoff");
+  m.def("calculate_fluxes_on_solar_disc", [](py11_array radii, SolarModel *s, std::string output_file_root, std::vector<double> erg_limits, std::string process) {
+          std::vector<double> radii_vec = py11_to_vector(radii);
+          std::vector<std::vector<double> > result;
+          { pybind11::gil_scoped_release release; result = py11_calc_integrated_flux_up_to_different_radii(radii_vec, s, output_file_root, erg_limits, process); }
+          return py11_to_arrays(std::move(result));
+        }, "Integrated flux within different radii on the solar disc.", "radii"_a, "s"_a, "output_file_root"_a="", "erg_limits"_a=v1, "process"_a="Primakoff");
+  m.def("calculate_d2Phi_a_domega_drho_distributed", [](py11_array ergs, py11_array radii, SolarModel &s, std::string process, std::string work_dir, std::string saveas, int chunk_size, double claim_timeout) {
+          std::vector<double> ergs_vec = py11_to_vector(ergs), radii_vec = py11_to_vector(radii);
+          SolarModelMemberFn integrand = py11_rate_function(process);
+          std::vector<std::vector<double> > result;
+          { pybind11::gil_scoped_release release; result = calculate_d2Phi_a_domega_drho_distributed(ergs_vec, radii_vec, s, integrand, work_dir, saveas, chunk_size, claim_timeout); }
+          return py11_to_arrays(std::move(result));
+        }, "Differential flux on a (radius, energy) grid, computed in chunks shared by all processes with the same work directory (empty until all chunks are done).",
+        "ergs"_a, "radii"_a, "s"_a, "process"_a, "work_dir"_a, "saveas"_a="", "chunk_size"_a=64, "claim_timeout"_a=distributed_claim_timeout);
+  m.def("integrate_d2Phi_a_domega_drho_between_rhos_distributed", [](py11_array ergs, py11_array radii, SolarModel &s, std::string process, std::string work_dir, std::string saveas,
+                                                                     bool use_ring_geometry, int chunk_size, double claim_timeout) {
+          std::vector<double> ergs_vec = py11_to_vector(ergs), radii_vec = py11_to_vector(radii);
+          SolarModelMemberFn integrand = py11_rate_function(process);
+          std::vector<std::vector<double> > result;
+          { pybind11::gil_scoped_release release; result = integrate_d2Phi_a_domega_drho_between_rhos_distributed(ergs_vec, radii_vec, s, integrand, work_dir, saveas, use_ring_geometry, chunk_size, claim_timeout); }
+          return py11_to_arrays(std::move(result));
+        }, "Spectral flux up to (or between) radii on the solar disc, computed in chunks shared by all processes with the same work directory (empty until all chunks are done).",
+        "ergs"_a, "radii"_a, "s"_a, "process"_a, "work_dir"_a, "saveas"_a="", "use_ring_geometry"_a=false, "chunk_size"_a=64, "claim_timeout"_a=distributed_claim_timeout);
   const std::vector<double> v2 = { 3.0e3, 50.0, 4.0 };
-  m.def("calculate_varied_spectra", &py11_save_varied_spectral_flux, "Integrates fluxes from solar model file and varies the opacities.", "ergs"_a, "solar_model_file"_a, "output_file_root"_a, "a"_a=0, "b"_a=0, "c"_a=v2);
-  m.def("calculate_reference_counts", &py11_calculate_reference_counts, "Calculate reference counts for each bin of a known experiment.", "masses"_a, "dataset"_a, "spectrum_file_P"_a, "spectrum_file_ABC"_a="", "output_file_name"_a="");
+  m.def("calculate_varied_spectra", [](py11_array ergs, std::string solar_model_file, std::string output_file_root, double a, double b, std::vector<double> c) {
+          std::vector<double> ergs_vec = py11_to_vector(ergs);
+          pybind11::gil_scoped_release release;
+          py11_save_varied_spectral_flux(ergs_vec, solar_model_file, output_file_root, a, b, c);
+        }, "Integrates fluxes from solar model file and varies the opacities.", "ergs"_a, "solar_model_file"_a, "output_file_root"_a, "a"_a=0, "b"_a=0, "c"_a=v2);
+  m.def("calculate_reference_counts", [](py11_array masses, std::string dataset, std::string spectrum_file_P, std::string spectrum_file_ABC, std::string output_file_name) {
+          std::vector<double> masses_vec = py11_to_vector(masses);
+          std::vector<std::vector<double> > result;
+          { pybind11::gil_scoped_release release; result = py11_calculate_reference_counts(masses_vec, dataset, spectrum_file_P, spectrum_file_ABC, output_file_name); }
+          return py11_to_arrays(std::move(result));
+        }, "Calculate reference counts for each bin of a known experiment.", "masses"_a, "dataset"_a, "spectrum_file_P"_a, "spectrum_file_ABC"_a="", "output_file_name"_a="");
+}
+
+// N.B. Input arrays are copied once here since the library routines expect std::vector; this is negligible compared to the integrations.
+std::vector<double> py11_to_vector(const py11_array &arr) { return std::vector<double> (arr.data(), arr.data()+arr.size()); }
+
+py11_array py11_to_array(std::vector<double> &&vec) {
+  std::vector<double>* data = new std::vector<double> (std::move(vec));
+  pybind11::capsule owner (data, [](void *ptr) { delete reinterpret_cast<std::vector<double>*>(ptr); });
+  return py11_array(data->size(), data->data(), owner);
+}
+
+pybind11::list py11_to_arrays(std::vector<std::vector<double> > &&table) {
+  pybind11::list result;
+  for (auto it = table.begin(); it != table.end(); ++it) { result.append(py11_to_array(std::move(*it))); }
+  table.clear();
+  return result;
+}
+
+SolarModelMemberFn py11_rate_function(std::string process) {
+  // N.B. 'ABC' is the name of the axion-electron processes in the other functions of the Python interface (Gamma_all_electron in C++)
+  if (process == "ABC") { return &SolarModel::Gamma_all_electron; }
+  auto iter = map_interaction_name_to_function.find(process);
+  if (iter == map_interaction_name_to_function.end()) {
+    std::string err_msg = "The process '"+process+"' is not a valid option. Choose 'ABC'";
+    for (auto& x: map_interaction_name_to_function) { err_msg += ", '"+x.first+"'"; }
+    throw XUnsupportedOption(err_msg+".");
+  }
+  return iter->second;
 }
 
 void module_info() {
@@ -67,9 +236,9 @@ void py11_save_spectral_flux_for_different_radii(std::vector<double> ergs, std::
   } else if (process == "plasmon") {
     integrate_d2Phi_a_domega_drho_up_to_rho_plasmon(ergs, radii, s, output_file_root+"_plasmon.dat");
   } else if (process == "all") {
-      integrate_d2Phi_a_domega_drho_up_to_rho_Primakoff(ergs, radii, s, output_file_root+"_P.dat");
-      integrate_d2Phi_a_domega_drho_up_to_rho_axionelectron(ergs, radii, s, output_file_root+"_ABC.dat");
-      integrate_d2Phi_a_domega_drho_up_to_rho_plasmon(ergs, radii, s, output_file_root+"_plasmon.dat");
+    // N.B. Single pass for all channels, which share the integration nodes (see the multi-channel integrate_d2Phi_a_domega_drho_between_rhos)
+    std::vector<SolarModelMemberFn> channels = { &SolarModel::Gamma_Primakoff, &SolarModel::Gamma_all_electron, &SolarModel::Gamma_plasmon };
+    integrate_d2Phi_a_domega_drho_between_rhos(ergs, radii, s, channels, { output_file_root+"_P.dat", output_file_root+"_ABC.dat", output_file_root+"_plasmon.dat" });
   } else {
     std::string err_msg = "The process '"+process+"' is not a valid option. Choose 'ABC', 'plasmon', 'Primakoff', or 'all'.";
     throw XUnsupportedOption(err_msg);
@@ -130,11 +299,11 @@ std::vector<std::vector<double> > py11_calc_integrated_flux_up_to_different_radi
   } else if (process == "plasmon") {
     result = integrate_d2Phi_a_domega_drho_up_to_rho_and_for_omega_interval(erg_limits[0], erg_limits[1], radii, *s, &SolarModel::Gamma_plasmon, saveas_pl);
   } else if (process == "all") {
-    result = integrate_d2Phi_a_domega_drho_up_to_rho_and_for_omega_interval(erg_limits[0], erg_limits[1], radii, *s, &SolarModel::Gamma_Primakoff, saveas_p);
-    std::vector<std::vector<double> > temp1 = integrate_d2Phi_a_domega_drho_up_to_rho_and_for_omega_interval(erg_limits[0], erg_limits[1], radii, *s, &SolarModel::Gamma_all_electron, saveas_e);
-    result.push_back(temp1[1]);
-    std::vector<std::vector<double> > temp2 = integrate_d2Phi_a_domega_drho_up_to_rho_and_for_omega_interval(erg_limits[0], erg_limits[1], radii, *s, &SolarModel::Gamma_plasmon, saveas_pl);
-    result.push_back(temp2[1]);
+    std::vector<SolarModelMemberFn> channels = { &SolarModel::Gamma_Primakoff, &SolarModel::Gamma_all_electron, &SolarModel::Gamma_plasmon };
+    std::vector<std::vector<std::vector<double> > > all_results = integrate_d2Phi_a_domega_drho_up_to_rho_and_for_omega_interval(erg_limits[0], erg_limits[1], radii, *s, channels, { saveas_p, saveas_e, saveas_pl });
+    result = all_results[0];
+    result.push_back(all_results[1][1]);
+    result.push_back(all_results[2][1]);
   } else {
     std::string err_msg = "The process '"+process+"' is not a valid option. Choose 'ABC', 'plasmon', 'Primakoff', or 'all'.";
     throw XUnsupportedOption(err_msg);
@@ -144,23 +313,26 @@ std::vector<std::vector<double> > py11_calc_integrated_flux_up_to_different_radi
 }
 
 void py11_save_varied_spectral_flux(std::vector<double> ergs, std::string solar_model_file, std::string output_file_root, double a, double b, std::vector<double> c) {
-  SolarModel s (solar_model_file, OP);
-  s.set_opacity_correction(a, b);
-  s.set_bfields(c[0], c[1], c[2]);
-
-  std::vector<double> check_1 = s.get_opacity_correction();
-  std::vector<double> check_2 = s.get_bfields();
-  std::cout << "INFO. Setting up Solar model from file " << solar_model_file << " and opacity correction parameters (" << check_1[0] << ", " << check_1[1] << ") "\
-               "and B-fields (" << check_2[0] << ", " << check_2[1] << ", " << check_2[2] << ")." << std::endl;
-
-  std::string output_file = output_file_root+"_Primakoff.dat";
-  fully_integrate_d2Phi_a_domega_drho_in_rho_Primakoff(ergs, s, output_file);
-  output_file = output_file_root+"_ABC.dat";
-  fully_integrate_d2Phi_a_domega_drho_in_rho_axionelectron(ergs, s, output_file);
-  if (c[0]+c[1]+c[2] > 0) {
-    output_file = output_file_root+"_plasmon.dat";
-    fully_integrate_d2Phi_a_domega_drho_in_rho_plasmon(ergs, s, output_file);
+  // N.B. The last Solar model and its VariedSpectralFlux object are kept (the GIL is released, hence the mutex), s.t. a scan over the parameters only loads
+  //      the model once and channels that do not depend on the changed parameters are not re-computed
+  static std::mutex cache_mutex;
+  static std::string cached_model_file;
+  static std::unique_ptr<SolarModel> cached_model;
+  static std::unique_ptr<VariedSpectralFlux> cached_varied_flux;
+  static std::vector<double> cached_ergs;
+  std::lock_guard<std::mutex> lock (cache_mutex);
+  if ((cached_model == nullptr) || (solar_model_file != cached_model_file)) {
+    std::cout << "INFO. Setting up Solar model from file " << solar_model_file << "." << std::endl;
+    cached_varied_flux.reset();
+    cached_model.reset(new SolarModel(solar_model_file, OP));
+    cached_model_file = solar_model_file;
+  }
+  if ((cached_varied_flux == nullptr) || (ergs != cached_ergs)) {
+    cached_varied_flux.reset(new VariedSpectralFlux(*cached_model, ergs));
+    cached_ergs = ergs;
   }
+  cached_varied_flux->set_parameters(a, b, c);
+  cached_varied_flux->save_spectral_fluxes(output_file_root);
 }
 
 std::vector<std::vector<double> > py11_calculate_reference_counts(std::vector<double> masses, std::string dataset, std::string spectrum_file_P, std::string spectrum_file_ABC, std::string output_file_name) {
@@ -1,13 +1,15 @@
 // Copyright 2020 Sebastian Hoof & Lennert J. Thormaehlen
 // See the LICENSE file for the license conditions and a disclaimer
 
+#include <mutex>
+
 #include "solar_model.hpp"
 
 
 // Some auxilliary function for the initialisation of the SolarModel
 const double abs_prec_aux_fun = 0;
 const double rel_prec_aux_fun = 1.0e-4;
-const int int_space_size_aux_fun = 1e6;
+const int int_space_size_aux_fun = 1000;
 const int max_iter = 1e4;
 struct solar_model_params { double ea; double p1; double ks2; double wpl2; double kBT; double n_e; double mu; std::vector<gsl_integration_workspace*> ws_vec; };
 
@@ -38,10 +40,87 @@ double n_e_from_chemical_potential(double mu, void * p) {
 
 
 
+// Key for the binary cache files; changes if the model file, opacity code, electron density approximation or library version change
+std::string solar_model_cache_key(std::string path_to_model_file, std::string path_to_data, opacitycode opcode_tag, bool raffelt_approx) {
+  struct stat buffer;
+  std::string file_info = "";
+  if (stat(path_to_model_file.c_str(), &buffer) == 0) { file_info = std::to_string(buffer.st_size)+" bytes, modified "+std::to_string(buffer.st_mtime); }
+  return std::string(LIBRARY_NAME)+"; model file: "+path_to_model_file+" ("+file_info+"); data: "+path_to_data+"; opacity code: "+opacitycode_name.at(opcode_tag)+"; Raffelt approx.: "+std::to_string(raffelt_approx);
+}
+
+// Cache of the derived radial profiles (chemical potential, degeneracy-corrected plasma frequency and screening scale, and degeneracy factor), which is created
+// automatically in the user cache directory. N.B. The file name and key use the content of the model file (not its location or time stamp), s.t. the cache
+// is shared by copies of the data folder; returns an empty string if there is no cache directory.
+std::string derived_profiles_cache_file(std::string model_file_name, uint64_t model_file_hash, bool raffelt_approx) {
+  const std::string cache_dir = user_cache_directory();
+  if (cache_dir == "") { return ""; }
+  std::ostringstream name;
+  name << cache_dir << "derived_profiles_" << model_file_name << "_" << std::hex << model_file_hash << std::dec << (raffelt_approx ? "_raffelt" : "_full_ionisation") << ".cache";
+  return name.str();
+}
+std::string derived_profiles_cache_key(uint64_t model_file_hash, bool raffelt_approx) {
+  std::ostringstream key;
+  key << LIBRARY_NAME << "; derived radial profiles; model file content: " << std::hex << model_file_hash << std::dec;
+  key << "; Raffelt approx.: " << raffelt_approx << "; precision: " << abs_prec_aux_fun << ", " << rel_prec_aux_fun;
+  return key.str();
+}
+
+// Locations of the opacity and ionisation tables (for grid point j of op_grid, TOPS temperature t and density rho, or OPAS radius r)
+std::string ionisation_table_file(std::string path_to_data, int j) {
+  return path_to_data+"ionisation_tables/ionisation_table_"+std::to_string(op_grid[j][0])+"_"+std::to_string(op_grid[j][1])+".dat";
+}
+std::string op_table_file(std::string path_to_data, std::string element, int j) {
+  return path_to_data+"opacity_tables/OP/opacity_table_"+element+"_"+std::to_string(op_grid[j][0])+"_"+std::to_string(op_grid[j][1])+".dat";
+}
+std::string tops_table_file(std::string path_to_data, std::string opcode_name, float t, float rho) {
+  std::stringstream Tstream;
+  std::stringstream rhostream;
+  Tstream << std::fixed << std::setprecision(3) << t;
+  rhostream << std::fixed << std::setprecision(3) << rho;
+  return path_to_data+"opacity_tables/"+opcode_name+"/T"+Tstream.str()+"Rho"+rhostream.str()+".dat";
+}
+std::string opas_table_file(std::string path_to_data, double r) {
+  std::stringstream Rstream;
+  Rstream << std::fixed << std::setprecision(2) << r;
+  return path_to_data+"opacity_tables/OPAS/R"+Rstream.str()+".dat";
+}
+
+// Tables that are read on first access (see TableLoading); a cell is filled at most once while holding the mutex, and only read after its flag is set.
+// N.B. The containers are allocated in the constructor and never resized, s.t. lookups of cells that are already loaded do not need the mutex.
+enum lazy_table { LAZY_IONISATION, LAZY_OP, LAZY_TOPS, LAZY_OPAS, n_lazy_tables };
+struct SolarModel::LazyTables {
+  LazyTables(std::string path_to_data, int n_tops, int n_opas) : path_to_data(path_to_data),
+    ionisationsqr(num_op_elements*op_grid_size, 0), op_log_u(num_op_elements*op_grid_size), op_opacity(num_op_elements*op_grid_size),
+    tops_acc(n_tops, nullptr), tops_interp(n_tops, nullptr), opas_acc(n_opas, nullptr), opas_interp(n_opas, nullptr) {
+    const int n_cells [n_lazy_tables] = { op_grid_size, op_grid_size, n_tops, n_opas };
+    for (int t = 0; t < n_lazy_tables; ++t) { loaded[t] = std::vector<std::atomic<bool> > (n_cells[t]); }
+  }
+  ~LazyTables() {
+    for (auto interp : tops_interp) { if (interp) { gsl_spline_free(interp); } }
+    for (auto interp : opas_interp) { if (interp) { gsl_spline_free(interp); } }
+    for (auto acc : tops_acc) { if (acc) { gsl_interp_accel_free(acc); } }
+    for (auto acc : opas_acc) { if (acc) { gsl_interp_accel_free(acc); } }
+  }
+  std::string path_to_data;
+  std::mutex mutex;
+  std::vector<std::atomic<bool> > loaded [n_lazy_tables];
+  // Same layout as op_ionisationsqr; OP data for element k and grid point j at position k*op_grid_size+j
+  std::vector<double> ionisationsqr;
+  std::vector<std::vector<double> > op_log_u, op_opacity;
+  // TOPS and OPAS interpolators (indexed by the position in tops_grid and opas_radii)
+  std::map<std::pair<float,float>,int> tops_index;
+  std::map<double,int> opas_index;
+  std::vector<gsl_interp_accel*> tops_acc;
+  std::vector<gsl_spline*> tops_interp;
+  std::vector<gsl_interp_accel*> opas_acc;
+  std::vector<gsl_spline*> opas_interp;
+};
+
 // Constructors
 SolarModel::SolarModel() : opcode(OP) {} // N.B. We don't need dummy memory allocation for GSL since destructor checks if the vectors containing them are empty
 
-SolarModel::SolarModel(std::string path_to_model_file, opacitycode opcode_tag, bool set_raffelt_approx) : opcode(opcode_tag) {
+SolarModel::SolarModel(std::string path_to_model_file, opacitycode opcode_tag, bool set_raffelt_approx, std::string cache_file, TableLoading loading) : opcode(opcode_tag) {
+  SOLAXFLUX_TIMER(timer, "SolarModel: solar model file and radial profiles");
   std::string path_to_data, model_file_name;
   locate_data_folder(path_to_model_file, path_to_data, model_file_name);
   if ((opcode_tag != OP) && (model_file_name != "SolarModel_AGSS09.dat")) {
@@ -51,6 +130,44 @@ SolarModel::SolarModel(std::string path_to_model_file, opacitycode opcode_tag, b
   // Set whether to use approximations from https://wwwth.mpp.mpg.de/members/raffelt/mypapers/198601.pdf equation 16 a or alternatively sum over all elements assuming full ionisation
   raffelt_approx = set_raffelt_approx;
   solar_model_name = model_file_name;
+
+  // Check if we can use a binary cache file (opt-in)
+  const bool use_cache = (cache_file != "");
+  std::string cache_key = "";
+  if (use_cache) {
+    cache_key = solar_model_cache_key(path_to_model_file, path_to_data, opcode_tag, raffelt_approx);
+    if (file_exists(cache_file)) { cache_mapping = MemoryMappedFile(cache_file); }
+  }
+  BinaryCacheReader cache (cache_mapping, cache_key);
+  const bool load_from_cache = cache.is_valid();
+  if (use_cache && not(load_from_cache)) {
+    if (cache_mapping.is_open()) {
+      std::cout << "WARNING. The cache file '" << cache_file << "' is not compatible with the current settings and will be overwritten." << std::endl;
+      cache_mapping = MemoryMappedFile();
+    }
+  }
+  // N.B. The cache file contains all tables (and can be memory-mapped), s.t. lazy loading is not needed
+  const bool lazy = loading.lazy && not(use_cache);
+  if (loading.lazy && use_cache) { std::cout << "INFO. Lazy loading of the opacity and ionisation tables is not used together with a cache file." << std::endl; }
+  // Opacity tables to be stored in the cache file (only for TOPS and OPAS)
+  std::vector<std::vector<double>> opacity_cache_buffer;
+
+  // Check if the derived radial profiles can be obtained from the cache file or from the automatic cache in the user cache directory
+  std::string profiles_cache_file = "";
+  std::string profiles_cache_key = "";
+  MemoryMappedFile profiles_cache_mapping;
+  if (not(load_from_cache) && loading.cache_profiles) {
+    const uint64_t model_file_hash = file_content_hash(path_to_model_file);
+    profiles_cache_file = derived_profiles_cache_file(model_file_name, model_file_hash, raffelt_approx);
+    profiles_cache_key = derived_profiles_cache_key(model_file_hash, raffelt_approx);
+    if ((profiles_cache_file != "") && file_exists(profiles_cache_file)) { profiles_cache_mapping = MemoryMappedFile(profiles_cache_file); }
+  }
+  BinaryCacheReader profiles_cache (profiles_cache_mapping, profiles_cache_key);
+  const bool load_profiles = load_from_cache || profiles_cache.is_valid();
+  if (profiles_cache_mapping.is_open() && not(profiles_cache.is_valid())) {
+    std::cout << "INFO. The cached radial profiles in '" << profiles_cache_file << "' are outdated and will be recalculated." << std::endl;
+  }
+
   data = ASCIItableReader(path_to_model_file);
   int pts = data.getnrow();
   // Terminate if number of columns is wrong; i.e. the wrong solar model file format.
@@ -72,6 +189,7 @@ SolarModel::SolarModel(std::string path_to_model_file, opacitycode opcode_tag, b
 
   // Initialise isotope-index map.
   for (int j = 0; j < num_tracked_isotopes; j++) { isotope_index_map[tracked_isotopes[j]] = j; }
+  ff_isotope_indices = { lookup_isotope_index({"H",1}), lookup_isotope_index({"He",3}), lookup_isotope_index({"He",4}) };
 
   // Extract the radius from the files (in units of the solar radius).
   r_lo = data["radius"][0];
@@ -104,20 +222,6 @@ SolarModel::SolarModel(std::string path_to_model_file, opacitycode opcode_tag, b
 
   const double* radius = &data["radius"][0];
 
-  // Integrators for correction functions
-  solar_model_params params;
-  gsl_root_fsolver * u = gsl_root_fsolver_alloc(gsl_root_fsolver_brent);
-  gsl_integration_workspace * v = gsl_integration_workspace_alloc(int_space_size_aux_fun);
-  gsl_integration_workspace * w = gsl_integration_workspace_alloc(int_space_size_aux_fun);
-  double ompl_corr_res, ompl_corr_err, ks_corr_res, ks_corr_err;
-  gsl_function f, g, h;
-  f.function = &omega_pl_correction_integrand;
-  f.params = &params;
-  g.function = &kappa_s_correction_integrand;
-  g.params = &params;
-  h.function = &n_e_from_chemical_potential;
-  h.params = &params;
-
   // Calculate the necessary quantities and store them internally
   for (int i = 0; i < pts; i++) {
     // Temperature: already given in the Solar model; convert to keV
@@ -166,41 +270,89 @@ SolarModel::SolarModel(std::string path_to_model_file, opacitycode opcode_tag, b
       n_op_element[k].push_back(temp);
     }
 
-    params.kBT = temperature[i];
-    params.n_e = gsl_pow_3(keV2cm)*n_e[i];
-
-    // Calculate the chemical potential
-    int status;
-    int iter = 0;
-    // Initial guess = 0, upper ~ zeta(3/2) (exponent = 1), lower ~ -14 (exponent = -1000)
-    double mu = 0.0, mu_up = 2.62*temperature[i], mu_lo = -14.0*temperature[i];
-    gsl_root_fsolver_set(u, &h, mu_lo, mu_up);
-    do {
-      iter++;
-      status = gsl_root_fsolver_iterate(u);
-      mu = gsl_root_fsolver_root(u);
-      mu_lo = gsl_root_fsolver_x_lower(u);
-      mu_up = gsl_root_fsolver_x_upper(u);
-      status = gsl_root_test_interval (mu_lo, mu_up, 1.0e-5, 0.0);
-    } while (status == GSL_CONTINUE && iter < max_iter);
-
-    chemical_potential.push_back(mu);
-    params.mu = mu;
-
-    // Calculated the (degeneracy-corrected) plasma frequency and screening scale
-    gsl_integration_qagiu(&f, 0, abs_prec_aux_fun, rel_prec_aux_fun, int_space_size_aux_fun, v, &ompl_corr_res, &ompl_corr_err);
-    omega_pl_squared_vals.push_back(ompl_corr_res);
-    gsl_integration_qagiu(&g, 0, abs_prec_aux_fun, rel_prec_aux_fun, int_space_size_aux_fun, w, &ks_corr_res, &ks_corr_err);
-    kappa_squared_vals.push_back(ks_corr_res);
-
     // Calculate degeneracy factor only for ~ 100 values of the radius; interpolate later
     if( (i%temp_skip == 0) || (i == pts-1) ) { temp_radius.push_back(data["radius"][i]); }
+
+  }
+
+  // Chemical potential and degeneracy-corrected plasma frequency and screening scale; the radii are independent and are distributed over get_num_threads() threads,
+  // each with its own root solver and integration workspaces. N.B. The results are stored by index, i.e. they do not depend on the number of threads.
+  if (not(load_profiles)) {
+    chemical_potential.resize(pts);
+    omega_pl_squared_vals.resize(pts);
+    kappa_squared_vals.resize(pts);
+    ParallelExceptionHandler exceptions;
+    #ifdef _OPENMP
+    #pragma omp parallel num_threads(get_num_threads())
+    #endif
+    {
+      // Integrators for correction functions
+      solar_model_params params;
+      gsl_root_fsolver * u = gsl_root_fsolver_alloc(gsl_root_fsolver_brent);
+      QAGWorkspace v (int_space_size_aux_fun);
+      QAGWorkspace w (int_space_size_aux_fun);
+      double ompl_corr_res, ompl_corr_err, ks_corr_res, ks_corr_err;
+      gsl_function f, g, h;
+      f.function = &omega_pl_correction_integrand;
+      f.params = &params;
+      g.function = &kappa_s_correction_integrand;
+      g.params = &params;
+      h.function = &n_e_from_chemical_potential;
+      h.params = &params;
+      #ifdef _OPENMP
+      #pragma omp for schedule(dynamic)
+      #endif
+      for (int i = 0; i < pts; i++) {
+        if (exceptions.has_exception()) { continue; }
+        try {
+          params.kBT = temperature[i];
+          params.n_e = gsl_pow_3(keV2cm)*n_e[i];
+
+          // Calculate the chemical potential
+          int status;
+          int iter = 0;
+          // Initial guess = 0, upper ~ zeta(3/2) (exponent = 1), lower ~ -14 (exponent = -1000)
+          double mu = 0.0, mu_up = 2.62*temperature[i], mu_lo = -14.0*temperature[i];
+          gsl_root_fsolver_set(u, &h, mu_lo, mu_up);
+          do {
+            iter++;
+            status = gsl_root_fsolver_iterate(u);
+            mu = gsl_root_fsolver_root(u);
+            mu_lo = gsl_root_fsolver_x_lower(u);
+            mu_up = gsl_root_fsolver_x_upper(u);
+            status = gsl_root_test_interval (mu_lo, mu_up, 1.0e-5, 0.0);
+          } while (status == GSL_CONTINUE && iter < max_iter);
+
+          chemical_potential[i] = mu;
+          params.mu = mu;
+
+          // Calculated the (degeneracy-corrected) plasma frequency and screening scale
+          integrate_qagiu(&f, 0, abs_prec_aux_fun, rel_prec_aux_fun, v, &ompl_corr_res, &ompl_corr_err);
+          omega_pl_squared_vals[i] = ompl_corr_res;
+          integrate_qagiu(&g, 0, abs_prec_aux_fun, rel_prec_aux_fun, w, &ks_corr_res, &ks_corr_err);
+          kappa_squared_vals[i] = ks_corr_res;
+        } catch (...) { exceptions.capture(); }
+      }
+      gsl_root_fsolver_free(u);
+    }
+    exceptions.rethrow_if_any();
   }
 
-  gsl_root_fsolver_free(u);
-  gsl_integration_workspace_free(v);
-  gsl_integration_workspace_free(w);
+  if (load_profiles) {
+    BinaryCacheReader &source = load_from_cache ? cache : profiles_cache;
+    chemical_potential = source.next_vector<double>();
+    omega_pl_squared_vals = source.next_vector<double>();
+    kappa_squared_vals = source.next_vector<double>();
+    degen_factor = source.next_vector<double>();
+    const size_t n_pts = pts;
+    if ((chemical_potential.size() != n_pts) || (omega_pl_squared_vals.size() != n_pts) || (kappa_squared_vals.size() != n_pts) || (degen_factor.size() != n_pts)) {
+      std::string source_file = load_from_cache ? cache_file : profiles_cache_file;
+      std::string err_msg = "The radial profiles in the cache file '"+source_file+"' are incompatible with the solar model file '"+path_to_model_file+"'.";
+      throw XSanityCheck(err_msg);
+    }
+  }
 
+  SOLAXFLUX_NEXT_PHASE(timer, "SolarModel: interpolating functions");
   // Set up the interpolating functions quantities so far
   accel.resize(11);
   linear_interp.resize(11);
@@ -214,18 +366,47 @@ SolarModel::SolarModel(std::string path_to_model_file, opacitycode opcode_tag, b
   init_numbered_interp(8, radius, &omega_pl_squared_vals[0]); // Degeneracy-corrected plasma frequency
   init_numbered_interp(9, radius, &kappa_squared_vals[0]); // Degeneracy-corrected screening scale
 
-  temp_degen_factor = calc_averaged_electron_degeneracy_factor(temp_radius);
-  gsl_interp_accel *temp_acc = gsl_interp_accel_alloc();
-  gsl_spline *temp_spline = gsl_spline_alloc(gsl_interp_linear, temp_radius.size());
-  const double* tr = &temp_radius[0];
-  const double* tdf = &temp_degen_factor[0];
-  gsl_spline_init(temp_spline, tr, tdf, temp_radius.size());
-  for (int i = 0; i < pts; i++) { degen_factor.push_back( gsl_spline_eval(temp_spline, data["radius"][i], temp_acc) ); }
-  gsl_spline_free(temp_spline);
-  gsl_interp_accel_free(temp_acc);
+  if (not(load_profiles)) {
+    // N.B. Evaluated in parallel if get_num_threads() > 1
+    temp_degen_factor = calc_averaged_electron_degeneracy_factor(temp_radius);
+    gsl_interp_accel *temp_acc = gsl_interp_accel_alloc();
+    gsl_spline *temp_spline = gsl_spline_alloc(gsl_interp_linear, temp_radius.size());
+    const double* tr = &temp_radius[0];
+    const double* tdf = &temp_degen_factor[0];
+    gsl_spline_init(temp_spline, tr, tdf, temp_radius.size());
+    for (int i = 0; i < pts; i++) { degen_factor.push_back( gsl_spline_eval(temp_spline, data["radius"][i], temp_acc) ); }
+    gsl_spline_free(temp_spline);
+    gsl_interp_accel_free(temp_acc);
+
+    // Save the profiles for the next SolarModel with the same model file and settings (unless there is no cache directory)
+    if (profiles_cache_file != "") {
+      BinaryCacheWriter profiles_cache_writer (profiles_cache_file, profiles_cache_key);
+      profiles_cache_writer.write(chemical_potential);
+      profiles_cache_writer.write(omega_pl_squared_vals);
+      profiles_cache_writer.write(kappa_squared_vals);
+      profiles_cache_writer.write(degen_factor);
+      profiles_cache_writer.close();
+    }
+  }
 
   init_numbered_interp(10, radius, &degen_factor[0]); // Degeneracy factor for the Primakoff flux
 
+  // Store reference values that are needed repeatedly for the opacity correction and to invert the plasma frequency
+  temperature_centre = temperature_in_keV(r_lo);
+  temperature_cz = temperature_in_keV(radius_cz);
+  omega_pl_squared_min = omega_pl_squared(r_hi);
+  omega_pl_squared_max = omega_pl_squared(r_lo);
+  // N.B. The inverse of the (linearly interpolated) profile is exact between the radii of the model; the plasma frequency decreases with r
+  inverse_omega_pl_squared.clear();
+  inverse_omega_pl_radius.clear();
+  for (int i = pts-1; i >= 0; i--) {
+    double wpl2 = omega_pl_squared(radius[i]);
+    if (inverse_omega_pl_squared.empty() || (wpl2 > inverse_omega_pl_squared.back())) {
+      inverse_omega_pl_squared.push_back(wpl2);
+      inverse_omega_pl_radius.push_back(radius[i]);
+    }
+  }
+
   // Quantities depending on specfific isotope or element
   n_isotope_acc.resize(num_tracked_isotopes);
   n_isotope_lin_interp.resize(num_tracked_isotopes);
@@ -235,47 +416,12 @@ SolarModel::SolarModel(std::string path_to_model_file, opacitycode opcode_tag, b
     init_interp(n_isotope_acc[j], n_isotope_lin_interp[j], radius, &n_isotope[j][0]); // Ion density for each isotope
     init_interp(z2_n_isotope_acc[j], z2_n_isotope_lin_interp[j], radius, &z2_n_isotope[j][0]); // Ion density weighted by charge^2 for each isotope (full ionisation)
   }
-  // N.B. The maps don't need to be resized etc. since the access operator '[]' will silently create the map if it is missing.
+  n_element_acc.resize(num_op_elements);
+  n_element_lin_interp.resize(num_op_elements);
   for (int k = 0; k < num_op_elements; k++) {
-      std::string element = op_element_names[k];
-      init_interp(n_element_acc[element], n_element_lin_interp[element], radius, &n_op_element[k][0]); // Ion density for each element (= summed isotopes with same charge)
+      init_interp(n_element_acc[k], n_element_lin_interp[k], radius, &n_op_element[k][0]); // Ion density for each element (= summed isotopes with same charge)
   }
 
-  // Read squared ionisation from ionisation tables
-  for (int j = 0; j < op_grid_size; j++){
-      std::string op_filename = path_to_data+"ionisation_tables/ionisation_table_"+std::to_string(op_grid[j][0])+"_"+std::to_string(op_grid[j][1])+".dat";
-      ASCIItableReader ion_data = ASCIItableReader(op_filename);
-      ion_data.setcolnames("atomic number", "ionisation", "ionisationsqr");
-      std::map<std::string, double> temp_ionisationsqr;
-      for (int k = 0; k < num_op_elements; k++) {
-          std::string element = op_element_names[k];
-          temp_ionisationsqr[element] = ion_data["ionisationsqr"][k];
-      }
-      auto pr = std::make_pair(op_grid[j][0], op_grid[j][1]);
-      element_ionisationsqr[pr] = temp_ionisationsqr;
-  }
-
-  // Opacity tables setup for interpolating functions (only for chosen opacity code)
-  // Do we use OP opacities?
-  if (opcode == OP) {
-    for (int k = 0; k < num_op_elements; k++) {
-      std::string element = op_element_names[k];
-      // Initialise grid values
-      for (int j = 0; j < op_grid_size; j++) {
-        std::string op_filename = path_to_data+"opacity_tables/OP/opacity_table_"+element+"_"+std::to_string(op_grid[j][0])+"_"+std::to_string(op_grid[j][1])+".dat";
-        ASCIItableReader op_data = ASCIItableReader(op_filename);
-
-        // Determine the number of interpolated mass values.
-        int op_pts = op_data[0].size();
-        auto pr = std::make_pair(op_grid[j][0], op_grid[j][1]);
-        opacity_acc_op[element].insert( std::pair<std::pair<int,int>, gsl_interp_accel*>(pr, gsl_interp_accel_alloc()) );
-        opacity_lin_interp_op[element].insert( std::pair<std::pair<int,int>, gsl_spline*>(pr, gsl_spline_alloc(gsl_interp_linear, op_pts)) );
-        const double* omega = &op_data[0][0];
-        const double* s = &op_data[1][0];
-        gsl_spline_init(opacity_lin_interp_op[element].find(pr)->second, omega, s, op_pts);
-      }
-    }
-  }
   //  Do we use LEDCOP & ATOMIC (both TOPS) opacitites?
   if (opcode == LEDCOP){
       tops_grid = ledcop_grid;
@@ -287,43 +433,126 @@ SolarModel::SolarModel(std::string path_to_model_file, opacitycode opcode_tag, b
         tops_temperatures = atomic_temperatures;
         tops_densities = atomic_densities;
   }
-  if ((opcode == LEDCOP) || (opcode == ATOMIC)) {
-    for (int j = 0; j < tops_grid.size(); j++){
-      std::stringstream Tstream;
-      std::stringstream rhostream;
-      Tstream << std::fixed << std::setprecision(3) << tops_grid[j][0];
-      rhostream << std::fixed << std::setprecision(3) << tops_grid[j][1];
-      std::string tops_filename = path_to_data+"opacity_tables/"+get_opacitycode_name()+"/T"+Tstream.str()+"Rho"+rhostream.str()+".dat";
-      ASCIItableReader tops_data = ASCIItableReader(tops_filename);
-      // Determine the number of interpolated energy values.
-      int tops_pts = tops_data[0].size();
+
+  SOLAXFLUX_NEXT_PHASE(timer, "SolarModel: ionisation tables");
+  // Read squared ionisation from ionisation tables (or set up the tables for lazy loading)
+  if (lazy) {
+    const int n_opas = (opcode == OPAS) ? opas_radii.size() : 0;
+    lazy_tables.reset(new LazyTables(path_to_data, tops_grid.size(), n_opas));
+    for (size_t j = 0; j < tops_grid.size(); j++) { lazy_tables->tops_index[std::make_pair(tops_grid[j][0], tops_grid[j][1])] = j; }
+    for (int j = 0; j < n_opas; j++) { lazy_tables->opas_index[opas_radii[j]] = j; }
+  } else if (load_from_cache) {
+    op_ionisationsqr = cache.next_vector<double>();
+  } else {
+    op_ionisationsqr.resize(num_op_elements*op_grid_size);
+    std::vector<std::string> ion_filenames;
+    for (int j = 0; j < op_grid_size; j++) { ion_filenames.push_back(ionisation_table_file(path_to_data, j)); }
+    std::vector<ASCIItableReader> all_ion_data = read_ascii_tables(ion_filenames);
+    for (int j = 0; j < op_grid_size; j++) {
+      ASCIItableReader &ion_data = all_ion_data[j];
+      ion_data.setcolnames("atomic number", "ionisation", "ionisationsqr");
+      for (int k = 0; k < num_op_elements; k++) { op_ionisationsqr[k*op_grid_size+j] = ion_data["ionisationsqr"][k]; }
+    }
+  }
+
+  SOLAXFLUX_NEXT_PHASE(timer, "SolarModel: opacity tables");
+  // Opacity tables setup for interpolating functions (only for chosen opacity code)
+  // Do we use OP opacities?
+  if ((opcode == OP) && load_from_cache) {
+    // N.B. The OP data are used directly from the memory-mapped cache file
+    size_t n_offsets, n_log_u, n_opacity;
+    const uint64_t* offsets = cache.next<uint64_t>(n_offsets);
+    op_offsets.assign(offsets, offsets+n_offsets);
+    op_log_u_ptr = cache.next<double>(n_log_u);
+    op_opacity_ptr = cache.next<double>(n_opacity);
+    if ((n_offsets != num_op_elements*op_grid_size+1) || (n_log_u != op_offsets.back()) || (n_opacity != op_offsets.back())) {
+      std::string err_msg = "The OP data in the cache file '"+cache_file+"' are corrupted.";
+      throw XSanityCheck(err_msg);
+    }
+  } else if ((opcode == OP) && not(lazy)) {
+    op_offsets.reserve(num_op_elements*op_grid_size+1);
+    op_offsets.push_back(0);
+    for (int k = 0; k < num_op_elements; k++) {
+      std::string element = op_element_names[k];
+      // Initialise grid values (reading all files for one element at once)
+      std::vector<std::string> op_filenames;
+      for (int j = 0; j < op_grid_size; j++) { op_filenames.push_back(op_table_file(path_to_data, element, j)); }
+      std::vector<ASCIItableReader> all_op_data = read_ascii_tables(op_filenames);
+      for (int j = 0; j < op_grid_size; j++) {
+        const ASCIItableReader &op_data = all_op_data[j];
+        // Append the log(u) and opacity values to the contiguous arrays
+        op_log_u.insert(op_log_u.end(), op_data[0].begin(), op_data[0].end());
+        op_opacity.insert(op_opacity.end(), op_data[1].begin(), op_data[1].end());
+        op_offsets.push_back(op_log_u.size());
+      }
+    }
+    op_log_u_ptr = op_log_u.data();
+    op_opacity_ptr = op_opacity.data();
+  }
+  if (((opcode == LEDCOP) || (opcode == ATOMIC)) && not(lazy)) {
+    // Read all files at once (in parallel if get_num_threads() > 1); the interpolators are set up in the order of the grid below
+    std::vector<ASCIItableReader> all_tops_data;
+    if (not(load_from_cache)) {
+      std::vector<std::string> tops_filenames;
+      for (size_t j = 0; j < tops_grid.size(); j++) { tops_filenames.push_back(tops_table_file(path_to_data, get_opacitycode_name(), tops_grid[j][0], tops_grid[j][1])); }
+      all_tops_data = read_ascii_tables(tops_filenames);
+    }
+    for (size_t j = 0; j < tops_grid.size(); j++){
+      const double* omega;
+      const double* s;
+      size_t tops_pts;
+      if (load_from_cache) {
+        omega = cache.next<double>(tops_pts);
+        s = cache.next<double>(tops_pts);
+      } else {
+        const ASCIItableReader &tops_data = all_tops_data[j];
+        // Determine the number of interpolated energy values.
+        tops_pts = tops_data[0].size();
+        omega = &tops_data[0][0];
+        s = &tops_data[1][0];
+        if (use_cache) { opacity_cache_buffer.push_back(tops_data[0]); opacity_cache_buffer.push_back(tops_data[1]); }
+      }
       auto pr = std::make_pair(tops_grid[j][0], tops_grid[j][1]);
       opacity_acc_tops[pr] = gsl_interp_accel_alloc();
       opacity_lin_interp_tops[pr] = gsl_spline_alloc(gsl_interp_linear, tops_pts);
-      const double* omega = &tops_data[0][0];
-      const double* s = &tops_data[1][0];
       gsl_spline_init(opacity_lin_interp_tops[pr], omega, s, tops_pts);
     }
   }
 
   //  Do we use OPAS opacities?
-  if (opcode == OPAS) {
-    for (int j = 0 ; j < opas_radii.size(); j++) {
-      std::stringstream Rstream;
-      Rstream << std::fixed << std::setprecision(2) << opas_radii[j];
-      std::string opas_filename = path_to_data+"opacity_tables/OPAS/R"+Rstream.str()+".dat";
-      ASCIItableReader opas_data = ASCIItableReader(opas_filename);
-      // Determine the number of interpolated energy values.
-      int opas_pts = opas_data[0].size();
+  if ((opcode == OPAS) && not(lazy)) {
+    std::vector<ASCIItableReader> all_opas_data;
+    if (not(load_from_cache)) {
+      std::vector<std::string> opas_filenames;
+      for (size_t j = 0; j < opas_radii.size(); j++) { opas_filenames.push_back(opas_table_file(path_to_data, opas_radii[j])); }
+      all_opas_data = read_ascii_tables(opas_filenames);
+    }
+    for (size_t j = 0 ; j < opas_radii.size(); j++) {
+      const double* omega;
+      const double* s;
+      size_t opas_pts;
+      if (load_from_cache) {
+        omega = cache.next<double>(opas_pts);
+        s = cache.next<double>(opas_pts);
+      } else {
+        const ASCIItableReader &opas_data = all_opas_data[j];
+        // Determine the number of interpolated energy values.
+        opas_pts = opas_data[0].size();
+        omega = &opas_data[0][0];
+        s = &opas_data[1][0];
+        if (use_cache) { opacity_cache_buffer.push_back(opas_data[0]); opacity_cache_buffer.push_back(opas_data[1]); }
+      }
       double rad = opas_radii[j];
       opacity_acc_opas[rad] = gsl_interp_accel_alloc();
       opacity_lin_interp_opas[rad] = gsl_spline_alloc(gsl_interp_linear, opas_pts);
-      const double* omega = &opas_data[0][0];
-      const double* s = &opas_data[1][0];
       gsl_spline_init(opacity_lin_interp_opas[rad], omega, s, opas_pts);
     }
   }
 
+  // Read the cells that will be needed according to the hints (lazy mode)
+  if (lazy) { preload_lazy_cells(loading.r_max, loading.uses_opacities); }
+
+  SOLAXFLUX_NEXT_PHASE(timer, "SolarModel: Rosseland opacities");
   std::string solar_model_name_stripped;
   try {
     solar_model_name_stripped = solar_model_name.substr(solar_model_name.find("_"));
@@ -332,10 +561,13 @@ SolarModel::SolarModel(std::string path_to_model_file, opacitycode opcode_tag, b
     throw XSanityCheck(err);
   }
 
-  int pts_ross_op;
+  size_t pts_ross_op;
   const double* radius_ross_op;
   const double* log10_ross_op;
-  try {
+  if (load_from_cache) {
+    radius_ross_op = cache.next<double>(pts_ross_op);
+    log10_ross_op = cache.next<double>(pts_ross_op);
+  } else try {
     data_rosseland_opacity = ASCIItableReader(path_to_data+"opacity_tables/Rosseland_mean/Rosseland"+solar_model_name_stripped);
     pts_ross_op = data_rosseland_opacity.getnrow();
     radius_ross_op = &data_rosseland_opacity[0][0];
@@ -356,30 +588,45 @@ SolarModel::SolarModel(std::string path_to_model_file, opacitycode opcode_tag, b
   accel[6] = gsl_interp_accel_alloc();
   linear_interp[6] = gsl_spline_alloc(gsl_interp_linear, pts_ross_op);
   gsl_spline_init(linear_interp[6], radius_ross_op, log10_ross_op, pts_ross_op);
+
+  SOLAXFLUX_NEXT_PHASE(timer, "SolarModel: cache file");
+  // Create the cache file if needed (N.B. the order must match the order in which the data are read above!)
+  if (use_cache && not(load_from_cache)) {
+    BinaryCacheWriter cache_writer (cache_file, cache_key);
+    cache_writer.write(chemical_potential);
+    cache_writer.write(omega_pl_squared_vals);
+    cache_writer.write(kappa_squared_vals);
+    cache_writer.write(degen_factor);
+    cache_writer.write(op_ionisationsqr);
+    if (opcode == OP) {
+      std::vector<uint64_t> offsets (op_offsets.begin(), op_offsets.end());
+      cache_writer.write(offsets);
+      cache_writer.write(op_log_u);
+      cache_writer.write(op_opacity);
+    }
+    for (auto vec : opacity_cache_buffer) { cache_writer.write(vec); }
+    cache_writer.write(radius_ross_op, pts_ross_op);
+    cache_writer.write(log10_ross_op, pts_ross_op);
+    cache_writer.close();
+  }
   // All done! Set Solar model class to be correctly initialised
   initialisation_status = true;
 }
 
-SolarModel::SolarModel(std::string path_to_model_file, std::string opcode_name, bool set_raffelt_approx) : SolarModel::SolarModel(path_to_model_file, opacitycode_tag.at(opcode_name), set_raffelt_approx) {}
+SolarModel::SolarModel(std::string path_to_model_file, std::string opcode_name, bool set_raffelt_approx, std::string cache_file, TableLoading loading) : SolarModel::SolarModel(path_to_model_file, opacitycode_tag.at(opcode_name), set_raffelt_approx, cache_file, loading) {}
 
 // Class destructor
 SolarModel::~SolarModel() {
   for (auto interp : linear_interp) { gsl_spline_free(interp); }
   for (auto interp : n_isotope_lin_interp) { gsl_spline_free(interp); }
   for (auto interp : z2_n_isotope_lin_interp) { gsl_spline_free(interp); }
-  for (auto map : n_element_lin_interp) { gsl_spline_free(map.second); }
-  for (auto map_1 : opacity_lin_interp_op) {
-    for (auto map_2 : map_1.second) { gsl_spline_free(map_2.second); }
-  }
+  for (auto interp : n_element_lin_interp) { gsl_spline_free(interp); }
   for (auto map : opacity_lin_interp_tops) { gsl_spline_free(map.second); }
   for (auto map : opacity_lin_interp_opas) { gsl_spline_free(map.second); }
   for (auto acc : accel) { gsl_interp_accel_free(acc); }
   for (auto acc : n_isotope_acc) { gsl_interp_accel_free(acc); }
   for (auto acc : z2_n_isotope_acc) { gsl_interp_accel_free(acc); }
-  for (auto map : n_element_acc) { gsl_interp_accel_free(map.second); }
-  for (auto map_1 : opacity_acc_op) {
-    for (auto map_2 : map_1.second) { gsl_interp_accel_free(map_2.second); }
-  }
+  for (auto acc : n_element_acc) { gsl_interp_accel_free(acc); }
   for (auto map : opacity_acc_tops) { gsl_interp_accel_free(map.second); }
   for (auto map : opacity_acc_opas) { gsl_interp_accel_free(map.second); }
 }
@@ -389,6 +636,7 @@ SolarModel& SolarModel::operator=(SolarModel &&src) {
   if (this != &src) {
     // Settings
     std::swap(raffelt_approx, src.raffelt_approx);
+    thread_safe_evaluation = src.thread_safe_evaluation.exchange(thread_safe_evaluation);
     // Info
     std::swap(initialisation_status,src.initialisation_status);
     std::swap(solar_model_name,src.solar_model_name);
@@ -400,10 +648,15 @@ SolarModel& SolarModel::operator=(SolarModel &&src) {
     std::swap(num_tracked_isotopes,src.num_tracked_isotopes);
     std::swap(isotope_index_map,src.isotope_index_map);
     std::swap(tracked_isotopes,src.tracked_isotopes);
+    std::swap(ff_isotope_indices,src.ff_isotope_indices);
     std::swap(accel,src.accel);
     std::swap(linear_interp,src.linear_interp);
-    std::swap(opacity_acc_op,src.opacity_acc_op);
-    std::swap(opacity_lin_interp_op,src.opacity_lin_interp_op);
+    std::swap(op_log_u,src.op_log_u);
+    std::swap(op_opacity,src.op_opacity);
+    std::swap(op_offsets,src.op_offsets);
+    std::swap(op_log_u_ptr,src.op_log_u_ptr);
+    std::swap(op_opacity_ptr,src.op_opacity_ptr);
+    cache_mapping = std::move(src.cache_mapping);
     std::swap(tops_grid,src.tops_grid);
     std::swap(tops_temperatures,src.tops_temperatures);
     std::swap(tops_densities,src.tops_densities);
@@ -417,7 +670,11 @@ SolarModel& SolarModel::operator=(SolarModel &&src) {
     std::swap(z2_n_isotope_lin_interp,src.z2_n_isotope_lin_interp);
     std::swap(n_element_acc,src.n_element_acc);
     std::swap(n_element_lin_interp,src.n_element_lin_interp);
-    std::swap(element_ionisationsqr,src.element_ionisationsqr);
+    std::swap(op_ionisationsqr,src.op_ionisationsqr);
+    std::swap(lazy_tables,src.lazy_tables);
+    std::swap(use_opacity_table,src.use_opacity_table);
+    std::swap(opacity_table,src.opacity_table);
+    std::swap(opacity_table_settings,src.opacity_table_settings);
     // Properties
     std::swap(r_lo, src.r_lo);
     std::swap(r_hi, src.r_hi);
@@ -426,6 +683,12 @@ SolarModel& SolarModel::operator=(SolarModel &&src) {
     std::swap(bfield_rad_T, src.bfield_rad_T);
     std::swap(bfield_tach_T, src.bfield_tach_T);
     std::swap(bfield_outer_T, src.bfield_outer_T);
+    std::swap(temperature_centre, src.temperature_centre);
+    std::swap(temperature_cz, src.temperature_cz);
+    std::swap(omega_pl_squared_min, src.omega_pl_squared_min);
+    std::swap(omega_pl_squared_max, src.omega_pl_squared_max);
+    std::swap(inverse_omega_pl_squared, src.inverse_omega_pl_squared);
+    std::swap(inverse_omega_pl_radius, src.inverse_omega_pl_radius);
   }
   return *this;
 }
@@ -439,46 +702,62 @@ void SolarModel::init_interp(gsl_interp_accel*& acc, gsl_spline*& interp, const
 
 void SolarModel::init_numbered_interp(const int index, const double* x, const double* y) { init_interp(accel[index], linear_interp[index], x, y); }
 
-// Use the interpolators
-double SolarModel::interp_index(int i, double r) { return gsl_spline_eval(linear_interp[i], r, accel[i]); }
+// Use the interpolators; N.B. GSL accepts a NULL accelerator and then performs a (stateless) binary search
+// The shared accelerators are only used in serial code; lookups from inside a parallel region never touch them (independent of the settings of any caller).
+inline gsl_interp_accel* SolarModel::lookup_accel(gsl_interp_accel* acc) const {
+  return (thread_safe_evaluation.load(std::memory_order_relaxed) || in_parallel_region()) ? NULL : acc;
+}
+
+int SolarModel::eval_interp(const gsl_spline* interp, gsl_interp_accel* acc, double x, double* result) const {
+  return gsl_spline_eval_e(interp, x, lookup_accel(acc), result);
+}
+
+double SolarModel::eval_interp(const gsl_spline* interp, gsl_interp_accel* acc, double x) const { return gsl_spline_eval(interp, x, lookup_accel(acc)); }
+
+double SolarModel::interp_index(int i, double r) const { return eval_interp(linear_interp[i], accel[i], r); }
 
 // Isotope index lookup
-int SolarModel::lookup_isotope_index(Isotope isotope) { return isotope_index_map.at(isotope); }
+int SolarModel::lookup_isotope_index(Isotope isotope) const { return isotope_index_map.at(isotope); }
 
 // Routine to return the various Solar quantities as a function of radius (see hpp file)
-double SolarModel::temperature_in_keV(double r) { return interp_index(0, r); }
-double SolarModel::density(double r) { return interp_index(3, r); }
-double SolarModel::kappa_squared(double r) {
+double SolarModel::temperature_in_keV(double r) const { return interp_index(0, r); }
+double SolarModel::density(double r) const { return interp_index(3, r); }
+double SolarModel::kappa_squared(double r) const {
   const double prefactor = 4.0*pi*alpha_EM;
   double e_contrib = interp_index(9, r)/(pi*pi);
   double z_contrib = z2_n(r)*gsl_pow_3(keV2cm)/temperature_in_keV(r);
   double total = z_contrib + e_contrib;
   return prefactor*total;
 }
-double SolarModel::n_element(double r, std::string element) { return gsl_spline_eval(n_element_lin_interp.at(element), r, n_element_acc.at(element)); }
-double SolarModel::mass_fraction(double r, std::string element){ return n_element(r,element)*atomic_weight({element,0})*(1.0E+9*eV2g)*atomic_mass_unit/density(r); }
-double SolarModel::z2_n_iz(double r, int isotope_index) { return gsl_spline_eval(z2_n_isotope_lin_interp[isotope_index], r, z2_n_isotope_acc[isotope_index]); }
+double SolarModel::n_element(double r, op_element element) const { return eval_interp(n_element_lin_interp[element], n_element_acc[element], r); }
+// N.B. Convenience function below (slower due to the name lookup)
+double SolarModel::n_element(double r, std::string element) const { return n_element(r, lookup_op_element(element)); }
+double SolarModel::mass_fraction(double r, op_element element) const { return n_element(r,element)*atomic_weight({op_element_names[element],0})*(1.0E+9*eV2g)*atomic_mass_unit/density(r); }
+double SolarModel::mass_fraction(double r, std::string element) const { return mass_fraction(r, lookup_op_element(element)); }
+double SolarModel::z2_n_iz(double r, int isotope_index) const { return eval_interp(z2_n_isotope_lin_interp[isotope_index], z2_n_isotope_acc[isotope_index], r); }
 // N.B. Convenience function below (may be slow for many calls!)
-double SolarModel::z2_n_iz(double r, Isotope isotope) { int isotope_index = lookup_isotope_index(isotope); return z2_n_iz(r, isotope_index); }
-double SolarModel::alpha(double r) {
+double SolarModel::z2_n_iz(double r, Isotope isotope) const { int isotope_index = lookup_isotope_index(isotope); return z2_n_iz(r, isotope_index); }
+double SolarModel::alpha(double r) const {
     double result = 0;
+    PlasmaState ps;
+    init_opacity_plasma_state(r, ps);
     for (int k = 2; k < num_op_elements; k++) {
-      std::string element = op_element_names[k];
-      result += mass_fraction(r, element) / metallicity(r) * ionisationsqr_element(r, element) / atomic_weight({element,0});
+      op_element element = op_element(k);
+      result += mass_fraction(r, element) / metallicity(r) * ionisationsqr_element(ps, element) / atomic_weight({op_element_names[k],0});
     }
     return result;
 }
-double SolarModel::z2_n(double r) {
+double SolarModel::z2_n(double r) const {
   if (heavyions_available.find(solar_model_name) != heavyions_available.end()) {
-    return (mass_fraction(r,"H") + mass_fraction(r,"He") + alpha(r)*metallicity(r)) * density(r)/((1.0E+9*eV2g)*atomic_mass_unit);
+    return (mass_fraction(r,OP_H) + mass_fraction(r,OP_He) + alpha(r)*metallicity(r)) * density(r)/((1.0E+9*eV2g)*atomic_mass_unit);
   } else {
     return interp_index(5, r);  // full ionisation
   }
 }
-double SolarModel::n_iz(double r, int isotope_index) { return gsl_spline_eval(n_isotope_lin_interp[isotope_index], r, n_isotope_acc[isotope_index]); }
+double SolarModel::n_iz(double r, int isotope_index) const { return eval_interp(n_isotope_lin_interp[isotope_index], n_isotope_acc[isotope_index], r); }
 // N.B. Convenience function below (may be slow for many calls!)
-double SolarModel::n_iz(double r, Isotope isotope) { int isotope_index = lookup_isotope_index(isotope); return n_iz(r, isotope_index); }
-double SolarModel::n_electron(double r) {
+double SolarModel::n_iz(double r, Isotope isotope) const { int isotope_index = lookup_isotope_index(isotope); return n_iz(r, isotope_index); }
+double SolarModel::n_electron(double r) const {
   if (raffelt_approx == false) {
     return interp_index(1, r);
   } else {
@@ -486,107 +765,227 @@ double SolarModel::n_electron(double r) {
   }
 }
 
-double SolarModel::metallicity(double r){ return 1.0 - mass_fraction(r, "H") - mass_fraction(r, "He"); }
+double SolarModel::metallicity(double r) const { return 1.0 - mass_fraction(r, "H") - mass_fraction(r, "He"); }
 // Routine to return the plasma freqeuency squared (in keV^2) of the zone around the distance r from the centre of the Sun.
-double SolarModel::omega_pl_squared(double r) {
+double SolarModel::omega_pl_squared(double r) const {
   const double prefactor = 4.0*alpha_EM/pi;
   return prefactor*interp_index(8, r);
 }
 
-// Function for finding r from omega plasma
-struct ompl_from_r_params{ SolarModel* s; double wpl2;};
-
-double err_func_ompl_from_r(double r, void * params){
-    struct ompl_from_r_params * p = (struct ompl_from_r_params *)params;
-    double wpl2 = (p->wpl2);
-    double omega2_at_r = p->s->omega_pl_squared(r);
-    return wpl2-omega2_at_r ;
-}
-
-double SolarModel::r_from_omega_pl(double omega_pl) {
-  static double wpl2_min = omega_pl_squared(r_lo), wpl2_max = omega_pl_squared(r_hi);
-  double wpl2 = omega_pl*omega_pl;
-  if (wpl2 > wpl2_min) { return r_lo; }
-  if (wpl2 < wpl2_max) { return r_hi; }
-
-  struct ompl_from_r_params params;
-  params.wpl2 = wpl2;
-  params.s = this;
-  gsl_function f;
-  f.function = &err_func_ompl_from_r;
-  f.params = &params;
-
-  // Set counters and initialise equation solver.
-  int status;
-  int iter = 0, max_iter = 1e4;
-  gsl_root_fsolver *s;
-  s = gsl_root_fsolver_alloc(gsl_root_fsolver_brent);
-  // Initial guess = 0.5, upper ~ 1.0, lower ~ 0.0
-  double r = 0.5, r_max = r_hi, r_min = r_lo;
-  gsl_root_fsolver_set(s, &f, r_min, r_max);
-  do {
-    iter++;
-    status = gsl_root_fsolver_iterate (s);
-    r = gsl_root_fsolver_root(s);
-    r_min = gsl_root_fsolver_x_lower(s);
-    r_max = gsl_root_fsolver_x_upper(s);
-    status = gsl_root_test_interval (r_min, r_max, 1.0e-5, 0.0);
-  } while (status == GSL_CONTINUE && iter < max_iter);
-
-  gsl_root_fsolver_free(s);
+// Invert the plasma frequency profile
+double SolarModel::r_from_omega_pl(double omega_pl) const { return r_from_omega_pl_squared(omega_pl*omega_pl); }
 
-  return r;
+double SolarModel::r_from_omega_pl_squared(double wpl2, double* dr_dwpl2) const {
+  if (dr_dwpl2 != NULL) { *dr_dwpl2 = 0; }
+  if (wpl2 >= omega_pl_squared_max) { return r_lo; }
+  if (wpl2 <= omega_pl_squared_min) { return r_hi; }
+  const std::vector<double> &w = inverse_omega_pl_squared, &r = inverse_omega_pl_radius;
+  const size_t n = w.size();
+  if (n < 2) { return (n == 1) ? r[0] : r_lo; }
+  size_t i = std::upper_bound(w.begin(), w.end(), wpl2) - w.begin();
+  i = std::min(std::max(i, size_t(1)), n-1);
+  const double slope = (r[i] - r[i-1])/(w[i] - w[i-1]);
+  if (dr_dwpl2 != NULL) { *dr_dwpl2 = slope; }
+  return r[i-1] + slope*(wpl2 - w[i-1]);
 }
 
 // Opacity correction factor
-double SolarModel::apply_opacity_correction_factor(double r) {
-  static double temp_0 = temperature_in_keV(r_lo);
+double SolarModel::apply_opacity_correction_factor(double r) const {
   const double r_cz_theo = radius_cz;
-  const double temp_cz = temperature_in_keV(r_cz_theo);
   double result = 1.0;
   if (r < r_cz_theo) {
-    result *= ( 1.0 + opacity_correction_a + opacity_correction_b * log10(temp_0/temperature_in_keV(r)) / log10(temp_0/temp_cz) );
+    result *= ( 1.0 + opacity_correction_a + opacity_correction_b * log10(temperature_centre/temperature_in_keV(r)) / log10(temperature_centre/temperature_cz) );
     result = std::max(result, 0.0);
   }
   return result;
 }
 
 // Opacity for individual isotope (only possible for OP)
-double SolarModel::opacity_element(double omega, double r, std::string element) {
+double SolarModel::opacity_element(double omega, const PlasmaState &ps, op_element element) const {
   const double prefactor4 = a_Bohr*a_Bohr*(keV2cm);
 
-  gsl_error_handler_t* old_handler = gsl_set_error_handler(&my_gsl_handler); // GSL error handler modified to avoid boundary error (fill value = 0)
   //terminate_with_error_if(opcode != OP, "ERROR! Chosen opacity code does not provide opacities for indivdual elements.");
   if (opcode != OP) {
     std::string err_msg = "The chosen opacity code ("+get_opacitycode_name()+") does not provide opacities for indivdual elements.";
     throw XUnsupportedOption(err_msg);
   }
 
-  double u = omega/temperature_in_keV(r);
-  double result = prefactor4*n_element(r, element)*opacity_table_interpolator_op(omega, r, element)*(-gsl_expm1(-u));
-  gsl_set_error_handler(old_handler); // reset the GSL error handler
+  double u = omega/ps.temperature;
+  double result = prefactor4*ps.n_op_element[element]*opacity_table_interpolator_op(omega, ps, element)*(-gsl_expm1(-u));
 
-  return result*apply_opacity_correction_factor(r);
+  return result*ps.opacity_correction;
+}
+double SolarModel::opacity_element(double omega, double r, op_element element) const {
+  PlasmaState ps;
+  init_opacity_plasma_state(r, ps);
+  return opacity_element(omega, ps, element);
 }
 // N.B. Opacity only depends on chemical properties; below just overloaded for convenience;
-double SolarModel::opacity_element(double omega, double r, Isotope isotope) { return opacity_element(omega, r, isotope.get_element_name()); }
+double SolarModel::opacity_element(double omega, double r, std::string element) const { return opacity_element(omega, r, lookup_op_element(element)); }
+double SolarModel::opacity_element(double omega, double r, Isotope isotope) const { return opacity_element(omega, r, isotope.get_element_name()); }
 
 // Opacity for total solar mixture
-double SolarModel::opacity(double omega, double r) {
+double SolarModel::opacity(double omega, const PlasmaState &ps) const {
   double result = 0.0;
 
+  // N.B. For OP, the correction factor is applied for each element and to the total (see below)
+  if (use_opacity_table && lookup_uncorrected_opacity(omega, ps.r, opacity_table.log_total, result)) {
+    if (opcode == OP) { result *= ps.opacity_correction; }
+    return result*ps.opacity_correction;
+  }
+
   if (opcode == OP) {
-    for (int k = 0; k < num_op_elements; k++) { result += opacity_element(omega, r, op_element_names[k]); }
+    for (int k = 0; k < num_op_elements; k++) { result += opacity_element(omega, ps, op_element(k)); }
   } else if ((opcode == LEDCOP) || (opcode == ATOMIC)) {
-    result = opacity_table_interpolator_tops(omega, r)*density(r)*keV2cm;
+    result = opacity_table_interpolator_tops(omega, ps.r)*ps.density*keV2cm;
   } else if (opcode == OPAS) {
-    result = opacity_table_interpolator_opas(omega, r)*density(r)*keV2cm;
+    result = opacity_table_interpolator_opas(omega, ps.r)*ps.density*keV2cm;
   }
 
-  return result*apply_opacity_correction_factor(r);
+  return result*ps.opacity_correction;
+}
+double SolarModel::opacity(double omega, double r) const {
+  PlasmaState ps;
+  init_opacity_plasma_state(r, ps);
+  return opacity(omega, ps);
+}
+
+// Opacity without the opacity correction factor for the full mixture or only for the elements with Z > 2 (only for OP)
+double SolarModel::uncorrected_opacity(double omega, const PlasmaState &ps, bool metals_only) const {
+  const double prefactor4 = a_Bohr*a_Bohr*(keV2cm);
+  double result = 0.0;
+  if (opcode == OP) {
+    double u = omega/ps.temperature;
+    for (int k = metals_only ? 2 : 0; k < num_op_elements; k++) { result += ps.n_op_element[k]*opacity_table_interpolator_op(omega, ps, op_element(k)); }
+    result *= prefactor4*(-gsl_expm1(-u));
+  } else if ((opcode == LEDCOP) || (opcode == ATOMIC)) {
+    result = opacity_table_interpolator_tops(omega, ps.r)*ps.density*keV2cm;
+  } else if (opcode == OPAS) {
+    result = opacity_table_interpolator_opas(omega, ps.r)*ps.density*keV2cm;
+  }
+  return result;
 }
 
-double SolarModel::bfield(double r) {
+// Uncorrected opacities for all combinations of radii and energies (at position i*ergs.size()+j); metals only computed for OP.
+void SolarModel::calc_uncorrected_opacities(const std::vector<double> &radii, const std::vector<double> &ergs, std::vector<double> &total, std::vector<double> &metals) const {
+  const int n_radii = radii.size(), n_ergs = ergs.size();
+  total.resize(n_radii*n_ergs);
+  metals.resize(opcode == OP ? n_radii*n_ergs : 0);
+  const int n_threads = get_num_threads();
+  ParallelExceptionHandler exceptions;
+  #ifdef _OPENMP
+  #pragma omp parallel for schedule(dynamic) num_threads(n_threads)
+  #endif
+  for (int i = 0; i < n_radii; ++i) {
+    if (exceptions.has_exception()) { continue; }
+    try {
+      PlasmaState ps;
+      init_opacity_plasma_state(radii[i], ps);
+      for (int j = 0; j < n_ergs; ++j) {
+        total[i*n_ergs+j] = uncorrected_opacity(ergs[j], ps, false);
+        if (opcode == OP) { metals[i*n_ergs+j] = uncorrected_opacity(ergs[j], ps, true); }
+      }
+    } catch (...) { exceptions.capture(); }
+  }
+  exceptions.rethrow_if_any();
+}
+
+// Log-bilinear interpolation in the opacity table
+bool SolarModel::lookup_uncorrected_opacity(double omega, double r, const std::vector<double> &log_values, double &result) const {
+  SOLAXFLUX_COUNT(COUNT_OPACITY_TABLE_LOOKUPS, 1);
+  const TabulatedOpacity &tab = opacity_table;
+  if (not(omega > 0)) { return false; }
+  double x = (r - tab.r_lo)/tab.r_delta;
+  double y = (log10(omega) - tab.log10_erg_lo)/tab.log10_erg_delta;
+  if ((x < 0) || (y < 0) || (x > tab.n_radii-1) || (y > tab.n_ergs-1)) { return false; }
+  int i = std::min(int(x), tab.n_radii-2);
+  int j = std::min(int(y), tab.n_ergs-2);
+  const double* v = &log_values[i*tab.n_ergs+j];
+  double v00 = v[0], v01 = v[1], v10 = v[tab.n_ergs], v11 = v[tab.n_ergs+1];
+  // N.B. Vanishing opacity at one of the grid points (e.g. missing OP data); use the standard routines
+  if (not(std::isfinite(v00) && std::isfinite(v01) && std::isfinite(v10) && std::isfinite(v11))) { return false; }
+  double tx = x - double(i), ty = y - double(j);
+  result = exp((1.0-tx)*((1.0-ty)*v00 + ty*v01) + tx*((1.0-ty)*v10 + ty*v11));
+  return true;
+}
+
+void SolarModel::set_tabulated_opacity(bool use_table, double rel_tolerance, double erg_lo, double erg_hi) {
+  SOLAXFLUX_TIMER(timer, "SolarModel::set_tabulated_opacity");
+  use_opacity_table = false;
+  opacity_table = TabulatedOpacity();
+  opacity_table_settings.clear();
+  if (use_table == false) { return; }
+  if ((erg_lo <= 0) || (erg_hi <= erg_lo) || (rel_tolerance <= 0)) {
+    throw XSanityCheck("Invalid arguments for SolarModel::set_tabulated_opacity; need 0 < erg_lo < erg_hi and rel_tolerance > 0.");
+  }
+
+  // Initial and maximum number of grid points in r and log10(omega)
+  const int n_radii_init = 101, n_ergs_init = 201;
+  const int n_radii_max = 801, n_ergs_max = 3201;
+
+  TabulatedOpacity tab;
+  tab.n_radii = n_radii_init;
+  tab.n_ergs = n_ergs_init;
+  tab.r_lo = r_lo;
+  tab.log10_erg_lo = log10(erg_lo);
+  double err_r, err_erg;
+  while (true) {
+    tab.r_delta = (r_hi - r_lo)/double(tab.n_radii-1);
+    tab.log10_erg_delta = (log10(erg_hi) - tab.log10_erg_lo)/double(tab.n_ergs-1);
+    // Grid points and midpoints between them
+    std::vector<double> radii, radii_mid, ergs, ergs_mid;
+    for (int i = 0; i < tab.n_radii; i++) { radii.push_back(std::min(tab.r_lo + i*tab.r_delta, r_hi)); }
+    for (int i = 0; i < tab.n_radii-1; i++) { radii_mid.push_back(tab.r_lo + (i+0.5)*tab.r_delta); }
+    for (int j = 0; j < tab.n_ergs; j++) { ergs.push_back(pow(10, tab.log10_erg_lo + j*tab.log10_erg_delta)); }
+    for (int j = 0; j < tab.n_ergs-1; j++) { ergs_mid.push_back(pow(10, tab.log10_erg_lo + (j+0.5)*tab.log10_erg_delta)); }
+
+    std::vector<double> total, metals;
+    calc_uncorrected_opacities(radii, ergs, total, metals);
+    tab.log_total.resize(total.size());
+    tab.log_metals.resize(metals.size());
+    for (size_t k = 0; k < total.size(); k++) { tab.log_total[k] = log(total[k]); }
+    for (size_t k = 0; k < metals.size(); k++) { tab.log_metals[k] = log(metals[k]); }
+    opacity_table = tab;
+
+    // Estimate the rms relative error at the midpoints in r and in omega (only where the table is used)
+    double sum_r = 0, sum_erg = 0;
+    int n_r = 0, n_erg = 0;
+    calc_uncorrected_opacities(radii_mid, ergs, total, metals);
+    for (size_t i = 0; i < radii_mid.size(); i++) {
+      for (size_t j = 0; j < ergs.size(); j++) {
+        double exact = total[i*ergs.size()+j], approx;
+        if ((exact > 0) && lookup_uncorrected_opacity(ergs[j], radii_mid[i], opacity_table.log_total, approx)) { sum_r += gsl_pow_2(approx/exact - 1.0); n_r++; }
+      }
+    }
+    calc_uncorrected_opacities(radii, ergs_mid, total, metals);
+    for (size_t i = 0; i < radii.size(); i++) {
+      for (size_t j = 0; j < ergs_mid.size(); j++) {
+        double exact = total[i*ergs_mid.size()+j], approx;
+        if ((exact > 0) && lookup_uncorrected_opacity(ergs_mid[j], radii[i], opacity_table.log_total, approx)) { sum_erg += gsl_pow_2(approx/exact - 1.0); n_erg++; }
+      }
+    }
+    err_r = n_r > 0 ? sqrt(sum_r/double(n_r)) : 0;
+    err_erg = n_erg > 0 ? sqrt(sum_erg/double(n_erg)) : 0;
+
+    bool refine_r = (err_r > rel_tolerance) && (tab.n_radii < n_radii_max);
+    bool refine_erg = (err_erg > rel_tolerance) && (tab.n_ergs < n_ergs_max);
+    if (not(refine_r || refine_erg)) { break; }
+    if (refine_r) { tab.n_radii = 2*tab.n_radii - 1; }
+    if (refine_erg) { tab.n_ergs = 2*tab.n_ergs - 1; }
+  }
+
+  if (std::max(err_r, err_erg) > rel_tolerance) {
+    std::cout << "WARNING. Tabulated opacities reached the maximum grid size; estimated rms relative error is " << std::max(err_r, err_erg) << " (requested: " << rel_tolerance << ")." << std::endl;
+  }
+  use_opacity_table = true;
+  opacity_table_settings = { rel_tolerance, erg_lo, erg_hi };
+}
+
+bool SolarModel::uses_tabulated_opacity() const { return use_opacity_table; }
+
+std::vector<double> SolarModel::get_tabulated_opacity_settings() const { return opacity_table_settings; }
+
+double SolarModel::bfield(double r) const {
   const double lambda = 10.0*radius_cz + 1.0;
   const double lambda_factor = (1.0 + lambda)*pow(1.0 + 1.0/lambda, lambda);
 
@@ -622,21 +1021,72 @@ double aux_integrand(double x, void * params) {
   return x * exp(-x2) * analytical_integral;
 }
 
-double aux_function(double u, double y) {
+double aux_function_exact(double u, double y, gsl_integration_workspace * w) {
   integrand_params_aux_fun p = { u, y };
-  gsl_integration_workspace * w = gsl_integration_workspace_alloc(int_space_size_aux_fun);
   double result, error;
   gsl_function f;
   f.function = &aux_integrand;
   f.params = &p;
-  gsl_integration_qagiu(&f, 0, abs_prec_aux_fun, rel_prec_aux_fun, int_space_size_aux_fun, w, &result, &error);
-  gsl_integration_workspace_free(w);
+  integrate_qagiu(&f, 0, abs_prec_aux_fun, rel_prec_aux_fun, w, &result, &error);
   return result;
 }
 
+double aux_function_exact(double u, double y) {
+  QAGWorkspace w (int_space_size_aux_fun);
+  double result = aux_function_exact(u, y, w);
+  return result;
+}
+
+// Tabulated version of the auxiliary function, using a bicubic spline of log(aux_function) in (log10(u), log10(y)).
+// N.B. A grid spacing of 0.1 dex reproduces the integral to better than ~ 2e-5 (relative), i.e. below rel_prec_aux_fun.
+// Points outside the grid are computed via the numerical integral.
+const double aux_fun_log10_u_lo = -4.0, aux_fun_log10_u_hi = 3.0;
+const double aux_fun_log10_y_lo = -6.0, aux_fun_log10_y_hi = 2.0;
+const double aux_fun_log10_step = 0.1;
+
+class AuxFunctionTable {
+  public:
+    AuxFunctionTable() {
+      n_u = int(round((aux_fun_log10_u_hi - aux_fun_log10_u_lo)/aux_fun_log10_step)) + 1;
+      n_y = int(round((aux_fun_log10_y_hi - aux_fun_log10_y_lo)/aux_fun_log10_step)) + 1;
+      std::vector<double> log10_u_vals (n_u), log10_y_vals (n_y), log_vals (n_u*n_y);
+      for (int i = 0; i < n_u; ++i) { log10_u_vals[i] = aux_fun_log10_u_lo + i*aux_fun_log10_step; }
+      for (int j = 0; j < n_y; ++j) { log10_y_vals[j] = aux_fun_log10_y_lo + j*aux_fun_log10_step; }
+      spline = gsl_spline2d_alloc(gsl_interp2d_bicubic, n_u, n_y);
+      QAGWorkspace w (int_space_size_aux_fun);
+      for (int i = 0; i < n_u; ++i) {
+        for (int j = 0; j < n_y; ++j) {
+          double val = aux_function_exact(pow(10, log10_u_vals[i]), pow(10, log10_y_vals[j]), w);
+          gsl_spline2d_set(spline, &log_vals[0], i, j, log(val));
+        }
+      }
+      gsl_spline2d_init(spline, &log10_u_vals[0], &log10_y_vals[0], &log_vals[0], n_u, n_y);
+    }
+    ~AuxFunctionTable() { gsl_spline2d_free(spline); }
+    AuxFunctionTable(const AuxFunctionTable&) = delete;
+    AuxFunctionTable& operator=(const AuxFunctionTable&) = delete;
+    // N.B. No accelerators are used, s.t. the (immutable) table can be shared by many threads.
+    double interpolate(double log10_u, double log10_y) const { return exp(gsl_spline2d_eval(spline, log10_u, log10_y, NULL, NULL)); }
+  private:
+    int n_u, n_y;
+    gsl_spline2d *spline;
+};
+
+double aux_function(double u, double y) {
+  if ((u > 0) && (y > 0)) {
+    double log10_u = log10(u), log10_y = log10(y);
+    if ((log10_u >= aux_fun_log10_u_lo) && (log10_u <= aux_fun_log10_u_hi) && (log10_y >= aux_fun_log10_y_lo) && (log10_y <= aux_fun_log10_y_hi)) {
+      // The table is only computed once, when it is first needed (thread-safe initialisation since C++11).
+      static const AuxFunctionTable table;
+      return table.interpolate(log10_u, log10_y);
+    }
+  }
+  return aux_function_exact(u, y);
+}
+
 
 // Functions for calculating and interpolating the Rosseland mean opacity
-struct integrand_params_rosseland { SolarModel* s; double r; };
+struct integrand_params_rosseland { const SolarModel* s; double r; };
 
 double rosseland_integrand(double omega, void * params){
     const double prefactor = 15.0/(4.0*gsl_pow_4(pi));
@@ -649,29 +1099,40 @@ double rosseland_integrand(double omega, void * params){
     return R / opac ;
 }
 
-std::vector<double> SolarModel::log10_rosseland_opacity(std::vector<double> radii) {
-    double result, error;
-    std::vector<double> results;
-
-    integrand_params_rosseland p;
-    p.s = this;
-    size_t neval;
-    gsl_function f;
-    f.function = &rosseland_integrand;
-    f.params = &p;
-    gsl_integration_cquad_workspace * v = gsl_integration_cquad_workspace_alloc(int_space_size_aux_fun);
-    std::vector<double> relevant_peaks = get_relevant_peaks(0.1, 19.0);
-    for(auto r = radii.begin(); r != radii.end(); ++r) {
-      p.r = *r;
-      gsl_integration_cquad(&f, 0.1, 19.0, 0.0, 1.0e-4, v, &result, &error, &neval);
-      results.push_back(log10(temperature_in_keV(*r)/result));
+// N.B. The loops over the radii below are parallelised if get_num_threads() > 1
+std::vector<double> SolarModel::log10_rosseland_opacity(std::vector<double> radii) const {
+    const int n_radii = radii.size();
+    std::vector<double> results (n_radii);
+    ParallelExceptionHandler exceptions;
+    #ifdef _OPENMP
+    #pragma omp parallel num_threads(get_num_threads())
+    #endif
+    {
+      double result, error;
+      integrand_params_rosseland p;
+      p.s = this;
+      size_t neval;
+      gsl_function f;
+      f.function = &rosseland_integrand;
+      f.params = &p;
+      CQUADWorkspace v (int_space_size_aux_fun);
+      #ifdef _OPENMP
+      #pragma omp for schedule(dynamic)
+      #endif
+      for (int i = 0; i < n_radii; ++i) {
+        if (exceptions.has_exception()) { continue; }
+        try {
+          p.r = radii[i];
+          gsl_integration_cquad(&f, 0.1, 19.0, 0.0, 1.0e-4, v, &result, &error, &neval);
+          results[i] = log10(temperature_in_keV(radii[i])/result);
+        } catch (...) { exceptions.capture(); }
+      }
     }
-
-    gsl_integration_cquad_workspace_free(v);
+    exceptions.rethrow_if_any();
     return results;
 }
 
-double SolarModel::interpolate_rosseland_opacity(double r) {
+double SolarModel::interpolate_rosseland_opacity(double r) const {
   double log10op = interp_index(6, r);
   double result = pow(10, log10op);
   if ((isnan(result) == true) or (isinf(result)==true)) { result = 0; }
@@ -679,7 +1140,7 @@ double SolarModel::interpolate_rosseland_opacity(double r) {
 }
 
 // Electron degeneracy-related functions
-double SolarModel::calc_electron_chemical_potential(double r) {
+double SolarModel::calc_electron_chemical_potential(double r) const {
   const double density_conversion = gsl_pow_3(keV2cm);
   double kBT = temperature_in_keV(r);
   struct solar_model_params params;
@@ -712,7 +1173,7 @@ double SolarModel::calc_electron_chemical_potential(double r) {
   return mu;
 }
 
-double SolarModel::electron_chemical_potential(double r) { return interp_index(7, r); }
+double SolarModel::electron_chemical_potential(double r) const { return interp_index(7, r); }
 
 // Some auxilliary functions for Primakoff rate and degeneracy calculation
 double primakoff_bracket(double t, double u) {
@@ -852,7 +1313,7 @@ double degen_wrapper_num_4(double p1, void * p) {
   return degen_wrapper_num_2(fp->ea, p);
 }
 
-std::vector<std::vector<double> > SolarModel::calc_electron_degeneracy_factor(std::vector<double> ergs, std::vector<double> all_radii) {
+std::vector<std::vector<double> > SolarModel::calc_electron_degeneracy_factor(std::vector<double> ergs, std::vector<double> all_radii) const {
   gsl_function f, g;
   struct solar_model_params params;
 
@@ -867,7 +1328,7 @@ std::vector<std::vector<double> > SolarModel::calc_electron_degeneracy_factor(st
 
   const int n = 1e4;
   std::vector<gsl_integration_workspace*> ws_vec;
-  for(int i = 0; i < 3; ++i) { ws_vec.push_back(gsl_integration_workspace_alloc(n)); }
+  for(int i = 0; i < 3; ++i) { ws_vec.push_back(acquire_qag_workspace(n)); }
   params.ws_vec = ws_vec;
 
   std::vector<double> t_r, t_e, integrals, errors;
@@ -889,154 +1350,263 @@ std::vector<std::vector<double> > SolarModel::calc_electron_degeneracy_factor(st
     }
   }
 
-  for (auto ws: ws_vec) { gsl_integration_workspace_free(ws); }
+  for (auto ws: ws_vec) { release_qag_workspace(ws); }
 
   std::vector<std::vector<double> > buffer = { t_e, t_r, integrals, errors };
   return buffer;
 }
 
-std::vector<double> SolarModel::calc_averaged_electron_degeneracy_factor(std::vector<double> radii) {
-  gsl_function f, g;
-  struct solar_model_params params;
-
-  f.function = &degen_wrapper_num_3;
-  f.params = &params;
-  g.function = &degen_wrapper_denom_2;
-  g.params = &params;
-
-  double num, num_err, denom, denom_err;
-
+std::vector<double> SolarModel::calc_averaged_electron_degeneracy_factor(std::vector<double> radii) const {
   const int n = 1e4;
-  std::vector<gsl_integration_workspace*> ws_vec;
-  for(int i = 0; i < 5; ++i) { ws_vec.push_back(gsl_integration_workspace_alloc(n)); }
-  params.ws_vec = ws_vec;
-
-  std::vector<double> valid_radii = get_supported_radii(radii);
-
-  std::vector<double> t_r, integrals, errors;
-  for(auto r = radii.begin(); r != radii.end(); ++r) {
-    params.mu = electron_chemical_potential(*r);
-    params.ks2 = kappa_squared(*r);
-    params.kBT = temperature_in_keV(*r);
-    params.wpl2 = omega_pl_squared(*r);
-    gsl_integration_qagiu(&g, 0, 0, 1.0e-4, n, ws_vec[3], &denom, &denom_err);
-    gsl_integration_qagiu(&f, 0, 0, 1.0e-4, n, ws_vec[4], &num, &num_err);
-    double res = num/denom;
-    integrals.push_back(res);
+  const int n_radii = radii.size();
+  std::vector<double> integrals (n_radii);
+  ParallelExceptionHandler exceptions;
+  #ifdef _OPENMP
+  #pragma omp parallel num_threads(get_num_threads())
+  #endif
+  {
+    // Each thread needs its own parameters, which contain the workspaces for the nested integrals
+    gsl_function f, g;
+    struct solar_model_params params;
+    f.function = &degen_wrapper_num_3;
+    f.params = &params;
+    g.function = &degen_wrapper_denom_2;
+    g.params = &params;
+    double num, num_err, denom, denom_err;
+    for(int i = 0; i < 5; ++i) { params.ws_vec.push_back(acquire_qag_workspace(n)); }
+    #ifdef _OPENMP
+    #pragma omp for schedule(dynamic)
+    #endif
+    for (int i = 0; i < n_radii; ++i) {
+      if (exceptions.has_exception()) { continue; }
+      try {
+        const double r = radii[i];
+        params.mu = electron_chemical_potential(r);
+        params.ks2 = kappa_squared(r);
+        params.kBT = temperature_in_keV(r);
+        params.wpl2 = omega_pl_squared(r);
+        gsl_integration_qagiu(&g, 0, 0, 1.0e-4, n, params.ws_vec[3], &denom, &denom_err);
+        gsl_integration_qagiu(&f, 0, 0, 1.0e-4, n, params.ws_vec[4], &num, &num_err);
+        integrals[i] = num/denom;
+      } catch (...) { exceptions.capture(); }
+    }
+    for (auto ws: params.ws_vec) { release_qag_workspace(ws); }
   }
-
-  for (auto ws: ws_vec) { gsl_integration_workspace_free(ws); }
+  exceptions.rethrow_if_any();
 
   return integrals;
 }
 
-double SolarModel::avg_degeneracy_factor(double r) { return interp_index(10, r); }
+double SolarModel::avg_degeneracy_factor(double r) const { return interp_index(10, r); }
+
+// Plasma state at radius r; N.B. The grid points and weights are the same as in opacity_table_interpolator_op and ionisationsqr_element
+void SolarModel::init_opacity_plasma_state(double r, PlasmaState &ps) const {
+  ps.r = r;
+  ps.temperature = temperature_in_keV(r);
+  ps.density = density(r);
+  ps.n_e = n_electron(r);
+  ps.opacity_correction = apply_opacity_correction_factor(r);
+  for (int k = 0; k < num_op_elements; k++) { ps.n_op_element[k] = n_element(r, op_element(k)); }
+  // Need temperature in Kelvin
+  double temperature = ps.temperature/(1.0e-3*K2eV);
+  double ite = 40.0*log10(temperature);
+  double jne = 4.0*log10(ps.n_e);
+  ps.ite2 = int(ceil(20.0*log10(temperature))*2);
+  ps.ite1 = ps.ite2 - 2;
+  ps.jne2 = int(ceil(log10(ps.n_e)*2)*2);
+  ps.jne1 = ps.jne2 - 2;
+  ps.t1 = (ite-double(ps.ite1))/2.0;
+  ps.t2 = (jne-double(ps.jne1))/2.0;
+  ps.kT_ite1 = 1.0e-3*K2eV*pow(10,double(ps.ite1)/40.0);
+  ps.kT_ite2 = 1.0e-3*K2eV*pow(10,double(ps.ite2)/40.0);
+}
+
+PlasmaState SolarModel::plasma_state(double r) const {
+  PlasmaState ps;
+  init_opacity_plasma_state(r, ps);
+  ps.z2_n = z2_n(r);
+  ps.z2_n_ff = 0;
+  for (auto iso_ind : ff_isotope_indices) { ps.z2_n_ff += z2_n_iz(r, iso_ind); }
+  // N.B. Same as kappa_squared(r), but re-using z2_n
+  ps.kappa_squared = 4.0*pi*alpha_EM*( ps.z2_n*gsl_pow_3(keV2cm)/ps.temperature + interp_index(9, r)/(pi*pi) );
+  ps.omega_pl_squared = omega_pl_squared(r);
+  ps.degeneracy_factor = avg_degeneracy_factor(r);
+  ps.bfield = bfield(r);
+  return ps;
+}
+
+
+// Energy-dependent parts of the ff, ee, and Compton rates; the radius-dependent quantities are passed as arguments.
+// N.B. "y" and "prefactor2" in aux_Gamma_ee are different from the "y_red" and "prefactor1" in aux_Gamma_ff.
+inline double aux_Gamma_ff(double omega, double temperature, double y_red, double n_e_z2_n) {
+  const double prefactor1 = (8.0*sqrt(pi)/(3.0*sqrt(2.0))) * gsl_pow_2(alpha_EM*g_aee) * gsl_pow_6(keV2cm);
+  double u = omega/temperature;
+  return prefactor1 * n_e_z2_n*exp(-u)*aux_function(u,y_red) / (omega*sqrt(temperature)*pow(m_electron,3.5));
+}
+
+inline double aux_Gamma_ee(double omega, double temperature, double y, double n_e) {
+  const double prefactor2 = (4.0*sqrt(pi)/3.0) * gsl_pow_2(alpha_EM*g_aee) * gsl_pow_6(keV2cm);
+  double u = omega/temperature;
+  return prefactor2 * gsl_pow_2(n_e) * exp(-u) * aux_function(u,y) / (omega * sqrt(temperature) * pow(m_electron,3.5));
+}
 
+inline double aux_Gamma_Compton(double omega, double temperature, double n_e) {
+  const double prefactor3 = (alpha_EM/3.0) * pow(g_aee/(m_electron),2) * pow(keV2cm,3);
+  double u = omega/temperature;
+  double v = omega/m_electron;
+  return prefactor3 * v*v*n_e/gsl_expm1(u);
+}
 
 // Calculate the free-free contribution; from Eq. (2.17) in [arXiv:1310.0823] (assuming full ionisation) for one isotope
-double SolarModel::Gamma_ff(double omega, double r, int isotope_index) {
+double SolarModel::Gamma_ff(double omega, double r, int isotope_index) const {
+  SOLAXFLUX_COUNT(COUNT_GAMMA_FF, 1);
   if (omega == 0) { return 0; }
-  const double prefactor1 = (8.0*sqrt(pi)/(3.0*sqrt(2.0))) * gsl_pow_2(alpha_EM*g_aee) * gsl_pow_6(keV2cm);
-  double u = omega/temperature_in_keV(r);
-  double y_red = sqrt(kappa_squared(r)/(2.0*m_electron*temperature_in_keV(r)));
-  return prefactor1 * n_electron(r)*z2_n_iz(r,isotope_index)*exp(-u)*aux_function(u,y_red) / (omega*sqrt(temperature_in_keV(r))*pow(m_electron,3.5));
+  double temperature = temperature_in_keV(r);
+  double y_red = sqrt(kappa_squared(r)/(2.0*m_electron*temperature));
+  return aux_Gamma_ff(omega, temperature, y_red, n_electron(r)*z2_n_iz(r,isotope_index));
 }
 // Calculate the free-free contribution; from Eq. (2.17) in [arXiv:1310.0823] (assuming full ionisation) for several isotopes
- double SolarModel::Gamma_ff(double omega, double r, std::vector<int> isotope_indices) {
+ double SolarModel::Gamma_ff(double omega, double r, std::vector<int> isotope_indices) const {
    if (omega == 0) { return 0; }
-   const double prefactor1 = (8.0*sqrt(pi)/(3.0*sqrt(2.0))) * gsl_pow_2(alpha_EM*g_aee) * gsl_pow_6(keV2cm);
-   double u = omega/temperature_in_keV(r);
-   double y_red = sqrt(kappa_squared(r)/(2.0*m_electron*temperature_in_keV(r)));
+   double temperature = temperature_in_keV(r);
+   double y_red = sqrt(kappa_squared(r)/(2.0*m_electron*temperature));
    double z2_isotopes = 0;
    for (auto it = isotope_indices.begin(); it != isotope_indices.end(); ++it) { z2_isotopes += z2_n_iz(r,*it);}
-   return prefactor1 * n_electron(r)*z2_isotopes*exp(-u)*aux_function(u,y_red) / (omega*sqrt(temperature_in_keV(r))*pow(m_electron,3.5));
+   return aux_Gamma_ff(omega, temperature, y_red, n_electron(r)*z2_isotopes);
  }
 
 // Calculate the free-free contribution; from Eq. (2.17) in [arXiv:1310.0823] (assuming full ionisation) for on isotope
 // N.B. Convenience function below (may be slow for many calls!)  (assuming full ionisation)
-double SolarModel::Gamma_ff(double omega, double r, Isotope isotope) { int isotope_index = lookup_isotope_index(isotope); return Gamma_ff(omega, r, isotope_index); }
+double SolarModel::Gamma_ff(double omega, double r, Isotope isotope) const { int isotope_index = lookup_isotope_index(isotope); return Gamma_ff(omega, r, isotope_index); }
 
 // Calculate the free-free contribution; from Eq. (2.17) in [arXiv:1310.0823] (assuming full ionisation)
-double SolarModel::Gamma_ff(double omega, double r) {
+double SolarModel::Gamma_ff(double omega, double r) const {
+  SOLAXFLUX_COUNT(COUNT_GAMMA_FF, 1);
   double result = 0;
-  const double prefactor1 = (8.0*sqrt(pi)/(3.0*sqrt(2.0))) * gsl_pow_2(alpha_EM*g_aee) * gsl_pow_6(keV2cm);
 
   if (omega > 0) {
     if (raffelt_approx == false) {
       // Assume full ionisation and only take H and He
-      static int iso_ind_1 = lookup_isotope_index({"H",1}), iso_ind_2 = lookup_isotope_index({"He",3}), iso_ind_3 = lookup_isotope_index({"He",4});
-      result = Gamma_ff(omega, r, iso_ind_1) + Gamma_ff(omega, r, iso_ind_2) + Gamma_ff(omega, r, iso_ind_3);
+      result = Gamma_ff(omega, r, ff_isotope_indices);
     } else {
       // Contributions from all elements, no full ionisation
-      double u = omega/temperature_in_keV(r);
-      double y_red = sqrt(kappa_squared(r)/(2.0*m_electron*temperature_in_keV(r)));
-      result = prefactor1 * n_electron(r)*z2_n(r)*exp(-u)*aux_function(u,y_red) / (omega*sqrt(temperature_in_keV(r))*pow(m_electron,3.5));
+      double temperature = temperature_in_keV(r);
+      double y_red = sqrt(kappa_squared(r)/(2.0*m_electron*temperature));
+      result = aux_Gamma_ff(omega, temperature, y_red, n_electron(r)*z2_n(r));
     }
   }
 
   return result;
 }
+double SolarModel::Gamma_ff(double omega, const PlasmaState &ps) const {
+  SOLAXFLUX_COUNT(COUNT_GAMMA_FF, 1);
+  if (omega > 0) {
+    double y_red = sqrt(ps.kappa_squared/(2.0*m_electron*ps.temperature));
+    return aux_Gamma_ff(omega, ps.temperature, y_red, ps.n_e*(raffelt_approx ? ps.z2_n : ps.z2_n_ff));
+  } else {
+    return 0;
+  }
+}
 
 // Calculate the e-e bremsstrahlung contribution; from Eq. (2.18) in [arXiv:1310.0823]
-double SolarModel::Gamma_ee(double omega, double r) {
-  // N.B. "y" and "prefactor2" are different from the "y_red" and "prefactor1" above.
-  const double prefactor2 = (4.0*sqrt(pi)/3.0) * gsl_pow_2(alpha_EM*g_aee) * gsl_pow_6(keV2cm);
+double SolarModel::Gamma_ee(double omega, double r) const {
+  SOLAXFLUX_COUNT(COUNT_GAMMA_EE, 1);
+  if (omega > 0) {
+    double temperature = temperature_in_keV(r);
+    double y = sqrt(kappa_squared(r)/(m_electron*temperature));
+    return aux_Gamma_ee(omega, temperature, y, n_electron(r));
+  } else {
+    return 0;
+  }
+}
+double SolarModel::Gamma_ee(double omega, const PlasmaState &ps) const {
+  SOLAXFLUX_COUNT(COUNT_GAMMA_EE, 1);
   if (omega > 0) {
-    double u = omega/temperature_in_keV(r);
-    double y = sqrt(kappa_squared(r)/(m_electron*temperature_in_keV(r)));
-    return prefactor2 * gsl_pow_2(n_electron(r)) * exp(-u) * aux_function(u,y) / (omega * sqrt(temperature_in_keV(r)) * pow(m_electron,3.5));
+    double y = sqrt(ps.kappa_squared/(m_electron*ps.temperature));
+    return aux_Gamma_ee(omega, ps.temperature, y, ps.n_e);
   } else {
     return 0;
   }
 }
 
 // Calculate the Compton contribution; from Eq. (2.19) in [arXiv:1310.0823]
-double SolarModel::Gamma_Compton(double omega, double r) {
-  const double prefactor3 = (alpha_EM/3.0) * pow(g_aee/(m_electron),2) * pow(keV2cm,3);
+double SolarModel::Gamma_Compton(double omega, double r) const {
+  SOLAXFLUX_COUNT(COUNT_GAMMA_COMPTON, 1);
+  if (omega > 0) {
+    return aux_Gamma_Compton(omega, temperature_in_keV(r), n_electron(r));
+  } else {
+    return 0;
+  }
+}
+double SolarModel::Gamma_Compton(double omega, const PlasmaState &ps) const {
+  SOLAXFLUX_COUNT(COUNT_GAMMA_COMPTON, 1);
   if (omega > 0) {
-    double u = omega/temperature_in_keV(r);
-    double v = omega/m_electron;
-    return prefactor3 * v*v*n_electron(r)/gsl_expm1(u);
+    return aux_Gamma_Compton(omega, ps.temperature, ps.n_e);
   } else {
     return 0;
   }
 }
 
 // Opacity contribution from one isotope; first term of Eq. (2.21) in [arXiv:1310.0823]
-double SolarModel::Gamma_opacity(double omega, double r, std::string element) {
+double SolarModel::Gamma_opacity(double omega, const PlasmaState &ps, op_element element) const {
+  SOLAXFLUX_COUNT(COUNT_GAMMA_OPACITY, 1);
   const double prefactor5 = 0.5*g_aee*g_aee/(4.0*pi*alpha_EM);
-  double u = omega/temperature_in_keV(r);
+  double u = omega/ps.temperature;
   double v = omega/m_electron;
-  return prefactor5*v*v*opacity_element(omega,r,element)/gsl_expm1(u);
+  return prefactor5*v*v*opacity_element(omega,ps,element)/gsl_expm1(u);
 }
+double SolarModel::Gamma_opacity(double omega, double r, op_element element) const {
+  PlasmaState ps;
+  init_opacity_plasma_state(r, ps);
+  return Gamma_opacity(omega, ps, element);
+}
+
+double SolarModel::Gamma_opacity(double omega, double r, std::string element) const { return Gamma_opacity(omega, r, lookup_op_element(element)); }
 
-double SolarModel::Gamma_opacity(double omega, double r, Isotope isotope) {
+double SolarModel::Gamma_opacity(double omega, double r, Isotope isotope) const {
   std::string element = isotope.get_element_name();
   return Gamma_opacity(omega, r, element);
 }
 
 // Full opacity contribution; first term of Eq. (2.21) in [arXiv:1310.0823]
-double SolarModel::Gamma_opacity(double omega, double r) {
+double SolarModel::Gamma_opacity(double omega, const PlasmaState &ps) const {
+  SOLAXFLUX_COUNT(COUNT_GAMMA_OPACITY, 1);
   const double prefactor5 = 0.5*g_aee*g_aee/(4.0*pi*alpha_EM);
-  double u = omega/temperature_in_keV(r);
+  double u = omega/ps.temperature;
   double v = omega/m_electron;
-  return prefactor5*v*v*opacity(omega,r)/gsl_expm1(u);
+  return prefactor5*v*v*opacity(omega,ps)/gsl_expm1(u);
+}
+double SolarModel::Gamma_opacity(double omega, double r) const {
+  PlasmaState ps;
+  init_opacity_plasma_state(r, ps);
+  return Gamma_opacity(omega, ps);
 }
 
-double SolarModel::Gamma_all_electron(double omega, double r) {
+double SolarModel::Gamma_all_electron(double omega, double r) const {
+  if (opcode == OPAS) { return Gamma_opacity(omega, r); }
+  return Gamma_all_electron(omega, plasma_state(r));
+}
+double SolarModel::Gamma_all_electron(double omega, const PlasmaState &ps) const {
   double result = 0;
   if (opcode == OP) {
     double element_contrib = 0.0;
-    static int iso_ind_1 = lookup_isotope_index({"H",1}), iso_ind_2 = lookup_isotope_index({"He",3}), iso_ind_3 = lookup_isotope_index({"He",4});
-    element_contrib += Gamma_ff(omega, r, {iso_ind_1,iso_ind_2,iso_ind_3});
-    for (int k = 2; k < num_op_elements; k++) { element_contrib += Gamma_opacity(omega, r, op_element_names[k]); }
-    result = element_contrib + Gamma_Compton(omega, r) + Gamma_ee(omega, r);
+    // N.B. Only H and He in the ff contribution; the other elements are included via the opacities
+    if (omega != 0) { element_contrib += aux_Gamma_ff(omega, ps.temperature, sqrt(ps.kappa_squared/(2.0*m_electron*ps.temperature)), ps.n_e*ps.z2_n_ff); }
+    double metals;
+    if (use_opacity_table && lookup_uncorrected_opacity(omega, ps.r, opacity_table.log_metals, metals)) {
+      const double prefactor5 = 0.5*g_aee*g_aee/(4.0*pi*alpha_EM);
+      double v = omega/m_electron;
+      element_contrib += prefactor5*v*v*metals*ps.opacity_correction/gsl_expm1(omega/ps.temperature);
+    } else {
+      for (int k = 2; k < num_op_elements; k++) { element_contrib += Gamma_opacity(omega, ps, op_element(k)); }
+    }
+    result = element_contrib + Gamma_Compton(omega, ps) + Gamma_ee(omega, ps);
   } else if ((opcode == LEDCOP) || (opcode == ATOMIC)) {
-    double u = omega/temperature_in_keV(r);
-    double reducedCompton = 0.5*(1.0 - 1.0/gsl_expm1(u)) * Gamma_Compton(omega, r);
-    result = Gamma_opacity(omega, r) + reducedCompton + Gamma_ee(omega, r);
+    double u = omega/ps.temperature;
+    double reducedCompton = 0.5*(1.0 - 1.0/gsl_expm1(u)) * Gamma_Compton(omega, ps);
+    result = Gamma_opacity(omega, ps) + reducedCompton + Gamma_ee(omega, ps);
   } else if (opcode == OPAS) {
-    result = Gamma_opacity(omega, r);
+    result = Gamma_opacity(omega, ps);
   } else {
     std::string err_msg = "Unkown option for 'opcode' argument. Use ";
     for (auto it = opacitycode_name.begin(); it != --opacitycode_name.end(); ++it) { err_msg += it->second + ", "; }; err_msg += "or " + (--opacitycode_name.end())->second + ".";
@@ -1045,18 +1615,16 @@ double SolarModel::Gamma_all_electron(double omega, double r) {
   return result;
 }
 
-double SolarModel::Gamma_Primakoff(double omega, double r) {
+// Energy-dependent part of the Primakoff rate; n_dens = (avg. degeneracy factor) x n_e + z2_n
+inline double aux_Gamma_Primakoff(double omega, double w_pl_sq, double temperature, double kappa_sq, double n_dens) {
   const double prefactor6 = g_agg*g_agg*alpha_EM*gsl_pow_3(keV2cm)/8.0;
-  double w_pl_sq = omega_pl_squared(r);
-  double z = omega/temperature_in_keV(r);
-
+  double z = omega/temperature;
   double om2 = omega*omega;
   double x = om2/w_pl_sq;
   if (x > 1.0) {
     double phase_factor = 2.0/(sqrt(1.0 - 1.0/x) * gsl_expm1(z));
-    double n_dens = avg_degeneracy_factor(r)*n_electron(r) + z2_n(r);
     double s = 2.0*omega*sqrt(om2 - w_pl_sq);
-    double t = kappa_squared(r)/s;
+    double t = kappa_sq/s;
     double u = (2.0*om2 - w_pl_sq)/s;
     double analytical_integral = primakoff_bracket(t, u);
     return prefactor6*phase_factor*n_dens*analytical_integral;
@@ -1065,13 +1633,38 @@ double SolarModel::Gamma_Primakoff(double omega, double r) {
   }
 }
 
+double SolarModel::Gamma_Primakoff(double omega, double r) const {
+  SOLAXFLUX_COUNT(COUNT_GAMMA_PRIMAKOFF, 1);
+  double w_pl_sq = omega_pl_squared(r);
+  if (omega*omega > w_pl_sq) {
+    double n_dens = avg_degeneracy_factor(r)*n_electron(r) + z2_n(r);
+    return aux_Gamma_Primakoff(omega, w_pl_sq, temperature_in_keV(r), kappa_squared(r), n_dens);
+  } else {
+    return 0;
+  }
+}
+double SolarModel::Gamma_Primakoff(double omega, const PlasmaState &ps) const {
+  SOLAXFLUX_COUNT(COUNT_GAMMA_PRIMAKOFF, 1);
+  if (omega*omega > ps.omega_pl_squared) {
+    double n_dens = ps.degeneracy_factor*ps.n_e + ps.z2_n;
+    return aux_Gamma_Primakoff(omega, ps.omega_pl_squared, ps.temperature, ps.kappa_squared, n_dens);
+  } else {
+    return 0;
+  }
+}
+
+// Damping xi^2 = gamma_L*omega of the LP resonance
+double aux_LP_xi_squared(double omega, double temperature, double opacity) {
+  double gammaL = -gsl_expm1(-omega/temperature)*opacity;
+  gammaL = std::max(gammaL, 1e-4); // to avoid numerical issues from very narrow resonances
+  return gammaL*omega;
+}
+
 double aux_Gamma_LP(double omega, double om_pl_sq, double bfield, double temperature, double opacity) {
-  static double prefactor = g_agg*g_agg;
+  const double prefactor = g_agg*g_agg;
   double om2 = omega*omega;
   double z = omega/temperature;
-  double gammaL = -gsl_expm1(-z)*opacity;
-  gammaL = std::max(gammaL, 1e-4); // to avoid numerical issues from very narrow resonances
-  double xi2 = gammaL*omega;
+  double xi2 = aux_LP_xi_squared(omega, temperature, opacity);
   double fwhm = sqrt(om2 + xi2) - sqrt(om2 - xi2); // FWHM of Lorentz/Cauchy peak
   // if (gsl_pow_2(om2 - om_pl_sq) > 100.0 * om2*gammaL*gammaL) { return 0; } //just integrate around resonance
   if (abs(omega - sqrt(om_pl_sq)) > 18.0*fwhm) { return 0; } // Just integrate around resonance
@@ -1080,7 +1673,8 @@ double aux_Gamma_LP(double omega, double om_pl_sq, double bfield, double tempera
   return prefactor * average_bfield_sq * fraction / gsl_expm1(z);
 }
 
-double SolarModel::Gamma_LP(double omega, double r) {
+double SolarModel::Gamma_LP(double omega, double r) const {
+  SOLAXFLUX_COUNT(COUNT_GAMMA_LP, 1);
   if (omega <= 0) { return 0; } // Analytical limit for omega -> 0
   double om_pl_sq = omega_pl_squared(r);
   double b = bfield(r);
@@ -1089,8 +1683,16 @@ double SolarModel::Gamma_LP(double omega, double r) {
   if (not(op > 0)) { op = opacity(temperature_in_keV(r)*0.075, r); }
   return aux_Gamma_LP(omega, om_pl_sq, b, temperature, op);
 }
+double SolarModel::Gamma_LP(double omega, const PlasmaState &ps) const {
+  SOLAXFLUX_COUNT(COUNT_GAMMA_LP, 1);
+  if (omega <= 0) { return 0; } // Analytical limit for omega -> 0
+  double op = opacity(omega, ps);
+  if (not(op > 0)) { op = opacity(ps.temperature*0.075, ps); }
+  return aux_Gamma_LP(omega, ps.omega_pl_squared, ps.bfield, ps.temperature, op);
+}
 
-double SolarModel::Gamma_LP_Rosseland(double omega, double r) {
+double SolarModel::Gamma_LP_Rosseland(double omega, double r) const {
+  SOLAXFLUX_COUNT(COUNT_GAMMA_LP, 1);
   if (omega <= 0) { return 0; } // Analytical limit for omega -> 0
   double om_pl_sq = omega_pl_squared(r);
   double b = bfield(r);
@@ -1099,6 +1701,18 @@ double SolarModel::Gamma_LP_Rosseland(double omega, double r) {
   return aux_Gamma_LP(omega, om_pl_sq, b, temperature, op);
 }
 
+double SolarModel::LP_resonance_width_squared(double omega, double r, bool use_rosseland_opacity) const {
+  double temperature = temperature_in_keV(r);
+  double op;
+  if (use_rosseland_opacity) {
+    op = interpolate_rosseland_opacity(r);
+  } else {
+    op = opacity(omega, r);
+    if (not(op > 0)) { op = opacity(temperature*0.075, r); }
+  }
+  return aux_LP_xi_squared(omega, temperature, op);
+}
+
 double aux_Gamma_TP(double omega, double om_pl_sq, double bfield, double temperature, double opacity) {
   const double photon_polarization = 2.0;
   double om2 = omega*omega;
@@ -1112,20 +1726,20 @@ double aux_Gamma_TP(double omega, double om_pl_sq, double bfield, double tempera
   return photon_polarization * deltaTsq * fraction / gsl_expm1(z);
 }
 
-double SolarModel::Gamma_TP(double omega, double r) {
-  const double geom_factor = 1.0; // factor accounting for observer's position (1.0 = angular average)
-  const double photon_polarization = 2.0;
-  if (omega_pl_squared(r) > omega*omega) { return 0; } // energy can't be lower than plasma frequency
-  double u = omega/temperature_in_keV(r);
-  double gamma = -gsl_expm1(-u)*opacity(omega, r);
-  double DeltaPsq = omega*omega * gsl_pow_2(sqrt(1-omega_pl_squared(r)/(omega*omega))-1); // transfered momentum squared
-  double average_b_field_sq = gsl_pow_2(bfield(r)) / 3.0;
-  double DeltaTsq = g_agg*g_agg * average_b_field_sq / 4.0;
-  double result = geom_factor * photon_polarization * gamma * DeltaTsq / ( (DeltaPsq+gsl_pow_2(0.5*gamma)) * gsl_expm1(u) ) ;
-  return result;
+double SolarModel::Gamma_TP(double omega, double r) const {
+  SOLAXFLUX_COUNT(COUNT_GAMMA_TP, 1);
+  double om_pl_sq = omega_pl_squared(r);
+  if (om_pl_sq > omega*omega) { return 0; } // energy can't be lower than plasma frequency
+  return aux_Gamma_TP(omega, om_pl_sq, bfield(r), temperature_in_keV(r), opacity(omega, r));
+}
+double SolarModel::Gamma_TP(double omega, const PlasmaState &ps) const {
+  SOLAXFLUX_COUNT(COUNT_GAMMA_TP, 1);
+  if (ps.omega_pl_squared > omega*omega) { return 0; } // energy can't be lower than plasma frequency
+  return aux_Gamma_TP(omega, ps.omega_pl_squared, ps.bfield, ps.temperature, opacity(omega, ps));
 }
 
-double SolarModel::Gamma_TP_Rosseland(double omega, double r) {
+double SolarModel::Gamma_TP_Rosseland(double omega, double r) const {
+  SOLAXFLUX_COUNT(COUNT_GAMMA_TP, 1);
   const double geom_factor = 1.0; // factor accounting for observer's position (1.0 = angular average)
   const double photon_polarization = 2.0;
   if (omega_pl_squared(r) > omega*omega) { return 0; } // energy can't be lower than plasma frequency
@@ -1138,78 +1752,154 @@ double SolarModel::Gamma_TP_Rosseland(double omega, double r) {
   return result;
 }
 
-double SolarModel::Gamma_plasmon(double omega, double r) { return Gamma_TP(omega, r) + Gamma_LP(omega, r); }
+double SolarModel::Gamma_plasmon(double omega, double r) const { return Gamma_TP(omega, r) + Gamma_LP(omega, r); }
+double SolarModel::Gamma_plasmon(double omega, const PlasmaState &ps) const { return Gamma_TP(omega, ps) + Gamma_LP(omega, ps); }
 
-double SolarModel::Gamma_all_photon(double omega, double r) { return Gamma_Primakoff(omega, r) + Gamma_plasmon(omega, r); }
+double SolarModel::Gamma_all_photon(double omega, double r) const { return Gamma_Primakoff(omega, r) + Gamma_plasmon(omega, r); }
+double SolarModel::Gamma_all_photon(double omega, const PlasmaState &ps) const { return Gamma_Primakoff(omega, ps) + Gamma_plasmon(omega, ps); }
 
+// Batched evaluation of the production rates for many energies at one radius
+typedef double (SolarModel::*state_rate_fn)(double, const PlasmaState&) const;
 
-// Interpolators for the various opacity codes
-// Read off interpolated elements for op, tops and opas
-double SolarModel::op_grid_interp_erg(double u, int ite, int jne, std::string element) {
-  double result = 0;
-  auto grid_position = std::make_pair(ite,jne);
-
-  if (unavailable_OP.find(grid_position) == unavailable_OP.end()) {
-    if (opacity_lin_interp_op.find(element) == opacity_lin_interp_op.end()) {
-      std::string err_msg = "OP data for element "+element+" does not exist.";
-      throw XUnsupportedOption(err_msg);
-    } else if (opacity_lin_interp_op.at(element).find(grid_position) == opacity_lin_interp_op.at(element).end()) {
-      std::string err_msg = "OP data for "+element+" at position ite = "+std::to_string(ite)+" and jne = "+std::to_string(jne)+" does not exist.";
-      throw XSanityCheck(err_msg);
+// Plasma state version of a rate (NULL if there is none); the radius-dependent quantities are then only computed once
+state_rate_fn plasma_state_rate(double (SolarModel::*rate)(double, double) const) {
+  typedef double (SolarModel::*rate_fn)(double, double) const;
+  static const std::vector<std::pair<rate_fn,state_rate_fn> > state_rates = {
+    {&SolarModel::Gamma_Primakoff, &SolarModel::Gamma_Primakoff}, {&SolarModel::Gamma_TP, &SolarModel::Gamma_TP}, {&SolarModel::Gamma_LP, &SolarModel::Gamma_LP},
+    {&SolarModel::Gamma_plasmon, &SolarModel::Gamma_plasmon}, {&SolarModel::Gamma_all_photon, &SolarModel::Gamma_all_photon}, {&SolarModel::Gamma_ff, &SolarModel::Gamma_ff},
+    {&SolarModel::Gamma_ee, &SolarModel::Gamma_ee}, {&SolarModel::Gamma_Compton, &SolarModel::Gamma_Compton}, {&SolarModel::Gamma_opacity, &SolarModel::Gamma_opacity},
+    {&SolarModel::Gamma_all_electron, &SolarModel::Gamma_all_electron} };
+  for (auto it = state_rates.begin(); it != state_rates.end(); ++it) { if (it->first == rate) { return it->second; } }
+  return NULL;
+}
+
+void SolarModel::rates(double (SolarModel::*rate)(double, double) const, const double* omegas, size_t n, double r, double* out) const {
+  state_rate_fn state_rate = plasma_state_rate(rate);
+  if (state_rate == NULL) {
+    // All other rates: use the standard routines
+    for (size_t i = 0; i < n; ++i) { out[i] = (this->*rate)(omegas[i], r); }
+  } else {
+    PlasmaState ps = plasma_state(r);
+    for (size_t i = 0; i < n; ++i) { out[i] = (this->*state_rate)(omegas[i], ps); }
+  }
+}
+
+// Batched evaluation of the production rates for one energy at many radii
+void SolarModel::rates(double (SolarModel::*rate)(double, double) const, double omega, const double* radii, size_t n, double* out) const {
+  for (size_t i = 0; i < n; ++i) { rates(rate, &omega, 1, radii[i], &out[i]); }
+}
+
+std::vector<double> SolarModel::rates(double (SolarModel::*rate)(double, double) const, const std::vector<double> &omegas, double r) const {
+  std::vector<double> result (omegas.size());
+  if (omegas.size() > 0) { rates(rate, &omegas[0], omegas.size(), r, &result[0]); }
+  return result;
+}
+
+void SolarModel::rates(const std::vector<double (SolarModel::*)(double, double) const> &channels, const double* omegas, size_t n, double r, double* out) const {
+  // N.B. The plasma state is only computed if at least one channel uses it
+  PlasmaState ps;
+  bool has_plasma_state = false;
+  for (size_t c = 0; c < channels.size(); ++c) {
+    state_rate_fn state_rate = plasma_state_rate(channels[c]);
+    if (state_rate == NULL) {
+      for (size_t i = 0; i < n; ++i) { out[c*n+i] = (this->*channels[c])(omegas[i], r); }
     } else {
-      gsl_error_handler_t* old_handler = gsl_set_error_handler (&my_gsl_handler); // error handler modified to avoid boundary error (fill value = 0)
-      result = gsl_spline_eval(opacity_lin_interp_op.at(element).at(grid_position), log(u), opacity_acc_op.at(element).at(grid_position));
-      gsl_set_error_handler (old_handler); // reset the error handler
-      if (gsl_isnan(result)) { result = 0; }
+      if (not(has_plasma_state)) { ps = plasma_state(r); has_plasma_state = true; }
+      for (size_t i = 0; i < n; ++i) { out[c*n+i] = (this->*state_rate)(omegas[i], ps); }
     }
   }
+}
+
+
+// Interpolators for the various opacity codes
+// Read off interpolated elements for op, tops and opas
+double SolarModel::op_grid_interp_erg(double u, int ite, int jne, op_element element) const {
+  int j = op_grid_index(ite, jne);
+  if (j == op_grid_unavailable) { return 0; }
+  const bool op_data_available = lazy_tables ? (opcode == OP) : (op_offsets.size() > 0);
+  if ((j == op_grid_missing) || not(op_data_available)) {
+    std::string err_msg = "OP data for "+op_element_names[element]+" at position ite = "+std::to_string(ite)+" and jne = "+std::to_string(jne)+" does not exist.";
+    throw XSanityCheck(err_msg);
+  }
+
+  // Linear interpolation in log(u); N.B. the fill value outside of the tabulated range is 0
+  const int pos = element*op_grid_size + j;
+  const double *x, *y;
+  int n;
+  if (lazy_tables) {
+    require_lazy_cell(LAZY_OP, j);
+    x = lazy_tables->op_log_u[pos].data();
+    y = lazy_tables->op_opacity[pos].data();
+    n = lazy_tables->op_log_u[pos].size();
+  } else {
+    x = op_log_u_ptr + op_offsets[pos];
+    y = op_opacity_ptr + op_offsets[pos];
+    n = op_offsets[pos+1] - op_offsets[pos];
+  }
+  double log_u = log(u);
+  if ((n < 2) || !(log_u >= x[0]) || !(log_u <= x[n-1])) { return 0; }
+  int i = std::min(int(std::upper_bound(x, x+n, log_u) - x), n-1);
+  double result = y[i-1] + (y[i]-y[i-1])*(log_u-x[i-1])/(x[i]-x[i-1]);
+  if (gsl_isnan(result)) { return 0; }
   return result;
 }
+// N.B. Convenience function below (slower due to the name lookup)
+double SolarModel::op_grid_interp_erg(double u, int ite, int jne, std::string element) const { return op_grid_interp_erg(u, ite, jne, lookup_op_element(element)); }
 
-double SolarModel::tops_grid_interp_erg(double erg, float t, float rho) {
+double SolarModel::tops_grid_interp_erg(double erg, float t, float rho) const {
   double result = 0;
   auto key = std::make_pair(t,rho);
+  if (lazy_tables) {
+    auto it = lazy_tables->tops_index.find(key);
+    if (it != lazy_tables->tops_index.end()) {
+      require_lazy_cell(LAZY_TOPS, it->second);
+      int status = eval_interp(lazy_tables->tops_interp[it->second], lazy_tables->tops_acc[it->second], erg, &result);
+      if ((status != GSL_SUCCESS) || gsl_isnan(result)) { return 0; }
+      return result;
+    }
+  }
   if (opacity_lin_interp_tops.find(key) == opacity_lin_interp_tops.end()) {
     std::string err_msg = "TOPS grid data at position t = "+std::to_string(t)+" and rho = "+std::to_string(rho)+" does not exist.";
     throw XSanityCheck(err_msg);
   } else {
-    gsl_error_handler_t* old_handler = gsl_set_error_handler(&my_gsl_handler); // GSL error handler modified to avoid boundary error (fill value = 0)
-    result = gsl_spline_eval(opacity_lin_interp_tops.at(key), erg, opacity_acc_tops.at(key));
-    gsl_set_error_handler(old_handler); // reset the GSL error handler
-    if (gsl_isnan(result)) { return 0; }
+    // N.B. Boundary errors are not passed to the GSL error handler but are caught here (fill value = 0)
+    int status = eval_interp(opacity_lin_interp_tops.at(key), opacity_acc_tops.at(key), erg, &result);
+    if ((status != GSL_SUCCESS) || gsl_isnan(result)) { return 0; }
   }
   return result;
 }
 
-double SolarModel::opas_grid_interp_erg(double erg, double r) {
+double SolarModel::opas_grid_interp_erg(double erg, double r) const {
+  if (lazy_tables) {
+    auto it = lazy_tables->opas_index.find(r);
+    if (it != lazy_tables->opas_index.end()) {
+      require_lazy_cell(LAZY_OPAS, it->second);
+      double result;
+      int status = eval_interp(lazy_tables->opas_interp[it->second], lazy_tables->opas_acc[it->second], erg, &result);
+      if ((status != GSL_SUCCESS) || (gsl_isnan(result) == true)) { return 0; }
+      return result;
+    }
+  }
   if (opacity_lin_interp_opas.find(r) == opacity_lin_interp_opas.end()) {
     std::string err_msg = "OPAS data at position R = "+std::to_string(r)+" does not exist.";
     throw XSanityCheck(err_msg);
   }
 
-  gsl_error_handler_t* old_handler = gsl_set_error_handler (&my_gsl_handler); // GSL error handler modified to avoid boundary error (fill value = 0)
-  double result = gsl_spline_eval(opacity_lin_interp_opas.at(r), erg, opacity_acc_opas.at(r));
-  gsl_set_error_handler (old_handler); // reset the GSL error handler
-  if (gsl_isnan(result) == true) { return 0; }
+  // N.B. Boundary errors are not passed to the GSL error handler but are caught here (fill value = 0)
+  double result;
+  int status = eval_interp(opacity_lin_interp_opas.at(r), opacity_acc_opas.at(r), erg, &result);
+  if ((status != GSL_SUCCESS) || (gsl_isnan(result) == true)) { return 0; }
   return result;
 }
 
 // Logarithmic interpolation on solar grid (used for all codes)
-double SolarModel::opacity_table_interpolator_op(double omega, double r, std::string element) {
-  // Need temperature in Kelvin
-  double temperature = temperature_in_keV(r)/(1.0e-3*K2eV);
-  double ne = n_electron(r);
-  double ite = 40.0*log10(temperature);
-  double jne = 4.0*log10(ne);
-  int ite2 = int(ceil(20.0*log10(temperature))*2);
-  int ite1 = ite2 - 2;
+double SolarModel::opacity_table_interpolator_op(double omega, const PlasmaState &ps, op_element element) const {
+  SOLAXFLUX_COUNT(COUNT_OPACITY_LOOKUPS, 1);
   // Need omega in Kelvin
-  double u1 = omega/(1.0e-3*K2eV*pow(10,double(ite1)/40.0));
-  double u2 = omega/(1.0e-3*K2eV*pow(10,double(ite2)/40.0));
-  int jne2 = int(ceil(log10(ne)*2)*2);
-  int jne1 = jne2 - 2;
-  double t1 = (ite-double(ite1))/2.0;
-  double t2 = (jne-double(jne1))/2.0;
+  double u1 = omega/ps.kT_ite1;
+  double u2 = omega/ps.kT_ite2;
+  double t1 = ps.t1, t2 = ps.t2;
+  int ite1 = ps.ite1, ite2 = ps.ite2, jne1 = ps.jne1, jne2 = ps.jne2;
   double result = pow(pow(op_grid_interp_erg(u1,ite1,jne1,element),1.0-t2)*pow(op_grid_interp_erg(u1,ite1,jne2,element),t2),1.0-t1)*  pow(pow(op_grid_interp_erg(u2,ite2,jne1,element),1.0-t2)*pow(op_grid_interp_erg(u2,ite2,jne2,element),t2),t1);
   if (result < 0) {
     std::string err_msg = "Negative opacity from SolarModel::opacity_table_interpolator_op.";
@@ -1217,20 +1907,17 @@ double SolarModel::opacity_table_interpolator_op(double omega, double r, std::st
   }
   return result;
 }
+double SolarModel::opacity_table_interpolator_op(double omega, double r, op_element element) const {
+  PlasmaState ps;
+  init_opacity_plasma_state(r, ps);
+  return opacity_table_interpolator_op(omega, ps, element);
+}
+double SolarModel::opacity_table_interpolator_op(double omega, double r, std::string element) const { return opacity_table_interpolator_op(omega, r, lookup_op_element(element)); }
 
 //  double logarithmic interpolation for all ionisations
-double SolarModel::ionisationsqr_element(double r, std::string element) {
-  // Need temperature in Kelvin
-  double temperature = temperature_in_keV(r)/(1.0e-3*K2eV);
-  double ne = n_electron(r);
-  double ite = 40.0*log10(temperature);
-  double jne = 4.0*log10(ne);
-  int ite2 = int(ceil(20.0*log10(temperature))*2);
-  int ite1 = ite2 - 2;
-  int jne2 = int(ceil(log10(ne)*2)*2);
-  int jne1 = jne2 - 2;
-  double t1 = (ite-double(ite1))/2.0;
-  double t2 = (jne-double(jne1))/2.0;
+double SolarModel::ionisationsqr_element(const PlasmaState &ps, op_element element) const {
+  double t1 = ps.t1, t2 = ps.t2;
+  int ite1 = ps.ite1, ite2 = ps.ite2, jne1 = ps.jne1, jne2 = ps.jne2;
   double result = pow(pow(ionisationsqr_grid(ite1,jne1,element),1.0-t2)*pow(ionisationsqr_grid(ite1,jne2,element),t2),1.0-t1)*  pow(pow(ionisationsqr_grid(ite2,jne1,element),1.0-t2)*pow(ionisationsqr_grid(ite2,jne2,element),t2),t1);
   if (result < 0) {
     std::string err_msg = "Negative ionisation.";
@@ -1238,9 +1925,16 @@ double SolarModel::ionisationsqr_element(double r, std::string element) {
   }
   return result;
 }
+double SolarModel::ionisationsqr_element(double r, op_element element) const {
+  PlasmaState ps;
+  init_opacity_plasma_state(r, ps);
+  return ionisationsqr_element(ps, element);
+}
+double SolarModel::ionisationsqr_element(double r, std::string element) const { return ionisationsqr_element(r, lookup_op_element(element)); }
 
 
-double SolarModel::opacity_table_interpolator_tops(double omega, double r) {
+double SolarModel::opacity_table_interpolator_tops(double omega, double r) const {
+  SOLAXFLUX_COUNT(COUNT_OPACITY_LOOKUPS, 1);
   double temperature = temperature_in_keV(r);
   double rho = density(r);
   int lenT = tops_temperatures.size();
@@ -1272,7 +1966,8 @@ double SolarModel::opacity_table_interpolator_tops(double omega, double r) {
   return result;
 }
 
-double SolarModel::opacity_table_interpolator_opas(double omega, double r) {
+double SolarModel::opacity_table_interpolator_opas(double omega, double r) const {
+  SOLAXFLUX_COUNT(COUNT_OPACITY_LOOKUPS, 1);
   if (r > opas_radii.back()) {return 0;}
   int lenR = opas_radii.size();
   double Rlow, Rup;
@@ -1297,41 +1992,152 @@ double SolarModel::opacity_table_interpolator_opas(double omega, double r) {
 }
 
 // Read off ionisation states
-double SolarModel::ionisationsqr_grid(int ite, int jne, std::string element) {
+double SolarModel::ionisationsqr_grid(int ite, int jne, op_element element) const {
   double result = 0.0;
-  auto grid_position = std::make_pair(ite,jne);
-  if (unavailable_OP.find(grid_position) == unavailable_OP.end()) {
-    if (element_ionisationsqr.find(grid_position) == element_ionisationsqr.end()) {
-        std::cout << "WARNING. OP Ionisation data for " << element << " at position ite = " << ite << " and jne = " << jne << " does not exist."  << std::endl;
-    } else if (element_ionisationsqr.at(grid_position).find(element) == element_ionisationsqr.at(grid_position).end()) {
-      std::string err_msg = "OP ionisation data for element "+element+" does not exist.";
-      throw XUnsupportedOption(err_msg);
+  int j = op_grid_index(ite, jne);
+  if (j != op_grid_unavailable) {
+    if ((j == op_grid_missing) || (not(lazy_tables) && (op_ionisationsqr.size() == 0))) {
+        std::cout << "WARNING. OP Ionisation data for " << op_element_names[element] << " at position ite = " << ite << " and jne = " << jne << " does not exist."  << std::endl;
+    } else if (lazy_tables) {
+      require_lazy_cell(LAZY_IONISATION, j);
+      result = lazy_tables->ionisationsqr[element*op_grid_size + j];
+      if (gsl_isnan(result) == true) { return 0; }
     } else  {
-      result = element_ionisationsqr.at(grid_position).at(element);
+      result = op_ionisationsqr[element*op_grid_size + j];
       if (gsl_isnan(result) == true) { return 0; }
     }
   }
   return result;
 }
+// N.B. Convenience function below (slower due to the name lookup)
+double SolarModel::ionisationsqr_grid(int ite, int jne, std::string element) const { return ionisationsqr_grid(ite, jne, lookup_op_element(element)); }
+
+// Lazy loading of the opacity and ionisation tables; the cells are given by their position in op_grid (ionisation, OP), tops_grid, or opas_radii
+void SolarModel::load_lazy_cells(int table, const std::vector<int> &cells) const {
+  SOLAXFLUX_TIMER(timer, "SolarModel: lazy table loading");
+  LazyTables &lt = *lazy_tables;
+  std::lock_guard<std::mutex> lock (lt.mutex);
+  std::vector<int> missing;
+  for (auto j : cells) { if (not(lt.loaded[table][j].load(std::memory_order_relaxed))) { missing.push_back(j); } }
+  const int n = missing.size();
+  if (n == 0) { return; }
+
+  std::vector<std::string> filenames;
+  if (table == LAZY_OP) {
+    for (int k = 0; k < num_op_elements; k++) {
+      for (auto j : missing) { filenames.push_back(op_table_file(lt.path_to_data, op_element_names[k], j)); }
+    }
+  } else {
+    for (auto j : missing) {
+      if (table == LAZY_IONISATION) { filenames.push_back(ionisation_table_file(lt.path_to_data, j)); }
+      if (table == LAZY_TOPS) { filenames.push_back(tops_table_file(lt.path_to_data, get_opacitycode_name(), tops_grid[j][0], tops_grid[j][1])); }
+      if (table == LAZY_OPAS) { filenames.push_back(opas_table_file(lt.path_to_data, opas_radii[j])); }
+    }
+  }
+  std::vector<ASCIItableReader> all_data = read_ascii_tables(filenames);
+
+  for (int i = 0; i < n; ++i) {
+    const int j = missing[i];
+    if (table == LAZY_IONISATION) {
+      ASCIItableReader &ion_data = all_data[i];
+      ion_data.setcolnames("atomic number", "ionisation", "ionisationsqr");
+      for (int k = 0; k < num_op_elements; k++) { lt.ionisationsqr[k*op_grid_size+j] = ion_data["ionisationsqr"][k]; }
+    } else if (table == LAZY_OP) {
+      for (int k = 0; k < num_op_elements; k++) {
+        const ASCIItableReader &op_data = all_data[k*n+i];
+        lt.op_log_u[k*op_grid_size+j] = op_data[0];
+        lt.op_opacity[k*op_grid_size+j] = op_data[1];
+      }
+    } else {
+      const ASCIItableReader &opacity_data = all_data[i];
+      const size_t pts = opacity_data[0].size();
+      gsl_interp_accel* &acc = (table == LAZY_TOPS) ? lt.tops_acc[j] : lt.opas_acc[j];
+      gsl_spline* &interp = (table == LAZY_TOPS) ? lt.tops_interp[j] : lt.opas_interp[j];
+      acc = gsl_interp_accel_alloc();
+      interp = gsl_spline_alloc(gsl_interp_linear, pts);
+      gsl_spline_init(interp, &opacity_data[0][0], &opacity_data[1][0], pts);
+    }
+    lt.loaded[table][j].store(true, std::memory_order_release);
+  }
+}
+
+void SolarModel::require_lazy_cell(int table, int cell) const {
+  if (not(lazy_tables->loaded[table][cell].load(std::memory_order_acquire))) { load_lazy_cells(table, std::vector<int> (1, cell)); }
+}
+
+// Read the cells needed for all radii r <= r_max of the solar model (ionisation tables and, if needed, the opacity tables)
+void SolarModel::preload_lazy_cells(double r_max, bool uses_opacities) const {
+  std::vector<double> radii;
+  for (auto r : data["radius"]) { if (r <= r_max) { radii.push_back(r); } }
+  std::set<int> op_cells;
+  for (auto r : radii) {
+    PlasmaState ps;
+    init_opacity_plasma_state(r, ps);
+    const int ites [2] = { ps.ite1, ps.ite2 }, jnes [2] = { ps.jne1, ps.jne2 };
+    for (int a = 0; a < 2; a++) {
+      for (int b = 0; b < 2; b++) {
+        int j = op_grid_index(ites[a], jnes[b]);
+        if (j >= 0) { op_cells.insert(j); }
+      }
+    }
+  }
+  std::vector<int> cells (op_cells.begin(), op_cells.end());
+  load_lazy_cells(LAZY_IONISATION, cells);
+  if (not(uses_opacities)) { return; }
+  if (opcode == OP) {
+    load_lazy_cells(LAZY_OP, cells);
+  } else {
+    // N.B. For TOPS and OPAS, evaluating the interpolators loads the required cells; errors are raised when the opacities are actually used
+    for (auto r : radii) {
+      try {
+        if (opcode == OPAS) { opacity_table_interpolator_opas(1.0, r); } else { opacity_table_interpolator_tops(1.0, r); }
+      } catch (XSanityCheck &e) {}
+    }
+  }
+}
+
+bool SolarModel::uses_lazy_table_loading() const { return bool(lazy_tables); }
+
+bool SolarModel::uses_raffelt_approx() const { return raffelt_approx; }
+
+TableLoading lazy_table_loading(std::vector<SolarModelMemberFn> channels, double r_max) {
+  // Channels that need the opacity tables
+  const std::vector<SolarModelMemberFn> opacity_channels = { static_cast<SolarModelMemberFn>(&SolarModel::Gamma_opacity), static_cast<SolarModelMemberFn>(&SolarModel::Gamma_all_electron),
+    static_cast<SolarModelMemberFn>(&SolarModel::Gamma_TP), static_cast<SolarModelMemberFn>(&SolarModel::Gamma_LP), static_cast<SolarModelMemberFn>(&SolarModel::Gamma_plasmon),
+    static_cast<SolarModelMemberFn>(&SolarModel::Gamma_all_photon) };
+  bool uses_opacities = false;
+  for (auto channel : channels) { uses_opacities = uses_opacities || (std::find(opacity_channels.begin(), opacity_channels.end(), channel) != opacity_channels.end()); }
+  return TableLoading(true, uses_opacities, r_max);
+}
 
 // Flux from nuclear transitions 
-double SolarModel::Gamma_nuclear(double omega, double r, Nucleartransition trans) {
+// Energy-integrated emission of the line, int domega omega^2 Gamma_nuclear(omega, r)/(2 pi^2), and its Doppler width
+double SolarModel::nuclear_line_emissivity(double r, Nucleartransition trans) const {
   double convfac = gsl_pow_3(keV2cm) * hbar *1.0e6;
   double z = exp(- trans.energy / temperature_in_keV(r));
   double w1 = (2.0 * trans.excitedJ + 1.0) * z / ((2.0 * trans.groundJ + 1.0) + (2.0 * trans.excitedJ + 1.0) * z);
   double nIsotope = n_element(r, trans.element) * trans.isotope_fraction; //
   if (nIsotope == 0) { nIsotope =  trans.nperrho * density(r); } // compensates for solar models which don't track the element in question
   double Na = nIsotope * w1 / trans.tau * trans.atogammaratio(); // axion emission rate per volume
-  double sigma = trans.energy * sqrt(temperature_in_keV(r) / (trans.nuclmass * atomic_mass_unit * 1.0e6)); // Doppler width
-  double result = convfac;
+  return convfac * Na;
+}
+
+double SolarModel::nuclear_line_doppler_width(double r, Nucleartransition trans) const {
+  return trans.energy * sqrt(temperature_in_keV(r) / (trans.nuclmass * atomic_mass_unit * 1.0e6));
+}
+
+double SolarModel::Gamma_nuclear(double omega, double r, Nucleartransition trans) const {
+  SOLAXFLUX_COUNT(COUNT_GAMMA_FE57, 1);
+  double sigma = nuclear_line_doppler_width(r, trans);
+  double result = nuclear_line_emissivity(r, trans);
   result *= gsl_pow_3(2.0 * pi) / (4.0 * pi * omega*omega); // to compensate for phase space factor introduced in calculate_spectral_flux
-  result *= Na / (sqrt(2.0 * pi) * sigma) * exp(- gsl_pow_2(omega - trans.energy)/ (2.0 * sigma * sigma));
+  result *= 1.0 / (sqrt(2.0 * pi) * sigma) * exp(- gsl_pow_2(omega - trans.energy)/ (2.0 * sigma * sigma));
   return result;
 }
 
 //flux from nuclear transitions  CAST Version (Fe mass fraction not radius dependent)
 /*
-double SolarModel::Gamma_nuclear(double omega, double r, Nucleartransition trans) {
+double SolarModel::Gamma_nuclear(double omega, double r, Nucleartransition trans) const {
     double convfac = gsl_pow_3(keV2cm) * hbar *1.0E+6;
     double z = exp(- trans.energy / temperature_in_keV(r));
     double w1 = (2.0 * trans.excitedJ + 1.0) * z / ((2.0 * trans.groundJ + 1.0) + (2.0 * trans.excitedJ + 1.0) * z);
@@ -1345,7 +2151,7 @@ double SolarModel::Gamma_nuclear(double omega, double r, Nucleartransition trans
 }
 */
 
-double SolarModel::Gamma_Fe57(double omega, double r) { return Gamma_nuclear(omega, r, fe57trans); }
+double SolarModel::Gamma_Fe57(double omega, double r) const { return Gamma_nuclear(omega, r, fe57trans); }
 
 
 // TODO: Utilise this + the new typedef in later versions?
@@ -1366,6 +2172,18 @@ SolarModelMemberFn get_SolarModel_function_pointer(std::string interaction_name)
   return integrand;
 }
 
+std::string get_SolarModel_function_name(SolarModelMemberFn integrand) {
+  for (auto& x: map_interaction_name_to_function) { if (x.second == integrand) { return x.first; } }
+  if (integrand == &SolarModel::Gamma_Fe57) { return "Fe57"; }
+  return "other";
+}
+
+std::string get_SolarModel_function_names(const std::vector<SolarModelMemberFn> &integrands) {
+  std::string result = "";
+  for (auto it = integrands.begin(); it != integrands.end(); ++it) { result += ((it == integrands.begin()) ? "" : "+")+get_SolarModel_function_name(*it); }
+  return result;
+}
+
 // Metadata and information
 
 // Save all solar model data relevant for axion computations.
@@ -1398,11 +2216,11 @@ void SolarModel::save_solar_model_data(std::string output_file_root, std::vector
   save_to_file(output_file_root+"_opacities.dat", buffer_2, comment_2);
 }
 
-double SolarModel::get_r_lo() { return r_lo; }
+double SolarModel::get_r_lo() const { return r_lo; }
 
-double SolarModel::get_r_hi() { return r_hi; }
+double SolarModel::get_r_hi() const { return r_hi; }
 
-std::vector<double> SolarModel::get_supported_radii(std::vector<double> radii) {
+std::vector<double> SolarModel::get_supported_radii(std::vector<double> radii) const {
   std::vector<double> supported_radii;
   auto it = std::min_element(radii.begin(), radii.end());
   double rad_min = *it;
@@ -1416,15 +2234,15 @@ std::vector<double> SolarModel::get_supported_radii(std::vector<double> radii) {
 
 std::vector<double> SolarModel::get_all_radii() { return data["radius"]; }
 
-double SolarModel::get_gagg_ref_value_in_inverse_GeV() { return 1.0e6*g_agg; }
+double SolarModel::get_gagg_ref_value_in_inverse_GeV() const { return 1.0e6*g_agg; }
 
-double SolarModel::get_gaee_ref_value() { return g_aee; }
+double SolarModel::get_gaee_ref_value() const { return g_aee; }
 
-std::string SolarModel::get_solaxlib_name_and_version() { return LIBRARY_NAME; }
+std::string SolarModel::get_solaxlib_name_and_version() const { return LIBRARY_NAME; }
 
-std::string SolarModel::get_solar_model_name() { return solar_model_name; }
+std::string SolarModel::get_solar_model_name() const { return solar_model_name; }
 
-std::string SolarModel::get_opacitycode_name() { return opacitycode_name.at(opcode); }
+std::string SolarModel::get_opacitycode_name() const { return opacitycode_name.at(opcode); }
 
 void SolarModel::set_bfields(double b_rad, double b_tach, double b_outer) {
   bfield_rad_T = b_rad;
@@ -1432,19 +2250,23 @@ void SolarModel::set_bfields(double b_rad, double b_tach, double b_outer) {
   bfield_outer_T = b_outer;
 }
 
-std::vector<double> SolarModel::get_bfields() {
+std::vector<double> SolarModel::get_bfields() const {
   std::vector<double> result = { bfield_rad_T, bfield_tach_T, bfield_outer_T };
   return result;
 }
 
 void SolarModel::set_opacity_correction(double a, double b) { opacity_correction_a = a; opacity_correction_b = b; }
 
-std::vector<double> SolarModel::get_opacity_correction() {
+std::vector<double> SolarModel::get_opacity_correction() const {
   std::vector<double> result = { opacity_correction_a, opacity_correction_b };
   return result;
 }
 
-bool SolarModel::is_initialised() { return initialisation_status; }
+bool SolarModel::is_initialised() const { return initialisation_status; }
+
+void SolarModel::set_thread_safe_evaluation(bool thread_safe) { thread_safe_evaluation.store(thread_safe); }
+
+bool SolarModel::is_thread_safe() const { return thread_safe_evaluation.load(); }
 
 std::string standard_header(SolarModel *s) {
   double g_ag = s->get_gagg_ref_value_in_inverse_GeV();
@@ -3,6 +3,10 @@
 
 #include "spectral_flux.hpp"
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 /////////////////////////////////////////////////////
 //  Integration routines for the solar axion flux  //
 /////////////////////////////////////////////////////
@@ -18,28 +22,60 @@ double r_integrand_1d(double r, void * params) {
   return 2.0 * gsl_pow_2(0.5*erg*r/pi) * (s->*(p1->integrand))(erg, r); // N.B. Factor of 2 from integration over theta angle.
 }
 
+// Settings for the treatment of the LP resonance in the 1D integrals
+static lp_resonance_integration lp_resonance_integration_setting = LP_RESONANCE_BREAKPOINT;
+
+void set_lp_resonance_integration(lp_resonance_integration mode) { lp_resonance_integration_setting = mode; }
+
+lp_resonance_integration get_lp_resonance_integration() { return lp_resonance_integration_setting; }
+
+// Integrand in theta = atan((omega^2 - omega_pl^2(r))/xi^2), where the Lorentzian LP resonance is (almost) flat
+double lp_resonance_theta_integrand(double theta, void * params) {
+  struct lp_resonance_integration_params * p = (struct lp_resonance_integration_params *)params;
+  double t = tan(theta);
+  double dr_dwpl2;
+  double r = p->p->s->r_from_omega_pl_squared(p->erg2 - p->xi2*t, &dr_dwpl2);
+  if (dr_dwpl2 == 0) { return 0; }
+  return r_integrand_1d(r, p->p) * std::abs(dr_dwpl2) * p->xi2 * (1.0 + t*t);
+}
+
 double erg_integrand_1d(double erg, void * params) {
   double result, error;
   struct solar_model_integration_parameters_1d * p2 = (struct solar_model_integration_parameters_1d *)params;
   p2->erg = erg;
 
-  if ((p2->integrand == &SolarModel::Gamma_LP) || (p2->integrand == &SolarModel::Gamma_LP_Rosseland)) {
+  const bool rosseland = (p2->integrand == &SolarModel::Gamma_LP_Rosseland);
+  if ((p2->integrand == static_cast<SolarModelMemberFn>(&SolarModel::Gamma_LP)) || rosseland) {
       std::vector<double> radii;
       double res = p2->s->r_from_omega_pl(erg);
       double low = p2->s->get_r_lo();
       double high = std::min(p2->s->get_r_hi(), 0.98);  // 0.99 maximum set by hand to avoid missing opacity data
-      if ((res > low) && (res < high)) {
-        radii = { low, res , high };
+      if ((res > low) && (res < high) && (lp_resonance_integration_setting == LP_RESONANCE_SUBSTITUTION)) {
+        // N.B. The rate vanishes away from the resonance (see aux_Gamma_LP), s.t. the theta interval covers the full support within [low, high]
+        lp_resonance_integration_params q = { p2, erg*erg, p2->s->LP_resonance_width_squared(erg, res, rosseland) };
+        double x_lo = std::max(p2->s->omega_pl_squared(high), q.erg2 - lp_resonance_window*q.xi2);
+        double x_hi = std::min(p2->s->omega_pl_squared(low), q.erg2 + lp_resonance_window*q.xi2);
+        gsl_function f;
+        f.function = &lp_resonance_theta_integrand;
+        f.params = &q;
+        integrate_qag(&f, atan((q.erg2 - x_hi)/q.xi2), atan((q.erg2 - x_lo)/q.xi2), int_abs_prec_1d, int_rel_prec_1d, int_method_1d, p2->w, &result, &error);
       } else {
-        radii = { low, high };
+        if ((res > low) && (res < high)) {
+          radii = { low, res , high };
+        } else {
+          radii = { low, high };
+        }
+        integrate_qagp(p2->f, &radii[0], radii.size(), int_abs_prec_1d, int_rel_prec_1d, p2->w, &result, &error);
       }
-      gsl_integration_qagp(p2->f, &radii[0], radii.size(), int_abs_prec_1d, int_rel_prec_1d, int_space_size_1d, p2->w, &result, &error);}
+  }
 
   else {
-  gsl_integration_qag(p2->f, p2->s->get_r_lo(), p2->s->get_r_hi(), int_abs_prec_1d, int_rel_prec_1d, int_space_size_1d, int_method_1d, p2->w, &result, &error);
+  integrate_qag(p2->f, p2->s->get_r_lo(), p2->s->get_r_hi(), int_abs_prec_1d, int_rel_prec_1d, int_method_1d, p2->w, &result, &error);
   //gsl_integration_qagp(p2->f, &radii[0], radii.size(), int_abs_prec_1d, int_rel_prec_1d, int_space_size_1d, p2->w, &result, &error);
   //gsl_integration_qags(p2->f, p2->s->get_r_lo(), 0.9, int_abs_prec_1d, int_rel_prec_1d, int_space_size_1d, p2->w, &result, &error);
   }
+  SOLAXFLUX_COUNT(COUNT_QAG_CALLS, 1);
+  SOLAXFLUX_COUNT(COUNT_QAG_INTERVALS, p2->w->size);
 
   return result;
 }
@@ -65,6 +101,8 @@ double rho_integrand_2d(double rho, void * params) {
   //gsl_integration_qag(&f2, rho, p2->s->get_r_hi(), 0.01*int_abs_prec_2d, 0.01*int_rel_prec_2d, int_space_size_2d, int_method_2d, p2->w1, &result, &error);
   //gsl_integration_qags(&f2, rho, p2->s->get_r_hi(), 0.1*int_abs_prec_2d, 0.1*int_rel_prec_2d, int_space_size_2d, p2->w1, &result, &error);
   gsl_integration_cquad(p2->f2, rho, 0.999999999*p2->s->get_r_hi(), 0.1*int_abs_prec_2d, 0.1*int_rel_prec_2d, p2->w2, &result, &error, &n_evals);
+  SOLAXFLUX_COUNT(COUNT_CQUAD_CALLS, 1);
+  SOLAXFLUX_COUNT(COUNT_CQUAD_EVALS, n_evals);
   //auto t2 = std::chrono::high_resolution_clock::now();
 
   result *= rho;
@@ -79,54 +117,394 @@ double erg_integrand_2d(double erg, void * params) {
   size_t n_evals;
 
   gsl_integration_cquad(p1->f1, p1->rho_0, p1->rho_1, int_abs_prec_2d, int_rel_prec_2d, p1->w1, &result, &error, &n_evals);
+  SOLAXFLUX_COUNT(COUNT_CQUAD_CALLS, 1);
+  SOLAXFLUX_COUNT(COUNT_CQUAD_EVALS, n_evals);
   return result;
 }
 
-std::vector<std::vector<double> > calculate_d2Phi_a_domega_drho(std::vector<double> ergs, std::vector<double> rhos, SolarModel &s, double (SolarModel::*integrand)(double, double), std::string saveas) {
-  std::vector<double> all_ergs, all_radii, results;
-
-  gsl_integration_cquad_workspace * w2 = gsl_integration_cquad_workspace_alloc(int_space_size_2d_cquad);
+// Per-thread parameters and workspaces for the integration routines (the workspaces are taken from the pool of the thread)
+integration_worker_1d::integration_worker_1d(SolarModel* s, double (SolarModel::*integrand)(double, double) const) {
+  w = acquire_qag_workspace(int_space_size_1d);
+  // N.B. The fully 2D integral in rho and r effectively reduces to the 1D integral in r, Eq. (2.42) in [arXiv:2101.08789]
+  f.function = &r_integrand_1d;
+  p = { 0.0, s, integrand, &f, w };
+  f.params = &p;
+}
 
-  std::vector<double> valid_rhos = s.get_supported_radii(rhos);
+integration_worker_1d::~integration_worker_1d() { release_qag_workspace(w); }
 
-  gsl_function f2;
+integration_worker_2d::integration_worker_2d(SolarModel* s, double (SolarModel::*integrand)(double, double) const) {
+  w1 = acquire_cquad_workspace(int_space_size_2d_cquad);
+  w2 = acquire_cquad_workspace(int_space_size_2d_cquad);
+  f1.function = &rho_integrand_2d;
   f2.function = &r_integrand_2d;
-  solar_model_integration_parameters_2d p { 0.0, 0.0, 0.0, 0.0, &s, integrand, NULL, NULL, &f2, w2 };
+  p = { 0.0, 0.0, 0.0, 0.0, s, integrand, &f1, w1, &f2, w2 };
+  f1.params = &p;
   f2.params = &p;
+}
+
+integration_worker_2d::~integration_worker_2d() {
+  release_cquad_workspace(w1);
+  release_cquad_workspace(w2);
+}
+
+// Settings for the integration engine of the 2D disc integrals
+static integration_engine integration_engine_setting = ADAPTIVE_INTEGRATION;
+static int fixed_order_panels_setting = 50;
+
+void set_integration_engine(integration_engine engine, int n_panels) {
+  if (n_panels < 1) { throw XSanityCheck("The number of panels for the fixed-order integration must be positive."); }
+  integration_engine_setting = engine;
+  fixed_order_panels_setting = n_panels;
+}
+
+integration_engine get_integration_engine() { return integration_engine_setting; }
+
+int get_fixed_order_panels() { return fixed_order_panels_setting; }
+
+bool supports_fixed_order_integration(double (SolarModel::*integrand)(double, double) const) {
+  const std::vector<SolarModelMemberFn> unsupported = { &SolarModel::Gamma_LP, &SolarModel::Gamma_LP_Rosseland, &SolarModel::Gamma_plasmon, &SolarModel::Gamma_all_photon, &SolarModel::Gamma_Fe57 };
+  return std::find(unsupported.begin(), unsupported.end(), integrand) == unsupported.end();
+}
+
+// Nodes (positive half incl. 0) and weights of the 15-point Gauss-Kronrod rule and the embedded 7-point Gauss rule (same as QUADPACK/GSL)
+const double gk15_nodes [8] = { 0.991455371120812639206854697526329, 0.949107912342758524526189684047851, 0.864864423359769072789712788640926, 0.741531185599394439863864773280788,
+                                0.586087235467691130294144845693013, 0.405845151377397166906606412076961, 0.207784955007898467600689403773245, 0.000000000000000000000000000000000 };
+const double gk15_weights_kronrod [8] = { 0.022935322010529224963732008058970, 0.063092092629978553290700663189204, 0.104790010322250183839876322541518, 0.140653259715525918745189590510238,
+                                          0.169004726639267902826583426598550, 0.190350578064785409913256402421014, 0.204432940075298892414161999234649, 0.209482141084727828012999174891714 };
+const double gk15_weights_gauss [8] = { 0.0, 0.129484966168869693270611432679082, 0.0, 0.279705391489276667901467771423780, 0.0, 0.381830050505118944950369775488975, 0.0, 0.417959183673469387755102040816327 };
+
+fixed_order_rule gauss_kronrod_rule(std::vector<double> breakpoints, bool sqrt_substitution) {
+  fixed_order_rule rule;
+  rule.n_panels = 0;
+  std::sort(breakpoints.begin(), breakpoints.end());
+  for (size_t p = 1; p < breakpoints.size(); p++) {
+    double a = breakpoints[p-1], b = breakpoints[p];
+    if (not(b - a > 1.0e-12*std::max(1.0, std::abs(b)))) { continue; }  // Skip (almost) duplicate breakpoints
+    for (int k = 0; k < 15; k++) {
+      int i = (k < 8) ? k : 14 - k;
+      double xi = (k < 8) ? -gk15_nodes[i] : gk15_nodes[i];
+      double t = 0.5*(1.0 + xi), jac;
+      if (sqrt_substitution) {
+        rule.x.push_back(a + (b - a)*t*t);
+        jac = (b - a)*t;
+      } else {
+        rule.x.push_back(a + (b - a)*t);
+        jac = 0.5*(b - a);
+      }
+      rule.w_kronrod.push_back(jac*gk15_weights_kronrod[i]);
+      rule.w_gauss.push_back(jac*gk15_weights_gauss[i]);
+      rule.panel.push_back(rule.n_panels);
+    }
+    rule.n_panels++;
+  }
+  return rule;
+}
+
+// Kronrod estimate of the integral and error estimate (sum of |Kronrod - Gauss| over all panels) for the values f (with stride)
+void apply_fixed_order_rule(const fixed_order_rule &rule, const double* f, size_t stride, double &integral, double &error) {
+  integral = 0;
+  error = 0;
+  double panel_diff = 0;
+  for (size_t m = 0; m < rule.x.size(); m++) {
+    double val = f[m*stride];
+    integral += rule.w_kronrod[m]*val;
+    panel_diff += (rule.w_kronrod[m] - rule.w_gauss[m])*val;
+    if ((m+1 == rule.x.size()) || (rule.panel[m+1] != rule.panel[m])) {
+      error += std::abs(panel_diff);
+      panel_diff = 0;
+    }
+  }
+}
+
+std::vector<std::vector<std::vector<double> > > fixed_order_disc_integrals(std::vector<double> ergs, std::vector<double> rhos_0, std::vector<double> rhos_1, SolarModel &s, std::vector<SolarModelMemberFn> integrands) {
+  SOLAXFLUX_TIMER(timer, "fixed_order_disc_integrals ["+get_SolarModel_function_names(integrands)+"]");
+  const int n_ergs = ergs.size(), n_rings = rhos_0.size(), n_channels = integrands.size();
+  // N.B. Same upper limit as in rho_integrand_2d
+  const double r_lo = s.get_r_lo(), r_max = 0.999999999*s.get_r_hi();
+  if (int(rhos_1.size()) != n_rings) { throw XSanityCheck("The number of inner and outer radii of the rings for fixed_order_disc_integrals do not match."); }
+
+  // Radial breakpoints: all ring boundaries and uniform panels; use sqrt substitution for the singularities of the (analytical) rho integral at the ring boundaries.
+  const int n_panels = get_fixed_order_panels();
+  std::vector<double> breakpoints;
+  for (int k = 0; k <= n_panels; k++) { breakpoints.push_back(r_lo + k*(r_max - r_lo)/double(n_panels)); }
+  for (int i = 0; i < n_rings; i++) {
+    if ((r_lo < rhos_0[i]) && (rhos_0[i] < r_max)) { breakpoints.push_back(rhos_0[i]); }
+    if ((r_lo < rhos_1[i]) && (rhos_1[i] < r_max)) { breakpoints.push_back(rhos_1[i]); }
+  }
+  fixed_order_rule rule = gauss_kronrod_rule(breakpoints, true);
+  const int n_nodes = rule.x.size();
+
+  // Rates of all channels at all radial nodes and energies (channel c at position (m*n_channels+c)*n_ergs+j); the radius-dependent quantities are computed once per node.
+  std::vector<double> rates (n_nodes*n_channels*n_ergs);
+  const int n_threads = get_num_threads();
+  ParallelExceptionHandler exceptions;
+  #ifdef _OPENMP
+  #pragma omp parallel for schedule(dynamic) num_threads(n_threads)
+  #endif
+  for (int m = 0; m < n_nodes; m++) {
+    if (exceptions.has_exception()) { continue; }
+    try {
+      if (n_ergs > 0) { s.rates(integrands, &ergs[0], n_ergs, rule.x[m], &rates[m*n_channels*n_ergs]); }
+    } catch (...) { exceptions.capture(); }
+  }
+  exceptions.rethrow_if_any();
+
+  // The rho integral over the ring yields 2 r [ sqrt(r^2 - rho_0^2) - sqrt(r^2 - min(r, rho_1)^2) ] for r > rho_0.
+  std::vector<std::vector<std::vector<double> > > result (n_channels, std::vector<std::vector<double> > (2, std::vector<double> (n_rings*n_ergs)));
+  std::vector<double> values (n_nodes);
+  for (int i = 0; i < n_rings; i++) {
+    if (not(rhos_1[i] > rhos_0[i])) { continue; }
+    std::vector<double> kernel (n_nodes, 0);
+    for (int m = 0; m < n_nodes; m++) {
+      double r = rule.x[m];
+      if (r > rhos_0[i]) { kernel[m] = 2.0*r*( sqrt(r*r - rhos_0[i]*rhos_0[i]) - sqrt(std::max(0.0, r*r - rhos_1[i]*rhos_1[i])) ); }
+    }
+    for (int c = 0; c < n_channels; c++) {
+      for (int j = 0; j < n_ergs; j++) {
+        double erg_factor = gsl_pow_2(0.5*ergs[j]/pi);
+        for (int m = 0; m < n_nodes; m++) { values[m] = erg_factor*kernel[m]*rates[(m*n_channels+c)*n_ergs+j]; }
+        apply_fixed_order_rule(rule, &values[0], 1, result[c][0][i*n_ergs+j], result[c][1][i*n_ergs+j]);
+      }
+    }
+  }
+
+  return result;
+}
+
+std::vector<std::vector<double> > fixed_order_disc_integrals(std::vector<double> ergs, std::vector<double> rhos_0, std::vector<double> rhos_1, SolarModel &s, double (SolarModel::*integrand)(double, double) const) {
+  return fixed_order_disc_integrals(ergs, rhos_0, rhos_1, s, std::vector<SolarModelMemberFn> { integrand })[0];
+}
+
+// Warn if the error estimates of the fixed-order integration exceed the target precision
+void check_fixed_order_errors(const std::vector<double> &fluxes, const std::vector<double> &errors, double rel_prec) {
+  double max_rel_error = 0;
+  for (size_t k = 0; k < fluxes.size(); k++) { if (fluxes[k] > 0) { max_rel_error = std::max(max_rel_error, errors[k]/fluxes[k]); } }
+  if (max_rel_error > rel_prec) {
+    std::cout << "WARNING. Estimated relative error of the fixed-order integration (" << max_rel_error << ") is larger than the target precision (" << rel_prec << "). Consider using more panels." << std::endl;
+  }
+}
+
+// Vector-valued adaptive integration with 15-point Gauss-Kronrod rules at shared nodes
+struct vector_adaptive_interval { int panel; double t_lo, t_hi; std::vector<double> integrals, errors; };
+
+void apply_vector_gk15(std::function<void(double, double*)> &f, int n, double a, double b, bool sqrt_substitution, vector_adaptive_interval &interval, std::vector<double> &values) {
+  interval.integrals.assign(n, 0);
+  interval.errors.assign(n, 0);
+  std::vector<double> gauss (n, 0);
+  const double t_mid = 0.5*(interval.t_lo + interval.t_hi), t_half = 0.5*(interval.t_hi - interval.t_lo);
+  for (int k = 0; k < 15; k++) {
+    int i = (k < 8) ? k : 14 - k;
+    double t = (k < 8) ? t_mid - t_half*gk15_nodes[i] : t_mid + t_half*gk15_nodes[i];
+    double x, jac;
+    if (sqrt_substitution) {
+      x = a + (b - a)*t*t;
+      jac = 2.0*(b - a)*t*t_half;
+    } else {
+      x = a + (b - a)*t;
+      jac = (b - a)*t_half;
+    }
+    f(x, &values[0]);
+    for (int c = 0; c < n; c++) {
+      interval.integrals[c] += jac*gk15_weights_kronrod[i]*values[c];
+      gauss[c] += jac*gk15_weights_gauss[i]*values[c];
+    }
+  }
+  for (int c = 0; c < n; c++) { interval.errors[c] = std::abs(interval.integrals[c] - gauss[c]); }
+}
+
+std::vector<std::vector<double> > integrate_vector_adaptive(std::function<void(double, double*)> f, int n, std::vector<double> breakpoints, double abs_prec, double rel_prec, int max_intervals,
+                                                           bool sqrt_substitution, bool* converged) {
+  std::sort(breakpoints.begin(), breakpoints.end());
+  std::vector<double> values (n);
+  std::vector<vector_adaptive_interval> intervals;
+  std::vector<std::pair<double,double> > panels;
+  for (size_t p = 1; p < breakpoints.size(); p++) {
+    double a = breakpoints[p-1], b = breakpoints[p];
+    if (not(b - a > 1.0e-12*std::max(1.0, std::abs(b)))) { continue; }  // Skip (almost) duplicate breakpoints
+    panels.push_back(std::make_pair(a, b));
+    vector_adaptive_interval interval = { int(panels.size())-1, 0.0, 1.0, {}, {} };
+    apply_vector_gk15(f, n, a, b, sqrt_substitution, interval, values);
+    intervals.push_back(interval);
+  }
+
+  std::vector<std::vector<double> > result (2, std::vector<double> (n, 0));
+  bool done = false;
+  while (true) {
+    // Totals and target precision of each component
+    std::vector<double> &integrals = result[0], &errors = result[1];
+    std::fill(integrals.begin(), integrals.end(), 0);
+    std::fill(errors.begin(), errors.end(), 0);
+    for (auto it = intervals.begin(); it != intervals.end(); it++) {
+      for (int c = 0; c < n; c++) { integrals[c] += it->integrals[c]; errors[c] += it->errors[c]; }
+    }
+    std::vector<double> tolerance (n);
+    done = true;
+    for (int c = 0; c < n; c++) {
+      tolerance[c] = std::max(abs_prec, rel_prec*std::abs(integrals[c]));
+      if (errors[c] > tolerance[c]) { done = false; }
+    }
+    if (done || (int(intervals.size()) >= max_intervals)) { break; }
+
+    // Bisect the interval with the largest error relative to the target precision (max-norm over all components that have not converged)
+    int worst = -1;
+    double worst_error = 0;
+    for (size_t k = 0; k < intervals.size(); k++) {
+      for (int c = 0; c < n; c++) {
+        if (errors[c] <= tolerance[c]) { continue; }
+        double scaled_error = (tolerance[c] > 0) ? intervals[k].errors[c]/tolerance[c] : intervals[k].errors[c];
+        if (scaled_error > worst_error) { worst_error = scaled_error; worst = k; }
+      }
+    }
+    if (worst < 0) { break; }
+    vector_adaptive_interval &interval = intervals[worst];
+    const double t_mid = 0.5*(interval.t_lo + interval.t_hi);
+    // N.B. Stop if the interval cannot be bisected any further (roundoff)
+    if (not((t_mid > interval.t_lo) && (t_mid < interval.t_hi))) { break; }
+    const double a = panels[interval.panel].first, b = panels[interval.panel].second;
+    vector_adaptive_interval upper = { interval.panel, t_mid, interval.t_hi, {}, {} };
+    interval.t_hi = t_mid;
+    apply_vector_gk15(f, n, a, b, sqrt_substitution, interval, values);
+    apply_vector_gk15(f, n, a, b, sqrt_substitution, upper, values);
+    intervals.push_back(upper);
+  }
+  SOLAXFLUX_COUNT(COUNT_QAG_CALLS, 1);
+  SOLAXFLUX_COUNT(COUNT_QAG_INTERVALS, intervals.size());
+  if (converged != NULL) { *converged = done; }
+
+  return result;
+}
+
+// Channels with the LP resonance, which is used as a breakpoint of the radial integration
+bool has_lp_resonance(double (SolarModel::*integrand)(double, double) const) {
+  const std::vector<SolarModelMemberFn> resonant = { static_cast<SolarModelMemberFn>(&SolarModel::Gamma_LP), &SolarModel::Gamma_LP_Rosseland, &SolarModel::Gamma_plasmon, &SolarModel::Gamma_all_photon };
+  return std::find(resonant.begin(), resonant.end(), integrand) != resonant.end();
+}
+
+std::vector<std::vector<double> > adaptive_disc_integrals(double erg, double rho_0, double rho_1, SolarModel &s, const std::vector<SolarModelMemberFn> &integrands, double rel_prec, bool* converged) {
+  const int n_channels = integrands.size();
+  // N.B. Same upper limit as in rho_integrand_2d
+  const double r_max = 0.999999999*s.get_r_hi();
+  if (converged != NULL) { *converged = true; }
+  if (not(rho_1 > rho_0) || not(r_max > rho_0)) { return std::vector<std::vector<double> > (2, std::vector<double> (n_channels, 0)); }
+
+  std::vector<double> breakpoints = { rho_0, r_max };
+  if (rho_1 < r_max) { breakpoints.push_back(rho_1); }
+  if (std::any_of(integrands.begin(), integrands.end(), has_lp_resonance)) {
+    double r_res = s.r_from_omega_pl(erg);
+    if ((r_res > rho_0) && (r_res < r_max)) { breakpoints.push_back(r_res); }
+  }
+  const double erg_factor = gsl_pow_2(0.5*erg/pi);
+  // The rho integral over the ring yields the same kernel as in fixed_order_disc_integrals
+  auto f = [&](double r, double* out) {
+    double kernel = 2.0*r*( sqrt(std::max(0.0, r*r - rho_0*rho_0)) - sqrt(std::max(0.0, r*r - rho_1*rho_1)) );
+    s.rates(integrands, &erg, 1, r, out);
+    for (int c = 0; c < n_channels; c++) { out[c] *= erg_factor*kernel; }
+  };
+  return integrate_vector_adaptive(f, n_channels, breakpoints, int_abs_prec_2d, rel_prec, int_space_size_2d, true, converged);
+}
+
+// Warn if the vector-valued adaptive integration did not reach the target precision for some of the tasks
+void check_vector_adaptive_convergence(int n_failed, int n_tasks, const std::vector<SolarModelMemberFn> &integrands) {
+  if (n_failed > 0) {
+    std::cout << "WARNING. The adaptive integration of [" << get_SolarModel_function_names(integrands) << "] did not reach the target precision for " << n_failed << " of " << n_tasks << " integrals." << std::endl;
+  }
+}
+
+// N.B. The loops over independent energies/radii below are parallelised if OpenMP is available and get_num_threads() > 1.
+// Results are always stored by index, s.t. the order of the output does not depend on the number of threads.
+
+// Task setup and output format of calculate_d2Phi_a_domega_drho (shared with the distributed version below)
+void d2Phi_a_domega_drho_tasks(std::vector<double> ergs, std::vector<double> rhos, SolarModel &s, std::vector<double> &all_ergs, std::vector<double> &all_radii) {
+  std::vector<double> valid_rhos = s.get_supported_radii(rhos);
   for (auto rho = valid_rhos.begin(); rho != valid_rhos.end(); rho++) {
-    p.rho_1 = *rho;
     for (auto erg = ergs.begin(); erg != ergs.end(); erg++) {
-      p.erg = *erg;
-      all_radii.push_back(p.rho_1);
-      all_ergs.push_back(p.erg);
-      results.push_back( distance_factor*rho_integrand_2d(p.rho_1, &p) );
+      all_radii.push_back(*rho);
+      all_ergs.push_back(*erg);
     }
   }
+}
 
-  gsl_integration_cquad_workspace_free(w2);
-
-  std::vector<std::vector<double> > buffer = { all_radii, all_ergs, results };
+std::string d2Phi_a_domega_drho_comment(SolarModel &s) {
   std::string comment = standard_header(&s);
   comment += "Differential flux on the solar disc by " LIBRARY_NAME ".\nColumns: Radius on solar disc [R_sol] | Energy [keV] | Differential axion flux [cm^-2 s^-1 keV^-1]";
-  save_to_file(saveas, buffer, comment);
-
-  return buffer;
+  return comment;
 }
 
+std::vector<std::vector<double> > calculate_d2Phi_a_domega_drho(std::vector<double> ergs, std::vector<double> rhos, SolarModel &s, double (SolarModel::*integrand)(double, double) const, std::string saveas) {
+  SOLAXFLUX_TIMER(timer, "calculate_d2Phi_a_domega_drho ["+get_SolarModel_function_name(integrand)+"]");
+  std::vector<double> all_ergs, all_radii;
+  d2Phi_a_domega_drho_tasks(ergs, rhos, s, all_ergs, all_radii);
+  int n_tasks = all_ergs.size();
+  std::vector<double> results (n_tasks);
+
+  // The rows are written to the output file while the computation runs (in order, as soon as all previous rows are done)
+  TableWriter writer (saveas, 3, d2Phi_a_domega_drho_comment(s));
+  std::vector<char> task_done (n_tasks, 0);
+  int n_rows_written = 0;
+
+  const int n_threads = get_num_threads();
+  ParallelExceptionHandler exceptions;
+  #ifdef _OPENMP
+  #pragma omp parallel num_threads(n_threads)
+  #endif
+  {
+    integration_worker_2d worker (&s, integrand);
+    #ifdef _OPENMP
+    #pragma omp for schedule(dynamic)
+    #endif
+    for (int k = 0; k < n_tasks; ++k) {
+      if (exceptions.has_exception()) { continue; }
+      try {
+        worker.p.rho_1 = all_radii[k];
+        worker.p.erg = all_ergs[k];
+        results[k] = distance_factor*rho_integrand_2d(all_radii[k], &worker.p);
+        if (saveas != "") {
+          #ifdef _OPENMP
+          #pragma omp critical (calculate_d2Phi_a_domega_drho_output)
+          #endif
+          {
+            task_done[k] = 1;
+            for ( ; (n_rows_written < n_tasks) && task_done[n_rows_written]; n_rows_written++) {
+              const double row [3] = { all_radii[n_rows_written], all_ergs[n_rows_written], results[n_rows_written] };
+              writer.write_row(row);
+            }
+          }
+        }
+      } catch (...) { exceptions.capture(); }
+    }
+  }
+  writer.close();
+  exceptions.rethrow_if_any();
 
-std::vector<std::vector<double> > fully_integrate_d2Phi_a_domega_drho_in_rho(std::vector<double> ergs, SolarModel &s, double (SolarModel::*integrand)(double, double), std::string saveas, Isotope isotope) {
-  std::vector<double> integrals;
-  std::ofstream output;
-  gsl_integration_workspace * w = gsl_integration_workspace_alloc(int_space_size_1d);
-  gsl_function f;
-  // N.B. The fully 2D integral in rho and r effectively reduces to the 1D integral in r, Eq. (2.42) in [arXiv:2101.08789]
-  f.function = r_integrand_1d;
-  solar_model_integration_parameters_1d p { 0.0, &s, integrand, &f, w };
-  f.params = &p;
+  std::vector<std::vector<double> > buffer = { all_radii, all_ergs, results };
+  return buffer;
+}
 
-  for (auto erg = ergs.begin(); erg != ergs.end(); erg++) { integrals.push_back( distance_factor*erg_integrand_1d(*erg, &p) ); }
 
-  gsl_integration_workspace_free(w);
+std::vector<std::vector<double> > fully_integrate_d2Phi_a_domega_drho_in_rho(std::vector<double> ergs, SolarModel &s, double (SolarModel::*integrand)(double, double) const, std::string saveas, Isotope isotope) {
+  SOLAXFLUX_TIMER(timer, "fully_integrate_d2Phi_a_domega_drho_in_rho ["+get_SolarModel_function_name(integrand)+"]");
+  int n_ergs = ergs.size();
+  std::vector<double> integrals (n_ergs);
+
+  const int n_threads = get_num_threads();
+  ParallelExceptionHandler exceptions;
+  #ifdef _OPENMP
+  #pragma omp parallel num_threads(n_threads)
+  #endif
+  {
+    integration_worker_1d worker (&s, integrand);
+    #ifdef _OPENMP
+    #pragma omp for schedule(dynamic)
+    #endif
+    for (int i = 0; i < n_ergs; ++i) {
+      if (exceptions.has_exception()) { continue; }
+      try {
+        integrals[i] = distance_factor*erg_integrand_1d(ergs[i], &worker.p);
+      } catch (...) { exceptions.capture(); }
+    }
+  }
+  exceptions.rethrow_if_any();
 
   std::vector<std::vector<double> > buffer = { ergs, integrals };
   std::string comment = standard_header(&s);
@@ -136,87 +514,257 @@ std::vector<std::vector<double> > fully_integrate_d2Phi_a_domega_drho_in_rho(std
   return buffer;
 }
 
-std::vector<std::vector<double> > integrate_d2Phi_a_domega_drho_up_to_rho_and_for_omega_interval(double erg_lo, double erg_hi, std::vector<double> rhos, SolarModel &s, double (SolarModel::*integrand)(double, double), std::string saveas) {
-  std::vector<double> results, errors;
-  std::vector<double> valid_rhos = s.get_supported_radii(rhos);
-  double rho_min = valid_rhos.front();
-  double rho_max = valid_rhos.back();
-  int n_rho_vals = valid_rhos.size();
-  std::vector<double> relevant_peaks = get_relevant_peaks(erg_lo, erg_hi);
+std::vector<std::vector<std::vector<double> > > fully_integrate_d2Phi_a_domega_drho_in_rho(std::vector<double> ergs, SolarModel &s, std::vector<SolarModelMemberFn> integrands, std::vector<std::string> saveas) {
+  SOLAXFLUX_TIMER(timer, "fully_integrate_d2Phi_a_domega_drho_in_rho ["+get_SolarModel_function_names(integrands)+"]");
+  const int n_channels = integrands.size();
+  if ((saveas.size() > 0) && (saveas.size() != size_t(n_channels))) { throw XSanityCheck("The number of output files does not match the number of channels."); }
+  std::vector<std::vector<std::vector<double> > > all_buffers (n_channels);
+
+  // Gamma_LP and Gamma_LP_Rosseland (restricted radial range, see erg_integrand_1d) are integrated separately...
+  std::vector<int> shared_channels;
+  std::vector<SolarModelMemberFn> shared_integrands;
+  for (int c = 0; c < n_channels; ++c) {
+    if ((integrands[c] != static_cast<SolarModelMemberFn>(&SolarModel::Gamma_LP)) && (integrands[c] != &SolarModel::Gamma_LP_Rosseland)) {
+      shared_channels.push_back(c);
+      shared_integrands.push_back(integrands[c]);
+    }
+  }
+  for (int c = 0; c < n_channels; ++c) {
+    if ((shared_channels.size() < 2) || (std::find(shared_channels.begin(), shared_channels.end(), c) == shared_channels.end())) {
+      all_buffers[c] = fully_integrate_d2Phi_a_domega_drho_in_rho(ergs, s, integrands[c], (saveas.size() > 0) ? saveas[c] : "");
+    }
+  }
+  if (shared_channels.size() < 2) { return all_buffers; }
+
+  // ... while all others share the nodes (and plasma states) of the vector-valued adaptive integration, with the LP resonance as a breakpoint
+  const bool resonant = std::any_of(shared_integrands.begin(), shared_integrands.end(), has_lp_resonance);
+  const int n_ergs = ergs.size(), n_shared = shared_channels.size();
+  std::vector<std::vector<double> > integrals (n_shared, std::vector<double> (n_ergs));
+  int n_failed = 0;
+  const int n_threads = get_num_threads();
+  ParallelExceptionHandler exceptions;
+  #ifdef _OPENMP
+  #pragma omp parallel for schedule(dynamic) num_threads(n_threads)
+  #endif
+  for (int i = 0; i < n_ergs; ++i) {
+    if (exceptions.has_exception()) { continue; }
+    try {
+      const double erg = ergs[i], low = s.get_r_lo(), high = s.get_r_hi();
+      std::vector<double> radii = { low, high };
+      if (resonant) {
+        double res = s.r_from_omega_pl(erg);
+        if ((res > low) && (res < high)) { radii.push_back(res); }
+      }
+      auto f = [&](double r, double* out) {
+        s.rates(shared_integrands, &erg, 1, r, out);
+        for (int c = 0; c < n_shared; c++) { out[c] *= 2.0 * gsl_pow_2(0.5*erg*r/pi); } // N.B. Same integrand as r_integrand_1d
+      };
+      bool converged;
+      std::vector<std::vector<double> > channel_integrals = integrate_vector_adaptive(f, n_shared, radii, int_abs_prec_1d, int_rel_prec_1d, int_space_size_1d, false, &converged);
+      for (int c = 0; c < n_shared; c++) { integrals[c][i] = distance_factor*channel_integrals[0][c]; }
+      if (not(converged)) {
+        #ifdef _OPENMP
+        #pragma omp atomic
+        #endif
+        n_failed++;
+      }
+    } catch (...) { exceptions.capture(); }
+  }
+  exceptions.rethrow_if_any();
+  check_vector_adaptive_convergence(n_failed, n_ergs, shared_integrands);
 
-  gsl_integration_workspace * w = gsl_integration_workspace_alloc(int_space_size_2d);
-  gsl_integration_cquad_workspace * w1 = gsl_integration_cquad_workspace_alloc(int_space_size_2d_cquad);
-  gsl_integration_cquad_workspace * w2 = gsl_integration_cquad_workspace_alloc(int_space_size_2d_cquad);
+  std::string comment = standard_header(&s);
+  comment += "Spectral flux over full solar volume.\nColumns: energy values [keV] | axion flux [cm^-2 s^-1 keV^-1]";
+  for (int k = 0; k < n_shared; ++k) {
+    const int c = shared_channels[k];
+    all_buffers[c] = { ergs, integrals[k] };
+    if (saveas.size() > 0) { save_to_file(saveas[c], all_buffers[c], comment); }
+  }
 
-  gsl_function f;
-  f.function = &erg_integrand_2d;
-  gsl_function f1;
-  f1.function = &rho_integrand_2d;
-  gsl_function f2;
-  f2.function = &r_integrand_2d;
-  solar_model_integration_parameters_2d p { 0.0, 0.0, 0.0, 0.0, &s, integrand, &f1, w1, &f2, w2 };
-  f.params = &p;
-  f1.params = &p;
-  f2.params = &p;
+  return all_buffers;
+}
+
+// Ring integrals over [erg_lo, erg_hi] for the adaptive engine, where rings[i] = [rhos_0[i], rhos_1[i]]
+void adaptive_omega_interval_ring_integrals(double erg_lo, double erg_hi, const std::vector<double> &rhos_0, const std::vector<double> &rhos_1, SolarModel &s, double (SolarModel::*integrand)(double, double) const,
+                                            std::vector<double> &ring_integrals, std::vector<double> &ring_errors) {
+  const int n_rings = rhos_0.size();
+  std::vector<double> relevant_peaks = get_relevant_peaks(erg_lo, erg_hi);
+  const int n_threads = get_num_threads();
+  ParallelExceptionHandler exceptions;
+  #ifdef _OPENMP
+  #pragma omp parallel num_threads(n_threads)
+  #endif
+  {
+    integration_worker_2d worker (&s, integrand);
+    QAGWorkspace w (int_space_size_2d);
+    gsl_function f;
+    f.function = &erg_integrand_2d;
+    f.params = &worker.p;
+    std::vector<double> pts = relevant_peaks;
+    #ifdef _OPENMP
+    #pragma omp for schedule(dynamic)
+    #endif
+    for (int i = 0; i < n_rings; ++i) {
+      if (exceptions.has_exception()) { continue; }
+      try {
+        double integral = 0, error = 0;
+        worker.p.rho_0 = rhos_0[i];
+        worker.p.rho_1 = rhos_1[i];
+        if (worker.p.rho_1 > worker.p.rho_0) {
+          //gsl_integration_qagiu(&f, 0.0, 10.0*int_abs_prec_2d, 10.0*int_rel_prec_2d, int_space_size_2d, w, &integral, &error); // Alternative integration from 0 -> infinity; too slow.
+          integrate_qagp(&f, &pts[0], pts.size(), 10.0*int_abs_prec_2d, 10.0*int_rel_prec_2d, w, &integral, &error);
+          SOLAXFLUX_COUNT(COUNT_QAG_CALLS, 1);
+          SOLAXFLUX_COUNT(COUNT_QAG_INTERVALS, w->size);
+        }
+        ring_integrals[i] = integral;
+        ring_errors[i] = error;
+      } catch (...) { exceptions.capture(); }
+    }
+  }
+  exceptions.rethrow_if_any();
+}
 
+// Same for several channels, which share the nodes of the vector-valued adaptive integration in omega and r (ring_integrals[c][i] for channel c and ring i)
+void adaptive_omega_interval_ring_integrals(double erg_lo, double erg_hi, const std::vector<double> &rhos_0, const std::vector<double> &rhos_1, SolarModel &s, const std::vector<SolarModelMemberFn> &integrands,
+                                            std::vector<std::vector<double> > &ring_integrals, std::vector<std::vector<double> > &ring_errors) {
+  const int n_rings = rhos_0.size(), n_channels = integrands.size();
+  std::vector<double> relevant_peaks = get_relevant_peaks(erg_lo, erg_hi);
+  int n_failed = 0;
+  const int n_threads = get_num_threads();
+  ParallelExceptionHandler exceptions;
+  #ifdef _OPENMP
+  #pragma omp parallel for schedule(dynamic) num_threads(n_threads)
+  #endif
+  for (int i = 0; i < n_rings; ++i) {
+    if (exceptions.has_exception()) { continue; }
+    try {
+      bool converged = true;
+      // N.B. Same target precisions as the nested routines of the single-channel version (up to the rho integral, which is performed analytically)
+      auto f = [&](double erg, double* out) {
+        bool disc_converged;
+        std::vector<std::vector<double> > disc = adaptive_disc_integrals(erg, rhos_0[i], rhos_1[i], s, integrands, int_rel_prec_2d, &disc_converged);
+        for (int c = 0; c < n_channels; c++) { out[c] = disc[0][c]; }
+        converged = converged && disc_converged;
+      };
+      std::vector<std::vector<double> > result (2, std::vector<double> (n_channels, 0));
+      if (rhos_1[i] > rhos_0[i]) {
+        bool erg_converged;
+        result = integrate_vector_adaptive(f, n_channels, relevant_peaks, 10.0*int_abs_prec_2d, 10.0*int_rel_prec_2d, int_space_size_2d, false, &erg_converged);
+        converged = converged && erg_converged;
+      }
+      for (int c = 0; c < n_channels; c++) {
+        ring_integrals[c][i] = result[0][c];
+        ring_errors[c][i] = result[1][c];
+      }
+      if (not(converged)) {
+        #ifdef _OPENMP
+        #pragma omp atomic
+        #endif
+        n_failed++;
+      }
+    } catch (...) { exceptions.capture(); }
+  }
+  exceptions.rethrow_if_any();
+  check_vector_adaptive_convergence(n_failed, n_rings, integrands);
+}
+
+std::vector<std::vector<std::vector<double> > > integrate_d2Phi_a_domega_drho_up_to_rho_and_for_omega_interval(double erg_lo, double erg_hi, std::vector<double> rhos, SolarModel &s, std::vector<SolarModelMemberFn> integrands,
+                                                                                                              std::vector<std::string> saveas) {
+  SOLAXFLUX_TIMER(timer, "integrate_d2Phi_a_domega_drho_up_to_rho_and_for_omega_interval ["+get_SolarModel_function_names(integrands)+"]");
+  const int n_channels = integrands.size();
+  if ((saveas.size() > 0) && (saveas.size() != size_t(n_channels))) { throw XSanityCheck("The number of output files does not match the number of channels."); }
+  std::vector<double> valid_rhos = s.get_supported_radii(rhos);
+  int n_rho_vals = valid_rhos.size();
+  std::vector<double> rhos_0, rhos_1;
   for (int i = 0; i < n_rho_vals; ++i) {
-    double integral, error;
+    rhos_0.push_back((i > 0) ? valid_rhos[i-1] : s.get_r_lo());
+    rhos_1.push_back(valid_rhos[i]);
+  }
 
-    if (i > 0) {
-      p.rho_0 = valid_rhos[i-1];
+  // Integrate over all rings independently; all channels that support the fixed-order engine share its nodes...
+  std::vector<std::vector<double> > ring_integrals (n_channels, std::vector<double> (n_rho_vals)), ring_errors (n_channels, std::vector<double> (n_rho_vals));
+  std::vector<int> fixed_order_channels, adaptive_channels;
+  std::vector<SolarModelMemberFn> adaptive_integrands;
+  for (int c = 0; c < n_channels; ++c) {
+    if ((get_integration_engine() == FIXED_ORDER_INTEGRATION) && supports_fixed_order_integration(integrands[c])) {
+      fixed_order_channels.push_back(c);
     } else {
-      p.rho_0 = s.get_r_lo();
+      adaptive_channels.push_back(c);
+      adaptive_integrands.push_back(integrands[c]);
     }
-
-    p.rho_1 = valid_rhos[i];
-    if (p.rho_1 > p.rho_0) {
-      //gsl_integration_qagiu(&f, 0.0, 10.0*int_abs_prec_2d, 10.0*int_rel_prec_2d, int_space_size_2d, w, &integral, &error); // Alternative integration from 0 -> infinity; too slow.
-      gsl_integration_qagp(&f, &relevant_peaks[0], relevant_peaks.size(), 10.0*int_abs_prec_2d, 10.0*int_rel_prec_2d, int_space_size_2d, w, &integral, &error);
-    } else {
-      integral = 0;
-      error = 0;
+  }
+  // ... and all others share the nodes of the vector-valued adaptive integration (a single channel uses the nested GSL routines)...
+  if (adaptive_channels.size() == 1) {
+    const int c = adaptive_channels[0];
+    adaptive_omega_interval_ring_integrals(erg_lo, erg_hi, rhos_0, rhos_1, s, integrands[c], ring_integrals[c], ring_errors[c]);
+  } else if (adaptive_channels.size() > 1) {
+    std::vector<std::vector<double> > adaptive_integrals (adaptive_channels.size(), std::vector<double> (n_rho_vals)), adaptive_errors (adaptive_channels.size(), std::vector<double> (n_rho_vals));
+    adaptive_omega_interval_ring_integrals(erg_lo, erg_hi, rhos_0, rhos_1, s, adaptive_integrands, adaptive_integrals, adaptive_errors);
+    for (size_t k = 0; k < adaptive_channels.size(); ++k) {
+      ring_integrals[adaptive_channels[k]] = adaptive_integrals[k];
+      ring_errors[adaptive_channels[k]] = adaptive_errors[k];
     }
-
-    if (i > 0) {
-      results.push_back( results.back() + distance_factor*integral );
-      errors.push_back( sqrt(gsl_pow_2(errors.back()) + gsl_pow_2(distance_factor*error)) );
-    } else {
-      results.push_back(distance_factor*integral);
-      errors.push_back(distance_factor*error);
+  }
+  if (fixed_order_channels.size() > 0) {
+    // Fixed-order rule in omega, with breakpoints at the relevant peaks; then the same rule in r for all rings and energies
+    std::vector<double> erg_breakpoints = get_relevant_peaks(erg_lo, erg_hi);
+    const int n_panels = get_fixed_order_panels();
+    for (int k = 1; k < n_panels; k++) { erg_breakpoints.push_back(erg_lo + k*(erg_hi - erg_lo)/double(n_panels)); }
+    fixed_order_rule erg_rule = gauss_kronrod_rule(erg_breakpoints);
+    std::vector<SolarModelMemberFn> fixed_order_integrands;
+    for (int c : fixed_order_channels) { fixed_order_integrands.push_back(integrands[c]); }
+    std::vector<std::vector<std::vector<double> > > all_disc = fixed_order_disc_integrals(erg_rule.x, rhos_0, rhos_1, s, fixed_order_integrands);
+    const int n_erg_nodes = erg_rule.x.size();
+    for (size_t k = 0; k < fixed_order_channels.size(); ++k) {
+      const int c = fixed_order_channels[k];
+      const std::vector<std::vector<double> > &disc = all_disc[k];
+      for (int i = 0; i < n_rho_vals; ++i) {
+        double disc_error = 0;
+        for (int j = 0; j < n_erg_nodes; ++j) { disc_error += erg_rule.w_kronrod[j]*disc[1][i*n_erg_nodes+j]; }
+        if (n_erg_nodes > 0) { apply_fixed_order_rule(erg_rule, &disc[0][i*n_erg_nodes], 1, ring_integrals[c][i], ring_errors[c][i]); }
+        ring_errors[c][i] += disc_error;
+      }
+      // Same target precision as for the adaptive ring integrals
+      check_fixed_order_errors(ring_integrals[c], ring_errors[c], 10.0*int_rel_prec_2d);
     }
   }
 
-  gsl_integration_workspace_free(w);
-  gsl_integration_cquad_workspace_free(w1);
-  gsl_integration_cquad_workspace_free(w2);
-
-  std::vector<std::vector<double>> buffer = { valid_rhos, results, errors };
-  std::string comment = standard_header(&s);
-  comment += "Total spectral flux for a given radius.\nColumns: Radius on solar disc [R_sol], Axion flux [cm^-2 s^-1] |  Axion flux error estimate [cm^-2 s^-1]";
-  save_to_file(saveas, buffer, comment);
+  // ... before they are summed up in order.
+  std::vector<std::vector<std::vector<double> > > all_buffers;
+  for (int c = 0; c < n_channels; ++c) {
+    std::vector<double> results, errors;
+    for (int i = 0; i < n_rho_vals; ++i) {
+      if (i > 0) {
+        results.push_back( results.back() + distance_factor*ring_integrals[c][i] );
+        errors.push_back( sqrt(gsl_pow_2(errors.back()) + gsl_pow_2(distance_factor*ring_errors[c][i])) );
+      } else {
+        results.push_back(distance_factor*ring_integrals[c][i]);
+        errors.push_back(distance_factor*ring_errors[c][i]);
+      }
+    }
+    std::vector<std::vector<double>> buffer = { valid_rhos, results, errors };
+    std::string comment = standard_header(&s);
+    comment += "Total spectral flux for a given radius.\nColumns: Radius on solar disc [R_sol], Axion flux [cm^-2 s^-1] |  Axion flux error estimate [cm^-2 s^-1]";
+    if (saveas.size() > 0) { save_to_file(saveas[c], buffer, comment); }
+    all_buffers.push_back(buffer);
+  }
 
-  return buffer;
+  return all_buffers;
 }
 
-std::vector<std::vector<double> > integrate_d2Phi_a_domega_drho_between_rhos(std::vector<double> ergs, std::vector<double> rhos, SolarModel &s, double (SolarModel::*integrand)(double, double), std::string saveas, bool use_ring_geometry, Isotope isotope) {
-  std::vector<double> all_ergs, all_radii_1, all_radii_2, fluxes;
-
-  gsl_integration_cquad_workspace * w1 = gsl_integration_cquad_workspace_alloc(int_space_size_2d_cquad);
-  gsl_integration_cquad_workspace * w2 = gsl_integration_cquad_workspace_alloc(int_space_size_2d_cquad);
+std::vector<std::vector<double> > integrate_d2Phi_a_domega_drho_up_to_rho_and_for_omega_interval(double erg_lo, double erg_hi, std::vector<double> rhos, SolarModel &s, double (SolarModel::*integrand)(double, double) const, std::string saveas) {
+  return integrate_d2Phi_a_domega_drho_up_to_rho_and_for_omega_interval(erg_lo, erg_hi, rhos, s, std::vector<SolarModelMemberFn> { integrand }, std::vector<std::string> { saveas })[0];
+}
 
+// Task setup and output format of integrate_d2Phi_a_domega_drho_between_rhos (shared with the distributed version below); returns the number of
+// leading rows with zero flux (rho_1 = rho_0 = r_min), which are not part of the tasks.
+int d2Phi_a_domega_drho_between_rhos_tasks(std::vector<double> ergs, std::vector<double> rhos, SolarModel &s, bool use_ring_geometry, std::vector<double> &all_ergs,
+                                           std::vector<double> &all_radii_1, std::vector<double> &all_radii_2, std::vector<double> &fluxes) {
   std::vector<double> valid_rhos = s.get_supported_radii(rhos);
   double r_min = valid_rhos.front();
   double r_max = valid_rhos.back();
   int n_r_vals = valid_rhos.size();
 
-  gsl_function f1;
-  f1.function = &rho_integrand_2d;
-  gsl_function f2;
-  f2.function = &r_integrand_2d;
-  solar_model_integration_parameters_2d p { 0.0, 0.0, 0.0, 0.0, &s, integrand, &f1, w1, &f2, w2 };
-  f1.params = &p;
-  f2.params = &p;
-
   if (not(use_ring_geometry)) {
     for (auto erg = ergs.begin(); erg != ergs.end(); erg++) {
         all_radii_2.push_back(r_min);
@@ -225,37 +773,347 @@ std::vector<std::vector<double> > integrate_d2Phi_a_domega_drho_between_rhos(std
     }
   }
 
-  p.rho_0 = r_min;
+  // Set up all (rho_0, rho_1, erg) combinations first; the fluxes are computed below
+  int n_skip = fluxes.size();
+  double rho_0 = r_min;
   for (int i = 1; i < n_r_vals; ++i) {
-    if (use_ring_geometry) { p.rho_0 = valid_rhos[i-1]; }
-    p.rho_1 = valid_rhos[i];
+    if (use_ring_geometry) { rho_0 = valid_rhos[i-1]; }
     for (auto erg = ergs.begin(); erg != ergs.end(); erg++) {
-      all_radii_1.push_back(p.rho_0);
-      all_radii_2.push_back(p.rho_1);
+      all_radii_1.push_back(rho_0);
+      all_radii_2.push_back(valid_rhos[i]);
       all_ergs.push_back(*erg);
-      fluxes.push_back( distance_factor*erg_integrand_2d(*erg, &p) );
     }
   }
+  fluxes.resize(n_skip+all_radii_1.size());
+  return n_skip;
+}
 
-  gsl_integration_cquad_workspace_free(w1);
-  gsl_integration_cquad_workspace_free(w2);
-
-  std::vector<std::vector<double> > buffer;
-  std::string comment = standard_header(&s);
+std::vector<std::vector<double> > d2Phi_a_domega_drho_between_rhos_buffer(SolarModel &s, bool use_ring_geometry, const std::vector<double> &all_ergs, const std::vector<double> &all_radii_1,
+                                                                         const std::vector<double> &all_radii_2, const std::vector<double> &fluxes, std::string &comment) {
+  comment = standard_header(&s);
   if (use_ring_geometry) {
-      buffer = { all_radii_1, all_radii_2, all_ergs, fluxes };
     comment += "Spectral flux over rings on the solar disc.\nColumns: Inner radius on solar disc [R_sol] | Outer radius [R_sol] | Energy [keV] | Axion flux [cm^-2 s^-1 keV^-1]";
-    save_to_file(saveas, buffer, comment);
+    return { all_radii_1, all_radii_2, all_ergs, fluxes };
+  }
+  comment += "Spectral flux over the solar disc up to a given radius.\nColumns: Radius on solar disc [R_sol] | Energy [keV] | Axion flux [cm^-2 s^-1 keV^-1]";
+  return { all_radii_2, all_ergs, fluxes };
+}
+
+std::vector<std::vector<double> > integrate_d2Phi_a_domega_drho_between_rhos(std::vector<double> ergs, std::vector<double> rhos, SolarModel &s, double (SolarModel::*integrand)(double, double) const, std::string saveas, bool use_ring_geometry, Isotope isotope) {
+  // N.B. The fixed-order engine is implemented in the multi-channel version below
+  if ((get_integration_engine() == FIXED_ORDER_INTEGRATION) && supports_fixed_order_integration(integrand)) {
+    return integrate_d2Phi_a_domega_drho_between_rhos(ergs, rhos, s, std::vector<SolarModelMemberFn> { integrand }, std::vector<std::string> { saveas }, use_ring_geometry)[0];
+  }
+  SOLAXFLUX_TIMER(timer, "integrate_d2Phi_a_domega_drho_between_rhos ["+get_SolarModel_function_name(integrand)+"]");
+  std::vector<double> all_ergs, all_radii_1, all_radii_2, fluxes;
+  int n_skip = d2Phi_a_domega_drho_between_rhos_tasks(ergs, rhos, s, use_ring_geometry, all_ergs, all_radii_1, all_radii_2, fluxes);
+  int n_tasks = all_radii_1.size();
+
+  const int n_threads = get_num_threads();
+  ParallelExceptionHandler exceptions;
+  #ifdef _OPENMP
+  #pragma omp parallel num_threads(n_threads)
+  #endif
+  {
+    integration_worker_2d worker (&s, integrand);
+    #ifdef _OPENMP
+    #pragma omp for schedule(dynamic)
+    #endif
+    for (int k = 0; k < n_tasks; ++k) {
+      if (exceptions.has_exception()) { continue; }
+      try {
+        worker.p.rho_0 = all_radii_1[k];
+        worker.p.rho_1 = all_radii_2[n_skip+k];
+        fluxes[n_skip+k] = distance_factor*erg_integrand_2d(all_ergs[n_skip+k], &worker.p);
+      } catch (...) { exceptions.capture(); }
+    }
+  }
+  exceptions.rethrow_if_any();
+
+  std::string comment;
+  std::vector<std::vector<double> > buffer = d2Phi_a_domega_drho_between_rhos_buffer(s, use_ring_geometry, all_ergs, all_radii_1, all_radii_2, fluxes, comment);
+  save_to_file(saveas, buffer, comment);
+
+  return buffer;
+}
+
+std::vector<std::vector<std::vector<double> > > integrate_d2Phi_a_domega_drho_between_rhos(std::vector<double> ergs, std::vector<double> rhos, SolarModel &s, std::vector<SolarModelMemberFn> integrands,
+                                                                                           std::vector<std::string> saveas, bool use_ring_geometry) {
+  SOLAXFLUX_TIMER(timer, "integrate_d2Phi_a_domega_drho_between_rhos ["+get_SolarModel_function_names(integrands)+"]");
+  const int n_channels = integrands.size();
+  if ((saveas.size() > 0) && (saveas.size() != size_t(n_channels))) { throw XSanityCheck("The number of output files does not match the number of channels."); }
+  std::vector<std::vector<std::vector<double> > > all_buffers (n_channels);
+
+  // Channels that support the fixed-order engine (if selected) share its nodes, and all others share the nodes of the vector-valued adaptive integration
+  // N.B. A single adaptive channel uses the nested GSL routines of the single-channel version.
+  std::vector<int> fixed_order_channels, adaptive_channels;
+  std::vector<SolarModelMemberFn> fixed_order_integrands, adaptive_integrands;
+  for (int c = 0; c < n_channels; ++c) {
+    if ((get_integration_engine() == FIXED_ORDER_INTEGRATION) && supports_fixed_order_integration(integrands[c])) {
+      fixed_order_channels.push_back(c);
+      fixed_order_integrands.push_back(integrands[c]);
+    } else {
+      adaptive_channels.push_back(c);
+      adaptive_integrands.push_back(integrands[c]);
+    }
+  }
+  if (adaptive_channels.size() == 1) {
+    const int c = adaptive_channels[0];
+    all_buffers[c] = integrate_d2Phi_a_domega_drho_between_rhos(ergs, rhos, s, integrands[c], (saveas.size() > 0) ? saveas[c] : "", use_ring_geometry);
+  }
+  if ((fixed_order_channels.size() == 0) && (adaptive_channels.size() < 2)) { return all_buffers; }
+
+  std::vector<double> all_ergs, all_radii_1, all_radii_2, fluxes;
+  int n_skip = d2Phi_a_domega_drho_between_rhos_tasks(ergs, rhos, s, use_ring_geometry, all_ergs, all_radii_1, all_radii_2, fluxes);
+  int n_tasks = all_radii_1.size();
+  std::string comment;
+
+  if (adaptive_channels.size() > 1) {
+    const int n_adaptive = adaptive_channels.size();
+    std::vector<std::vector<double> > adaptive_fluxes (n_adaptive, fluxes);
+    int n_failed = 0;
+    const int n_threads = get_num_threads();
+    ParallelExceptionHandler exceptions;
+    #ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic) num_threads(n_threads)
+    #endif
+    for (int k = 0; k < n_tasks; ++k) {
+      if (exceptions.has_exception()) { continue; }
+      try {
+        bool converged;
+        std::vector<std::vector<double> > disc = adaptive_disc_integrals(all_ergs[n_skip+k], all_radii_1[k], all_radii_2[n_skip+k], s, adaptive_integrands, int_rel_prec_2d, &converged);
+        for (int i = 0; i < n_adaptive; ++i) { adaptive_fluxes[i][n_skip+k] = distance_factor*disc[0][i]; }
+        if (not(converged)) {
+          #ifdef _OPENMP
+          #pragma omp atomic
+          #endif
+          n_failed++;
+        }
+      } catch (...) { exceptions.capture(); }
+    }
+    exceptions.rethrow_if_any();
+    check_vector_adaptive_convergence(n_failed, n_tasks, adaptive_integrands);
+    for (int i = 0; i < n_adaptive; ++i) {
+      const int c = adaptive_channels[i];
+      all_buffers[c] = d2Phi_a_domega_drho_between_rhos_buffer(s, use_ring_geometry, all_ergs, all_radii_1, all_radii_2, adaptive_fluxes[i], comment);
+      if (saveas.size() > 0) { save_to_file(saveas[c], all_buffers[c], comment); }
+    }
+  }
+  if (fixed_order_channels.size() == 0) { return all_buffers; }
+
+  // All (rho_0, rho_1) pairs are ordered as rings x energies (see d2Phi_a_domega_drho_between_rhos_tasks)
+  std::vector<double> rhos_0, rhos_1;
+  for (int k = 0; k < n_tasks; k += ergs.size()) {
+    rhos_0.push_back(all_radii_1[k]);
+    rhos_1.push_back(all_radii_2[n_skip+k]);
+  }
+  std::vector<std::vector<std::vector<double> > > all_disc = fixed_order_disc_integrals(ergs, rhos_0, rhos_1, s, fixed_order_integrands);
+  for (size_t i = 0; i < fixed_order_channels.size(); ++i) {
+    const int c = fixed_order_channels[i];
+    check_fixed_order_errors(all_disc[i][0], all_disc[i][1], int_rel_prec_2d);
+    for (int k = 0; k < n_tasks; ++k) { fluxes[n_skip+k] = distance_factor*all_disc[i][0][k]; }
+    all_buffers[c] = d2Phi_a_domega_drho_between_rhos_buffer(s, use_ring_geometry, all_ergs, all_radii_1, all_radii_2, fluxes, comment);
+    if (saveas.size() > 0) { save_to_file(saveas[c], all_buffers[c], comment); }
+  }
+
+  return all_buffers;
+}
+
+// Adaptive energy grids
+std::vector<std::vector<double> > adaptive_erg_grid(double erg_lo, double erg_hi, std::function<std::vector<double>(const std::vector<double>&)> fluxes, double rel_tolerance, double abs_tolerance,
+                                                    int n_initial, int max_points) {
+  SOLAXFLUX_TIMER(timer, "adaptive_erg_grid");
+  if (not(erg_hi > erg_lo)) { throw XSanityCheck("The energy range for the adaptive energy grid needs to be non-empty."); }
+  if ((n_initial < 2) || (max_points < n_initial) || not(rel_tolerance >= 0) || not(abs_tolerance >= 0)) { throw XSanityCheck("Invalid settings for the adaptive energy grid."); }
+
+  // Initial grid: uniform energies and both sides of the absorption edges in the energy range
+  // N.B. The interval across each edge is not split further (width = min_width), s.t. the refinement does not chase the discontinuity
+  const double min_width = adaptive_erg_grid_min_width*(erg_hi - erg_lo);
+  std::vector<double> new_ergs;
+  for (int i = 0; i < n_initial; i++) { new_ergs.push_back(erg_lo + i*(erg_hi - erg_lo)/double(n_initial-1)); }
+  new_ergs.back() = erg_hi;
+  std::vector<double> peaks = get_relevant_peaks(erg_lo, erg_hi);
+  for (auto peak = peaks.begin()+1; peak < peaks.end()-1; peak++) {
+    new_ergs.push_back(std::max(*peak - 0.5*min_width, erg_lo));
+    new_ergs.push_back(std::min(*peak + 0.5*min_width, erg_hi));
+  }
+  std::sort(new_ergs.begin(), new_ergs.end());
+  new_ergs.erase(std::unique(new_ergs.begin(), new_ergs.end()), new_ergs.end());
+
+  // All computed energies and fluxes (sorted by energy), and the intervals that still need to be tested
+  std::map<double,double> points;
+  std::vector<std::pair<double,double> > intervals;
+  std::vector<double> new_fluxes = fluxes(new_ergs);
+  for (size_t i = 0; i < new_ergs.size(); i++) { points[new_ergs[i]] = new_fluxes[i]; }
+  for (size_t i = 1; i < new_ergs.size(); i++) { intervals.push_back(std::make_pair(new_ergs[i-1], new_ergs[i])); }
+
+  while (not(intervals.empty())) {
+    if (points.size() + intervals.size() > size_t(max_points)) {
+      std::cout << "WARNING. The adaptive energy grid reached the maximum number of points (" << max_points << ") before the target accuracy was achieved in all intervals." << std::endl;
+      break;
+    }
+    new_ergs.clear();
+    for (auto it = intervals.begin(); it != intervals.end(); it++) { new_ergs.push_back(0.5*(it->first + it->second)); }
+    new_fluxes = fluxes(new_ergs);
+    std::vector<std::pair<double,double> > next_intervals;
+    for (size_t i = 0; i < intervals.size(); i++) {
+      const double a = intervals[i].first, b = intervals[i].second, m = new_ergs[i];
+      const double deviation = std::abs(new_fluxes[i] - 0.5*(points[a] + points[b]));
+      points[m] = new_fluxes[i];
+      if ((deviation > std::max(rel_tolerance*std::abs(new_fluxes[i]), abs_tolerance)) && (0.5*(b - a) > min_width)) {
+        next_intervals.push_back(std::make_pair(a, m));
+        next_intervals.push_back(std::make_pair(m, b));
+      }
+    }
+    intervals = std::move(next_intervals);
+  }
+
+  std::vector<std::vector<double> > result (2);
+  for (auto it = points.begin(); it != points.end(); it++) {
+    result[0].push_back(it->first);
+    result[1].push_back(it->second);
+  }
+  return result;
+}
+
+std::vector<std::vector<double> > adaptively_integrate_d2Phi_a_domega_drho_in_rho(double erg_lo, double erg_hi, SolarModel &s, double (SolarModel::*integrand)(double, double) const,
+                                                                                  double rel_tolerance, std::string saveas, double abs_tolerance) {
+  SOLAXFLUX_TIMER(timer, "adaptively_integrate_d2Phi_a_domega_drho_in_rho ["+get_SolarModel_function_name(integrand)+"]");
+  auto fluxes = [&s, integrand](const std::vector<double> &ergs) { return fully_integrate_d2Phi_a_domega_drho_in_rho(ergs, s, integrand)[1]; };
+  std::vector<std::vector<double> > buffer = adaptive_erg_grid(erg_lo, erg_hi, fluxes, rel_tolerance, abs_tolerance);
+  std::string comment = standard_header(&s);
+  comment += "Spectral flux over full solar volume (adaptive energy grid, target accuracy " + std::to_string(rel_tolerance) + ").\nColumns: energy values [keV] | axion flux [cm^-2 s^-1 keV^-1]";
+  save_to_file(saveas, buffer, comment);
+  return buffer;
+}
+
+std::vector<std::vector<double> > adaptively_integrate_d2Phi_a_domega_drho_up_to_rho(double erg_lo, double erg_hi, double rho_max, SolarModel &s, double (SolarModel::*integrand)(double, double) const,
+                                                                                     double rel_tolerance, std::string saveas, double abs_tolerance) {
+  SOLAXFLUX_TIMER(timer, "adaptively_integrate_d2Phi_a_domega_drho_up_to_rho ["+get_SolarModel_function_name(integrand)+"]");
+  // N.B. The fluxes for the energies are the last rows of the table (the 2D routines also return the rows for the zero flux at r_min)
+  auto fluxes = [&s, integrand, rho_max](const std::vector<double> &ergs) {
+    std::vector<double> all_fluxes = integrate_d2Phi_a_domega_drho_up_to_rho(ergs, rho_max, s, integrand).back();
+    return std::vector<double> (all_fluxes.end()-ergs.size(), all_fluxes.end());
+  };
+  std::vector<std::vector<double> > buffer = adaptive_erg_grid(erg_lo, erg_hi, fluxes, rel_tolerance, abs_tolerance);
+  std::string comment = standard_header(&s);
+  comment += "Spectral flux over the solar disc up to radius " + std::to_string(rho_max) + " R_sol (adaptive energy grid, target accuracy " + std::to_string(rel_tolerance) + ").\nColumns: energy values [keV] | axion flux [cm^-2 s^-1 keV^-1]";
+  save_to_file(saveas, buffer, comment);
+  return buffer;
+}
+
+// Distributed versions: see TaskCheckpoints in utils.hpp
+// The key identifies the computation by the driver, the integrand, the solar model setup and (a hash of) all task parameters
+std::string distributed_task_key(std::string driver, SolarModel &s, double (SolarModel::*integrand)(double, double) const, const std::vector<std::vector<double> > &task_parameters) {
+  uint64_t hash = fnv1a_offset_basis;
+  for (auto col = task_parameters.begin(); col != task_parameters.end(); col++) { hash = fnv1a_hash(col->data(), col->size()*sizeof(double), hash); }
+  std::ostringstream key;
+  key << std::setprecision(17);
+  key << LIBRARY_NAME << " | " << driver << " [" << get_SolarModel_function_name(integrand) << "]\n";
+  key << "Solar model: " << s.get_solar_model_name() << ", opacity code: " << s.get_opacitycode_name() << "\n";
+  key << "Opacity correction:";
+  for (double x : s.get_opacity_correction()) { key << " " << x; }
+  key << "\nB-fields:";
+  for (double x : s.get_bfields()) { key << " " << x; }
+  key << "\nRaffelt approx.: " << s.uses_raffelt_approx();
+  key << "\nTabulated opacities:";
+  if (s.uses_tabulated_opacity()) {
+    for (double x : s.get_tabulated_opacity_settings()) { key << " " << x; }
   } else {
-    buffer = { all_radii_2, all_ergs, fluxes };
-    comment += "Spectral flux over the solar disc up to a given radius.\nColumns: Radius on solar disc [R_sol] | Energy [keV] | Axion flux [cm^-2 s^-1 keV^-1]";
-    save_to_file(saveas, buffer, comment);
+    key << " none";
   }
+  key << "\nParameters: " << task_parameters.front().size() << " tasks, hash " << std::hex << hash;
+  return key.str();
+}
+
+// Process the chunks claimed by this process; the tasks in each chunk are parallelised with OpenMP
+void process_distributed_chunks(TaskCheckpoints &checkpoints, SolarModel &s, double (SolarModel::*integrand)(double, double) const, std::function<double(integration_worker_2d&, int)> task) {
+  int chunk, first_task, last_task;
+  const int n_threads = get_num_threads();
+  while (checkpoints.claim_chunk(chunk, first_task, last_task)) {
+    std::vector<double> results (last_task - first_task);
+    ParallelExceptionHandler exceptions;
+    #ifdef _OPENMP
+    #pragma omp parallel num_threads(n_threads)
+    #endif
+    {
+      integration_worker_2d worker (&s, integrand);
+      #ifdef _OPENMP
+      #pragma omp for schedule(dynamic)
+      #endif
+      for (int k = first_task; k < last_task; ++k) {
+        if (exceptions.has_exception()) { continue; }
+        try {
+          results[k-first_task] = task(worker, k);
+          // Keep the claim alive during long chunks
+          #ifdef _OPENMP
+          #pragma omp critical (process_distributed_chunks_refresh)
+          #endif
+          checkpoints.refresh_claim(chunk);
+        } catch (...) { exceptions.capture(); }
+      }
+    }
+    exceptions.rethrow_if_any();
+    checkpoints.save_chunk(chunk, results);
+  }
+}
+
+bool distributed_computation_complete(const TaskCheckpoints &checkpoints, std::string work_dir) {
+  if (checkpoints.is_complete()) { return true; }
+  std::cout << "INFO. " << checkpoints.get_n_chunks_done() << " of " << checkpoints.get_n_chunks() << " chunks in " << work_dir << " are done; the other chunks are";
+  std::cout << " still being processed (or were interrupted). Run again to resume the computation and merge the results." << std::endl;
+  return false;
+}
 
+std::vector<std::vector<double> > calculate_d2Phi_a_domega_drho_distributed(std::vector<double> ergs, std::vector<double> rhos, SolarModel &s, double (SolarModel::*integrand)(double, double) const,
+                                                                            std::string work_dir, std::string saveas, int chunk_size, double claim_timeout) {
+  SOLAXFLUX_TIMER(timer, "calculate_d2Phi_a_domega_drho_distributed ["+get_SolarModel_function_name(integrand)+"]");
+  std::vector<double> all_ergs, all_radii;
+  d2Phi_a_domega_drho_tasks(ergs, rhos, s, all_ergs, all_radii);
+
+  std::string key = distributed_task_key("calculate_d2Phi_a_domega_drho", s, integrand, { all_radii, all_ergs });
+  TaskCheckpoints checkpoints (work_dir, key, all_ergs.size(), chunk_size, claim_timeout);
+  process_distributed_chunks(checkpoints, s, integrand, [&](integration_worker_2d &worker, int k) {
+    worker.p.rho_1 = all_radii[k];
+    worker.p.erg = all_ergs[k];
+    return distance_factor*rho_integrand_2d(all_radii[k], &worker.p);
+  });
+  if (not(distributed_computation_complete(checkpoints, work_dir))) { return {}; }
+
+  std::vector<std::vector<double> > buffer = { all_radii, all_ergs, checkpoints.merge_results() };
+  save_to_file_atomically(saveas, buffer, d2Phi_a_domega_drho_comment(s));
   return buffer;
 }
 
-std::vector<std::vector<double> > integrate_d2Phi_a_domega_drho_up_to_rho(std::vector<double> ergs, double rho_max, SolarModel &s, double (SolarModel::*integrand)(double, double), std::string saveas, Isotope isotope) {
+// N.B. Always uses the adaptive integration engine, since the fixed-order engine integrates all rings at once.
+std::vector<std::vector<double> > integrate_d2Phi_a_domega_drho_between_rhos_distributed(std::vector<double> ergs, std::vector<double> rhos, SolarModel &s, double (SolarModel::*integrand)(double, double) const,
+                                                                                         std::string work_dir, std::string saveas, bool use_ring_geometry, int chunk_size, double claim_timeout) {
+  SOLAXFLUX_TIMER(timer, "integrate_d2Phi_a_domega_drho_between_rhos_distributed ["+get_SolarModel_function_name(integrand)+"]");
+  std::vector<double> all_ergs, all_radii_1, all_radii_2, fluxes;
+  int n_skip = d2Phi_a_domega_drho_between_rhos_tasks(ergs, rhos, s, use_ring_geometry, all_ergs, all_radii_1, all_radii_2, fluxes);
+  std::vector<double> task_ergs (all_ergs.begin()+n_skip, all_ergs.end());
+  std::vector<double> task_radii_2 (all_radii_2.begin()+n_skip, all_radii_2.end());
+
+  // N.B. Without rings, all inner radii are r_min, s.t. the outer radii are required to identify the tasks
+  std::string driver = use_ring_geometry ? "integrate_d2Phi_a_domega_drho_between_rhos (rings)" : "integrate_d2Phi_a_domega_drho_between_rhos";
+  std::string key = distributed_task_key(driver, s, integrand, { all_radii_1, task_radii_2, task_ergs });
+  TaskCheckpoints checkpoints (work_dir, key, all_radii_1.size(), chunk_size, claim_timeout);
+  process_distributed_chunks(checkpoints, s, integrand, [&](integration_worker_2d &worker, int k) {
+    worker.p.rho_0 = all_radii_1[k];
+    worker.p.rho_1 = all_radii_2[n_skip+k];
+    return distance_factor*erg_integrand_2d(all_ergs[n_skip+k], &worker.p);
+  });
+  if (not(distributed_computation_complete(checkpoints, work_dir))) { return {}; }
+
+  std::vector<double> results = checkpoints.merge_results();
+  std::copy(results.begin(), results.end(), fluxes.begin()+n_skip);
+  std::string comment;
+  std::vector<std::vector<double> > buffer = d2Phi_a_domega_drho_between_rhos_buffer(s, use_ring_geometry, all_ergs, all_radii_1, all_radii_2, fluxes, comment);
+  save_to_file_atomically(saveas, buffer, comment);
+  return buffer;
+}
+
+std::vector<std::vector<double> > integrate_d2Phi_a_domega_drho_up_to_rho(std::vector<double> ergs, double rho_max, SolarModel &s, double (SolarModel::*integrand)(double, double) const, std::string saveas, Isotope isotope) {
   // Check if rho_max >= biggest available radius and switch to faster 1D integration if that's the case
   if (rho_max >= s.get_r_hi()) {
     std::vector<std::vector<double> > tmp1 = fully_integrate_d2Phi_a_domega_drho_in_rho(ergs, s, integrand, saveas, isotope);
@@ -317,6 +1175,82 @@ std::vector<std::vector<double> > integrate_d2Phi_a_domega_drho_up_to_rho_axione
   return integrate_d2Phi_a_domega_drho_up_to_rho(ergs, rho_max, s, &SolarModel::Gamma_all_electron, saveas);
 }
 
+VariedSpectralFlux::VariedSpectralFlux(SolarModel &s, std::vector<double> ergs) : s(&s), ergs(ergs) {}
+
+void VariedSpectralFlux::set_parameters(double a, double b, std::vector<double> c) {
+  if (c.size() != 3) { throw XSanityCheck("Three B-field values (radiative zone, tachocline, outer layers) are required."); }
+  s->set_opacity_correction(a, b);
+  s->set_bfields(c[0], c[1], c[2]);
+}
+
+// Parameters that the spectrum of a channel depends on (N.B. the opacity table also matters for the opacity-dependent channels)
+std::vector<double> VariedSpectralFlux::channel_parameters(std::string channel) const {
+  std::vector<double> result;
+  if (channel == "Primakoff") { return result; }
+  if ((channel != "ABC") && (channel != "plasmon")) {
+    std::string err_msg = "The channel '"+channel+"' is not a valid option. Choose 'ABC', 'plasmon', or 'Primakoff'.";
+    throw XUnsupportedOption(err_msg);
+  }
+  result = s->get_opacity_correction();
+  result.push_back(s->uses_tabulated_opacity() ? 1.0 : 0.0);
+  if (channel == "plasmon") {
+    std::vector<double> bfields = s->get_bfields();
+    result.insert(result.end(), bfields.begin(), bfields.end());
+  }
+  return result;
+}
+
+// Compute the spectra of all channels that are not cached for the current parameters (in one multi-channel pass if there are several)
+void VariedSpectralFlux::update_cache(std::vector<std::string> channels) {
+  std::vector<std::string> outdated;
+  std::vector<std::vector<double> > outdated_parameters;
+  std::vector<SolarModelMemberFn> integrands;
+  for (auto channel = channels.begin(); channel != channels.end(); channel++) {
+    std::vector<double> parameters = channel_parameters(*channel);
+    auto it = cache.find(*channel);
+    if ((it == cache.end()) || (it->second.parameters != parameters)) {
+      outdated.push_back(*channel);
+      outdated_parameters.push_back(parameters);
+      if (*channel == "Primakoff") {
+        integrands.push_back(&SolarModel::Gamma_Primakoff);
+      } else if (*channel == "ABC") {
+        integrands.push_back(&SolarModel::Gamma_all_electron);
+      } else {
+        integrands.push_back(&SolarModel::Gamma_plasmon);
+      }
+    }
+  }
+  if (outdated.size() == 0) { return; }
+  std::vector<std::vector<std::vector<double> > > results = fully_integrate_d2Phi_a_domega_drho_in_rho(ergs, *s, integrands);
+  for (size_t k = 0; k < outdated.size(); k++) {
+    n_computations++;
+    cache[outdated[k]] = { outdated_parameters[k], results[k] };
+  }
+}
+
+std::vector<std::vector<double> > VariedSpectralFlux::spectral_flux(std::string channel, std::string saveas) {
+  update_cache({ channel });
+  const channel_cache &cached = cache[channel];
+  // N.B. Same output format as fully_integrate_d2Phi_a_domega_drho_in_rho
+  std::string comment = standard_header(s);
+  comment += "Spectral flux over full solar volume.\nColumns: energy values [keV] | axion flux [cm^-2 s^-1 keV^-1]";
+  save_to_file(saveas, cached.result, comment);
+  return cached.result;
+}
+
+void VariedSpectralFlux::save_spectral_fluxes(std::string output_file_root) {
+  std::vector<double> a_b = s->get_opacity_correction(), c = s->get_bfields();
+  std::cout << "INFO. Computing spectra for opacity correction parameters (" << a_b[0] << ", " << a_b[1] << ") and B-fields (" << c[0] << ", " << c[1] << ", " << c[2] << ")." << std::endl;
+  std::vector<std::string> channels = { "Primakoff", "ABC" };
+  if (c[0]+c[1]+c[2] > 0) { channels.push_back("plasmon"); }
+  // N.B. All outdated channels share the nodes of the radial integration, see fully_integrate_d2Phi_a_domega_drho_in_rho
+  update_cache(channels);
+  for (auto channel = channels.begin(); channel != channels.end(); channel++) { spectral_flux(*channel, output_file_root+"_"+(*channel)+".dat"); }
+}
+
+int VariedSpectralFlux::get_n_computations() const { return n_computations; }
+
+
 
 // Here, we also define some simple, custom integration routines similar to the ones defined above
 // Weighted Compton contribution
@@ -350,9 +1284,10 @@ double integrand_opacity_element(double r, void * params) {
 }
 
 std::vector<double> calculate_spectral_flux_custom(std::vector<double> ergs, SolarModel &s, double (*integrand)(double, void*), std::string saveas, Isotope isotope) {
+  SOLAXFLUX_TIMER(timer, "calculate_spectral_flux_custom");
   std::vector<double> results, errors;
 
-  gsl_integration_workspace * w = gsl_integration_workspace_alloc(int_space_size_1d);
+  QAGWorkspace w (int_space_size_1d);
   gsl_function f;
   f.function = integrand;
   solar_model_integration_params_custom p = { 0.0, &s, isotope };
@@ -361,13 +1296,13 @@ std::vector<double> calculate_spectral_flux_custom(std::vector<double> ergs, Sol
   for (auto erg = ergs.begin(); erg != ergs.end(); erg++) {
     double integral, error;
     p.erg = *erg;
-    gsl_integration_qag(&f, s.get_r_lo(), s.get_r_hi(), int_abs_prec_1d, int_rel_prec_1d, int_space_size_1d, int_method_1d, w, &integral, &error);
+    integrate_qag(&f, s.get_r_lo(), s.get_r_hi(), int_abs_prec_1d, int_rel_prec_1d, int_method_1d, w, &integral, &error);
+    SOLAXFLUX_COUNT(COUNT_QAG_CALLS, 1);
+    SOLAXFLUX_COUNT(COUNT_QAG_INTERVALS, w->size);
     results.push_back(distance_factor*integral);
     errors.push_back(distance_factor*error);
   }
 
-  gsl_integration_workspace_free(w);
-
   std::vector<std::vector<double>> buffer = { ergs, results, errors };
   std::string comment = standard_header(&s);
   comment += "Spectral flux over full solar volume.\nColumns: energy values [keV] | axion flux [cm^-2 s^-1 keV^-1] | axion flux error estimate [cm^-2 s^-1 keV^-1]";
@@ -389,16 +1324,155 @@ std::vector<double> calculate_spectral_flux_opacity_element(std::vector<double>
   return calculate_spectral_flux_custom(ergs, s, &integrand_opacity_element, saveas, isotope);
 }
 
+// Monte Carlo sampling of axions from the differential flux on the solar disc
+// N.B. Counter-based random numbers: draw d of event k is the SplitMix64 output for the state base(seed) + (flux_sampler_draws*k + d + 1)*gamma.
+const int flux_sampler_draws = 5;
+const uint64_t splitmix64_gamma = 0x9e3779b97f4a7c15ULL;
+
+inline uint64_t splitmix64_mix(uint64_t z) {
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+// Uniform random number in [0, 1) from the 53 upper bits
+inline double uniform_from_bits(uint64_t x) { return double(int64_t(x >> 11)) * (1.0/9007199254740992.0); }
+
+FluxSampler::FluxSampler() {}
+
+FluxSampler::FluxSampler(const std::vector<std::vector<double> > &d2Phi_table) { init(d2Phi_table); }
+
+FluxSampler::FluxSampler(std::string d2Phi_file) {
+  if (not(file_exists(d2Phi_file))) { throw XFileNotFound(d2Phi_file); }
+  ASCIItableReader tab (d2Phi_file);
+  init(tab.get_data());
+}
+
+FluxSampler::FluxSampler(SolarModel &s, std::vector<SolarModelMemberFn> integrands, std::vector<double> ergs, std::vector<double> rhos) {
+  SOLAXFLUX_TIMER(timer, "FluxSampler ["+get_SolarModel_function_names(integrands)+"]");
+  if (integrands.empty()) { throw XSanityCheck("FluxSampler needs at least one channel."); }
+  std::vector<std::vector<double> > table;
+  for (auto integrand = integrands.begin(); integrand != integrands.end(); integrand++) {
+    std::vector<std::vector<double> > channel_table = calculate_d2Phi_a_domega_drho(ergs, rhos, s, *integrand);
+    if (table.empty()) {
+      table = std::move(channel_table);
+    } else {
+      for (size_t k = 0; k < table[2].size(); k++) { table[2][k] += channel_table[2][k]; }
+    }
+  }
+  init(table);
+}
+
+void FluxSampler::init(const std::vector<std::vector<double> > &d2Phi_table) {
+  if (d2Phi_table.size() < 3) { throw XSanityCheck("FluxSampler needs a table with three columns (radius, energy, differential flux)."); }
+  const std::vector<double> &all_rhos = d2Phi_table[0], &all_ergs = d2Phi_table[1], &fluxes = d2Phi_table[2];
+  const size_t n_rows = all_rhos.size();
+  size_t n_ergs = 0;
+  while ((n_ergs < n_rows) && (all_rhos[n_ergs] == all_rhos[0])) { n_ergs++; }
+  if ((n_ergs < 2) || (n_rows % n_ergs != 0) || (n_rows/n_ergs < 2)) { throw XSanityCheck("FluxSampler needs a rectangular grid with at least two radii and two energies."); }
+  const size_t n_rhos = n_rows/n_ergs;
+  ergs.assign(all_ergs.begin(), all_ergs.begin()+n_ergs);
+  rhos.clear();
+  for (size_t i = 0; i < n_rhos; i++) {
+    rhos.push_back(all_rhos[i*n_ergs]);
+    if ((i > 0) && (rhos[i] <= rhos[i-1])) { throw XSanityCheck("The radii of the FluxSampler grid need to be strictly increasing."); }
+    for (size_t j = 0; j < n_ergs; j++) {
+      if ((all_rhos[i*n_ergs+j] != rhos[i]) || (all_ergs[i*n_ergs+j] != ergs[j])) { throw XSanityCheck("FluxSampler needs a rectangular grid, where the energy runs fastest."); }
+      if ((j > 0) && (ergs[j] <= ergs[j-1])) { throw XSanityCheck("The energies of the FluxSampler grid need to be strictly increasing."); }
+    }
+  }
+
+  // Cell weights (integrals of the bilinear interpolation) and the corner probabilities within each cell; negative fluxes (e.g. numerical noise) are set to zero
+  const size_t n_cells = (n_rhos-1)*(n_ergs-1);
+  if (n_cells > size_t(UINT32_MAX)) { throw XSanityCheck("The FluxSampler grid has too many cells."); }
+  cells = std::vector<cell> (n_cells);
+  std::vector<double> weights (n_cells);
+  total_flux = 0;
+  for (size_t i = 0; i < n_rhos-1; i++) {
+    for (size_t j = 0; j < n_ergs-1; j++) {
+      const double f [4] = { std::max(fluxes[i*n_ergs+j], 0.0), std::max(fluxes[(i+1)*n_ergs+j], 0.0), std::max(fluxes[i*n_ergs+j+1], 0.0), std::max(fluxes[(i+1)*n_ergs+j+1], 0.0) };
+      const double sum = f[0] + f[1] + f[2] + f[3];
+      const size_t c = i*(n_ergs-1) + j;
+      cells[c].i = i;
+      cells[c].j = j;
+      weights[c] = 0.25*sum*(rhos[i+1] - rhos[i])*(ergs[j+1] - ergs[j]);
+      total_flux += weights[c];
+      double cdf = 0;
+      for (int k = 0; k < 3; k++) {
+        cdf += (sum > 0) ? f[k]/sum : 0;
+        cells[c].corner_cdf[k] = (sum > 0) ? cdf : 1.0;
+      }
+    }
+  }
+  if (not(total_flux > 0)) { throw XSanityCheck("The flux on the FluxSampler grid needs to be positive."); }
+
+  // Alias table (Vose's method)
+  std::vector<double> probs (n_cells);
+  std::vector<size_t> small, large;
+  for (size_t c = 0; c < n_cells; c++) {
+    probs[c] = weights[c]*double(n_cells)/total_flux;
+    if (probs[c] < 1.0) { small.push_back(c); } else { large.push_back(c); }
+  }
+  while (not(small.empty()) && not(large.empty())) {
+    size_t l = small.back(), g = large.back();
+    small.pop_back();
+    cells[l].alias_prob = probs[l];
+    cells[l].alias = g;
+    probs[g] -= 1.0 - probs[l];
+    if (probs[g] < 1.0) { large.pop_back(); small.push_back(g); }
+  }
+  // N.B. Remaining entries have probability 1 (up to rounding)
+  for (auto c = large.begin(); c != large.end(); c++) { cells[*c].alias_prob = 1.0; cells[*c].alias = *c; }
+  for (auto c = small.begin(); c != small.end(); c++) { cells[*c].alias_prob = 1.0; cells[*c].alias = *c; }
+}
+
+void FluxSampler::sample(size_t n, double* ergs_out, double* rhos_out, double* phis_out, uint64_t seed, uint64_t first_event) const {
+  if (cells.empty()) { throw XSanityCheck("FluxSampler has not been initialised."); }
+  const uint64_t base = splitmix64_mix(seed + splitmix64_gamma);
+  const size_t n_cells = cells.size();
+  const long long n_events = n;
+  #ifdef _OPENMP
+  #pragma omp parallel for schedule(static) num_threads(get_num_threads())
+  #endif
+  for (long long k = 0; k < n_events; k++) {
+    uint64_t state = base + (flux_sampler_draws*(first_event + uint64_t(k)) + 1)*splitmix64_gamma;
+    double x [flux_sampler_draws];
+    for (int d = 0; d < flux_sampler_draws; d++) { x[d] = uniform_from_bits(splitmix64_mix(state)); state += splitmix64_gamma; }
+    // Cell from the alias table
+    double t = x[0]*double(n_cells);
+    size_t c = std::min(size_t(int64_t(t)), n_cells-1);
+    // N.B. The selections below are written without branches, since their outcomes are random (and mispredictions would dominate the cost)
+    const size_t use_alias = -size_t(t - double(c) >= cells[c].alias_prob);
+    c = (c & ~use_alias) | (size_t(cells[c].alias) & use_alias);
+    // Corner of the bilinear density; the density of each corner is linear in both directions, i.e. 2u or 2(1-u), which is sampled by sqrt(x)
+    const double* cdf = cells[c].corner_cdf;
+    const int corner = int(x[1] >= cdf[0]) + int(x[1] >= cdf[1]) + int(x[1] >= cdf[2]);
+    const double upper_rho = double(corner & 1), upper_erg = double((corner >> 1) & 1);
+    const double u = (1.0 - upper_rho) + (2.0*upper_rho - 1.0)*sqrt(x[2]);
+    const double v = (1.0 - upper_erg) + (2.0*upper_erg - 1.0)*sqrt(x[3]);
+    const size_t i = cells[c].i, j = cells[c].j;
+    if (rhos_out != NULL) { rhos_out[k] = rhos[i] + u*(rhos[i+1] - rhos[i]); }
+    if (ergs_out != NULL) { ergs_out[k] = ergs[j] + v*(ergs[j+1] - ergs[j]); }
+    if (phis_out != NULL) { phis_out[k] = 2.0*pi*x[4]; }
+  }
+}
+
+std::vector<std::vector<double> > FluxSampler::sample(size_t n, uint64_t seed, uint64_t first_event) const {
+  std::vector<std::vector<double> > result (3, std::vector<double> (n));
+  if (n > 0) { sample(n, &result[0][0], &result[1][0], &result[2][0], seed, first_event); }
+  return result;
+}
+
 // Additional integration routines for integrating the content of a file
 double flux_integrand_from_file(double erg, void * params) {
-  OneDInterpolator * interp = (OneDInterpolator *)params;
+  const SpectrumInterpolator * interp = (const SpectrumInterpolator *)params;
   return interp->interpolate(erg);
 }
 
 double integrated_flux_from_file(double erg_min, double erg_max, std::string spectral_flux_file, bool includes_electron_interactions) {
   double result, error;
 
-  OneDInterpolator spectral_flux_interpolator (spectral_flux_file);
+  SpectrumInterpolator spectral_flux_interpolator (spectral_flux_file);
   if ( (erg_min < spectral_flux_interpolator.lower()) || (erg_max > spectral_flux_interpolator.upper()) ) {
     erg_min = std::max(erg_min, spectral_flux_interpolator.lower());
     erg_max = std::min(erg_max, spectral_flux_interpolator.upper());
@@ -406,19 +1480,58 @@ double integrated_flux_from_file(double erg_min, double erg_max, std::string spe
               << ". Setting integration region to overlap: [" << erg_min << ", " << erg_max << "]." << std::endl;
   }
 
-  gsl_integration_workspace * w = gsl_integration_workspace_alloc(int_space_size_file);
+  QAGWorkspace w (int_space_size_file);
   gsl_function f;
   f.function = &flux_integrand_from_file;
   f.params = &spectral_flux_interpolator;
 
   if (includes_electron_interactions) {
     std::vector<double> relevant_peaks = get_relevant_peaks(erg_min, erg_max);
-    gsl_integration_qagp(&f, &relevant_peaks[0], relevant_peaks.size(), 10.0*int_abs_prec_file, 10.0*int_rel_prec_file, int_space_size_file, w, &result, &error);
+    integrate_qagp(&f, &relevant_peaks[0], relevant_peaks.size(), 10.0*int_abs_prec_file, 10.0*int_rel_prec_file, w, &result, &error);
   } else {
-    gsl_integration_qag(&f, erg_min, erg_max, int_abs_prec_file, int_rel_prec_file, int_space_size_file, int_method_file, w, &result, &error);
+    integrate_qag(&f, erg_min, erg_max, int_abs_prec_file, int_rel_prec_file, int_method_file, w, &result, &error);
   }
 
-  gsl_integration_workspace_free(w);
+  return result;
+}
 
+// Analytic treatment of the lines from nuclear transitions; the rho integral of the disc is performed analytically (cf. fixed_order_disc_integrals)
+double nuclear_line_r_integrand(double r, void * params) {
+  struct nuclear_line_integration_params * p = (struct nuclear_line_integration_params *)params;
+  double rho = std::min(p->rho_max, r);
+  double result = r*(r - sqrt(std::max(r*r - rho*rho, 0.0)))*(p->s->nuclear_line_emissivity(r, p->trans));
+  if (p->doppler_moment) { result *= gsl_pow_2(p->s->nuclear_line_doppler_width(r, p->trans)); }
   return result;
 }
+
+nuclear_line nuclear_line_source(SolarModel &s, Nucleartransition trans, double rho_max) {
+  nuclear_line result = { trans.energy, 0, 0 };
+  double r_lo = s.get_r_lo(), r_hi = s.get_r_hi();
+  if (rho_max <= r_lo) { return result; }
+
+  QAGWorkspace w (int_space_size_1d);
+  nuclear_line_integration_params p = { &s, trans, rho_max, false };
+  gsl_function f;
+  f.function = &nuclear_line_r_integrand;
+  f.params = &p;
+
+  double flux, moment, error;
+  integrate_qag(&f, r_lo, r_hi, int_abs_prec_1d, int_rel_prec_1d, int_method_1d, w, &flux, &error);
+  p.doppler_moment = true;
+  integrate_qag(&f, r_lo, r_hi, int_abs_prec_1d, int_rel_prec_1d, int_method_1d, w, &moment, &error);
+  SOLAXFLUX_COUNT(COUNT_QAG_CALLS, 2);
+
+  result.flux = distance_factor*flux;
+  if (flux > 0) { result.width = sqrt(moment/flux); }
+  return result;
+}
+
+std::vector<std::vector<double> > nuclear_line_flux_up_to_rho(std::vector<double> rhos, SolarModel &s, Nucleartransition trans, std::string saveas) {
+  std::vector<double> fluxes;
+  for (auto rho = rhos.begin(); rho != rhos.end(); rho++) { fluxes.push_back(nuclear_line_source(s, trans, *rho).flux); }
+  std::vector<std::vector<double> > buffer = { rhos, fluxes };
+  std::string comment = standard_header(&s);
+  comment += "Line flux from nuclear transition at " + std::to_string(trans.energy) + " keV, integrated up to different radii.\nColumns: Radius on solar disc [R_sol] | Line flux [g_eff^2 cm^-2 s^-1]";
+  save_to_file(saveas, buffer, comment);
+  return buffer;
+}
@@ -3,6 +3,24 @@
 
 #include "utils.hpp"
 
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <clocale>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <utime.h>
+#include <cerrno>
+#include <mutex>
+#if defined(__APPLE__)
+#include <xlocale.h>
+#endif
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 /////////////////////////////////////////////////////
 //  General functions  (I/O, error handling, ...)  //
 /////////////////////////////////////////////////////
@@ -30,7 +48,7 @@ void my_gsl_handler(const char * reason, const char * file, int line, int gsl_er
     // acceptable/expeted error
   } else {
     std::string err_string = "GSL error "+std::string(reason)+" in "+std::string(file)+", line "+std::to_string(line)+" (error no. "+std::to_string(gsl_errno)+").";
-    throw std::runtime_error(err_string);
+    throw XGSLError(err_string, gsl_errno);
     //terminate_with_error(err_string);
   }
 }
@@ -51,6 +69,42 @@ bool file_exists(const std::string& filename) {
 }
 
 // Infer the (absolute) path of the data folder that the user wants to use
+bool make_directory(std::string path) {
+  return ((mkdir(path.c_str(), 0755) == 0) || (errno == EEXIST));
+}
+
+std::string user_cache_directory() {
+  std::string path;
+  const char* custom_dir = getenv("SOLAXFLUX_CACHE_DIR");
+  const char* xdg_dir = getenv("XDG_CACHE_HOME");
+  const char* home_dir = getenv("HOME");
+  if ((custom_dir != NULL) && (custom_dir[0] != '\0')) {
+    path = custom_dir;
+    if (path == "none") { return ""; }
+  } else if ((xdg_dir != NULL) && (xdg_dir[0] != '\0')) {
+    path = std::string(xdg_dir)+"/solaxflux";
+  } else if ((home_dir != NULL) && (home_dir[0] != '\0')) {
+    path = std::string(home_dir)+"/.cache/solaxflux";
+  } else {
+    return "";
+  }
+  // Create all missing parent directories
+  for (size_t pos = path.find('/', 1); pos != std::string::npos; pos = path.find('/', pos+1)) { make_directory(path.substr(0, pos)); }
+  if (not(make_directory(path))) { return ""; }
+  return path+"/";
+}
+
+uint64_t fnv1a_hash(const void* data, size_t n, uint64_t hash) {
+  const unsigned char* bytes = static_cast<const unsigned char*>(data);
+  for (size_t i = 0; i < n; i++) { hash = (hash ^ bytes[i])*1099511628211ULL; }
+  return hash;
+}
+
+uint64_t file_content_hash(std::string path) {
+  MemoryMappedFile file (path);
+  return fnv1a_hash(file.data(), file.size());
+}
+
 void locate_data_folder(std::string path_to_model_file, std::string &path_to_data, std::string &model_file_name) {
   auto pos = path_to_model_file.find_last_of("/");
   if (pos!= std::string::npos) {
@@ -63,76 +117,441 @@ void locate_data_folder(std::string path_to_model_file, std::string &path_to_dat
   path_to_data += "/../"; // Since we expect model file to be in data/solar_models.
 }
 
-// Save a data from a buffer to a text file
-void save_to_file(std::string path, std::vector<std::vector<double>> buffer, std::string comment, bool overwrite) {
+// Output files: checks if the file exists and returns the path to be used
+std::string output_file_path(std::string path, bool overwrite) {
+  if (file_exists(path)) {
+    if (overwrite) {
+      std::cout << "WARNING! File " << path << " exists and will be overwritten." << std::endl;
+    } else {
+      std::cout << "WARNING! File " << path << " exists! Now saving to " << path << "_new" << std::endl; path += "_new";
+    }
+  }
+  return path;
+}
+
+void open_output_file(std::ofstream &output, std::string path, bool binary) {
+  output.open(path, binary ? (std::ios::out | std::ios::binary | std::ios::trunc) : std::ios::out);
+  if (!output.is_open()) {
+    std::string err_msg = "The file '"+path+"' could not be created/opened. Check if the folder exists and if you have permissions to access it.";
+    throw XSanityCheck(err_msg);
+  }
+}
+
+// Comment lines, starting with "# "
+std::string comment_lines(std::string comment) {
+  size_t pos = 0;
+  const std::string newline = "\n";
+  const std::string comment_newline = "\n# ";
+  while ((pos = comment.find(newline, pos)) != std::string::npos) {
+    comment.replace(pos, newline.length(), comment_newline);
+    pos += comment_newline.length();
+  }
+  return "# " + comment;
+}
+
+bool is_binary_table_file(std::string path) { return (path.size() >= 4) && (path.compare(path.size()-4, 4, ".npy") == 0); }
+
+// Header of the .npy format (version 1.0) for a table of 8-byte floats in native byte order; the number of rows is padded s.t. the header
+// can be rewritten once the final number of rows is known. N.B. The comment lines are truncated s.t. the complete header (incl. padding) stays
+// below the default limit of numpy.load (max_header_size = 10000).
+const char npy_magic [6] = { '\x93', 'N', 'U', 'M', 'P', 'Y' };
+const size_t npy_max_header_size = 8192;
+bool is_little_endian() { const uint16_t test = 1; return (*reinterpret_cast<const char*>(&test) == 1); }
+
+std::string npy_header(size_t n_rows, size_t n_cols, bool fortran_order, std::string comment) {
+  std::ostringstream dict;
+  dict << "{'descr': '" << (is_little_endian() ? "<f8" : ">f8") << "', 'fortran_order': " << (fortran_order ? "True" : "False") << ", 'shape': (" << std::setw(20) << n_rows << ", " << n_cols << "), }";
+  std::string header = dict.str();
+  // Leave room for the newlines and at most 63 bytes of padding
+  const size_t max_comment_size = npy_max_header_size - header.size() - 65;
+  if (comment != "") { header += "\n" + comment_lines(comment).substr(0, max_comment_size); }
+  // Pad with spaces s.t. the data start at a multiple of 64 bytes
+  const size_t prefix_size = sizeof(npy_magic) + 4;
+  header += std::string((64 - (prefix_size + header.size() + 1)%64)%64, ' ') + "\n";
+  const uint16_t header_len = header.size();
+  std::string result (npy_magic, sizeof(npy_magic));
+  result += '\x01';
+  result += '\x00';
+  result += char(header_len & 0xff);
+  result += char(header_len >> 8);
+  return result + header;
+}
+
+// Save a data from a buffer to a text file or an .npy file
+void save_to_file(std::string path, const std::vector<std::vector<double>> &buffer, std::string comment, bool overwrite) {
   if (path != "") {
-    if (file_exists(path)) {
-      if (overwrite) {
-        std::cout << "WARNING! File " << path << " exists and will be overwritten." << std::endl;
-      } else {
-        std::cout << "WARNING! File " << path << " exists! Now saving to " << path << "_new" << std::endl; path += "_new";
+    int n_cols = buffer.size();
+    int n_rows = (n_cols > 0) ? buffer[0].size() : 0;
+    const bool empty = (n_cols > 0) && (n_rows == 0);
+
+    if (is_binary_table_file(path)) {
+      path = output_file_path(path, overwrite);
+      if (empty) { std::cout << "WARNING! The data you are trying to write to " << path << " is empty! Created an empty file." << std::endl; }
+      for (auto col = buffer.begin(); col != buffer.end(); ++col) {
+        if (col->size() != size_t(n_rows)) { throw XSanityCheck("All columns written to the binary file '"+path+"' need to have the same length."); }
       }
+      std::ofstream output;
+      open_output_file(output, path, true);
+      const std::string header = npy_header(n_rows, n_cols, true, comment);
+      output.write(header.data(), header.size());
+      for (auto col = buffer.begin(); col != buffer.end(); ++col) { output.write(reinterpret_cast<const char*>(col->data()), n_rows*sizeof(double)); }
+      output.close();
+      if (output.fail()) { throw XSanityCheck("Could not write the binary file '"+path+"'."); }
+      return;
     }
 
-    // Open file and check if it was successful.
-    std::ofstream output;
-    output.open(path);
-    if (!output.is_open()) {
-      std::string err_msg = "The file '"+path+"' could not be created/opened. Check if the folder exists and if you have permissions to access it.";
-      throw XSanityCheck(err_msg);
+    // N.B. Write the rows with "\n" instead of std::endl to avoid flushing the stream for every row
+    TableWriter writer (path, n_cols, comment, overwrite);
+    if (empty) { std::cout << "WARNING! The data you are trying to write to " << path << " is empty! Created an empty file." << std::endl; }
+    std::vector<double> row (n_cols);
+    for (int i=0; i<n_rows; ++i) {
+      for (int j=0; j<n_cols; ++j) { row[j] = buffer[j][i]; }
+      writer.write_row(row.data());
     }
+    writer.close();
+  }
+}
 
-    if (comment != "") {
-      size_t pos = 0;
-      const std::string newline = "\n";
-      const std::string comment_newline = "\n# ";
-      while ((pos = comment.find(newline, pos)) != std::string::npos) {
-        comment.replace(pos, newline.length(), comment_newline);
-        pos += comment_newline.length();
-      }
-      output << "# " << comment << std::endl;
+std::string process_identifier() {
+  char host [256] = { 0 };
+  if (gethostname(host, sizeof(host)-1) != 0) { std::strcpy(host, "unknown"); }
+  return std::string(host)+"-"+std::to_string(getpid());
+}
+
+void save_to_file_atomically(std::string path, const std::vector<std::vector<double>> &buffer, std::string comment) {
+  if (path == "") { return; }
+  // N.B. The temporary file needs the same extension to use the same format
+  std::string tmp_path = path+".tmp"+process_identifier();
+  if (is_binary_table_file(path)) { tmp_path = path.substr(0, path.size()-4)+".tmp"+process_identifier()+".npy"; }
+  save_to_file(tmp_path, buffer, comment);
+  if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+    std::remove(tmp_path.c_str());
+    std::string err_msg = "The file '"+path+"' could not be created. Check if the folder exists and if you have permissions to access it.";
+    throw XSanityCheck(err_msg);
+  }
+}
+
+// Functions related to the TaskCheckpoints class
+TaskCheckpoints::TaskCheckpoints(std::string work_dir, std::string key, int n_tasks, int chunk_size, double claim_timeout) :
+  work_dir(work_dir), n_tasks(n_tasks), chunk_size(chunk_size), claim_timeout(claim_timeout) {
+  if ((n_tasks < 0) || (chunk_size < 1)) { throw XSanityCheck("TaskCheckpoints requires n_tasks >= 0 and chunk_size >= 1."); }
+  n_chunks = (n_tasks + chunk_size - 1)/chunk_size;
+  if (not(make_directory(work_dir))) {
+    std::string err_msg = "The directory '"+work_dir+"' could not be created. Check if you have permissions to access it.";
+    throw XSanityCheck(err_msg);
+  }
+
+  // The manifest file identifies the computation (written by the first process; all others compare it to their own)
+  std::string manifest = key+"\nTasks: "+std::to_string(n_tasks)+", chunk size: "+std::to_string(chunk_size)+"\n";
+  std::string manifest_file = work_dir+"/manifest.txt";
+  if (not(file_exists(manifest_file))) {
+    std::string tmp_file = manifest_file+".tmp"+process_identifier();
+    std::ofstream out (tmp_file);
+    out << manifest;
+    out.close();
+    if (out.fail() || (std::rename(tmp_file.c_str(), manifest_file.c_str()) != 0)) {
+      std::remove(tmp_file.c_str());
+      std::string err_msg = "The manifest file '"+manifest_file+"' could not be created.";
+      throw XSanityCheck(err_msg);
     }
-    output << std::scientific << std::setprecision(8);
-    int n_cols = buffer.size();
-    if (n_cols > 0) {
-      int n_rows = buffer[0].size();
-      if (n_rows > 0) {
-        for (int i=0; i<n_rows; ++i) {
-          output << buffer[0][i];
-          for (int j=1; j<n_cols; ++j) { output << " " << buffer[j][i]; }
-          output << std::endl;
-        }
-      } else {
-        std::cout << "WARNING! The data you are trying to write to " << path << " is empty! Created an empty file." << std::endl;
+  }
+  std::ifstream in (manifest_file);
+  std::stringstream existing_manifest;
+  existing_manifest << in.rdbuf();
+  if (existing_manifest.str() != manifest) {
+    std::string err_msg = "The directory '"+work_dir+"' contains (partial) results of a different computation; see "+manifest_file+".";
+    throw XSanityCheck(err_msg);
+  }
+}
+
+std::string TaskCheckpoints::chunk_file(int chunk) const { return work_dir+"/chunk_"+std::to_string(chunk)+".npy"; }
+std::string TaskCheckpoints::claim_file(int chunk) const { return work_dir+"/chunk_"+std::to_string(chunk)+".claim"; }
+
+int TaskCheckpoints::get_n_chunks_done() const {
+  int result = 0;
+  for (int i = 0; i < n_chunks; i++) { if (file_exists(chunk_file(i))) { result++; } }
+  return result;
+}
+
+// N.B. Creating the lock file with O_EXCL is atomic, i.e. only one process can claim a chunk. Stale claims are taken over by refreshing their time stamp;
+//      in the rare case that two processes do this at the same time, the chunk is computed twice (with identical results).
+bool TaskCheckpoints::try_claim(int chunk, bool take_over_stale_claims) {
+  const std::string claim = claim_file(chunk);
+  if (take_over_stale_claims) {
+    struct stat buffer;
+    if ((stat(claim.c_str(), &buffer) != 0) || (difftime(time(NULL), buffer.st_mtime) < claim_timeout)) { return false; }
+    if (utime(claim.c_str(), NULL) != 0) { return false; }
+    std::cout << "INFO. Taking over the stale claim of chunk " << chunk << " in " << work_dir << "." << std::endl;
+  } else {
+    int fd = open(claim.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) { return false; }
+    const std::string owner = process_identifier()+"\n";
+    if (write(fd, owner.c_str(), owner.size()) < 0) { std::cout << "WARNING. Could not write to the lock file '" << claim << "'." << std::endl; }
+    ::close(fd);
+  }
+  // The chunk may have been finished in the meantime
+  if (file_exists(chunk_file(chunk))) {
+    std::remove(claim.c_str());
+    return false;
+  }
+  last_claim_refresh = time(NULL);
+  return true;
+}
+
+void TaskCheckpoints::refresh_claim(int chunk) {
+  const time_t now = time(NULL);
+  if (difftime(now, last_claim_refresh) < 0.1*claim_timeout) { return; }
+  last_claim_refresh = now;
+  if (utime(claim_file(chunk).c_str(), NULL) != 0) { std::cout << "WARNING. Could not refresh the lock file '" << claim_file(chunk) << "'." << std::endl; }
+}
+
+bool TaskCheckpoints::claim_chunk(int &chunk, int &first_task, int &last_task) {
+  for (int pass = 0; pass < 2; pass++) {
+    for (int i = 0; i < n_chunks; i++) {
+      if (file_exists(chunk_file(i))) { continue; }
+      if (try_claim(i, pass == 1)) {
+        chunk = i;
+        first_task = i*chunk_size;
+        last_task = std::min(first_task + chunk_size, n_tasks);
+        return true;
       }
     }
-    output.close();
   }
+  return false;
+}
+
+void TaskCheckpoints::save_chunk(int chunk, const std::vector<double> &results) {
+  const int n_expected = std::min(chunk_size, n_tasks - chunk*chunk_size);
+  if ((chunk < 0) || (chunk >= n_chunks) || (results.size() != size_t(n_expected))) { throw XSanityCheck("The results do not match the tasks of chunk "+std::to_string(chunk)+"."); }
+  save_to_file_atomically(chunk_file(chunk), { results });
+  std::remove(claim_file(chunk).c_str());
+}
+
+std::vector<double> TaskCheckpoints::merge_results() const {
+  std::vector<double> result;
+  result.reserve(n_tasks);
+  for (int i = 0; i < n_chunks; i++) {
+    if (not(file_exists(chunk_file(i)))) { throw XSanityCheck("The results in '"+work_dir+"' are incomplete (chunk "+std::to_string(i)+" is missing)."); }
+    ASCIItableReader chunk_data (chunk_file(i));
+    const int n_expected = std::min(chunk_size, n_tasks - i*chunk_size);
+    if ((chunk_data.getncol() != 1) || (chunk_data.getnrow() != n_expected)) { throw XSanityCheck("The file '"+chunk_file(i)+"' is corrupted."); }
+    result.insert(result.end(), chunk_data[0].begin(), chunk_data[0].end());
+  }
+  return result;
+}
+
+// Functions related to the TableWriter class
+TableWriter::TableWriter(std::string path, int n_cols, std::string comment, bool overwrite) : path(path), comment(comment), n_cols(n_cols) {
+  binary = is_binary_table_file(path);
+  if (path == "") { closed = true; return; }
+  this->path = output_file_path(path, overwrite);
+  stream_buffer.resize(1 << 20);
+  out.rdbuf()->pubsetbuf(stream_buffer.data(), stream_buffer.size());
+  open_output_file(out, this->path, binary);
+  if (binary) {
+    const std::string header = npy_header(0, n_cols, false, comment);
+    out.write(header.data(), header.size());
+  } else {
+    if (comment != "") { out << comment_lines(comment) << "\n"; }
+    out << std::scientific << std::setprecision(8);
+  }
+}
+
+TableWriter::~TableWriter() { if (not(closed)) { close(); } }
+
+void TableWriter::write_row(const double* row) {
+  if (closed) { return; }
+  if (binary) {
+    out.write(reinterpret_cast<const char*>(row), n_cols*sizeof(double));
+  } else if (n_cols > 0) {
+    out << row[0];
+    for (int j=1; j<n_cols; ++j) { out << " " << row[j]; }
+    out << "\n";
+  }
+  n_rows++;
+}
+
+void TableWriter::write_row(const std::vector<double> &row) {
+  if (row.size() != size_t(n_cols)) { throw XSanityCheck("The row written to the file '"+path+"' has the wrong number of columns."); }
+  write_row(row.data());
+}
+
+bool TableWriter::close() {
+  if (closed) { return true; }
+  closed = true;
+  if (binary) {
+    // Now the number of rows is known
+    const std::string header = npy_header(n_rows, n_cols, false, comment);
+    out.seekp(0);
+    out.write(header.data(), header.size());
+  }
+  out.close();
+  if (out.fail()) {
+    std::cout << "WARNING! Could not write the file '" << path << "'." << std::endl;
+    return false;
+  }
+  return true;
 }
 
 // Functions related to the ASCIItableReader class
 int ASCIItableReader::read(std::string filename) {
-  std::ifstream in(filename.c_str(), std::ios::binary);
-  if (in.fail()) { throw XFileNotFound(filename); }
-  std::string line;
-  while(std::getline(in, line)) {
-    if (line[0] == '#') continue;
-    std::stringstream ss(line);
-
-    size_t i = 0;
-    double tmp;
-    while(ss >> tmp) {
-      if ( i+1 > data.size() ) data.resize(i+1);
-      data[i].push_back(tmp);
-      i++;
+  data.clear();
+  colnames.clear();
+  // N.B. The MemoryMappedFile constructor throws XFileNotFound if the file does not exist; empty files are not mapped.
+  MemoryMappedFile file (filename);
+  if (file.is_open()) {
+    if ((file.size() >= sizeof(npy_magic)) && (std::memcmp(file.data(), npy_magic, sizeof(npy_magic)) == 0)) {
+      if (not(parse_npy(file.data(), file.data()+file.size()))) {
+        std::string err_msg = "The binary file '"+filename+"' is not a valid .npy file with one or two dimensions (8-byte floats).";
+        throw XSanityCheck(err_msg);
+      }
+    } else {
+      parse(file.data(), file.data()+file.size());
     }
   }
-  in.close();
   return 0;
 }
 
+// Locale-independent conversion of a single number (the token is copied to a small buffer s.t. it is null-terminated)
+inline bool parse_double(const char* begin, const char* end, double &result) {
+  #if defined(__GLIBC__) || defined(__APPLE__)
+    static const locale_t c_locale = newlocale(LC_ALL_MASK, "C", (locale_t)0);
+  #endif
+  char buffer [64];
+  size_t len = end - begin;
+  if (len >= sizeof(buffer)) { return false; }
+  std::memcpy(buffer, begin, len);
+  buffer[len] = '\0';
+  char* parsed_to;
+  #if defined(__GLIBC__) || defined(__APPLE__)
+    result = strtod_l(buffer, &parsed_to, c_locale);
+  #else
+    result = strtod(buffer, &parsed_to);
+  #endif
+  return (parsed_to == buffer+len);
+}
+
+inline bool is_blank(char c) { return (c == ' ') || (c == '\t') || (c == '\r') || (c == '\v') || (c == '\f'); }
+
+void ASCIItableReader::parse(const char* begin, const char* end) {
+  // Count the rows first and determine the number of columns from the first one to reserve the memory.
+  size_t n_rows = 0, n_cols = 0;
+  for (const char* line = begin; line < end; ) {
+    const char* line_end = static_cast<const char*>(std::memchr(line, '\n', end-line));
+    if (line_end == nullptr) { line_end = end; }
+    if (*line != '#') {
+      n_rows++;
+      if (n_cols == 0) {
+        for (const char* c = line; c < line_end; ) {
+          while ((c < line_end) && is_blank(*c)) { c++; }
+          if (c == line_end) { break; }
+          n_cols++;
+          while ((c < line_end) && not(is_blank(*c))) { c++; }
+        }
+      }
+    }
+    line = line_end + 1;
+  }
+  data.resize(n_cols);
+  for (auto &col : data) { col.reserve(n_rows); }
+
+  // Parse all lines; as for stream extraction, the remainder of a line is ignored after the first entry that is not a number.
+  for (const char* line = begin; line < end; ) {
+    const char* line_end = static_cast<const char*>(std::memchr(line, '\n', end-line));
+    if (line_end == nullptr) { line_end = end; }
+    if (*line != '#') {
+      size_t i = 0;
+      for (const char* c = line; c < line_end; ) {
+        while ((c < line_end) && is_blank(*c)) { c++; }
+        if (c == line_end) { break; }
+        const char* token_end = c;
+        while ((token_end < line_end) && not(is_blank(*token_end))) { token_end++; }
+        double tmp;
+        if (not(parse_double(c, token_end, tmp))) { break; }
+        if ( i+1 > data.size() ) data.resize(i+1);
+        data[i].push_back(tmp);
+        i++;
+        c = token_end;
+      }
+    }
+    line = line_end + 1;
+  }
+}
+
+// Binary tables in the .npy format (versions 1.0 to 3.0); a 1D array is read as a single column
+bool ASCIItableReader::parse_npy(const char* begin, const char* end) {
+  const size_t size = end - begin;
+  if (size < 10) { return false; }
+  const int major_version = static_cast<unsigned char>(begin[6]);
+  size_t prefix_size, header_len = 0;
+  if (major_version == 1) {
+    prefix_size = 10;
+    for (int i = 1; i >= 0; i--) { header_len = 256*header_len + static_cast<unsigned char>(begin[8+i]); }
+  } else if ((major_version == 2) || (major_version == 3)) {
+    if (size < 12) { return false; }
+    prefix_size = 12;
+    for (int i = 3; i >= 0; i--) { header_len = 256*header_len + static_cast<unsigned char>(begin[8+i]); }
+  } else {
+    return false;
+  }
+  if (prefix_size + header_len > size) { return false; }
+  const std::string header (begin+prefix_size, header_len);
+
+  // Data type (8-byte floats, possibly with the opposite byte order), memory layout, and shape
+  size_t pos = header.find("'descr'");
+  if (pos == std::string::npos) { return false; }
+  pos = header.find("'", header.find(":", pos));
+  const std::string descr = (pos == std::string::npos) ? "" : header.substr(pos+1, 3);
+  const bool native = is_little_endian() ? ((descr == "<f8") || (descr == "=f8")) : ((descr == ">f8") || (descr == "=f8"));
+  const bool swapped = is_little_endian() ? (descr == ">f8") : (descr == "<f8");
+  if (not(native || swapped)) { return false; }
+  const bool fortran_order = (header.find("'fortran_order': True") != std::string::npos);
+  pos = header.find("'shape'");
+  if (pos == std::string::npos) { return false; }
+  const size_t shape_begin = header.find("(", pos), shape_end = header.find(")", pos);
+  if ((shape_begin == std::string::npos) || (shape_end == std::string::npos) || (shape_end < shape_begin)) { return false; }
+  std::vector<size_t> shape;
+  std::stringstream shape_stream (header.substr(shape_begin+1, shape_end-shape_begin-1));
+  std::string dim;
+  while (std::getline(shape_stream, dim, ',')) {
+    if (dim.find_first_not_of(" ") == std::string::npos) { continue; }
+    shape.push_back(std::strtoull(dim.c_str(), NULL, 10));
+  }
+  if ((shape.size() < 1) || (shape.size() > 2)) { return false; }
+  const size_t n_rows = shape[0], n_cols = (shape.size() == 2) ? shape[1] : 1;
+  const char* values = begin + prefix_size + header_len;
+  if (n_rows*n_cols*sizeof(double) > size_t(end - values)) { return false; }
+
+  data.assign(n_cols, std::vector<double> (n_rows));
+  for (size_t i = 0; i < n_rows; ++i) {
+    for (size_t j = 0; j < n_cols; ++j) {
+      const size_t index = fortran_order ? (j*n_rows + i) : (i*n_cols + j);
+      char bytes [sizeof(double)];
+      std::memcpy(bytes, values + index*sizeof(double), sizeof(double));
+      if (swapped) { std::reverse(bytes, bytes+sizeof(double)); }
+      std::memcpy(&data[j][i], bytes, sizeof(double));
+    }
+  }
+  return true;
+}
+
+std::vector<ASCIItableReader> read_ascii_tables(const std::vector<std::string> &filenames) {
+  int n_files = filenames.size();
+  std::vector<ASCIItableReader> result (n_files);
+  ParallelExceptionHandler exceptions;
+  #ifdef _OPENMP
+  #pragma omp parallel for schedule(dynamic) num_threads(get_num_threads())
+  #endif
+  for (int i = 0; i < n_files; i++) {
+    if (exceptions.has_exception()) { continue; }
+    try { result[i].read(filenames[i]); } catch (...) { exceptions.capture(); }
+  }
+  exceptions.rethrow_if_any();
+  return result;
+}
+
 void ASCIItableReader::setcolnames(std::vector<std::string> names) {
-  if ( (int) names.size() == data.size() ) {
+  if ( names.size() == data.size() ) {
     size_t i = 0;
     for (auto it = names.begin(); it != names.end(); it++) {
       colnames[*it] = i;
@@ -143,6 +562,93 @@ void ASCIItableReader::setcolnames(std::vector<std::string> names) {
   }
 }
 
+// Memory-mapped files
+MemoryMappedFile::MemoryMappedFile(std::string filename) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) { throw XFileNotFound(filename); }
+  struct stat buffer;
+  // N.B. Empty files cannot be mapped and remain closed
+  if ((fstat(fd, &buffer) == 0) && (buffer.st_size > 0)) {
+    void* addr = mmap(NULL, buffer.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr != MAP_FAILED) {
+      mapped_data = static_cast<const char*>(addr);
+      mapped_size = buffer.st_size;
+    } else {
+      std::cout << "WARNING. Could not map the file '" << filename << "' into memory." << std::endl;
+    }
+  }
+  // N.B. The mapping remains valid after closing the file descriptor
+  ::close(fd);
+}
+
+MemoryMappedFile::MemoryMappedFile(MemoryMappedFile&& src) { std::swap(mapped_data, src.mapped_data); std::swap(mapped_size, src.mapped_size); }
+
+MemoryMappedFile& MemoryMappedFile::operator=(MemoryMappedFile&& src) {
+  if (this != &src) {
+    std::swap(mapped_data, src.mapped_data);
+    std::swap(mapped_size, src.mapped_size);
+  }
+  return *this;
+}
+
+MemoryMappedFile::~MemoryMappedFile() { if (mapped_data != nullptr) { munmap(const_cast<char*>(mapped_data), mapped_size); } }
+
+// Binary cache files
+const char binary_cache_magic [8] = { 'S', 'A', 'X', 'F', 'C', 'A', 'C', 'H' };
+const uint64_t binary_cache_byte_order = 0x0102030405060708;
+
+BinaryCacheWriter::BinaryCacheWriter(std::string filename, std::string key) : filename(filename) {
+  // Write to a temporary file first s.t. other processes never see an incomplete cache file
+  tmp_filename = filename+".tmp"+process_identifier();
+  out.open(tmp_filename.c_str(), std::ios::binary | std::ios::trunc);
+  out.write(binary_cache_magic, sizeof(binary_cache_magic));
+  out.write(reinterpret_cast<const char*>(&binary_cache_format_version), sizeof(uint64_t));
+  out.write(reinterpret_cast<const char*>(&binary_cache_byte_order), sizeof(uint64_t));
+  // Key string, padded with zeros to a multiple of 8 bytes to keep the arrays aligned
+  uint64_t key_len = key.size();
+  out.write(reinterpret_cast<const char*>(&key_len), sizeof(uint64_t));
+  out.write(key.c_str(), key_len);
+  const char padding [8] = { 0 };
+  out.write(padding, (8 - key_len%8)%8);
+}
+
+BinaryCacheWriter::~BinaryCacheWriter() { if (not(closed)) { close(); } }
+
+bool BinaryCacheWriter::close() {
+  closed = true;
+  out.close();
+  bool success = not(out.fail());
+  if (success) { success = (std::rename(tmp_filename.c_str(), filename.c_str()) == 0); }
+  if (not(success)) {
+    std::remove(tmp_filename.c_str());
+    std::cout << "WARNING. Could not write the binary cache file '" << filename << "'." << std::endl;
+  }
+  return success;
+}
+
+BinaryCacheReader::BinaryCacheReader(const MemoryMappedFile &file, std::string key) : file(file) {
+  const size_t header_size = sizeof(binary_cache_magic) + 3*sizeof(uint64_t);
+  if (not(file.is_open()) || (file.size() < header_size)) { return; }
+  const char* data = file.data();
+  uint64_t version, byte_order, key_len;
+  std::memcpy(&version, data+8, sizeof(uint64_t));
+  std::memcpy(&byte_order, data+16, sizeof(uint64_t));
+  std::memcpy(&key_len, data+24, sizeof(uint64_t));
+  if ((std::memcmp(data, binary_cache_magic, sizeof(binary_cache_magic)) != 0) || (version != binary_cache_format_version) || (byte_order != binary_cache_byte_order)) { return; }
+  if ((key_len != key.size()) || (file.size() < header_size + key_len) || (std::memcmp(data+header_size, key.c_str(), key_len) != 0)) { return; }
+  pos = header_size + key_len + (8 - key_len%8)%8;
+  valid = true;
+}
+
+const uint64_t* BinaryCacheReader::next_block(size_t &n) {
+  if (not(valid) || (pos + sizeof(uint64_t) > file.size())) { throw XSanityCheck("Attempted to read beyond the end of the binary cache file."); }
+  const uint64_t* len = reinterpret_cast<const uint64_t*>(file.data()+pos);
+  n = *len;
+  if (pos + (n+1)*sizeof(uint64_t) > file.size()) { throw XSanityCheck("The binary cache file is truncated."); }
+  pos += (n+1)*sizeof(uint64_t);
+  return len;
+}
+
 ///////////////////////////////
 //  Interpolation functions  //
 ///////////////////////////////
@@ -180,7 +686,7 @@ OneDInterpolator::OneDInterpolator(std::string file, std::string type) {
   // terminate_with_error_if(not(file_exists(file)), "ERROR! File '"+file+"' for interpolation not found!");
   try {
     ASCIItableReader tab (file);
-    data = tab.get_data();
+    data = tab.move_data();
   }
   catch (const std::exception& err) {
     throw;
@@ -190,7 +696,7 @@ OneDInterpolator::OneDInterpolator(std::string file, std::string type) {
 
 OneDInterpolator::OneDInterpolator(const std::vector<double> &x, const std::vector<double> &y, std::string type) { init(x, y, type); }
 
-OneDInterpolator::OneDInterpolator(std::vector<std::vector<double> > table, std::string type) { data = table; init(type); }
+OneDInterpolator::OneDInterpolator(std::vector<std::vector<double> > table, std::string type) { data = std::move(table); init(type); }
 
 OneDInterpolator::~OneDInterpolator() {
   // Free allocated memory!
@@ -222,6 +728,72 @@ std::vector<double> OneDInterpolator::interpolate(std::vector<double> x) {
 double OneDInterpolator::lower() { return lo; }
 double OneDInterpolator::upper() { return up; }
 
+// Linear interpolation of spectra on (log-)uniform grids
+SpectrumInterpolator::SpectrumInterpolator() {}
+
+SpectrumInterpolator::SpectrumInterpolator(std::string file) {
+  ASCIItableReader tab (file);
+  std::vector<std::vector<double> > data = tab.move_data();
+  if (data.size() < 2) { throw XSanityCheck("Spectrum file '"+file+"' needs to contain at least two columns."); }
+  xs = std::move(data[0]);
+  ys = std::move(data[1]);
+  init();
+}
+
+SpectrumInterpolator::SpectrumInterpolator(std::vector<std::vector<double> > table) {
+  if (table.size() < 2) { throw XSanityCheck("SpectrumInterpolator needs a table with at least two columns."); }
+  xs = std::move(table[0]);
+  ys = std::move(table[1]);
+  init();
+}
+
+SpectrumInterpolator::SpectrumInterpolator(const std::vector<double> &x, const std::vector<double> &y) : xs(x), ys(y) { init(); }
+
+bool SpectrumInterpolator::check_range(double x_lo, double x_hi, std::string context) const {
+  if ((x_lo >= lo) && (x_hi <= up)) { return true; }
+  std::cout << "WARNING! The range [" << x_lo << ", " << x_hi << "] used by " << context << " extends beyond the tabulated spectrum ["
+            << lo << ", " << up << "]. The spectrum is set to zero outside the table." << std::endl;
+  return false;
+}
+
+void SpectrumInterpolator::init() {
+  const size_t n = xs.size();
+  if ((n < 2) || (ys.size() != n)) { throw XSanityCheck("SpectrumInterpolator needs at least two points and the same number of x and y values."); }
+  for (size_t i = 1; i < n; i++) {
+    if (xs[i] <= xs[i-1]) { throw XSanityCheck("The x values for SpectrumInterpolator need to be strictly increasing."); }
+  }
+  lo = xs.front();
+  up = xs.back();
+  // N.B. A grid counts as (log-)uniform if all points are within a quarter interval of the ideal grid, s.t. the index estimate is off by at most one.
+  auto is_regular = [&](bool use_log) {
+    const double t_lo = use_log ? log(lo) : lo;
+    const double delta = ((use_log ? log(up) : up) - t_lo)/double(n-1);
+    for (size_t i = 1; i < n-1; i++) {
+      if (std::abs((use_log ? log(xs[i]) : xs[i]) - t_lo - i*delta) > 0.25*delta) { return false; }
+    }
+    offset = t_lo;
+    inv_delta = 1.0/delta;
+    return true;
+  };
+  if (is_regular(false)) {
+    grid = uniform;
+  } else if ((lo > 0) && is_regular(true)) {
+    grid = log_uniform;
+  } else {
+    grid = irregular;
+  }
+}
+
+void SpectrumInterpolator::interpolate(const double* x, size_t n, double* out) const {
+  for (size_t i = 0; i < n; i++) { out[i] = (*this)(x[i]); }
+}
+
+std::vector<double> SpectrumInterpolator::interpolate(const std::vector<double> &x) const {
+  std::vector<double> result (x.size());
+  if (result.size() > 0) { interpolate(&x[0], x.size(), &result[0]); }
+  return result;
+}
+
 // Two-dimensional interpolation (similar to OneDInterpolator)
 TwoDInterpolator::TwoDInterpolator() {
   // NOTE. Allocate memory in the default constructor for the move-assign operator (via std::swap) works with the destructor.
@@ -281,12 +853,12 @@ void TwoDInterpolator::init(std::string type) {
     gsl_spline2d_init (spline, x, y, z, nx, ny);
 }
 
-TwoDInterpolator::TwoDInterpolator(std::vector<std::vector<double>> table, std::string type) { data = table; init(type); }
+TwoDInterpolator::TwoDInterpolator(std::vector<std::vector<double>> table, std::string type) { data = std::move(table); init(type); }
 
 TwoDInterpolator::TwoDInterpolator(std::string file, std::string type) {
   try {
     ASCIItableReader table (file);
-    data = table.get_data();
+    data = table.move_data();
   }
   catch (const std::exception& err) {
     throw;
@@ -392,6 +964,32 @@ double Nucleartransition::atogammaratio() {
 // Return atomic weight of an isotope (not a class member)
 double atomic_weight(Isotope isotope) { return isotope_avg_weight.at(isotope); }
 
+op_element lookup_op_element(std::string element) {
+  auto it = op_element_tag.find(element);
+  if (it == op_element_tag.end()) {
+    std::string err_msg = "OP data for element "+element+" does not exist.";
+    throw XUnsupportedOption(err_msg);
+  }
+  return it->second;
+}
+
+// Dense lookup table for the positions in op_grid; the grid points (ite, jne) are all even numbers
+const int op_grid_ite_lo = 150, op_grid_ite_hi = 288, op_grid_jne_lo = 54, op_grid_jne_hi = 106;
+const int op_grid_n_ite = (op_grid_ite_hi-op_grid_ite_lo)/2 + 1, op_grid_n_jne = (op_grid_jne_hi-op_grid_jne_lo)/2 + 1;
+
+std::vector<int> init_op_grid_lookup_table() {
+  std::vector<int> result (op_grid_n_ite*op_grid_n_jne, op_grid_missing);
+  for (auto pt : unavailable_OP) { result[((pt.first-op_grid_ite_lo)/2)*op_grid_n_jne + (pt.second-op_grid_jne_lo)/2] = op_grid_unavailable; }
+  for (int j = 0; j < op_grid_size; j++) { result[((op_grid[j][0]-op_grid_ite_lo)/2)*op_grid_n_jne + (op_grid[j][1]-op_grid_jne_lo)/2] = j; }
+  return result;
+}
+
+int op_grid_index(int ite, int jne) {
+  static const std::vector<int> lookup_table = init_op_grid_lookup_table();
+  if ((ite < op_grid_ite_lo) || (ite > op_grid_ite_hi) || (jne < op_grid_jne_lo) || (jne > op_grid_jne_hi) || (ite % 2 != 0) || (jne % 2 != 0)) { return op_grid_missing; }
+  return lookup_table[((ite-op_grid_ite_lo)/2)*op_grid_n_jne + (jne-op_grid_jne_lo)/2];
+}
+
 // Get the (approximate) locations of the peaks in the axion-electron spectrum
 std::vector<double> get_relevant_peaks(double erg_lo, double erg_hi) {
   const std::vector<double> all_peaks = { 0.653029, 0.779074, 0.920547, 0.956836, 1.02042, 1.05343, 1.3497, 1.40807, 1.46949, 1.59487, 1.62314, 1.65075, 1.72461, 1.76286, 1.86037, 2.00007, 2.45281, 2.61233, 3.12669, 3.30616, 3.88237, 4.08163,
@@ -431,3 +1029,191 @@ std::string current_time_string() {
 }
 
 void print_current_time() { std::cout << "Timestamp: " << current_time_string() << std::endl; }
+
+// Settings for parallel execution
+static int num_threads_setting = 1;
+
+void set_num_threads(int n_threads) { num_threads_setting = n_threads; }
+
+int get_num_threads() {
+  #ifdef _OPENMP
+    return (num_threads_setting > 0) ? num_threads_setting : omp_get_max_threads();
+  #else
+    return 1;
+  #endif
+}
+
+bool in_parallel_region() {
+  #ifdef _OPENMP
+    return omp_in_parallel();
+  #else
+    return false;
+  #endif
+}
+
+// Thread-local pools of integration workspaces
+struct IntegrationWorkspacePool {
+  ~IntegrationWorkspacePool() {
+    for (auto w : qag) { gsl_integration_workspace_free(w); }
+    for (auto w : cquad) { gsl_integration_cquad_workspace_free(w); }
+  }
+  std::vector<gsl_integration_workspace*> qag;
+  std::vector<gsl_integration_cquad_workspace*> cquad;
+};
+
+IntegrationWorkspacePool& integration_workspace_pool() {
+  static thread_local IntegrationWorkspacePool pool;
+  return pool;
+}
+
+// Remove and return the smallest free workspace with capacity >= n (or NULL if there is none)
+template <typename T>
+T* take_from_pool(std::vector<T*> &pool, size_t n, size_t T::*capacity) {
+  auto best = pool.end();
+  for (auto it = pool.begin(); it != pool.end(); it++) {
+    if (((*it)->*capacity >= n) && ((best == pool.end()) || ((*it)->*capacity < (*best)->*capacity))) { best = it; }
+  }
+  if (best == pool.end()) { return NULL; }
+  T* result = *best;
+  pool.erase(best);
+  return result;
+}
+
+gsl_integration_workspace* acquire_qag_workspace(size_t limit) {
+  gsl_integration_workspace* w = take_from_pool(integration_workspace_pool().qag, limit, &gsl_integration_workspace::limit);
+  return w ? w : gsl_integration_workspace_alloc(limit);
+}
+
+void release_qag_workspace(gsl_integration_workspace* w) {
+  if (w == NULL) { return; }
+  if (w->limit > max_pooled_workspace_limit) { gsl_integration_workspace_free(w); } else { integration_workspace_pool().qag.push_back(w); }
+}
+
+gsl_integration_cquad_workspace* acquire_cquad_workspace(size_t n) {
+  gsl_integration_cquad_workspace* w = take_from_pool(integration_workspace_pool().cquad, n, &gsl_integration_cquad_workspace::size);
+  return w ? w : gsl_integration_cquad_workspace_alloc(n);
+}
+
+void release_cquad_workspace(gsl_integration_cquad_workspace* w) { if (w) { integration_workspace_pool().cquad.push_back(w); } }
+
+// N.B. Errors from nested integrations in the integrand are passed on (the workspace of the outer integration is not full in this case). The workspace is
+//      enlarged in place (by swapping the contents of the GSL structs) s.t. all copies of the pointer, e.g. in integration parameters, remain valid.
+template <typename IntegrationRoutine>
+int integrate_with_growing_workspace(gsl_integration_workspace* w, IntegrationRoutine integrate) {
+  while (true) {
+    try {
+      return integrate();
+    } catch (XGSLError &e) {
+      if ((e.gsl_errno != GSL_EMAXITER) || (w->size < w->limit) || (w->limit >= max_workspace_limit)) { throw; }
+      gsl_integration_workspace* larger = gsl_integration_workspace_alloc(std::min(8*w->limit, max_workspace_limit));
+      std::swap(*w, *larger);
+      gsl_integration_workspace_free(larger);
+    }
+  }
+}
+
+int integrate_qag(gsl_function* f, double a, double b, double epsabs, double epsrel, int key, gsl_integration_workspace* w, double* result, double* abserr) {
+  return integrate_with_growing_workspace(w, [&]() { return gsl_integration_qag(f, a, b, epsabs, epsrel, w->limit, key, w, result, abserr); });
+}
+
+int integrate_qagp(gsl_function* f, double* pts, size_t npts, double epsabs, double epsrel, gsl_integration_workspace* w, double* result, double* abserr) {
+  return integrate_with_growing_workspace(w, [&]() { return gsl_integration_qagp(f, pts, npts, epsabs, epsrel, w->limit, w, result, abserr); });
+}
+
+int integrate_qagiu(gsl_function* f, double a, double epsabs, double epsrel, gsl_integration_workspace* w, double* result, double* abserr) {
+  return integrate_with_growing_workspace(w, [&]() { return gsl_integration_qagiu(f, a, epsabs, epsrel, w->limit, w, result, abserr); });
+}
+
+void ParallelExceptionHandler::capture() {
+  #ifdef _OPENMP
+  #pragma omp critical(solaxflux_parallel_exception)
+  #endif
+  {
+    if (not(exception)) { exception = std::current_exception(); }
+  }
+}
+
+// Instrumentation; N.B. the shared objects below are never destroyed since threads (incl. the main thread) may exit after the static destructors ran
+static std::mutex& instrumentation_mutex() { static std::mutex* m = new std::mutex; return *m; }
+static std::set<InstrumentationCounters*>& instrumentation_registry() { static auto* r = new std::set<InstrumentationCounters*>; return *r; }
+static std::vector<uint64_t>& instrumentation_retired_counts() { static auto* c = new std::vector<uint64_t> (n_instrumentation_counters, 0); return *c; }
+static std::map<std::string,std::pair<double,uint64_t> >& instrumentation_timers() { static auto* t = new std::map<std::string,std::pair<double,uint64_t> >; return *t; }
+
+#ifdef SOLAXFLUX_INSTRUMENTATION
+thread_local InstrumentationCounters instrumentation_counters;
+#endif
+
+InstrumentationCounters::InstrumentationCounters() {
+  reset();
+  std::lock_guard<std::mutex> lock (instrumentation_mutex());
+  instrumentation_registry().insert(this);
+}
+
+InstrumentationCounters::~InstrumentationCounters() {
+  // Keep the counts of finished threads
+  std::lock_guard<std::mutex> lock (instrumentation_mutex());
+  for (int c = 0; c < n_instrumentation_counters; c++) { instrumentation_retired_counts()[c] += get(c); }
+  instrumentation_registry().erase(this);
+}
+
+InstrumentationTimer::InstrumentationTimer(std::string name) : name(name), start(std::chrono::steady_clock::now()) {}
+
+InstrumentationTimer::~InstrumentationTimer() { next(""); }
+
+void InstrumentationTimer::next(std::string next_name) {
+  auto now = std::chrono::steady_clock::now();
+  double seconds = std::chrono::duration<double>(now - start).count();
+  {
+    std::lock_guard<std::mutex> lock (instrumentation_mutex());
+    std::pair<double,uint64_t> &timer = instrumentation_timers()[name];
+    timer.first += seconds;
+    timer.second += 1;
+  }
+  name = next_name;
+  start = std::chrono::steady_clock::now();
+}
+
+bool instrumentation_enabled() {
+  #ifdef SOLAXFLUX_INSTRUMENTATION
+    return true;
+  #else
+    return false;
+  #endif
+}
+
+InstrumentationSnapshot instrumentation_snapshot() {
+  InstrumentationSnapshot result;
+  if (not(instrumentation_enabled())) { return result; }
+  std::lock_guard<std::mutex> lock (instrumentation_mutex());
+  std::vector<uint64_t> counts = instrumentation_retired_counts();
+  for (auto it = instrumentation_registry().begin(); it != instrumentation_registry().end(); ++it) {
+    for (int c = 0; c < n_instrumentation_counters; c++) { counts[c] += (*it)->get(c); }
+  }
+  for (int c = 0; c < n_instrumentation_counters; c++) { result.counters[instrumentation_counter_names[c]] = counts[c]; }
+  for (auto it = instrumentation_timers().begin(); it != instrumentation_timers().end(); ++it) {
+    result.timer_seconds[it->first] = it->second.first;
+    result.timer_calls[it->first] = it->second.second;
+  }
+  return result;
+}
+
+void reset_instrumentation() {
+  std::lock_guard<std::mutex> lock (instrumentation_mutex());
+  std::fill(instrumentation_retired_counts().begin(), instrumentation_retired_counts().end(), 0);
+  for (auto it = instrumentation_registry().begin(); it != instrumentation_registry().end(); ++it) { (*it)->reset(); }
+  instrumentation_timers().clear();
+}
+
+void print_instrumentation_report() {
+  if (not(instrumentation_enabled())) {
+    std::cout << "INFO. Instrumentation is not available; recompile the library with SOLAXFLUX_INSTRUMENTATION defined." << std::endl;
+    return;
+  }
+  InstrumentationSnapshot snapshot = instrumentation_snapshot();
+  std::cout << "INFO. Instrumentation counters:" << std::endl;
+  for (auto it = snapshot.counters.begin(); it != snapshot.counters.end(); ++it) { std::cout << "  " << std::setw(24) << std::left << it->first << it->second << std::endl; }
+  std::cout << "INFO. Instrumentation timers [s] (calls):" << std::endl;
+  for (auto it = snapshot.timer_seconds.begin(); it != snapshot.timer_seconds.end(); ++it) {
+    std::cout << "  " << std::setw(64) << std::left << it->first << it->second << " (" << snapshot.timer_calls[it->first] << ")" << std::endl;
+  }
+}